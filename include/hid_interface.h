@@ -61,18 +61,40 @@ typedef VOID
     IN  PINTERFACE  Interface
     );
 
+typedef BOOLEAN
+(*XENHID_HID_CALLBACK_V1)(
+    IN  PVOID       Argument OPTIONAL,
+    IN  PVOID       Buffer,
+    IN  ULONG       Length
+    );
+
 /*! \typedef XENHID_HID_CALLBACK
     \brief Provider to subscriber callback function
 
     \param Argument An optional context argument passed to the callback
     \param Buffer A HID report buffer to complete
     \param Length The length of the \a Buffer
+    \param Sequence The report sequence number
+
+    \a Sequence starts at an arbitrary value when the interface is
+    enabled and is incremented (modulo 2^32) for each new report. A
+    report that is refused (i.e. the callback returns FALSE) must be
+    offered again with the same \a Sequence. The callback is never
+    invoked concurrently for the same interface.
 */
 typedef BOOLEAN
 (*XENHID_HID_CALLBACK)(
     IN  PVOID       Argument OPTIONAL,
     IN  PVOID       Buffer,
-    IN  ULONG       Length
+    IN  ULONG       Length,
+    IN  ULONG       Sequence
+    );
+
+typedef NTSTATUS
+(*XENHID_HID_ENABLE_V1)(
+    IN  PINTERFACE              Interface,
+    IN  XENHID_HID_CALLBACK_V1  Callback,
+    IN  PVOID                   Argument OPTIONAL
     );
 
 /*! \typedef XENHID_HID_ENABLE
@@ -290,6 +312,29 @@ DEFINE_GUID(GUID_XENHID_HID_INTERFACE,
     \ingroup interfaces
 */
 struct _XENHID_HID_INTERFACE_V1 {
+    INTERFACE                                       Interface;
+    XENHID_HID_ACQUIRE                              Acquire;
+    XENHID_HID_RELEASE                              Release;
+    XENHID_HID_ENABLE_V1                            EnableVersion1;
+    XENHID_HID_DISABLE                              Disable;
+    XENHID_HID_GET_DEVICE_ATTRIBUTES                GetDeviceAttributes;
+    XENHID_HID_GET_DEVICE_DESCRIPTOR                GetDeviceDescriptor;
+    XENHID_HID_GET_REPORT_DESCRIPTOR                GetReportDescriptor;
+    XENHID_HID_GET_STRING                           GetString;
+    XENHID_HID_GET_INDEXED_STRING                   GetIndexedString;
+    XENHID_HID_GET_FEATURE                          GetFeature;
+    XENHID_HID_SET_FEATURE                          SetFeature;
+    XENHID_HID_GET_INPUT_REPORT                     GetInputReport;
+    XENHID_HID_SET_OUTPUT_REPORT                    SetOutputReport;
+    XENHID_HID_READ_REPORT                          ReadReport;
+    XENHID_HID_WRITE_REPORT                         WriteReport;
+};
+
+/*! \struct _XENHID_HID_INTERFACE_V2
+    \brief HID interface version 2
+    \ingroup interfaces
+*/
+struct _XENHID_HID_INTERFACE_V2 {
     INTERFACE                                       Interface;
     XENHID_HID_ACQUIRE                              Acquire;
     XENHID_HID_RELEASE                              Release;
@@ -308,7 +353,7 @@ struct _XENHID_HID_INTERFACE_V1 {
     XENHID_HID_WRITE_REPORT                         WriteReport;
 };
 
-typedef struct _XENHID_HID_INTERFACE_V1 XENHID_HID_INTERFACE, *PXENHID_HID_INTERFACE;
+typedef struct _XENHID_HID_INTERFACE_V2 XENHID_HID_INTERFACE, *PXENHID_HID_INTERFACE;
 
 /*! \def XENHID_HID
     \brief Macro at assist in method invocation
@@ -319,6 +364,6 @@ typedef struct _XENHID_HID_INTERFACE_V1 XENHID_HID_INTERFACE, *PXENHID_HID_INTER
 #endif  // _WINDLL
 
 #define XENHID_HID_INTERFACE_VERSION_MIN    1
-#define XENHID_HID_INTERFACE_VERSION_MAX    1
+#define XENHID_HID_INTERFACE_VERSION_MAX    2
 
 #endif  // _XENHID_INTERFACE_H
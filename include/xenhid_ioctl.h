@@ -0,0 +1,179 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+/*! \file xenhid_ioctl.h
+    \brief XENHID control device IOCTLs
+
+    XENHID creates a control device so that software in the guest can
+    query driver state without opening a HID collection
+*/
+
+#ifndef _XENHID_IOCTL_H
+#define _XENHID_IOCTL_H
+
+/*! \def XENHID_CONTROL_DEVICE_NAME
+    \brief Kernel name of the control device
+*/
+#define XENHID_CONTROL_DEVICE_NAME      L"\\Device\\XenHid"
+
+/*! \def XENHID_CONTROL_SYMBOLIC_LINK
+    \brief Win32 visible name of the control device (\\.\XenHid)
+*/
+#define XENHID_CONTROL_SYMBOLIC_LINK    L"\\DosDevices\\XenHid"
+
+/*! \def IOCTL_XENHID_QUERY_STATISTICS
+    \brief Query a snapshot of every device's statistics
+
+    The output buffer receives a \a XENHID_STATISTICS header followed by
+    \a DeviceCount records of \a DeviceSize bytes. If the buffer is
+    large enough for the header but not for every record then
+    STATUS_BUFFER_OVERFLOW is returned with only the header filled in,
+    so that the caller can retry with \a Size bytes.
+
+    scripts/statsdecode.py decodes a saved copy of the output buffer.
+*/
+#define IOCTL_XENHID_QUERY_STATISTICS   \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*! \def IOCTL_XENHID_QUERY_POOL
+    \brief Query the driver's pool accounting
+
+    The output buffer receives a \a XENHID_POOL_STATISTICS header
+    followed by \a TagCount records of \a TagSize bytes, one for each
+    pool tag the driver has allocated with. A buffer that is too small
+    is handled as for \a IOCTL_XENHID_QUERY_STATISTICS.
+*/
+#define IOCTL_XENHID_QUERY_POOL         \
+        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*! \enum _XENHID_STATISTIC
+    \brief Per-device counters
+
+    New counters are only ever added at the end so that a consumer
+    built against an older version can use \a StatisticCount to skip
+    those it does not know about. Times are in microseconds.
+*/
+typedef enum _XENHID_STATISTIC {
+    XENHID_STATISTIC_REPORTS_RECEIVED = 0,
+    XENHID_STATISTIC_REPORTS_REFUSED,
+    XENHID_STATISTIC_IRPS_COMPLETED,
+    XENHID_STATISTIC_IRPS_CANCELLED,
+    XENHID_STATISTIC_QUEUE_DEPTH_MAXIMUM,
+    XENHID_STATISTIC_GET_DEVICE_ATTRIBUTES,
+    XENHID_STATISTIC_GET_DEVICE_DESCRIPTOR,
+    XENHID_STATISTIC_GET_REPORT_DESCRIPTOR,
+    XENHID_STATISTIC_GET_STRING,
+    XENHID_STATISTIC_GET_INDEXED_STRING,
+    XENHID_STATISTIC_GET_FEATURE,
+    XENHID_STATISTIC_SET_FEATURE,
+    XENHID_STATISTIC_GET_INPUT_REPORT,
+    XENHID_STATISTIC_SET_OUTPUT_REPORT,
+    XENHID_STATISTIC_READ_REPORT,
+    XENHID_STATISTIC_WRITE_REPORT,
+    XENHID_STATISTIC_D3_TO_D0,
+    XENHID_STATISTIC_D0_TO_D3,
+    XENHID_STATISTIC_PROBES,
+    XENHID_STATISTIC_SEQUENCE_GAPS,
+    XENHID_STATISTIC_REPORTS_LOST,
+    XENHID_STATISTIC_SEQUENCE_DUPLICATES,
+    XENHID_STATISTIC_SEQUENCE_REORDERS,
+    XENHID_STATISTIC_WATCHDOG_RECOVERIES,
+    XENHID_STATISTIC_IRPS_DRAINED,
+    XENHID_STATISTIC_IRPS_DEFERRED,
+    XENHID_STATISTIC_CALLBACK_TIME,
+    XENHID_STATISTIC_CALLBACK_TIME_MAXIMUM,
+    XENHID_STATISTIC_IDLE_ENTRIES,
+    XENHID_STATISTIC_IDLE_WAKES,
+    XENHID_STATISTIC_IDLE_WAKE_TIME,
+    XENHID_STATISTIC_QUIESCE_TIME,
+    XENHID_STATISTIC_COUNT
+} XENHID_STATISTIC, *PXENHID_STATISTIC;
+
+/*! \def XENHID_STATISTICS_VERSION
+    \brief Version of the \a XENHID_STATISTICS layout
+*/
+#define XENHID_STATISTICS_VERSION   1
+
+/*! \struct _XENHID_STATISTICS_DEVICE
+    \brief Statistics for a single device
+
+    \a Value holds \a StatisticCount (from the header) counters indexed
+    by \a XENHID_STATISTIC
+*/
+typedef struct _XENHID_STATISTICS_DEVICE {
+    ULONG       Index;
+    ULONG       DevicePowerState;
+    ULONG64     Value[XENHID_STATISTIC_COUNT];
+} XENHID_STATISTICS_DEVICE, *PXENHID_STATISTICS_DEVICE;
+
+/*! \struct _XENHID_STATISTICS
+    \brief Output of \a IOCTL_XENHID_QUERY_STATISTICS
+*/
+typedef struct _XENHID_STATISTICS {
+    ULONG       Version;
+    ULONG       Size;
+    ULONG       StatisticCount;
+    ULONG       DeviceSize;
+    ULONG       DeviceCount;
+    ULONG       Reserved;
+} XENHID_STATISTICS, *PXENHID_STATISTICS;
+
+/*! \def XENHID_POOL_STATISTICS_VERSION
+    \brief Version of the \a XENHID_POOL_STATISTICS layout
+*/
+#define XENHID_POOL_STATISTICS_VERSION  1
+
+/*! \struct _XENHID_POOL_STATISTICS_TAG
+    \brief Accounting for a single pool tag
+
+    \a Live and \a Peak are in bytes; \a Allocations is the number
+    made since the driver was loaded
+*/
+typedef struct _XENHID_POOL_STATISTICS_TAG {
+    ULONG       Tag;
+    ULONG       Reserved;
+    ULONG64     Live;
+    ULONG64     Peak;
+    ULONG64     Allocations;
+} XENHID_POOL_STATISTICS_TAG, *PXENHID_POOL_STATISTICS_TAG;
+
+/*! \struct _XENHID_POOL_STATISTICS
+    \brief Output of \a IOCTL_XENHID_QUERY_POOL
+*/
+typedef struct _XENHID_POOL_STATISTICS {
+    ULONG       Version;
+    ULONG       Size;
+    ULONG       TagSize;
+    ULONG       TagCount;
+} XENHID_POOL_STATISTICS, *PXENHID_POOL_STATISTICS;
+
+#endif  // _XENHID_IOCTL_H
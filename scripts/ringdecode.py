@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+#
+# Decode the XENHID per-processor event rings (see src/xenhid/ring.c)
+#
+# The input is a raw copy of the ring array, e.g. saved from a crash
+# dump with:
+#
+#   .writemem rings.bin poi(xenhid!RingDescriptor+0x18) L?(dwo(xenhid!RingDescriptor+0x10) * dwo(xenhid!RingDescriptor+0x14))
+#
+# RingDescriptor is laid out the same way on x86 and x64 (RingCount at
+# 0x10, RingSize at 0x14 and the Ring pointer at 0x18) so the same
+# command works for either. A copy of the descriptor itself, e.g.
+#
+#   .writemem descriptor.bin xenhid!RingDescriptor L0x18
+#
+# can be passed with --descriptor to check that the dump is one this
+# script understands.
+#
+# Entries from every ring are merged by timestamp and printed oldest
+# first. Entries that were still being written (or were overwritten while
+# being written) have a Sequence that does not match their slot and are
+# skipped.
+#
+import argparse
+import struct
+import sys
+
+RING_MAGIC = 0x474e4952  # 'GNIR'
+RING_VERSION = 3
+RING_ENTRY_COUNT = 256
+
+# Must match RING_ENTRY
+ENTRY = struct.Struct("<QQQQIIiI")
+# Must match RING (Index, Processor, then the entries)
+HEADER = struct.Struct("<iI")
+RING_SIZE = HEADER.size + (RING_ENTRY_COUNT * ENTRY.size)
+
+# Must match RING_DESCRIPTOR, up to the Ring pointer
+DESCRIPTOR = struct.Struct("<IIIIII")
+
+# Must match RING_EVENT in src/xenhid/ring.h
+EVENTS = [
+    "invalid",
+    "report-arrival",
+    "report-refused",
+    "irp-queue",
+    "irp-complete",
+    "irp-cancel",
+    "power-start",
+    "power-end",
+    "thread-wake",
+    "thread-alert",
+    "thread-exit",
+]
+
+
+def decode_ring(data, offset):
+    index, processor = HEADER.unpack_from(data, offset)
+    index &= 0xffffffff
+
+    entries = []
+    torn = 0
+
+    # Index is the number of entries ever claimed so the valid claims are
+    # the last RING_ENTRY_COUNT of them
+    first = max(0, index - RING_ENTRY_COUNT)
+    for claim in range(first, index):
+        slot = claim & (RING_ENTRY_COUNT - 1)
+        (timestamp, fdo, argument0, argument1,
+         event, entry_processor, sequence, _) = ENTRY.unpack_from(
+            data, offset + HEADER.size + (slot * ENTRY.size))
+
+        if (sequence & 0xffffffff) != ((claim + 1) & 0xffffffff):
+            torn += 1
+            continue
+
+        entries.append((timestamp, entry_processor, event, fdo,
+                        argument0, argument1))
+
+    return processor, entries, torn
+
+
+def check_descriptor(path, size):
+    with open(path, "rb") as f:
+        data = f.read(DESCRIPTOR.size)
+
+    if len(data) != DESCRIPTOR.size:
+        sys.exit("%s: too short for a ring descriptor" % path)
+
+    (magic, version, entry_size, entry_count,
+     ring_count, ring_size) = DESCRIPTOR.unpack(data)
+
+    if magic != RING_MAGIC:
+        sys.exit("%s: bad magic %08x" % (path, magic))
+
+    if version != RING_VERSION:
+        sys.exit("%s: ring version %u, expected %u" %
+                 (path, version, RING_VERSION))
+
+    if (entry_size != ENTRY.size or entry_count != RING_ENTRY_COUNT or
+            ring_size != RING_SIZE):
+        sys.exit("%s: entries of %u x %u bytes in rings of %u bytes, "
+                 "expected %u x %u in %u" %
+                 (path, entry_count, entry_size, ring_size,
+                  RING_ENTRY_COUNT, ENTRY.size, RING_SIZE))
+
+    if size != ring_count * ring_size:
+        sys.exit("%s: %u rings do not match a dump of %u bytes" %
+                 (path, ring_count, size))
+
+
+def event_name(event):
+    if event < len(EVENTS):
+        return EVENTS[event]
+
+    return "unknown(%u)" % event
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode XENHID event rings")
+    parser.add_argument("file", help="raw copy of the ring array")
+    parser.add_argument("--descriptor",
+                        help="raw copy of RingDescriptor, to check against")
+    parser.add_argument("--tsc-frequency", type=float, default=0,
+                        help="TSC frequency in Hz, to print times in us")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+
+    if args.descriptor is not None:
+        check_descriptor(args.descriptor, len(data))
+
+    if len(data) == 0 or len(data) % RING_SIZE != 0:
+        sys.exit("%s: size %u is not a multiple of %u (ring version %u)" %
+                 (args.file, len(data), RING_SIZE, RING_VERSION))
+
+    timeline = []
+    for offset in range(0, len(data), RING_SIZE):
+        processor, entries, torn = decode_ring(data, offset)
+        if torn != 0:
+            print("cpu %u: %u incomplete entries skipped" % (processor, torn),
+                  file=sys.stderr)
+
+        timeline.extend(entries)
+
+    timeline.sort(key=lambda entry: entry[0])
+    if len(timeline) == 0:
+        return
+
+    start = timeline[0][0]
+    for timestamp, processor, event, fdo, argument0, argument1 in timeline:
+        delta = timestamp - start
+        if args.tsc_frequency != 0:
+            when = "%14.3fus" % (delta * 1000000.0 / args.tsc_frequency)
+        else:
+            when = "%16u" % delta
+
+        print("%s cpu%-3u %-16s fdo %016x %016x %016x" %
+              (when, processor, event_name(event), fdo, argument0, argument1))
+
+
+if __name__ == "__main__":
+    main()
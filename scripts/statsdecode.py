@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# Decode the output of IOCTL_XENHID_QUERY_STATISTICS (see
+# include/xenhid_ioctl.h)
+#
+# The input is the raw output buffer, as returned by DeviceIoControl()
+# on \\.\XenHid. It is a XENHID_STATISTICS header followed by
+# DeviceCount records of DeviceSize bytes, each holding StatisticCount
+# counters. Counters added by a newer driver than this script knows
+# about are printed by number; a buffer that only holds the header (the
+# STATUS_BUFFER_OVERFLOW case) is reported with the size needed.
+#
+import argparse
+import struct
+import sys
+
+STATISTICS_VERSION = 1
+
+# Must match XENHID_STATISTICS
+HEADER = struct.Struct("<IIIIII")
+# Must match XENHID_STATISTICS_DEVICE, up to the counters
+DEVICE = struct.Struct("<II")
+VALUE = struct.Struct("<Q")
+
+# Must match XENHID_STATISTIC, named as FdoStatisticName() names them
+STATISTICS = [
+    "reports-received",
+    "reports-refused",
+    "irps-completed",
+    "irps-cancelled",
+    "queue-depth-maximum",
+    "get-device-attributes",
+    "get-device-descriptor",
+    "get-report-descriptor",
+    "get-string",
+    "get-indexed-string",
+    "get-feature",
+    "set-feature",
+    "get-input-report",
+    "set-output-report",
+    "read-report",
+    "write-report",
+    "d3-to-d0",
+    "d0-to-d3",
+    "probes",
+    "sequence-gaps",
+    "reports-lost",
+    "sequence-duplicates",
+    "sequence-reorders",
+    "watchdog-recoveries",
+    "irps-drained",
+    "irps-deferred",
+    "callback-time-us",
+    "callback-time-maximum-us",
+    "idle-entries",
+    "idle-wakes",
+    "idle-wake-time-us",
+    "quiesce-time-us",
+]
+
+# DEVICE_POWER_STATE
+POWER_STATES = ["unspecified", "D0", "D1", "D2", "D3"]
+
+
+def statistic_name(index):
+    if index < len(STATISTICS):
+        return STATISTICS[index]
+
+    return "statistic-%u" % index
+
+
+def power_state_name(state):
+    if state < len(POWER_STATES):
+        return POWER_STATES[state]
+
+    return "state-%u" % state
+
+
+def decode(data):
+    if len(data) < HEADER.size:
+        sys.exit("%u bytes is too short for a header" % len(data))
+
+    (version, size, statistic_count, device_size,
+     device_count, _) = HEADER.unpack_from(data, 0)
+
+    if version != STATISTICS_VERSION:
+        sys.exit("statistics version %u, expected %u" %
+                 (version, STATISTICS_VERSION))
+
+    if device_size < DEVICE.size + (statistic_count * VALUE.size):
+        sys.exit("device records of %u bytes cannot hold %u statistics" %
+                 (device_size, statistic_count))
+
+    if size != HEADER.size + (device_count * device_size):
+        sys.exit("size %u does not match %u device records of %u bytes" %
+                 (size, device_count, device_size))
+
+    print("version %u: %u device(s), %u statistic(s)" %
+          (version, device_count, statistic_count))
+
+    if len(data) < size:
+        if len(data) == HEADER.size:
+            sys.exit("header only: query again with %u bytes" % size)
+
+        sys.exit("truncated: %u of %u bytes" % (len(data), size))
+
+    for device in range(device_count):
+        offset = HEADER.size + (device * device_size)
+        index, power_state = DEVICE.unpack_from(data, offset)
+
+        print("device %u (%s)" % (index, power_state_name(power_state)))
+
+        offset += DEVICE.size
+        for statistic in range(statistic_count):
+            (value,) = VALUE.unpack_from(data, offset)
+            print("  %-32s %20u" % (statistic_name(statistic), value))
+
+            offset += VALUE.size
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Decode a XENHID statistics snapshot")
+    parser.add_argument("file", help="raw IOCTL_XENHID_QUERY_STATISTICS output")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+
+    decode(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -79,7 +79,8 @@ __Bug(
 
 #define __NT_ASSERT(_EXP)                                       \
         ((!(_EXP)) ?                                            \
-        (Error("ASSERTION FAILED: " #_EXP "\n"),                \
+        (__DbgPrintLevel(DPFLTR_ERROR_LEVEL,                    \
+                         "ASSERTION FAILED: " #_EXP "\n"),      \
          __annotation(L"Debug", L"AssertFail", L#_EXP),         \
          DbgRaiseAssertionFailure(), FALSE) :                   \
         TRUE)
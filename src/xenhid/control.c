@@ -0,0 +1,326 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define INITGUID
+#include <ntddk.h>
+#include <wdmsec.h>
+#include <xenhid_ioctl.h>
+
+#include "control.h"
+#include "fdo.h"
+#include "pool.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+// The control device is a plain (non-PnP) device object so, while it
+// exists, the driver cannot be unloaded. It is therefore reference
+// counted: each FDO and each open handle holds a reference and the
+// device is deleted when the last one is dropped, and re-created if
+// another FDO subsequently arrives.
+//
+// Deletion can race with an IRP_MJ_CREATE that the I/O manager has
+// already dispatched: the device object stays valid until that IRP
+// completes but it is no longer Control.DeviceObject. The device is
+// therefore recognised by its extension, not by comparison with
+// Control.DeviceObject, and creates are admitted under the same mutex
+// that serialises deletion.
+
+// {dccde84c-09d9-4fe8-bf1f-2bb9516e243b}
+DEFINE_GUID(GUID_XENHID_CONTROL_CLASS,
+            0xdccde84c, 0x09d9, 0x4fe8, 0xbf, 0x1f, 0x2b, 0xb9, 0x51, 0x6e, 0x24, 0x3b);
+
+typedef struct _XENHID_CONTROL {
+    PDRIVER_OBJECT  DriverObject;
+    FAST_MUTEX      Mutex;
+    PDEVICE_OBJECT  DeviceObject;
+    LONG            References;
+} XENHID_CONTROL, *PXENHID_CONTROL;
+
+static XENHID_CONTROL   Control;
+
+// The extension of every other device object owned by this driver is
+// a HID_DEVICE_EXTENSION, which starts with a PDO pointer, so it can
+// never hold the address of Control
+typedef struct _XENHID_CONTROL_EXTENSION {
+    PXENHID_CONTROL Control;
+} XENHID_CONTROL_EXTENSION, *PXENHID_CONTROL_EXTENSION;
+
+static NTSTATUS
+__ControlCreateDevice(
+    VOID
+    )
+{
+    UNICODE_STRING              Name;
+    UNICODE_STRING              Link;
+    PDEVICE_OBJECT              DeviceObject;
+    PXENHID_CONTROL_EXTENSION   Extension;
+    NTSTATUS                    status;
+
+    ASSERT3P(Control.DeviceObject, ==, NULL);
+
+    RtlInitUnicodeString(&Name, XENHID_CONTROL_DEVICE_NAME);
+    RtlInitUnicodeString(&Link, XENHID_CONTROL_SYMBOLIC_LINK);
+
+    status = IoCreateDeviceSecure(Control.DriverObject,
+                                  sizeof (XENHID_CONTROL_EXTENSION),
+                                  &Name,
+                                  FILE_DEVICE_UNKNOWN,
+                                  FILE_DEVICE_SECURE_OPEN,
+                                  FALSE,
+                                  &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+                                  &GUID_XENHID_CONTROL_CLASS,
+                                  &DeviceObject);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Extension = DeviceObject->DeviceExtension;
+    Extension->Control = &Control;
+
+    status = IoCreateSymbolicLink(&Link, &Name);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    DeviceObject->Flags |= DO_BUFFERED_IO;
+    DeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+
+    Control.DeviceObject = DeviceObject;
+
+    Info("created %wZ\n", &Name);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    IoDeleteDevice(DeviceObject);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+__ControlDeleteDevice(
+    VOID
+    )
+{
+    UNICODE_STRING  Link;
+
+    ASSERT(Control.DeviceObject != NULL);
+
+    RtlInitUnicodeString(&Link, XENHID_CONTROL_SYMBOLIC_LINK);
+
+    (VOID) IoDeleteSymbolicLink(&Link);
+    IoDeleteDevice(Control.DeviceObject);
+
+    Control.DeviceObject = NULL;
+
+    Info("deleted\n");
+}
+
+VOID
+ControlReference(
+    VOID
+    )
+{
+    ExAcquireFastMutex(&Control.Mutex);
+
+    // Failure to create the device is not fatal; diagnostics are
+    // simply unavailable until the next attempt succeeds
+    if (Control.DeviceObject == NULL)
+        (VOID) __ControlCreateDevice();
+
+    Control.References++;
+
+    ExReleaseFastMutex(&Control.Mutex);
+}
+
+VOID
+ControlDereference(
+    VOID
+    )
+{
+    ExAcquireFastMutex(&Control.Mutex);
+
+    ASSERT(Control.References != 0);
+    if (--Control.References == 0 && Control.DeviceObject != NULL)
+        __ControlDeleteDevice();
+
+    ExReleaseFastMutex(&Control.Mutex);
+}
+
+BOOLEAN
+ControlIsDeviceObject(
+    IN  PDEVICE_OBJECT  DeviceObject
+    )
+{
+    PXENHID_CONTROL_EXTENSION   Extension;
+
+    Extension = DeviceObject->DeviceExtension;
+
+    return (Extension != NULL && Extension->Control == &Control) ? TRUE : FALSE;
+}
+
+static NTSTATUS
+ControlCreate(
+    IN  PDEVICE_OBJECT  DeviceObject
+    )
+{
+    NTSTATUS            status;
+
+    ExAcquireFastMutex(&Control.Mutex);
+
+    // The device may have been deleted since this IRP was dispatched
+    if (DeviceObject == Control.DeviceObject) {
+        Control.References++;
+        status = STATUS_SUCCESS;
+    } else {
+        status = STATUS_DELETE_PENDING;
+    }
+
+    ExReleaseFastMutex(&Control.Mutex);
+
+    return status;
+}
+
+static NTSTATUS
+ControlDeviceControl(
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Returned;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Returned = 0;
+
+    switch (StackLocation->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_XENHID_QUERY_STATISTICS:
+        status = FdoQueryStatistics(Irp->AssociatedIrp.SystemBuffer,
+                                    StackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+                                    &Returned);
+        break;
+
+    case IOCTL_XENHID_QUERY_POOL:
+        status = PoolQueryStatistics(Irp->AssociatedIrp.SystemBuffer,
+                                     StackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+                                     &Returned);
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    Irp->IoStatus.Information = Returned;
+
+    return status;
+}
+
+NTSTATUS
+ControlDispatch(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    NTSTATUS            status;
+
+    ASSERT(ControlIsDeviceObject(DeviceObject));
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Irp->IoStatus.Information = 0;
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_CREATE:
+        status = ControlCreate(DeviceObject);
+        break;
+
+    case IRP_MJ_CLOSE:
+        // Only successfully created handles are closed, and they
+        // keep the device current
+        ASSERT3P(DeviceObject, ==, Control.DeviceObject);
+        ControlDereference();
+        status = STATUS_SUCCESS;
+        break;
+
+    case IRP_MJ_CLEANUP:
+        status = STATUS_SUCCESS;
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        status = ControlDeviceControl(Irp);
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+NTSTATUS
+ControlInitialize(
+    IN  PDRIVER_OBJECT  DriverObject
+    )
+{
+    NTSTATUS            status;
+
+    Control.DriverObject = DriverObject;
+    ExInitializeFastMutex(&Control.Mutex);
+
+    ExAcquireFastMutex(&Control.Mutex);
+    status = __ControlCreateDevice();
+    ExReleaseFastMutex(&Control.Mutex);
+
+    return status;
+}
+
+VOID
+ControlTeardown(
+    VOID
+    )
+{
+    ASSERT3U(Control.References, ==, 0);
+
+    if (Control.DeviceObject != NULL)
+        __ControlDeleteDevice();
+
+    RtlZeroMemory(&Control, sizeof (XENHID_CONTROL));
+}
@@ -42,31 +42,29 @@
 
 #pragma warning(disable:4127)   // conditional expression is constant
 
-static __inline VOID
-__Error(
-    IN  const CHAR  *Prefix,
-    IN  const CHAR  *Format,
-    ...
-    )
-{
-    va_list         Arguments;
+#define DBG_PRINT_LEVEL(_Level)         (1ul << (_Level))
 
-    va_start(Arguments, Format);
+// All levels up to and including _Level
+#define DBG_PRINT_LEVEL_MASK(_Level)    ((DBG_PRINT_LEVEL(_Level) << 1) - 1)
 
-#pragma prefast(suppress:6001) // Using uninitialized memory
-    vDbgPrintExWithPrefix(Prefix,
-                          DPFLTR_IHVDRIVER_ID,
-                          DPFLTR_ERROR_LEVEL,
-                          Format,
-                          Arguments);
-    va_end(Arguments);
-}
+// Levels compiled into the driver. A call site for any other level is
+// removed entirely, including evaluation of its arguments.
+#ifndef DBG_PRINT_STATIC_MASK
+#if DBG
+#define DBG_PRINT_STATIC_MASK   DBG_PRINT_LEVEL_MASK(DPFLTR_INFO_LEVEL)
+#else
+#define DBG_PRINT_STATIC_MASK   (DBG_PRINT_LEVEL_MASK(DPFLTR_INFO_LEVEL) & \
+                                 ~DBG_PRINT_LEVEL(DPFLTR_TRACE_LEVEL))
+#endif
+#endif
 
-#define Error(...)  \
-        __Error(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+// Levels printed at runtime. This is tested with a single load before
+// any argument is evaluated. Errors are always printed.
+extern ULONG    DbgPrintMask;
 
 static __inline VOID
-__Warning(
+__DbgPrint(
+    IN  ULONG       Level,
     IN  const CHAR  *Prefix,
     IN  const CHAR  *Format,
     ...
@@ -79,76 +77,95 @@ __Warning(
 #pragma prefast(suppress:6001) // Using uninitialized memory
     vDbgPrintExWithPrefix(Prefix,
                           DPFLTR_IHVDRIVER_ID,
-                          DPFLTR_WARNING_LEVEL,
+                          Level,
                           Format,
                           Arguments);
     va_end(Arguments);
 }
 
-#define Warning(...)  \
-        __Warning(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
-
-#if DBG
-
-static __inline VOID
-__Trace(
-    IN  const CHAR  *Prefix,
-    IN  const CHAR  *Format,
-    ...
+#define __DbgPrintEnabled(_Level)                                       \
+        ((DBG_PRINT_STATIC_MASK & DBG_PRINT_LEVEL(_Level)) != 0 &&      \
+         (DbgPrintMask & DBG_PRINT_LEVEL(_Level)) != 0)
+
+#define __DbgPrintPrefix    __MODULE__ "|" __FUNCTION__ ": "
+
+// This is an expression rather than a statement so that it can be
+// used inside __NT_ASSERT()
+#define __DbgPrintLevel(_Level, ...)                                    \
+        (__DbgPrintEnabled(_Level) ?                                    \
+         __DbgPrint((_Level), __DbgPrintPrefix, __VA_ARGS__) :          \
+         (VOID)0)
+
+// Token bucket used to limit the rate of messages from a single call
+// site. Each bucket holds DBG_PRINT_RATE_BURST messages and is refilled
+// once every DBG_PRINT_RATE_INTERVAL; whoever refills it reports how
+// many messages were dropped in the meantime.
+#define DBG_PRINT_RATE_BURST    10
+#define DBG_PRINT_RATE_INTERVAL 10000000ll  // 1s in 100ns units
+
+typedef struct _DBG_PRINT_RATE_LIMIT {
+    LONGLONG    Time;
+    LONG        Tokens;
+    LONG        Suppressed;
+} DBG_PRINT_RATE_LIMIT, *PDBG_PRINT_RATE_LIMIT;
+
+static __inline BOOLEAN
+__DbgPrintRateLimit(
+    IN  PDBG_PRINT_RATE_LIMIT   Limit,
+    OUT PLONG                   Suppressed
     )
 {
-    va_list         Arguments;
+    LONGLONG                    Now;
+    LONGLONG                    Time;
 
-    va_start(Arguments, Format);
+    *Suppressed = 0;
 
-#pragma prefast(suppress:6001) // Using uninitialized memory
-    vDbgPrintExWithPrefix(Prefix,
-                          DPFLTR_IHVDRIVER_ID,
-                          DPFLTR_TRACE_LEVEL,
-                          Format,
-                          Arguments);
-    va_end(Arguments);
-}
+    Now = (LONGLONG)KeQueryInterruptTime();
+    Time = ReadNoFence64(&Limit->Time);
 
-#else   // DBG
+    if (Now - Time >= DBG_PRINT_RATE_INTERVAL &&
+        InterlockedCompareExchange64(&Limit->Time, Now, Time) == Time) {
+        (VOID) InterlockedExchange(&Limit->Tokens, DBG_PRINT_RATE_BURST);
+        *Suppressed = InterlockedExchange(&Limit->Suppressed, 0);
+    }
 
-static __inline VOID
-__Trace(
-    IN  const CHAR  *Prefix,
-    IN  const CHAR  *Format,
-    ...
-    )
-{
-    UNREFERENCED_PARAMETER(Prefix);
-    UNREFERENCED_PARAMETER(Format);
-}
+    if (InterlockedDecrement(&Limit->Tokens) >= 0)
+        return TRUE;
 
-#endif  // DBG
+    (VOID) InterlockedIncrement(&Limit->Suppressed);
+    return FALSE;
+}
 
-#define Trace(...)  \
-        __Trace(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+#define __DbgPrintLevelRateLimited(_Level, ...)                         \
+        do {                                                            \
+            static DBG_PRINT_RATE_LIMIT _Limit;                         \
+            LONG                        _Suppressed;                    \
+                                                                        \
+            if (!__DbgPrintEnabled(_Level))                             \
+                break;                                                  \
+                                                                        \
+            if (!__DbgPrintRateLimit(&_Limit, &_Suppressed))            \
+                break;                                                  \
+                                                                        \
+            if (_Suppressed != 0)                                       \
+                __DbgPrint((_Level),                                    \
+                           __DbgPrintPrefix,                            \
+                           "%d messages suppressed\n",                  \
+                           _Suppressed);                                \
+                                                                        \
+            __DbgPrint((_Level), __DbgPrintPrefix, __VA_ARGS__);        \
+        } while (FALSE)
 
-static __inline VOID
-__Info(
-    IN  const CHAR  *Prefix,
-    IN  const CHAR  *Format,
-    ...
-    )
-{
-    va_list         Arguments;
+#define Error(...)  \
+        __DbgPrintLevelRateLimited(DPFLTR_ERROR_LEVEL, __VA_ARGS__)
 
-    va_start(Arguments, Format);
+#define Warning(...)  \
+        __DbgPrintLevelRateLimited(DPFLTR_WARNING_LEVEL, __VA_ARGS__)
 
-#pragma prefast(suppress:6001) // Using uninitialized memory
-    vDbgPrintExWithPrefix(Prefix,
-                          DPFLTR_IHVDRIVER_ID,
-                          DPFLTR_INFO_LEVEL,
-                          Format,
-                          Arguments);
-    va_end(Arguments);
-}
+#define Trace(...)  \
+        __DbgPrintLevel(DPFLTR_TRACE_LEVEL, __VA_ARGS__)
 
 #define Info(...)  \
-        __Info(__MODULE__ "|"  __FUNCTION__ ": ", __VA_ARGS__)
+        __DbgPrintLevel(DPFLTR_INFO_LEVEL, __VA_ARGS__)
 
 #endif  // _XENHID_DBG_PRINT_H
@@ -38,17 +38,36 @@
 #include <version.h>
 
 #include "fdo.h"
+#include "control.h"
 #include "driver.h"
+#include "etw.h"
+#include "ring.h"
+#include "pool.h"
+#include "thread.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
 typedef struct _XENHID_DRIVER {
     PDRIVER_OBJECT      DriverObject;
+    PDRIVER_DISPATCH    HidDispatch[IRP_MJ_MAXIMUM_FUNCTION + 1];
+    PXENHID_THREAD_POOL ThreadPool;
 } XENHID_DRIVER, *PXENHID_DRIVER;
 
+// The pool runs short-lived PASSIVE_LEVEL work (such as publishing probe
+// results) on behalf of every device, at the normal priority of a system
+// thread
+#define DRIVER_THREAD_POOL_WORKERS  2
+#define DRIVER_THREAD_POOL_PRIORITY 8
+
 static XENHID_DRIVER    Driver;
 
+ULONG                   DbgPrintMask = DBG_PRINT_LEVEL_MASK(DPFLTR_INFO_LEVEL);
+
+TRACELOGGING_DEFINE_PROVIDER(EtwProvider,
+                             "XenProject.XenHid",
+                             (0xcacbf1bf, 0x8693, 0x4db7, 0x93, 0x4d, 0x17, 0x71, 0xa7, 0xb6, 0xf8, 0x24));
+
 static FORCEINLINE VOID
 __DriverSetDriverObject(
     IN  PDRIVER_OBJECT  DriverObject
@@ -73,6 +92,14 @@ DriverGetDriverObject(
     return __DriverGetDriverObject();
 }
 
+PXENHID_THREAD_POOL
+DriverGetThreadPool(
+    VOID
+    )
+{
+    return Driver.ThreadPool;
+}
+
 DRIVER_UNLOAD       DriverUnload;
 
 VOID
@@ -93,10 +120,21 @@ DriverUnload(
          MONTH,
          YEAR);
 
+    ControlTeardown();
+
+    RtlZeroMemory(Driver.HidDispatch, sizeof (Driver.HidDispatch));
+
+    ThreadPoolDestroy(Driver.ThreadPool);
+    Driver.ThreadPool = NULL;
+
     __DriverSetDriverObject(NULL);
 
     ASSERT(IsZeroMemory(&Driver, sizeof (XENHID_DRIVER)));
 
+    PoolTeardown();
+    RingTeardown();
+    TraceLoggingUnregister(EtwProvider);
+
     Trace("<====\n");
 }
 
@@ -153,6 +191,27 @@ Dispatch(
     return status;
 }
 
+DRIVER_DISPATCH DriverDispatch;
+
+// HidRegisterMinidriver() replaces every entry in MajorFunction[] with
+// a HIDCLASS handler that assumes a HID device extension. IRPs for the
+// control device must therefore be intercepted before they get there.
+NTSTATUS
+DriverDispatch(
+    IN PDEVICE_OBJECT   DeviceObject,
+    IN PIRP             Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+
+    if (ControlIsDeviceObject(DeviceObject))
+        return ControlDispatch(DeviceObject, Irp);
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    return Driver.HidDispatch[StackLocation->MajorFunction](DeviceObject, Irp);
+}
+
 DRIVER_INITIALIZE   DriverEntry;
 
 NTSTATUS
@@ -170,8 +229,18 @@ DriverEntry(
     ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
     WdmlibProcgrpInitialize();
 
+    // Failure is not fatal; events are simply never enabled
+    (VOID) TraceLoggingRegister(EtwProvider);
+
+    // Likewise, without memory for the rings nothing is recorded
+    (VOID) RingInitialize();
+
     Trace("====>\n");
 
+    status = PoolInitialize();
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
     __DriverSetDriverObject(DriverObject);
 
     Driver.DriverObject->DriverUnload = DriverUnload;
@@ -185,6 +254,18 @@ DriverEntry(
          MONTH,
          YEAR);
 
+    status = ThreadPoolCreate(min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+                                  DRIVER_THREAD_POOL_WORKERS),
+                              NULL,
+                              DRIVER_THREAD_POOL_PRIORITY,
+                              &Driver.ThreadPool);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = FdoInitialize();
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     DriverObject->DriverExtension->AddDevice = AddDevice;
 
     for (Index = 0; Index <= IRP_MJ_MAXIMUM_FUNCTION; Index++) {
@@ -202,18 +283,48 @@ DriverEntry(
 
     status = HidRegisterMinidriver(&Minidriver);
     if (!NT_SUCCESS(status))
-        goto fail1;
+        goto fail4;
+
+    for (Index = 0; Index <= IRP_MJ_MAXIMUM_FUNCTION; Index++) {
+        Driver.HidDispatch[Index] = DriverObject->MajorFunction[Index];
+#pragma prefast(suppress:28169) // No __drv_dispatchType annotation
+#pragma prefast(suppress:28168) // No matching __drv_dispatchType annotation for IRP_MJ_CREATE
+        DriverObject->MajorFunction[Index] = DriverDispatch;
+    }
+
+    // Diagnostics only, so failure is not fatal. Creation will be
+    // retried when a device is added.
+    status = ControlInitialize(DriverObject);
+    if (!NT_SUCCESS(status))
+        Warning("failed to create control device (%08x)\n", status);
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+    ThreadPoolDestroy(Driver.ThreadPool);
+    Driver.ThreadPool = NULL;
+
+fail2:
+    Error("fail2\n");
 
     __DriverSetDriverObject(NULL);
 
     ASSERT(IsZeroMemory(&Driver, sizeof (XENHID_DRIVER)));
 
+    PoolTeardown();
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    RingTeardown();
+    TraceLoggingUnregister(EtwProvider);
+
     return status;
 }
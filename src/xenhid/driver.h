@@ -33,9 +33,16 @@
 #ifndef _XENHID_DRIVER_H
 #define _XENHID_DRIVER_H
 
+#include "thread.h"
+
 extern PDRIVER_OBJECT
 DriverGetDriverObject(
     VOID
     );
 
+extern PXENHID_THREAD_POOL
+DriverGetThreadPool(
+    VOID
+    );
+
 #endif  // _XENHID_DRIVER_H
@@ -0,0 +1,110 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENHID_ETW_H
+#define _XENHID_ETW_H
+
+#include <ntddk.h>
+#include <TraceLoggingProvider.h>
+
+// {CACBF1BF-8693-4DB7-934D-1771A7B6F824}
+TRACELOGGING_DECLARE_PROVIDER(EtwProvider);
+
+#define ETW_KEYWORD_REPORT  0x00000001
+#define ETW_KEYWORD_IRP     0x00000002
+#define ETW_KEYWORD_POWER   0x00000004
+#define ETW_KEYWORD_STORE   0x00000008
+
+// TraceLoggingWrite() only evaluates its arguments when the event is
+// enabled, so the timestamp below costs nothing for a disabled event.
+#define __EtwTimestamp()                                             \
+        TraceLoggingInt64(KeQueryPerformanceCounter(NULL).QuadPart, "Timestamp")
+
+#define __EtwWrite(_Name, _Keyword, ...)                             \
+        TraceLoggingWrite(EtwProvider,                               \
+                          _Name,                                     \
+                          TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), \
+                          TraceLoggingKeyword(_Keyword),             \
+                          __EtwTimestamp(),                          \
+                          __VA_ARGS__)
+
+#define EtwReportArrival(_Fdo, _Sequence, _Length)                   \
+        __EtwWrite("ReportArrival",                                  \
+                   ETW_KEYWORD_REPORT,                               \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingUInt64(_Sequence, "CorrelationId"),   \
+                   TraceLoggingUInt32(_Length, "Length"))
+
+#define EtwIrpQueue(_Fdo, _Irp)                                      \
+        __EtwWrite("IrpQueue",                                       \
+                   ETW_KEYWORD_IRP,                                  \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingPointer(_Irp, "CorrelationId"))
+
+#define EtwIrpComplete(_Fdo, _Irp, _Sequence, _Status)               \
+        __EtwWrite("IrpComplete",                                    \
+                   ETW_KEYWORD_IRP,                                  \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingPointer(_Irp, "CorrelationId"),       \
+                   TraceLoggingUInt64(_Sequence, "Report"),          \
+                   TraceLoggingNTStatus(_Status, "Status"))
+
+#define EtwIrpCancel(_Fdo, _Irp)                                     \
+        __EtwWrite("IrpCancel",                                      \
+                   ETW_KEYWORD_IRP,                                  \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingPointer(_Irp, "CorrelationId"))
+
+#define EtwPowerStart(_Fdo, _Irp, _From, _To)                        \
+        __EtwWrite("PowerStart",                                     \
+                   ETW_KEYWORD_POWER,                                \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingPointer(_Irp, "CorrelationId"),       \
+                   TraceLoggingUInt32(_From, "From"),                \
+                   TraceLoggingUInt32(_To, "To"))
+
+#define EtwPowerEnd(_Fdo, _Irp, _Status)                             \
+        __EtwWrite("PowerEnd",                                       \
+                   ETW_KEYWORD_POWER,                                \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingPointer(_Irp, "CorrelationId"),       \
+                   TraceLoggingNTStatus(_Status, "Status"))
+
+#define EtwStoreOperation(_Fdo, _Operation, _Path, _Status)          \
+        __EtwWrite("StoreOperation",                                 \
+                   ETW_KEYWORD_STORE,                                \
+                   TraceLoggingPointer(_Fdo, "Fdo"),                 \
+                   TraceLoggingString(_Operation, "Operation"),      \
+                   TraceLoggingString(_Path, "Path"),                \
+                   TraceLoggingNTStatus(_Status, "Status"))
+
+#endif  // _XENHID_ETW_H
@@ -40,10 +40,15 @@
 #include <hid_interface.h>
 #include <store_interface.h>
 #include <suspend_interface.h>
+#include <xenhid_ioctl.h>
 
 #include "fdo.h"
+#include "control.h"
 #include "thread.h"
 #include "driver.h"
+#include "etw.h"
+#include "ring.h"
+#include "pool.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -52,6 +57,123 @@
 
 #define MAXNAMELEN  128
 
+static FORCEINLINE const CHAR *
+FdoStatisticName(
+    IN  XENHID_STATISTIC    Statistic
+    )
+{
+#define _FDO_STATISTIC_NAME(_Statistic, _Name)  \
+        case XENHID_STATISTIC_ ## _Statistic:   \
+            return _Name;
+
+    switch (Statistic) {
+    _FDO_STATISTIC_NAME(REPORTS_RECEIVED, "reports-received");
+    _FDO_STATISTIC_NAME(REPORTS_REFUSED, "reports-refused");
+    _FDO_STATISTIC_NAME(IRPS_COMPLETED, "irps-completed");
+    _FDO_STATISTIC_NAME(IRPS_CANCELLED, "irps-cancelled");
+    _FDO_STATISTIC_NAME(QUEUE_DEPTH_MAXIMUM, "queue-depth-maximum");
+    _FDO_STATISTIC_NAME(GET_DEVICE_ATTRIBUTES, "get-device-attributes");
+    _FDO_STATISTIC_NAME(GET_DEVICE_DESCRIPTOR, "get-device-descriptor");
+    _FDO_STATISTIC_NAME(GET_REPORT_DESCRIPTOR, "get-report-descriptor");
+    _FDO_STATISTIC_NAME(GET_STRING, "get-string");
+    _FDO_STATISTIC_NAME(GET_INDEXED_STRING, "get-indexed-string");
+    _FDO_STATISTIC_NAME(GET_FEATURE, "get-feature");
+    _FDO_STATISTIC_NAME(SET_FEATURE, "set-feature");
+    _FDO_STATISTIC_NAME(GET_INPUT_REPORT, "get-input-report");
+    _FDO_STATISTIC_NAME(SET_OUTPUT_REPORT, "set-output-report");
+    _FDO_STATISTIC_NAME(READ_REPORT, "read-report");
+    _FDO_STATISTIC_NAME(WRITE_REPORT, "write-report");
+    _FDO_STATISTIC_NAME(D3_TO_D0, "d3-to-d0");
+    _FDO_STATISTIC_NAME(D0_TO_D3, "d0-to-d3");
+    _FDO_STATISTIC_NAME(PROBES, "probes");
+    _FDO_STATISTIC_NAME(SEQUENCE_GAPS, "sequence-gaps");
+    _FDO_STATISTIC_NAME(REPORTS_LOST, "reports-lost");
+    _FDO_STATISTIC_NAME(SEQUENCE_DUPLICATES, "sequence-duplicates");
+    _FDO_STATISTIC_NAME(SEQUENCE_REORDERS, "sequence-reorders");
+    _FDO_STATISTIC_NAME(WATCHDOG_RECOVERIES, "watchdog-recoveries");
+    _FDO_STATISTIC_NAME(IRPS_DRAINED, "irps-drained");
+    _FDO_STATISTIC_NAME(IRPS_DEFERRED, "irps-deferred");
+    _FDO_STATISTIC_NAME(CALLBACK_TIME, "callback-time-us");
+    _FDO_STATISTIC_NAME(CALLBACK_TIME_MAXIMUM, "callback-time-maximum-us");
+    _FDO_STATISTIC_NAME(IDLE_ENTRIES, "idle-entries");
+    _FDO_STATISTIC_NAME(IDLE_WAKES, "idle-wakes");
+    _FDO_STATISTIC_NAME(IDLE_WAKE_TIME, "idle-wake-time-us");
+    _FDO_STATISTIC_NAME(QUIESCE_TIME, "quiesce-time-us");
+    default:
+        break;
+    }
+
+    return "unknown";
+
+#undef  _FDO_STATISTIC_NAME
+}
+
+// Runtime tunables. These are parsed by the configuration thread
+// whenever anything under FDO_CONFIGURATION_PATH changes and are then
+// read without locks, so each field must be a naturally aligned ULONG.
+typedef struct _FDO_CONFIGURATION {
+    ULONG   QueueLimit;
+    ULONG   StatisticsInterval;
+    ULONG   ProbeReportId;
+    ULONG   WatchdogTimeout;
+    ULONG   DeferredCompletion;
+    ULONG   CallbackTiming;
+} FDO_CONFIGURATION, *PFDO_CONFIGURATION;
+
+#define FDO_CONFIGURATION_PATH  "control/xenhid"
+
+typedef struct _FDO_KNOB {
+    const CHAR  *Name;
+    ULONG       Offset;
+    ULONG       Minimum;
+    ULONG       Maximum;
+    ULONG       Default;
+} FDO_KNOB, *PFDO_KNOB;
+
+#define FDO_KNOB(_Name, _Field, _Minimum, _Maximum, _Default)   \
+        { _Name, FIELD_OFFSET(FDO_CONFIGURATION, _Field), _Minimum, _Maximum, _Default }
+
+static const FDO_KNOB   FdoKnob[] = {
+    FDO_KNOB("queue-limit", QueueLimit, 0, 1024, 0),  // 0 means unlimited
+    FDO_KNOB("statistics-interval", StatisticsInterval, 1, 3600, 10),  // seconds
+    FDO_KNOB("probe-report-id", ProbeReportId, 0, 255, 0),  // 0 means disabled
+    FDO_KNOB("watchdog-timeout", WatchdogTimeout, 0, 60000, 1000),  // ms, 0 means disabled
+    FDO_KNOB("deferred-completion", DeferredCompletion, 0, 1, 0),
+    FDO_KNOB("callback-timing", CallbackTiming, 0, 1, 0),  // 1 keeps callback-time-us
+};
+
+#undef  FDO_KNOB
+
+// The log level is not per-FDO: it sets the driver-wide DbgPrintMask.
+// Every FDO watches the same key, so they all agree on its value.
+static const FDO_KNOB   FdoLogLevelKnob = {
+    "log-level", 0, DPFLTR_ERROR_LEVEL, DPFLTR_INFO_LEVEL, DPFLTR_INFO_LEVEL
+};
+
+// A probe is a report, sent by dom0 tooling, whose first byte is the
+// configured probe report id and which is optionally followed by a
+// 32-bit sequence number. It is never passed to HIDCLASS, so no IRP is
+// ever completed for it. Instead its arrival time and the time at
+// which a read IRP was found ready to receive it are written to
+// XenStore so that dom0 can measure the end-to-end latency of input
+// delivery.
+typedef struct _FDO_PROBE {
+    ULONG       Sequence;
+    ULONG       Attempts;
+    LONGLONG    Arrival;
+    LONGLONG    Ready;
+} FDO_PROBE, *PFDO_PROBE;
+
+// Counters are kept per processor so that the hot path never contends
+// on a shared cache line. They are only summed when a snapshot is taken.
+// Each processor's block is cache aligned, and hence padded to a whole
+// number of cache lines, so that neighbours never share a line.
+typedef struct DECLSPEC_CACHEALIGN _FDO_PROCESSOR_STATISTICS {
+    LONGLONG    Value[XENHID_STATISTIC_COUNT];
+} FDO_PROCESSOR_STATISTICS, *PFDO_PROCESSOR_STATISTICS;
+
+C_ASSERT((sizeof (FDO_PROCESSOR_STATISTICS) % SYSTEM_CACHE_ALIGNMENT_SIZE) == 0);
+
 struct _XENHID_FDO {
     PDEVICE_OBJECT              DeviceObject;
     PDEVICE_OBJECT              LowerDeviceObject;
@@ -60,16 +182,167 @@ struct _XENHID_FDO {
     DEVICE_POWER_STATE          DevicePowerState;
     BOOLEAN                     Enabled;
     XENHID_HID_INTERFACE        HidInterface;
+    ULONG                       HidInterfaceVersion;
+    SEQUENCE_WINDOW             SequenceWindow;
+    BOOLEAN                     SequenceValid;
     XENBUS_STORE_INTERFACE      StoreInterface;
     XENBUS_SUSPEND_INTERFACE    SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallback;
     IO_CSQ                      Queue;
     KSPIN_LOCK                  Lock;
     LIST_ENTRY                  List;
+    LONG                        QueueDepth;
+    PXENHID_THREAD              WatchdogThread;
+    XENHID_THREAD_TIMER         WatchdogTimer;
+    BOOLEAN                     WatchdogEnabled;
+    LONGLONG                    WatchdogActivity;
+    KSPIN_LOCK                  StagedLock;
+    LIST_ENTRY                  Staged;
+    KDPC                        CompletionDpc;
+    LONGLONG                    CallbackTimeMaximum;
+    PIRP                        IdleIrp;
+    HID_IDLE_CALLBACK           IdleCallback;
+    PVOID                       IdleContext;
+    XENHID_WORK_ITEM            IdleItem;
+    EX_RUNDOWN_REF              IdleRundown;
+    BOOLEAN                     Idle;
+    LONGLONG                    IdleWakeTime;
+    FDO_CONFIGURATION           Configuration;
+    PXENHID_THREAD              ConfigurationThread;
+    PXENBUS_STORE_WATCH         ConfigurationWatch;
+    ULONG                       Index;
+    CHAR                        Path[MAXNAMELEN];
+    CHAR                        FrontendPath[MAXNAMELEN];
+    LONG                        FeaturesStale;
+    CHAR                        StatisticsPath[MAXNAMELEN];
+    PXENHID_THREAD              StatisticsThread;
+    XENHID_THREAD_TIMER         StatisticsTimer;
+    PFDO_PROCESSOR_STATISTICS   Statistics;
+    ULONG                       ProcessorCount;
+    LONG                        QueueDepthMaximum;
+    LONGLONG                    ReportSequence;
+    ULONG64                     Published[XENHID_STATISTIC_COUNT];
+    LIST_ENTRY                  ListEntry;
+    KSPIN_LOCK                  ProbeLock;
+    FDO_PROBE                   Probe;
+    FDO_PROBE                   ProbeResult;
+    BOOLEAN                     ProbePending;
+    XENHID_WORK_ITEM            ProbeItem;
+    EX_RUNDOWN_REF              ProbeRundown;
 };
 
 #define FDO_POOL_TAG 'ODF'
 
+static LIST_ENTRY   FdoList;
+static KSPIN_LOCK   FdoListLock;
+
+// Indices of the data/xenhid/<index> nodes in use, protected by
+// FdoListLock. A node is only removed when its device is, so indices
+// are recycled rather than handed out from an ever growing counter.
+#define FDO_MAXIMUM_INDEX   63
+
+static ULONG64      FdoIndexMap;
+
+// Each time a device enters D0 it probes drivers/<index> keys until it
+// finds a free one, so the key format is compiled once, by
+// FdoInitialize()
+#define FDO_DISTRIBUTION_INDEX_FORMAT   "%u"
+
+static XENHID_STRING_FORMAT FdoDistributionIndexFormat;
+
+static FORCEINLINE VOID
+__FdoAddStatistic(
+    IN  PXENHID_FDO         Fdo,
+    IN  XENHID_STATISTIC    Statistic,
+    IN  LONGLONG            Value
+    )
+{
+    ULONG                   Index;
+
+    Index = KeGetCurrentProcessorNumberEx(NULL);
+    ASSERT3U(Index, <, Fdo->ProcessorCount);
+
+    (VOID) InterlockedAdd64(&Fdo->Statistics[Index].Value[Statistic], Value);
+}
+
+static FORCEINLINE VOID
+__FdoIncrementStatistic(
+    IN  PXENHID_FDO         Fdo,
+    IN  XENHID_STATISTIC    Statistic
+    )
+{
+    __FdoAddStatistic(Fdo, Statistic, 1);
+}
+
+static FORCEINLINE ULONG64
+__FdoTicksToMicroseconds(
+    IN  ULONG64     Ticks
+    )
+{
+    LARGE_INTEGER   Frequency;
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    // Split the conversion to avoid overflowing the multiplication
+    return ((Ticks / Frequency.QuadPart) * 1000000) +
+           (((Ticks % Frequency.QuadPart) * 1000000) / Frequency.QuadPart);
+}
+
+static FORCEINLINE VOID
+__FdoAccountCallback(
+    IN  PXENHID_FDO Fdo,
+    IN  LONGLONG    Ticks
+    )
+{
+    LONGLONG        Maximum;
+
+    __FdoAddStatistic(Fdo, XENHID_STATISTIC_CALLBACK_TIME, Ticks);
+
+    Maximum = ReadNoFence64(&Fdo->CallbackTimeMaximum);
+    while (Ticks > Maximum) {
+        LONGLONG    Old;
+
+        Old = InterlockedCompareExchange64(&Fdo->CallbackTimeMaximum,
+                                           Ticks,
+                                           Maximum);
+        if (Old == Maximum)
+            break;
+
+        Maximum = Old;
+    }
+}
+
+static VOID
+__FdoQueryStatistics(
+    IN  PXENHID_FDO     Fdo,
+    OUT PULONG64        Value
+    )
+{
+    ULONG               Index;
+
+    RtlZeroMemory(Value, sizeof (ULONG64) * XENHID_STATISTIC_COUNT);
+
+    for (Index = 0; Index < Fdo->ProcessorCount; Index++) {
+        PFDO_PROCESSOR_STATISTICS   Statistics = &Fdo->Statistics[Index];
+        ULONG                       Statistic;
+
+        for (Statistic = 0; Statistic < XENHID_STATISTIC_COUNT; Statistic++)
+            Value[Statistic] += (ULONG64)ReadNoFence64(&Statistics->Value[Statistic]);
+    }
+
+    Value[XENHID_STATISTIC_QUEUE_DEPTH_MAXIMUM] =
+        (ULONG64)ReadNoFence(&Fdo->QueueDepthMaximum);
+
+    // Callback and quiesce times are accumulated in performance counter
+    // ticks
+    Value[XENHID_STATISTIC_CALLBACK_TIME] =
+        __FdoTicksToMicroseconds(Value[XENHID_STATISTIC_CALLBACK_TIME]);
+    Value[XENHID_STATISTIC_CALLBACK_TIME_MAXIMUM] =
+        __FdoTicksToMicroseconds((ULONG64)ReadNoFence64(&Fdo->CallbackTimeMaximum));
+    Value[XENHID_STATISTIC_QUIESCE_TIME] =
+        __FdoTicksToMicroseconds(Value[XENHID_STATISTIC_QUIESCE_TIME]);
+}
+
 ULONG
 FdoGetSize(
     VOID
@@ -78,17 +351,315 @@ FdoGetSize(
     return sizeof(XENHID_FDO);
 }
 
-IO_CSQ_INSERT_IRP FdoCsqInsertIrp;
+NTSTATUS
+FdoInitialize(
+    VOID
+    )
+{
+    NTSTATUS    status;
+
+    InitializeListHead(&FdoList);
+    KeInitializeSpinLock(&FdoListLock);
+
+    status = StringFormatCompile(&FdoDistributionIndexFormat,
+                                 FDO_DISTRIBUTION_INDEX_FORMAT);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// The watchdog catches read IRPs that have been left queued because the
+// backend has stopped calling back (e.g. an event lost over migration).
+// It is a one-shot timer that is only armed while there are IRPs in the
+// queue; whenever it finds that nothing has happened for WatchdogTimeout
+// it kicks the backend with ReadReport. The timer runs on its own
+// thread, so the kick is made at PASSIVE_LEVEL.
+static FORCEINLINE VOID
+__FdoWatchdogArm(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG           Timeout;
+
+    // Called with Fdo->Lock held
+    Timeout = Fdo->Configuration.WatchdogTimeout;
+    if (!Fdo->WatchdogEnabled || Timeout == 0)
+        return;
+
+    (VOID) ThreadTimerSet(Fdo->WatchdogThread,
+                          &Fdo->WatchdogTimer,
+                          Timeout,
+                          0,
+                          Timeout / 4);
+}
+
+static VOID
+FdoWatchdogTimer(
+    IN  PVOID       Context
+    )
+{
+    PXENHID_FDO     Fdo = Context;
+    LONGLONG        Idle;
+    LONG            Depth;
+    BOOLEAN         Stalled;
+    KIRQL           Irql;
+
+    Stalled = FALSE;
+    Idle = 0;
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+
+    // Let the timer lapse if there is nothing to watch
+    Depth = Fdo->QueueDepth;
+    if (!Fdo->WatchdogEnabled || Depth == 0)
+        goto done;
+
+    Idle = (LONGLONG)KeQueryInterruptTime() -
+           ReadNoFence64(&Fdo->WatchdogActivity);
+    if (Idle >= TIME_MS((LONGLONG)Fdo->Configuration.WatchdogTimeout)) {
+        WriteNoFence64(&Fdo->WatchdogActivity,
+                       (LONGLONG)KeQueryInterruptTime());
+        Stalled = TRUE;
+    }
+
+    __FdoWatchdogArm(Fdo);
+
+done:
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    if (!Stalled)
+        return;
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_WATCHDOG_RECOVERIES);
+
+    Warning("%d read(s) stalled for %llums\n",
+            Depth,
+            (ULONGLONG)(Idle / TIME_MS(1)));
+
+    XENHID_HID(ReadReport,
+               &Fdo->HidInterface);
+}
+
+// The thread only exists to run the watchdog timer, which it does from
+// within ThreadWait()
+static NTSTATUS
+FdoWatchdog(
+    IN  PXENHID_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    for (;;) {
+        (VOID) ThreadWait(Self, NULL);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        ThreadSpuriousWake(Self);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+FdoStartWatchdog(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    PXENHID_THREAD  Thread;
+    KIRQL           Irql;
+    NTSTATUS        status;
+
+    ThreadTimerInitialize(&Fdo->WatchdogTimer, FdoWatchdogTimer, Fdo);
+
+    status = ThreadCreate(FdoWatchdog, Fdo, &Thread);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+
+    Fdo->WatchdogThread = Thread;
+    Fdo->WatchdogEnabled = TRUE;
+    WriteNoFence64(&Fdo->WatchdogActivity,
+                   (LONGLONG)KeQueryInterruptTime());
+
+    // IRPs may have been queued while the backend was disabled
+    if (Fdo->QueueDepth != 0)
+        __FdoWatchdogArm(Fdo);
+
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    RtlZeroMemory(&Fdo->WatchdogTimer, sizeof (XENHID_THREAD_TIMER));
+
+    return status;
+}
+
+static DECLSPEC_NOINLINE VOID
+FdoStopWatchdog(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    PXENHID_THREAD  Thread;
+    KIRQL           Irql;
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+    Fdo->WatchdogEnabled = FALSE;
+    Thread = Fdo->WatchdogThread;
+    Fdo->WatchdogThread = NULL;
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    // With WatchdogEnabled clear the timer will not be re-armed, and
+    // once the thread has been joined no kick can be in progress
+    ThreadAlert(Thread);
+    ThreadJoin(Thread);
+
+    RtlZeroMemory(&Fdo->WatchdogTimer, sizeof (XENHID_THREAD_TIMER));
+    Fdo->WatchdogActivity = 0;
+}
+
+// When deferred completion is enabled, FdoHidCallback() only stages
+// the IRPs it has filled and the I/O manager completion work is done
+// by a threaded DPC, which keeps it out of the backend's delivery path.
+// The DPC is targeted at the processor that dispatched the first IRP
+// in each batch; that processor number is stashed in DriverContext[0]
+// when the IRP is queued (DriverContext[3] belongs to the CSQ).
+C_ASSERT(sizeof (PROCESSOR_NUMBER) <= sizeof (PVOID));
+
+KDEFERRED_ROUTINE FdoCompletionDpc;
 
 VOID
+FdoCompletionDpc(
+    IN  PKDPC       Dpc,
+    IN  PVOID       Context,
+    IN  PVOID       Argument1,
+    IN  PVOID       Argument2
+    )
+{
+    PXENHID_FDO     Fdo = Context;
+    LIST_ENTRY      List;
+    KIRQL           Irql;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    InitializeListHead(&List);
+
+    // A threaded DPC may run at PASSIVE_LEVEL
+    KeAcquireSpinLock(&Fdo->StagedLock, &Irql);
+
+    if (!IsListEmpty(&Fdo->Staged)) {
+        List.Flink = Fdo->Staged.Flink;
+        List.Blink = Fdo->Staged.Blink;
+        List.Flink->Blink = &List;
+        List.Blink->Flink = &List;
+
+        InitializeListHead(&Fdo->Staged);
+    }
+
+    KeReleaseSpinLock(&Fdo->StagedLock, Irql);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY ListEntry;
+        PIRP        Irp;
+
+        ListEntry = RemoveHeadList(&List);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+static FORCEINLINE VOID
+__FdoStageIrp(
+    IN  PXENHID_FDO     Fdo,
+    IN  PIRP            Irp
+    )
+{
+    BOOLEAN             Empty;
+    KIRQL               Irql;
+
+    KeAcquireSpinLock(&Fdo->StagedLock, &Irql);
+
+    Empty = IsListEmpty(&Fdo->Staged);
+    InsertTailList(&Fdo->Staged, &Irp->Tail.Overlay.ListEntry);
+
+    // The DPC is only ever queued on the empty to non-empty transition
+    // so it cannot already be in a DPC queue when it is re-targeted
+    if (Empty) {
+        PROCESSOR_NUMBER    Number;
+
+        RtlCopyMemory(&Number,
+                      &Irp->Tail.Overlay.DriverContext[0],
+                      sizeof (PROCESSOR_NUMBER));
+
+        (VOID) KeSetTargetProcessorDpcEx(&Fdo->CompletionDpc, &Number);
+        (VOID) KeInsertQueueDpc(&Fdo->CompletionDpc, NULL, NULL);
+    }
+
+    KeReleaseSpinLock(&Fdo->StagedLock, Irql);
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_IRPS_DEFERRED);
+}
+
+IO_CSQ_INSERT_IRP_EX FdoCsqInsertIrp;
+
+NTSTATUS
 FdoCsqInsertIrp(
     IN  PIO_CSQ Csq,
-    IN  PIRP    Irp
+    IN  PIRP    Irp,
+    IN  PVOID   InsertContext
     )
 {
     PXENHID_FDO Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
+    ULONG       QueueLimit;
+
+    UNREFERENCED_PARAMETER(InsertContext);
+
+    // Called with Fdo->Lock held. Checking the power state here, rather
+    // than only in the dispatch routine, means nothing can be queued
+    // behind FdoDrainQueue().
+    if (Fdo->DevicePowerState != PowerDeviceD0)
+        return STATUS_DEVICE_NOT_READY;
+
+    // Reads over the limit are refused as busy. Only reads beyond the
+    // limit are ever refused and a non-zero limit is at least one, so
+    // there is always a read pending for input to complete.
+    QueueLimit = ReadULongNoFence(&Fdo->Configuration.QueueLimit);
+    if (QueueLimit != 0 && (ULONG)Fdo->QueueDepth >= QueueLimit)
+        return STATUS_DEVICE_BUSY;
+
+    (VOID) KeGetCurrentProcessorNumberEx((PPROCESSOR_NUMBER)&Irp->Tail.Overlay.DriverContext[0]);
 
     InsertTailList(&Fdo->List, &Irp->Tail.Overlay.ListEntry);
+
+    // Record the IRP while the lock still keeps it from being removed,
+    // so that its queue event always precedes its completion
+    EtwIrpQueue(Fdo, Irp);
+    RingRecord(RING_EVENT_IRP_QUEUE, Fdo, (ULONG_PTR)Irp, 0);
+
+    if (++Fdo->QueueDepth == 1) {
+        WriteNoFence64(&Fdo->WatchdogActivity,
+                       (LONGLONG)KeQueryInterruptTime());
+        __FdoWatchdogArm(Fdo);
+    }
+
+    if (Fdo->QueueDepth > Fdo->QueueDepthMaximum)
+        Fdo->QueueDepthMaximum = Fdo->QueueDepth;
+
+    return STATUS_SUCCESS;
 }
 
 IO_CSQ_REMOVE_IRP FdoCsqRemoveIrp;
@@ -99,9 +670,12 @@ FdoCsqRemoveIrp(
     IN  PIRP    Irp
     )
 {
-    UNREFERENCED_PARAMETER(Csq);
+    PXENHID_FDO Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
 
     RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+
+    // Called with Fdo->Lock held
+    --Fdo->QueueDepth;
 }
 
 IO_CSQ_PEEK_NEXT_IRP FdoCsqPeekNextIrp;
@@ -172,71 +746,477 @@ FdoCsqCompleteCanceledIrp(
     IN  PIRP    Irp
     )
 {
-    UNREFERENCED_PARAMETER(Csq);
+    PXENHID_FDO Fdo = CONTAINING_RECORD(Csq, XENHID_FDO, Queue);
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_IRPS_CANCELLED);
+    EtwIrpCancel(Fdo, Irp);
+    RingRecord(RING_EVENT_IRP_CANCEL, Fdo, (ULONG_PTR)Irp, 0);
 
     Irp->IoStatus.Information = 0;
     Irp->IoStatus.Status = STATUS_DEVICE_NOT_READY;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
-static DECLSPEC_NOINLINE BOOLEAN
-FdoHidCallback(
-    IN  PVOID       Argument,
-    IN  PVOID       Buffer,
-    IN  ULONG       Length
+// HIDCLASS selective suspend. When HIDCLASS considers the device idle
+// it sends IOCTL_HID_SEND_IDLE_NOTIFICATION_REQUEST. There is no bus to
+// prepare so the IRP is held and the supplied callback invoked straight
+// away, after which HIDCLASS requests D3. The callback is made from a
+// thread pool work item rather than from within the IOCTL, which
+// HIDCLASS may have sent holding its own locks. Nor can it be made from
+// the device power thread, since HIDCLASS may wait within the callback
+// for the D3 request that thread has to handle. For that D3 the backend
+// is left enabled (see FdoD0ToIdle()) so that input arriving while idle
+// can complete the held IRP, which prompts HIDCLASS to return the device
+// to D0. The report itself is refused and will be offered again by the
+// backend once read IRPs are queued.
+
+DRIVER_CANCEL FdoIdleCancel;
+
+VOID
+FdoIdleCancel(
+    IN  PDEVICE_OBJECT  DeviceObject,
+    IN  PIRP            Irp
     )
 {
-    PXENHID_FDO     Fdo = Argument;
-    BOOLEAN         Completed = FALSE;
-    PIRP            Irp;
+    PXENHID_FDO         Fdo = Irp->Tail.Overlay.DriverContext[0];
+    KIRQL               Irql;
 
-    Irp = IoCsqRemoveNextIrp(&Fdo->Queue, NULL);
-    if (Irp == NULL)
-        goto done;
+    UNREFERENCED_PARAMETER(DeviceObject);
 
-    RtlCopyMemory(Irp->UserBuffer,
-                  Buffer,
-                  Length);
-    Irp->IoStatus.Information = Length;
-    Irp->IoStatus.Status = STATUS_SUCCESS;
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
 
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    Completed = TRUE;
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+    if (Fdo->IdleIrp == Irp)
+        Fdo->IdleIrp = NULL;
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
 
-done:
-    return Completed;
-}
+    Irp->Tail.Overlay.DriverContext[0] = NULL;
 
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
 
-static FORCEINLINE PVOID
-__FdoAllocate(
-    IN  ULONG   Length
+static VOID
+FdoIdleCallback(
+    IN  PVOID           Context
     )
 {
-    PVOID       Buffer;
+    PXENHID_FDO         Fdo = Context;
+    HID_IDLE_CALLBACK   Callback;
+    PVOID               IdleContext;
+    KIRQL               Irql;
 
-    Buffer = __AllocatePoolWithTag(NonPagedPool, Length, FDO_POOL_TAG);
-    if (Buffer)
-        RtlZeroMemory(Buffer, Length);
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
 
-    return Buffer;
+    // Don't call back for an IRP that has since been cancelled
+    Callback = (Fdo->IdleIrp != NULL) ? Fdo->IdleCallback : NULL;
+    IdleContext = Fdo->IdleContext;
+
+    Fdo->IdleCallback = NULL;
+    Fdo->IdleContext = NULL;
+
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    if (Callback != NULL)
+        Callback(IdleContext);
+
+    ExReleaseRundownProtection(&Fdo->IdleRundown);
 }
 
+// Each queued instance of the idle work item holds a reference on
+// IdleRundown, which FdoDestroy() waits to be released
 static FORCEINLINE VOID
-__FdoFree(
-    IN  PVOID   Buffer
+__FdoQueueIdleCallback(
+    IN  PXENHID_FDO Fdo
     )
 {
-    __FreePoolWithTag(Buffer, FDO_POOL_TAG);
-}
+    if (!ExAcquireRundownProtection(&Fdo->IdleRundown))
+        return;
 
-static FORCEINLINE VOID
-__FdoSetDevicePowerState(
-    IN  PXENHID_FDO         Fdo,
-    IN  DEVICE_POWER_STATE  State
-)
-{
-    Fdo->DevicePowerState = State;
+    if (!ThreadPoolQueue(DriverGetThreadPool(), &Fdo->IdleItem))
+        ExReleaseRundownProtection(&Fdo->IdleRundown);
+}
+
+static NTSTATUS
+FdoSubmitIdleNotification(
+    IN  PXENHID_FDO                                 Fdo,
+    IN  PIRP                                        Irp
+    )
+{
+    PIO_STACK_LOCATION                              StackLocation;
+    PHID_SUBMIT_IDLE_NOTIFICATION_CALLBACK_INFO     Info;
+    KIRQL                                           Irql;
+    NTSTATUS                                        status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    Info = StackLocation->Parameters.DeviceIoControl.Type3InputBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (StackLocation->Parameters.DeviceIoControl.InputBufferLength <
+        sizeof (HID_SUBMIT_IDLE_NOTIFICATION_CALLBACK_INFO) ||
+        Info == NULL ||
+        Info->IdleCallback == NULL)
+        goto fail1;
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+
+    status = STATUS_DEVICE_BUSY;
+    if (Fdo->IdleIrp != NULL)
+        goto fail2;
+
+    Irp->Tail.Overlay.DriverContext[0] = Fdo;
+
+    IoMarkIrpPending(Irp);
+    (VOID) IoSetCancelRoutine(Irp, FdoIdleCancel);
+
+    if (Irp->Cancel) {
+        // If the cancel routine has been claimed then it will complete
+        // the IRP, otherwise it has to be done here
+        if (IoSetCancelRoutine(Irp, NULL) != NULL) {
+            KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+            Irp->Tail.Overlay.DriverContext[0] = NULL;
+
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = STATUS_CANCELLED;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            return STATUS_PENDING;
+        }
+
+        KeReleaseSpinLock(&Fdo->Lock, Irql);
+        return STATUS_PENDING;
+    }
+
+    Fdo->IdleIrp = Irp;
+    Fdo->IdleCallback = Info->IdleCallback;
+    Fdo->IdleContext = Info->IdleContext;
+
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    __FdoQueueIdleCallback(Fdo);
+
+    return STATUS_PENDING;
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static BOOLEAN
+FdoCompleteIdleIrp(
+    IN  PXENHID_FDO Fdo,
+    IN  NTSTATUS    Status
+    )
+{
+    PIRP            Irp;
+    KIRQL           Irql;
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+
+    Irp = Fdo->IdleIrp;
+    if (Irp == NULL)
+        goto done;
+
+    // If the cancel routine has been claimed then it owns the IRP
+    if (IoSetCancelRoutine(Irp, NULL) == NULL) {
+        Irp = NULL;
+        goto done;
+    }
+
+    Fdo->IdleIrp = NULL;
+
+done:
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    if (Irp == NULL)
+        return FALSE;
+
+    Irp->Tail.Overlay.DriverContext[0] = NULL;
+
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = Status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return TRUE;
+}
+
+static DECLSPEC_NOINLINE BOOLEAN
+FdoIdleWake(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    LONGLONG        Now;
+
+    Now = (LONGLONG)KeQueryInterruptTime();
+
+    // Only the first report seen while idle starts the wake
+    if (InterlockedCompareExchange64(&Fdo->IdleWakeTime, Now, 0) == 0)
+        (VOID) FdoCompleteIdleIrp(Fdo, STATUS_SUCCESS);
+
+    return FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+__FdoIsProbe(
+    IN  PXENHID_FDO Fdo,
+    IN  PVOID       Buffer,
+    IN  ULONG       Length
+    )
+{
+    ULONG           ProbeReportId;
+
+    ProbeReportId = Fdo->Configuration.ProbeReportId;
+
+    return (ProbeReportId != 0 &&
+            Length != 0 &&
+            *(PUCHAR)Buffer == (UCHAR)ProbeReportId) ? TRUE : FALSE;
+}
+
+// Each queued instance of the probe work item holds a reference on
+// ProbeRundown, which FdoStopProbe() waits to be released
+static FORCEINLINE VOID
+__FdoQueueProbe(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    if (!ExAcquireRundownProtection(&Fdo->ProbeRundown))
+        return;
+
+    if (!ThreadPoolQueue(DriverGetThreadPool(), &Fdo->ProbeItem))
+        ExReleaseRundownProtection(&Fdo->ProbeRundown);
+}
+
+static DECLSPEC_NOINLINE BOOLEAN
+FdoProbe(
+    IN  PXENHID_FDO Fdo,
+    IN  PVOID       Buffer,
+    IN  ULONG       Length
+    )
+{
+    PFDO_PROBE      Probe = &Fdo->Probe;
+    LARGE_INTEGER   Now;
+    ULONG           Sequence;
+    BOOLEAN         Ready;
+    KIRQL           Irql;
+
+    Now = KeQueryPerformanceCounter(NULL);
+
+    Sequence = 0;
+    if (Length >= sizeof (UCHAR) + sizeof (ULONG))
+        RtlCopyMemory(&Sequence, (PUCHAR)Buffer + 1, sizeof (ULONG));
+
+    KeAcquireSpinLock(&Fdo->ProbeLock, &Irql);
+
+    // A probe that is refused will be offered again by the backend, so
+    // only the first attempt counts as its arrival
+    if (Probe->Attempts == 0 || Probe->Sequence != Sequence) {
+        Probe->Sequence = Sequence;
+        Probe->Attempts = 0;
+        Probe->Arrival = Now.QuadPart;
+    }
+
+    Probe->Attempts++;
+
+    // Accept the probe exactly when a real report would have been
+    // accepted, i.e. when there is a read IRP queued, but leave the
+    // IRP where it is
+    KeAcquireSpinLockAtDpcLevel(&Fdo->Lock);
+    Ready = !IsListEmpty(&Fdo->List);
+    KeReleaseSpinLockFromDpcLevel(&Fdo->Lock);
+
+    if (Ready) {
+        Probe->Ready = KeQueryPerformanceCounter(NULL).QuadPart;
+
+        Fdo->ProbeResult = *Probe;
+        Fdo->ProbePending = TRUE;
+
+        RtlZeroMemory(Probe, sizeof (FDO_PROBE));
+    }
+
+    KeReleaseSpinLock(&Fdo->ProbeLock, Irql);
+
+    if (Ready) {
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_PROBES);
+        __FdoQueueProbe(Fdo);
+    }
+
+    return Ready;
+}
+
+static FORCEINLINE BOOLEAN
+__FdoHidCallback(
+    IN  PXENHID_FDO Fdo,
+    IN  PVOID       Buffer,
+    IN  ULONG       Length
+    )
+{
+    BOOLEAN         Completed = FALSE;
+    BOOLEAN         Timing;
+    LONGLONG        Sequence;
+    LARGE_INTEGER   Start;
+    PIRP            Irp;
+
+    WriteNoFence64(&Fdo->WatchdogActivity,
+                   (LONGLONG)KeQueryInterruptTime());
+
+    if (Fdo->Idle)
+        return FdoIdleWake(Fdo);
+
+    if (__FdoIsProbe(Fdo, Buffer, Length))
+        return FdoProbe(Fdo, Buffer, Length);
+
+    // The performance counter may be emulated, and so cost an exit to
+    // the hypervisor, so the callback is only timed on request
+    Timing = (ReadULongNoFence(&Fdo->Configuration.CallbackTiming) != 0) ?
+             TRUE :
+             FALSE;
+
+    Start.QuadPart = 0;
+    if (Timing)
+        Start = KeQueryPerformanceCounter(NULL);
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_REPORTS_RECEIVED);
+    Sequence = InterlockedIncrement64(&Fdo->ReportSequence);
+    EtwReportArrival(Fdo, Sequence, Length);
+    RingRecord(RING_EVENT_REPORT_ARRIVAL, Fdo, (ULONG_PTR)Sequence, Length);
+
+    Irp = IoCsqRemoveNextIrp(&Fdo->Queue, NULL);
+    if (Irp == NULL) {
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_REPORTS_REFUSED);
+        RingRecord(RING_EVENT_REPORT_REFUSED, Fdo, (ULONG_PTR)Sequence, 0);
+        goto done;
+    }
+
+    RtlCopyMemory(Irp->UserBuffer,
+                  Buffer,
+                  Length);
+    Irp->IoStatus.Information = Length;
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    EtwIrpComplete(Fdo, Irp, Sequence, STATUS_SUCCESS);
+    RingRecord(RING_EVENT_IRP_COMPLETE, Fdo, (ULONG_PTR)Irp, (ULONG_PTR)Sequence);
+
+    if (Fdo->Configuration.DeferredCompletion != 0)
+        __FdoStageIrp(Fdo, Irp);
+    else
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    Completed = TRUE;
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_IRPS_COMPLETED);
+
+done:
+    if (Timing)
+        __FdoAccountCallback(Fdo,
+                             KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart);
+
+    return Completed;
+}
+
+static DECLSPEC_NOINLINE BOOLEAN
+FdoHidCallbackVersion1(
+    IN  PVOID       Argument,
+    IN  PVOID       Buffer,
+    IN  ULONG       Length
+    )
+{
+    PXENHID_FDO     Fdo = Argument;
+
+    return __FdoHidCallback(Fdo, Buffer, Length);
+}
+
+static DECLSPEC_NOINLINE BOOLEAN
+FdoHidCallback(
+    IN  PVOID       Argument,
+    IN  PVOID       Buffer,
+    IN  ULONG       Length,
+    IN  ULONG       Sequence
+    )
+{
+    PXENHID_FDO     Fdo = Argument;
+    SEQUENCE_OFFER  Offer;
+    ULONG           Skipped;
+    BOOLEAN         Completed;
+
+    // The provider never calls back concurrently so the sequence
+    // window needs no lock. The first report after enable sets the
+    // baseline, so nothing before it can be taken for a lost report.
+    if (!Fdo->SequenceValid) {
+        __SequenceWindowInitialize(&Fdo->SequenceWindow, Sequence);
+        Fdo->SequenceValid = TRUE;
+    }
+
+    Offer = __SequenceWindowOffer(&Fdo->SequenceWindow, Sequence, &Skipped);
+    if (Skipped != 0) {
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_SEQUENCE_GAPS);
+        __FdoAddStatistic(Fdo, XENHID_STATISTIC_REPORTS_LOST, Skipped);
+    }
+
+    // A report that has already been passed to HIDCLASS, or that is too
+    // old to tell, must not be passed again
+    if (Offer == SEQUENCE_OFFER_REPEAT) {
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_SEQUENCE_DUPLICATES);
+        return TRUE;
+    }
+
+    // A refused report will be offered again with the same sequence
+    // number, so the window only moves on once it is accepted
+    Completed = __FdoHidCallback(Fdo, Buffer, Length);
+    if (!Completed)
+        return FALSE;
+
+    __SequenceWindowAccept(&Fdo->SequenceWindow, Sequence);
+
+    // A late report fills a gap that was counted as lost
+    if (Offer == SEQUENCE_OFFER_LATE) {
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_SEQUENCE_REORDERS);
+        __FdoAddStatistic(Fdo, XENHID_STATISTIC_REPORTS_LOST, -1);
+    }
+
+    return Completed;
+}
+
+
+static FORCEINLINE PVOID
+__FdoAllocate(
+    IN  ULONG   Length
+    )
+{
+    return PoolAllocate(Length, FDO_POOL_TAG);
+}
+
+static FORCEINLINE PVOID
+__FdoAllocateAligned(
+    IN  ULONG   Length,
+    IN  ULONG   Alignment
+    )
+{
+    return PoolAllocateAligned(Length, Alignment, FDO_POOL_TAG);
+}
+
+static FORCEINLINE VOID
+__FdoFree(
+    IN  PVOID   Buffer
+    )
+{
+    PoolFree(Buffer, FDO_POOL_TAG);
+}
+
+static FORCEINLINE VOID
+__FdoSetDevicePowerState(
+    IN  PXENHID_FDO         Fdo,
+    IN  DEVICE_POWER_STATE  State
+)
+{
+    Fdo->DevicePowerState = State;
 }
 
 static FORCEINLINE DEVICE_POWER_STATE
@@ -248,65 +1228,28 @@ __FdoGetDevicePowerState(
 }
 
 static FORCEINLINE PANSI_STRING
-__FdoMultiSzToUpcaseAnsi(
+__FdoMultiSzToAnsi(
     IN  PCHAR       Buffer
 )
 {
     PANSI_STRING    Ansi;
-    LONG            Index;
-    LONG            Count;
+    ULONG           Count;
     NTSTATUS        status;
 
-    Index = 0;
-    Count = 0;
-    for (;;) {
-        if (Buffer[Index] == '\0') {
-            Count++;
-            Index++;
-
-            // Check for double NUL
-            if (Buffer[Index] == '\0')
-                break;
-        }
-        else {
-            Buffer[Index] = __toupper(Buffer[Index]);
-            Index++;
-        }
-    }
+    Count = __MultiSzCount(Buffer);
 
+    // A single allocation holds the whole array; each entry is a view
+    // onto the NUL terminated names in Buffer, so Buffer must outlive it.
     Ansi = __FdoAllocate(sizeof(ANSI_STRING) * (Count + 1));
 
     status = STATUS_NO_MEMORY;
     if (Ansi == NULL)
         goto fail1;
 
-    for (Index = 0; Index < Count; Index++) {
-        ULONG   Length;
-
-        Length = (ULONG)strlen(Buffer);
-        Ansi[Index].MaximumLength = (USHORT)(Length + 1);
-        Ansi[Index].Buffer = __FdoAllocate(Ansi[Index].MaximumLength);
-
-        status = STATUS_NO_MEMORY;
-        if (Ansi[Index].Buffer == NULL)
-            goto fail2;
-
-        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length);
-        Ansi[Index].Length = (USHORT)Length;
-
-        Buffer += Length + 1;
-    }
+    __MultiSzToViews(Buffer, Ansi, Count);
 
     return Ansi;
 
-fail2:
-    Error("fail2\n");
-
-    while (--Index >= 0)
-        __FdoFree(Ansi[Index].Buffer);
-
-    __FdoFree(Ansi);
-
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -318,12 +1261,19 @@ __FdoFreeAnsi(
     IN  PANSI_STRING    Ansi
     )
 {
-    ULONG               Index;
+    __FdoFree(Ansi);
+}
 
-    for (Index = 0; Ansi[Index].Buffer != NULL; Index++)
-        __FdoFree(Ansi[Index].Buffer);
+#define MAXIMUM_INDEX   255
 
-    __FdoFree(Ansi);
+static FORCEINLINE BOOLEAN
+__FdoIsDistributionIndex(
+    IN  PANSI_STRING    Ansi
+    )
+{
+    // __FdoSetDistribution only ever writes decimal keys in the range
+    // [0, MAXIMUM_INDEX] so anything else cannot be ours
+    return __IsDecimalIndex(Ansi, MAXIMUM_INDEX);
 }
 
 static FORCEINLINE BOOLEAN
@@ -386,16 +1336,14 @@ fail1:
     return FALSE;
 }
 
-#define MAXIMUM_INDEX   255
-
 static FORCEINLINE NTSTATUS
 __FdoSetDistribution(
     IN  PXENHID_FDO     Fdo
     )
 {
     ULONG               Index;
-    CHAR                Distribution[MAXNAMELEN];
-    CHAR                Vendor[MAXNAMELEN];
+    CHAR                Distribution[sizeof ("4294967295")];
+    CHAR                Vendor[sizeof (VENDOR_NAME_STR)];
     STRING              String;
     const CHAR          *Product;
     NTSTATUS            status;
@@ -410,10 +1358,11 @@ __FdoSetDistribution(
         String.MaximumLength = sizeof(Distribution);
         String.Length = 0;
 
-        status = StringPrintf(&String,
-                              "%u",
-                              Index);
-        ASSERT(NT_SUCCESS(status));
+        status = StringFormatPrintf(&String,
+                                    &FdoDistributionIndexFormat,
+                                    Index);
+        if (!NT_SUCCESS(status))
+            goto fail1;
 
         status = XENBUS_STORE(Read,
                               &Fdo->StoreInterface,
@@ -439,16 +1388,9 @@ __FdoSetDistribution(
     goto fail2;
 
 update:
-    String.Buffer = Vendor;
-    String.MaximumLength = sizeof(Vendor);
-    String.Length = 0;
-
-    status = StringPrintf(&String,
-                          "%s",
-                          VENDOR_NAME_STR);
-    ASSERT(NT_SUCCESS(status));
+    RtlCopyMemory(Vendor, VENDOR_NAME_STR, sizeof (Vendor));
 
-    for (Index = 0; Vendor[Index] != '\0'; Index++)
+    for (Index = 0; Index < sizeof (Vendor) - 1; Index++)
         if (!isalnum((UCHAR)Vendor[Index]))
             Vendor[Index] = '_';
 
@@ -460,32 +1402,44 @@ update:
 #define ATTRIBUTES   ""
 #endif
 
-    (VOID)XENBUS_STORE(Printf,
-                       &Fdo->StoreInterface,
-                       NULL,
-                       "drivers",
-                       Distribution,
-                       "%s %s %u.%u.%u.%u %s",
-                       Vendor,
-                       Product,
-                       MAJOR_VERSION,
-                       MINOR_VERSION,
-                       MICRO_VERSION,
-                       BUILD_NUMBER,
-                       ATTRIBUTES
-    );
+    // The record is formatted only once per call, so the store formats
+    // it directly into a buffer of the right size rather than it being
+    // formatted here and then copied
+    status = XENBUS_STORE(Printf,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          "drivers",
+                          Distribution,
+                          "%s %s %u.%u.%u.%u %s",
+                          Vendor,
+                          Product,
+                          MAJOR_VERSION,
+                          MINOR_VERSION,
+                          MICRO_VERSION,
+                          BUILD_NUMBER,
+                          ATTRIBUTES);
 
 #undef  ATTRIBUTES
 
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    EtwStoreOperation(Fdo, "SetDistribution", "drivers", STATUS_SUCCESS);
+
     Trace("<====\n");
     return STATUS_SUCCESS;
 
+fail3:
+    Error("fail3\n");
+
 fail2:
     Error("fail2\n");
 
 fail1:
     Error("fail1 (%08x)\n", status);
 
+    EtwStoreOperation(Fdo, "SetDistribution", "drivers", status);
+
     return status;
 }
 
@@ -494,6 +1448,7 @@ __FdoClearDistribution(
     IN  PXENHID_FDO     Fdo
     )
 {
+    PCHAR               Directory;
     PCHAR               Buffer;
     PANSI_STRING        Distributions;
     ULONG               Index;
@@ -506,23 +1461,20 @@ __FdoClearDistribution(
                           NULL,
                           NULL,
                           "drivers",
-                          &Buffer);
-    if (NT_SUCCESS(status)) {
-        Distributions = __FdoMultiSzToUpcaseAnsi(Buffer);
-
-        XENBUS_STORE(Free,
-                     &Fdo->StoreInterface,
-                     Buffer);
-    } else {
-        Distributions = NULL;
-    }
+                          &Directory);
+    if (!NT_SUCCESS(status))
+        goto done;
 
+    Distributions = __FdoMultiSzToAnsi(Directory);
     if (Distributions == NULL)
-        goto done;
+        goto cleanup;
 
     for (Index = 0; Distributions[Index].Buffer != NULL; Index++) {
         PANSI_STRING    Distribution = &Distributions[Index];
 
+        if (!__FdoIsDistributionIndex(Distribution))
+            continue;
+
         status = XENBUS_STORE(Read,
                               &Fdo->StoreInterface,
                               NULL,
@@ -546,10 +1498,173 @@ __FdoClearDistribution(
 
     __FdoFreeAnsi(Distributions);
 
+cleanup:
+    XENBUS_STORE(Free,
+                 &Fdo->StoreInterface,
+                 Directory);
+
 done:
+    EtwStoreOperation(Fdo, "ClearDistribution", "drivers", status);
     Trace("<====\n");
 }
 
+typedef enum _FDO_FEATURE {
+    FDO_FEATURE_MAX_INFLIGHT_READS = 0,
+    FDO_FEATURE_SEQUENCE_NUMBERS,
+    FDO_FEATURE_COUNT
+} FDO_FEATURE, *PFDO_FEATURE;
+
+static FORCEINLINE const CHAR *
+FdoFeatureName(
+    IN  FDO_FEATURE Feature
+    )
+{
+#define _FDO_FEATURE_NAME(_Feature, _Name)  \
+        case FDO_FEATURE_ ## _Feature:      \
+            return _Name;
+
+    switch (Feature) {
+    _FDO_FEATURE_NAME(MAX_INFLIGHT_READS, "feature-max-inflight-reads");
+    _FDO_FEATURE_NAME(SEQUENCE_NUMBERS, "feature-sequence-numbers");
+    default:
+        break;
+    }
+
+    return "unknown";
+
+#undef  _FDO_FEATURE_NAME
+}
+
+static FORCEINLINE ULONG
+__FdoGetFeature(
+    IN  PXENHID_FDO Fdo,
+    IN  FDO_FEATURE Feature
+    )
+{
+    switch (Feature) {
+    case FDO_FEATURE_MAX_INFLIGHT_READS:
+        return Fdo->Configuration.QueueLimit;
+
+    case FDO_FEATURE_SEQUENCE_NUMBERS:
+        return (Fdo->HidInterfaceVersion >= 2) ? 1 : 0;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+#define FDO_FRONTEND_PREFIX "device/vkbd"
+
+// Feature keys are for the backend so they go in the frontend area that
+// it watches, device/vkbd/<id>, where <id> is the PDO's bus address. As
+// that area belongs to the bus driver nothing is written unless it has
+// a backend key, i.e. unless it really is a frontend area.
+static BOOLEAN
+__FdoHasFrontend(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    PCHAR           Buffer;
+    NTSTATUS        status;
+
+    if (Fdo->FrontendPath[0] == '\0')
+        return FALSE;
+
+    status = XENBUS_STORE(Read,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          Fdo->FrontendPath,
+                          "backend",
+                          &Buffer);
+    if (!NT_SUCCESS(status))
+        return FALSE;
+
+    XENBUS_STORE(Free,
+                 &Fdo->StoreInterface,
+                 Buffer);
+
+    return TRUE;
+}
+
+// Only called from the configuration thread, which is the only place
+// the values can change, so the keys never lag behind the knobs.
+static VOID
+__FdoSetFeatures(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG           Index;
+
+    Trace("====>\n");
+
+    if (!__FdoHasFrontend(Fdo)) {
+        Warning("%s: not a frontend area\n", Fdo->FrontendPath);
+        goto done;
+    }
+
+    // As with other Xen PV frontends, an absent feature-* key means
+    // the feature is not supported so a zero value removes the key
+    for (Index = 0; Index < FDO_FEATURE_COUNT; Index++) {
+        ULONG   Value = __FdoGetFeature(Fdo, Index);
+
+        if (Value == 0) {
+            (VOID)XENBUS_STORE(Remove,
+                               &Fdo->StoreInterface,
+                               NULL,
+                               Fdo->FrontendPath,
+                               (PCHAR)FdoFeatureName(Index));
+            continue;
+        }
+
+        (VOID)XENBUS_STORE(Printf,
+                           &Fdo->StoreInterface,
+                           NULL,
+                           Fdo->FrontendPath,
+                           (PCHAR)FdoFeatureName(Index),
+                           "%u",
+                           Value);
+    }
+
+done:
+    Trace("<====\n");
+}
+
+static VOID
+__FdoClearFeatures(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG           Index;
+
+    Trace("====>\n");
+
+    if (!__FdoHasFrontend(Fdo))
+        goto done;
+
+    for (Index = 0; Index < FDO_FEATURE_COUNT; Index++)
+        (VOID)XENBUS_STORE(Remove,
+                           &Fdo->StoreInterface,
+                           NULL,
+                           Fdo->FrontendPath,
+                           (PCHAR)FdoFeatureName(Index));
+
+done:
+    Trace("<====\n");
+}
+
+static FORCEINLINE VOID
+__FdoRefreshFeatures(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    (VOID) InterlockedExchange(&Fdo->FeaturesStale, 1);
+
+    if (Fdo->ConfigurationThread != NULL)
+        ThreadWake(Fdo->ConfigurationThread);
+}
+
 static DECLSPEC_NOINLINE VOID
 FdoSuspendCallback(
     IN  PVOID       Argument
@@ -558,6 +1673,7 @@ FdoSuspendCallback(
     PXENHID_FDO     Fdo = Argument;
 
     (VOID)__FdoSetDistribution(Fdo);
+    __FdoRefreshFeatures(Fdo);
 }
 
 static DECLSPEC_NOINLINE NTSTATUS
@@ -608,6 +1724,690 @@ FdoClearDistribution(
     Trace("<====\n");
 }
 
+static FORCEINLINE PULONG
+__FdoKnobValue(
+    IN  PFDO_CONFIGURATION  Configuration,
+    IN  const FDO_KNOB      *Knob
+    )
+{
+    return (PULONG)((PUCHAR)Configuration + Knob->Offset);
+}
+
+static VOID
+__FdoSetDefaultConfiguration(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG           Index;
+
+    for (Index = 0; Index < ARRAYSIZE(FdoKnob); Index++) {
+        const FDO_KNOB  *Knob = &FdoKnob[Index];
+
+        *__FdoKnobValue(&Fdo->Configuration, Knob) = Knob->Default;
+    }
+}
+
+static ULONG
+__FdoReadKnob(
+    IN  PXENHID_FDO     Fdo,
+    IN  const FDO_KNOB  *Knob
+    )
+{
+    PCHAR               Buffer;
+    ULONG               Parsed;
+    ULONG               Value;
+    NTSTATUS            status;
+
+    Value = Knob->Default;
+
+    status = XENBUS_STORE(Read,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          FDO_CONFIGURATION_PATH,
+                          (PCHAR)Knob->Name,
+                          &Buffer);
+    if (!NT_SUCCESS(status))
+        return Value;
+
+    status = RtlCharToInteger(Buffer, 10, &Parsed);
+    if (NT_SUCCESS(status) &&
+        Parsed >= Knob->Minimum &&
+        Parsed <= Knob->Maximum)
+        Value = Parsed;
+    else
+        Warning("%s: ignoring invalid value '%s'\n",
+                Knob->Name,
+                Buffer);
+
+    XENBUS_STORE(Free,
+                 &Fdo->StoreInterface,
+                 Buffer);
+
+    return Value;
+}
+
+static VOID
+__FdoReadConfiguration(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG           Index;
+    ULONG           Mask;
+    BOOLEAN         Changed;
+
+    Changed = FALSE;
+
+    for (Index = 0; Index < ARRAYSIZE(FdoKnob); Index++) {
+        const FDO_KNOB  *Knob = &FdoKnob[Index];
+        PULONG          Current;
+        ULONG           Value;
+
+        Value = __FdoReadKnob(Fdo, Knob);
+
+        Current = __FdoKnobValue(&Fdo->Configuration, Knob);
+        if (*Current == Value)
+            continue;
+
+        Info("%s: %u -> %u\n", Knob->Name, *Current, Value);
+
+        WriteULongNoFence(Current, Value);
+        Changed = TRUE;
+    }
+
+    Mask = DBG_PRINT_LEVEL_MASK(__FdoReadKnob(Fdo, &FdoLogLevelKnob));
+    if (ReadULongNoFence(&DbgPrintMask) != Mask) {
+        Info("%s: %08x -> %08x\n",
+             FdoLogLevelKnob.Name,
+             ReadULongNoFence(&DbgPrintMask),
+             Mask);
+
+        WriteULongNoFence(&DbgPrintMask, Mask);
+    }
+
+    EtwStoreOperation(Fdo, "ReadConfiguration", FDO_CONFIGURATION_PATH, STATUS_SUCCESS);
+
+    if (!Changed)
+        return;
+
+    KeMemoryBarrier();
+
+    // feature-max-inflight-reads follows queue-limit
+    Fdo->FeaturesStale = 1;
+
+    // Pick up a new publishing interval straight away
+    if (Fdo->StatisticsThread != NULL)
+        ThreadWake(Fdo->StatisticsThread);
+}
+
+static NTSTATUS
+FdoConfiguration(
+    IN  PXENHID_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PXENHID_FDO         Fdo = (PXENHID_FDO)Context;
+
+    for (;;) {
+        (VOID) ThreadWait(Self, NULL);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        __FdoReadConfiguration(Fdo);
+
+        if (InterlockedExchange(&Fdo->FeaturesStale, 0) != 0)
+            __FdoSetFeatures(Fdo);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+FdoStartConfiguration(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    NTSTATUS        status;
+
+    status = ThreadCreate(FdoConfiguration, Fdo, &Fdo->ConfigurationThread);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // The watch fires once when it is added, which loads the initial values
+    status = XENBUS_STORE(WatchAdd,
+                          &Fdo->StoreInterface,
+                          NULL,
+                          FDO_CONFIGURATION_PATH,
+                          ThreadGetEvent(Fdo->ConfigurationThread),
+                          &Fdo->ConfigurationWatch);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    ThreadAlert(Fdo->ConfigurationThread);
+    ThreadJoin(Fdo->ConfigurationThread);
+    Fdo->ConfigurationThread = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static DECLSPEC_NOINLINE VOID
+FdoStopConfiguration(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    (VOID) XENBUS_STORE(WatchRemove,
+                        &Fdo->StoreInterface,
+                        Fdo->ConfigurationWatch);
+    Fdo->ConfigurationWatch = NULL;
+
+    ThreadAlert(Fdo->ConfigurationThread);
+    ThreadJoin(Fdo->ConfigurationThread);
+    Fdo->ConfigurationThread = NULL;
+}
+
+static NTSTATUS
+__FdoPublishThreadStatistics(
+    IN  PXENHID_FDO                 Fdo,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction,
+    IN  PCHAR                       Name,
+    IN  PXENHID_THREAD              Thread
+    )
+{
+    XENHID_THREAD_STATISTICS        Statistics;
+    CHAR                            Path[MAXNAMELEN];
+    STRING                          String;
+    NTSTATUS                        status;
+
+    String.Buffer = Path;
+    String.MaximumLength = sizeof (Path);
+    String.Length = 0;
+
+    status = StringPrintf(&String,
+                          "%s/threads/%s",
+                          Fdo->StatisticsPath,
+                          Name);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    ThreadQueryStatistics(Thread, &Statistics);
+
+    status = XENBUS_STORE(Printf,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          Path,
+                          "wakes",
+                          "%llu",
+                          Statistics.Wakes);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_STORE(Printf,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          Path,
+                          "spurious-wakes",
+                          "%llu",
+                          Statistics.SpuriousWakes);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_STORE(Printf,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          Path,
+                          "busy-time",
+                          "%llu",
+                          Statistics.BusyTime);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_STORE(Printf,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          Path,
+                          "busy-time-maximum",
+                          "%llu",
+                          Statistics.BusyTimeMaximum);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_STORE(Printf,
+                          &Fdo->StoreInterface,
+                          Transaction,
+                          Path,
+                          "wake-to-run-time",
+                          "%llu",
+                          Statistics.WakeToRunTime);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// The counters of the FDO's threads are published alongside its own,
+// but only for threads that are known to outlive the statistics thread:
+// the device power thread, the watchdog thread and (if Self is not
+// NULL) the statistics thread itself. They change on every wake so,
+// rather than forcing a publication every interval, they are only
+// refreshed when the counters are.
+static NTSTATUS
+__FdoPublishStatistics(
+    IN  PXENHID_FDO             Fdo,
+    IN  PULONG64                Snapshot,
+    IN  PXENHID_THREAD          Self OPTIONAL
+    )
+{
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    for (;;) {
+        status = XENBUS_STORE(TransactionStart,
+                              &Fdo->StoreInterface,
+                              &Transaction);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        for (Index = 0; Index < XENHID_STATISTIC_COUNT; Index++) {
+            status = XENBUS_STORE(Printf,
+                                  &Fdo->StoreInterface,
+                                  Transaction,
+                                  Fdo->StatisticsPath,
+                                  (PCHAR)FdoStatisticName(Index),
+                                  "%llu",
+                                  Snapshot[Index]);
+            if (!NT_SUCCESS(status))
+                goto fail2;
+        }
+
+        status = __FdoPublishThreadStatistics(Fdo,
+                                              Transaction,
+                                              "device-power",
+                                              Fdo->DevicePowerThread);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = __FdoPublishThreadStatistics(Fdo,
+                                              Transaction,
+                                              "watchdog",
+                                              Fdo->WatchdogThread);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        if (Self != NULL) {
+            status = __FdoPublishThreadStatistics(Fdo,
+                                                  Transaction,
+                                                  "statistics",
+                                                  Self);
+            if (!NT_SUCCESS(status))
+                goto fail2;
+        }
+
+        status = XENBUS_STORE(TransactionEnd,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              TRUE);
+        if (status != STATUS_RETRY)
+            break;
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    EtwStoreOperation(Fdo, "PublishStatistics", Fdo->StatisticsPath, status);
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    (VOID) XENBUS_STORE(TransactionEnd,
+                        &Fdo->StoreInterface,
+                        Transaction,
+                        FALSE);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    EtwStoreOperation(Fdo, "PublishStatistics", Fdo->StatisticsPath, status);
+    return status;
+}
+
+static VOID
+FdoStatisticsTimer(
+    IN  PVOID       Context
+    )
+{
+    PXENHID_THREAD  Self = Context;
+
+    ThreadWake(Self);
+}
+
+static NTSTATUS
+FdoStatistics(
+    IN  PXENHID_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PXENHID_FDO         Fdo = (PXENHID_FDO)Context;
+    ULONG               Interval;
+
+    // Snapshots are taken on a periodic coalescable timer, so they do
+    // not drift by the time taken to publish them
+    ThreadTimerInitialize(&Fdo->StatisticsTimer, FdoStatisticsTimer, Self);
+    Interval = 0;
+
+    for (;;) {
+        ULONG64     Snapshot[XENHID_STATISTIC_COUNT];
+        NTSTATUS    status;
+
+        // The configuration thread wakes us when the interval changes
+        if (Fdo->Configuration.StatisticsInterval != Interval) {
+            Interval = Fdo->Configuration.StatisticsInterval;
+
+            (VOID) ThreadTimerSet(Self,
+                                  &Fdo->StatisticsTimer,
+                                  Interval * 1000,
+                                  Interval * 1000,
+                                  Interval * 250);
+        }
+
+        (VOID) ThreadWait(Self, NULL);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        __FdoQueryStatistics(Fdo, Snapshot);
+
+        // Only touch XenStore if something has changed
+        if (RtlEqualMemory(Snapshot, Fdo->Published, sizeof (Snapshot)))
+            continue;
+
+        status = __FdoPublishStatistics(Fdo, Snapshot, Self);
+        if (NT_SUCCESS(status))
+            RtlCopyMemory(Fdo->Published, Snapshot, sizeof (Snapshot));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+FdoStartStatistics(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    STRING          String;
+    NTSTATUS        status;
+
+    String.Buffer = Fdo->StatisticsPath;
+    String.MaximumLength = sizeof (Fdo->StatisticsPath);
+    String.Length = 0;
+
+    status = StringPrintf(&String,
+                          "%s/statistics",
+                          Fdo->Path);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = ThreadCreate(FdoStatistics, Fdo, &Fdo->StatisticsThread);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    RtlZeroMemory(Fdo->StatisticsPath, sizeof (Fdo->StatisticsPath));
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// The counters outlive the transition to D3 so, rather than removing
+// them, a final snapshot is published. That includes d0-to-d3, which is
+// counted just before this is called. The node itself goes when the
+// device does (see FdoRemovePath()).
+static DECLSPEC_NOINLINE VOID
+FdoStopStatistics(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG64         Snapshot[XENHID_STATISTIC_COUNT];
+
+    ThreadAlert(Fdo->StatisticsThread);
+    ThreadJoin(Fdo->StatisticsThread);
+    Fdo->StatisticsThread = NULL;
+
+    RtlZeroMemory(&Fdo->StatisticsTimer, sizeof (XENHID_THREAD_TIMER));
+
+    __FdoQueryStatistics(Fdo, Snapshot);
+    (VOID) __FdoPublishStatistics(Fdo, Snapshot, NULL);
+
+    RtlZeroMemory(Fdo->Published, sizeof (Fdo->Published));
+    RtlZeroMemory(Fdo->StatisticsPath, sizeof (Fdo->StatisticsPath));
+}
+
+static FORCEINLINE NTSTATUS
+__FdoHidEnable(
+    IN  PXENHID_FDO                         Fdo
+    )
+{
+    struct _XENHID_HID_INTERFACE_V1         *HidInterface;
+
+    Fdo->SequenceValid = FALSE;
+
+    if (Fdo->HidInterfaceVersion >= 2)
+        return XENHID_HID(Enable,
+                          &Fdo->HidInterface,
+                          FdoHidCallback,
+                          Fdo);
+
+    // Version 1 has an identical layout but its callback does not
+    // carry a sequence number
+    HidInterface = (struct _XENHID_HID_INTERFACE_V1 *)&Fdo->HidInterface;
+
+    return XENHID_HID(EnableVersion1,
+                      HidInterface,
+                      FdoHidCallbackVersion1,
+                      Fdo);
+}
+
+static NTSTATUS
+__FdoPublishProbe(
+    IN  PXENHID_FDO             Fdo,
+    IN  PFDO_PROBE              Probe
+    )
+{
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    LARGE_INTEGER               Frequency;
+    NTSTATUS                    status;
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    for (;;) {
+        status = XENBUS_STORE(TransactionStart,
+                              &Fdo->StoreInterface,
+                              &Transaction);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        status = XENBUS_STORE(Printf,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              Fdo->Path,
+                              "probe/frequency",
+                              "%llu",
+                              (ULONGLONG)Frequency.QuadPart);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = XENBUS_STORE(Printf,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              Fdo->Path,
+                              "probe/arrival",
+                              "%llu",
+                              (ULONGLONG)Probe->Arrival);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = XENBUS_STORE(Printf,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              Fdo->Path,
+                              "probe/ready",
+                              "%llu",
+                              (ULONGLONG)Probe->Ready);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = XENBUS_STORE(Printf,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              Fdo->Path,
+                              "probe/attempts",
+                              "%u",
+                              Probe->Attempts);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = XENBUS_STORE(Printf,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              Fdo->Path,
+                              "probe/sequence",
+                              "%u",
+                              Probe->Sequence);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        status = XENBUS_STORE(TransactionEnd,
+                              &Fdo->StoreInterface,
+                              Transaction,
+                              TRUE);
+        if (status != STATUS_RETRY)
+            break;
+    }
+
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    EtwStoreOperation(Fdo, "PublishProbe", Fdo->Path, status);
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    (VOID) XENBUS_STORE(TransactionEnd,
+                        &Fdo->StoreInterface,
+                        Transaction,
+                        FALSE);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    EtwStoreOperation(Fdo, "PublishProbe", Fdo->Path, status);
+    return status;
+}
+
+static VOID
+FdoProbeWork(
+    IN  PVOID       Context
+    )
+{
+    PXENHID_FDO     Fdo = (PXENHID_FDO)Context;
+    FDO_PROBE       Probe;
+    BOOLEAN         Pending;
+    KIRQL           Irql;
+
+    KeAcquireSpinLock(&Fdo->ProbeLock, &Irql);
+
+    Probe = Fdo->ProbeResult;
+    Pending = Fdo->ProbePending;
+    Fdo->ProbePending = FALSE;
+
+    KeReleaseSpinLock(&Fdo->ProbeLock, Irql);
+
+    // If several probes completed since the item was queued then only
+    // the most recent is published
+    if (Pending)
+        (VOID) __FdoPublishProbe(Fdo, &Probe);
+
+    ExReleaseRundownProtection(&Fdo->ProbeRundown);
+}
+
+static DECLSPEC_NOINLINE VOID
+FdoStartProbe(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    KeInitializeSpinLock(&Fdo->ProbeLock);
+    ThreadWorkItemInitialize(&Fdo->ProbeItem, FdoProbeWork, Fdo);
+    ExInitializeRundownProtection(&Fdo->ProbeRundown);
+}
+
+static DECLSPEC_NOINLINE VOID
+FdoStopProbe(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    // Once this returns the work item is neither queued nor running,
+    // and cannot be queued again
+    ExWaitForRundownProtectionRelease(&Fdo->ProbeRundown);
+
+    (VOID) XENBUS_STORE(Remove,
+                        &Fdo->StoreInterface,
+                        NULL,
+                        Fdo->Path,
+                        "probe");
+
+    RtlZeroMemory(&Fdo->Probe, sizeof (FDO_PROBE));
+    RtlZeroMemory(&Fdo->ProbeResult, sizeof (FDO_PROBE));
+    Fdo->ProbePending = FALSE;
+    RtlZeroMemory(&Fdo->ProbeItem, sizeof (XENHID_WORK_ITEM));
+    RtlZeroMemory(&Fdo->ProbeRundown, sizeof (EX_RUNDOWN_REF));
+    RtlZeroMemory(&Fdo->ProbeLock, sizeof (KSPIN_LOCK));
+}
+
+static DECLSPEC_NOINLINE VOID
+FdoIdleToD0(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    LONGLONG        WakeTime;
+
+    Fdo->Idle = FALSE;
+    KeMemoryBarrier();
+
+    // WakeTime is zero if HIDCLASS woke the device of its own accord
+    WakeTime = InterlockedExchange64(&Fdo->IdleWakeTime, 0);
+    if (WakeTime == 0)
+        return;
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_IDLE_WAKES);
+    __FdoAddStatistic(Fdo,
+                      XENHID_STATISTIC_IDLE_WAKE_TIME,
+                      ((LONGLONG)KeQueryInterruptTime() - WakeTime) / TIME_US(1));
+}
+
 static DECLSPEC_NOINLINE NTSTATUS
 FdoD3ToD0(
     IN  PXENHID_FDO Fdo
@@ -619,6 +2419,8 @@ FdoD3ToD0(
 
     Trace("=====>\n");
 
+    RingRecord(RING_EVENT_POWER_START, Fdo, PowerDeviceD3, PowerDeviceD0);
+
     if (Fdo->Enabled)
         goto done;
 
@@ -639,24 +2441,70 @@ FdoD3ToD0(
     status = XENHID_HID(Acquire,
                         &Fdo->HidInterface);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail4;
+
+    FdoStartProbe(Fdo);
+
+    status = __FdoHidEnable(Fdo);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    status = FdoStartWatchdog(Fdo);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
+    status = FdoStartStatistics(Fdo);
+    if (!NT_SUCCESS(status))
+        goto fail7;
 
-    status = XENHID_HID(Enable,
-                        &Fdo->HidInterface,
-                        FdoHidCallback,
-                        Fdo);
+    // The configuration thread publishes the features once it has
+    // loaded the initial configuration
+    Fdo->FeaturesStale = 1;
+
+    status = FdoStartConfiguration(Fdo);
     if (!NT_SUCCESS(status))
-        goto fail5;
+        goto fail8;
 
     Fdo->Enabled = TRUE;
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_D3_TO_D0);
+
 done:
     __FdoSetDevicePowerState(Fdo, PowerDeviceD0);
+
+    if (Fdo->Idle)
+        FdoIdleToD0(Fdo);
+
+    RingRecord(RING_EVENT_POWER_END, Fdo, PowerDeviceD0, STATUS_SUCCESS);
+
     Trace("<=====\n");
     return STATUS_SUCCESS;
 
+fail8:
+    Error("fail8\n");
+
+    Fdo->FeaturesStale = 0;
+
+    FdoStopStatistics(Fdo);
+
+fail7:
+    Error("fail7\n");
+
+    FdoStopWatchdog(Fdo);
+
+fail6:
+    Error("fail6\n");
+
+    XENHID_HID(Disable,
+               &Fdo->HidInterface);
+
+    RtlZeroMemory(&Fdo->SequenceWindow, sizeof (SEQUENCE_WINDOW));
+    Fdo->SequenceValid = FALSE;
+
 fail5:
     Error("fail5\n");
 
+    FdoStopProbe(Fdo);
+
     XENHID_HID(Release,
                &Fdo->HidInterface);
 
@@ -679,9 +2527,109 @@ fail2:
 
 fail1:
     Error("fail1 %08x\n", status);
+
+    RingRecord(RING_EVENT_POWER_END, Fdo, PowerDeviceD3, (ULONG_PTR)status);
+
     return status;
 }
 
+// Complete everything left in the read queue. The whole queue is taken
+// off under a single hold of the CSQ lock, each IRP as
+// IoCsqRemoveNextIrp() would take it: its cancel routine is cleared
+// first, and one that is being cancelled concurrently is left for the
+// CSQ to complete. The IRPs are then completed with the lock released.
+static DECLSPEC_NOINLINE VOID
+FdoDrainQueue(
+    IN  PXENHID_FDO Fdo,
+    IN  NTSTATUS    Status
+    )
+{
+    LIST_ENTRY      List;
+    PLIST_ENTRY     ListEntry;
+    LARGE_INTEGER   Start;
+    LONGLONG        Ticks;
+    ULONG           Count;
+    KIRQL           Irql;
+
+    Start = KeQueryPerformanceCounter(NULL);
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLock(&Fdo->Lock, &Irql);
+
+    ListEntry = Fdo->List.Flink;
+    while (ListEntry != &Fdo->List) {
+        PIRP    Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        ListEntry = ListEntry->Flink;
+
+        if (IoSetCancelRoutine(Irp, NULL) == NULL)
+            continue;
+
+        // The IRP is no longer the CSQ's
+        Irp->Tail.Overlay.DriverContext[3] = NULL;
+
+        FdoCsqRemoveIrp(&Fdo->Queue, Irp);
+        InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    KeReleaseSpinLock(&Fdo->Lock, Irql);
+
+    Count = 0;
+    while (!IsListEmpty(&List)) {
+        PIRP    Irp;
+
+        ListEntry = RemoveHeadList(&List);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status = Status;
+
+        EtwIrpComplete(Fdo, Irp, 0, Status);
+        RingRecord(RING_EVENT_IRP_COMPLETE, Fdo, (ULONG_PTR)Irp, 0);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        Count++;
+    }
+
+    if (Count == 0)
+        return;
+
+    Ticks = KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart;
+
+    __FdoAddStatistic(Fdo, XENHID_STATISTIC_IRPS_DRAINED, Count);
+    __FdoAddStatistic(Fdo, XENHID_STATISTIC_QUIESCE_TIME, Ticks);
+
+    Info("%u IRP(s) drained in %lluus\n",
+         Count,
+         __FdoTicksToMicroseconds((ULONG64)Ticks));
+}
+
+// D3 entered at HIDCLASS's request because the device is idle. Unlike
+// FdoD0ToD3() the backend stays enabled so that input can wake it.
+static DECLSPEC_NOINLINE VOID
+FdoD0ToIdle(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    Trace("=====>\n");
+
+    RingRecord(RING_EVENT_POWER_START, Fdo, __FdoGetDevicePowerState(Fdo), PowerDeviceD3);
+
+    __FdoSetDevicePowerState(Fdo, PowerDeviceD3);
+
+    Fdo->IdleWakeTime = 0;
+    KeMemoryBarrier();
+    Fdo->Idle = TRUE;
+
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_IDLE_ENTRIES);
+
+    FdoDrainQueue(Fdo, STATUS_DEVICE_NOT_READY);
+
+    RingRecord(RING_EVENT_POWER_END, Fdo, PowerDeviceD3, STATUS_SUCCESS);
+
+    Trace("<=====\n");
+}
+
 static DECLSPEC_NOINLINE VOID
 FdoD0ToD3(
     IN  PXENHID_FDO Fdo
@@ -689,14 +2637,40 @@ FdoD0ToD3(
 {
     Trace("=====>\n");
 
+    RingRecord(RING_EVENT_POWER_START, Fdo, __FdoGetDevicePowerState(Fdo), PowerDeviceD3);
+
     __FdoSetDevicePowerState(Fdo, PowerDeviceD3);
 
+    (VOID) FdoCompleteIdleIrp(Fdo, STATUS_CANCELLED);
+
+    Fdo->Idle = FALSE;
+    Fdo->IdleWakeTime = 0;
+
     if (!Fdo->Enabled)
         goto done;
 
+    __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_D0_TO_D3);
+
+    FdoStopConfiguration(Fdo);
+    Fdo->FeaturesStale = 0;
+
+    __FdoClearFeatures(Fdo);
+
+    FdoStopStatistics(Fdo);
+
+    FdoStopWatchdog(Fdo);
+
     XENHID_HID(Disable,
                &Fdo->HidInterface);
 
+    // Make sure any IRPs staged by the final callbacks are completed
+    KeFlushQueuedDpcs();
+
+    RtlZeroMemory(&Fdo->SequenceWindow, sizeof (SEQUENCE_WINDOW));
+    Fdo->SequenceValid = FALSE;
+
+    FdoStopProbe(Fdo);
+
     XENHID_HID(Release,
                &Fdo->HidInterface);
 
@@ -710,6 +2684,11 @@ FdoD0ToD3(
 
     Fdo->Enabled = FALSE;
 done:
+    // The power state is already D3, so nothing more can be queued
+    FdoDrainQueue(Fdo, STATUS_DEVICE_NOT_READY);
+
+    RingRecord(RING_EVENT_POWER_END, Fdo, PowerDeviceD3, STATUS_SUCCESS);
+
     Trace("<=====\n");
 }
 
@@ -835,6 +2814,39 @@ FdoStopDevice(
     return status;
 }
 
+// Statistics are left in XenStore across D3 so that dom0 can still read
+// them; the per-device node only goes away with the device.
+static DECLSPEC_NOINLINE VOID
+FdoRemovePath(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    NTSTATUS        status;
+
+    // Nothing may re-create the node behind our back
+    ASSERT3P(Fdo->StatisticsThread, ==, NULL);
+    ASSERT(IsZeroMemory(&Fdo->ProbeRundown, sizeof (EX_RUNDOWN_REF)));
+
+    status = XENBUS_STORE(Acquire,
+                          &Fdo->StoreInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    (VOID) XENBUS_STORE(Remove,
+                        &Fdo->StoreInterface,
+                        NULL,
+                        NULL,
+                        Fdo->Path);
+
+    XENBUS_STORE(Release,
+                 &Fdo->StoreInterface);
+
+    return;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+}
+
 static DECLSPEC_NOINLINE NTSTATUS
 FdoRemoveDevice(
     IN  PXENHID_FDO Fdo,
@@ -846,6 +2858,7 @@ FdoRemoveDevice(
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
 
     FdoD0ToD3(Fdo);
+    FdoRemovePath(Fdo);
 
     Irp->IoStatus.Status = STATUS_SUCCESS;
 
@@ -900,6 +2913,22 @@ FdoDispatchPnp(
     return status;
 }
 
+// Only D0 and D3 are distinguished. There is nothing to do differently
+// for D1 or D2, so they are handled as D3.
+static FORCEINLINE DEVICE_POWER_STATE
+__FdoRequestedDevicePowerState(
+    IN  PIO_STACK_LOCATION  StackLocation
+    )
+{
+    DEVICE_POWER_STATE      DeviceState;
+
+    DeviceState = StackLocation->Parameters.Power.State.DeviceState;
+    if (DeviceState == PowerDeviceD1 || DeviceState == PowerDeviceD2)
+        DeviceState = PowerDeviceD3;
+
+    return DeviceState;
+}
+
 static FORCEINLINE NTSTATUS
 __FdoSetDevicePowerUp(
     IN  PXENHID_FDO     Fdo,
@@ -913,7 +2942,7 @@ __FdoSetDevicePowerUp(
     Trace("====>\n");
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
-    DeviceState = StackLocation->Parameters.Power.State.DeviceState;
+    DeviceState = __FdoRequestedDevicePowerState(StackLocation);
 
     ASSERT3U(DeviceState, <, __FdoGetDevicePowerState(Fdo));
 
@@ -925,10 +2954,14 @@ __FdoSetDevicePowerUp(
         PowerDeviceStateName(__FdoGetDevicePowerState(Fdo)),
         PowerDeviceStateName(DeviceState));
 
+    EtwPowerStart(Fdo, Irp, __FdoGetDevicePowerState(Fdo), DeviceState);
+
     ASSERT3U(DeviceState, ==, PowerDeviceD0);
     status = FdoD3ToD0(Fdo);
     ASSERT(NT_SUCCESS(status));
 
+    EtwPowerEnd(Fdo, Irp, status);
+
 done:
     Irp->IoStatus.Status = status;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -948,7 +2981,7 @@ __FdoSetDevicePowerDown(
     NTSTATUS            status;
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
-    DeviceState = StackLocation->Parameters.Power.State.DeviceState;
+    DeviceState = __FdoRequestedDevicePowerState(StackLocation);
 
     ASSERT3U(DeviceState, >, __FdoGetDevicePowerState(Fdo));
 
@@ -958,8 +2991,19 @@ __FdoSetDevicePowerDown(
 
     ASSERT3U(DeviceState, ==, PowerDeviceD3);
 
-    if (__FdoGetDevicePowerState(Fdo) == PowerDeviceD0)
-        FdoD0ToD3(Fdo);
+    EtwPowerStart(Fdo, Irp, __FdoGetDevicePowerState(Fdo), DeviceState);
+
+    // A D3 request that follows an idle notification is HIDCLASS
+    // selective suspend, unless it is part of a system power transition
+    if (__FdoGetDevicePowerState(Fdo) == PowerDeviceD0) {
+        if (Fdo->IdleIrp != NULL &&
+            StackLocation->Parameters.Power.ShutdownType == PowerActionNone)
+            FdoD0ToIdle(Fdo);
+        else
+            FdoD0ToD3(Fdo);
+    }
+
+    EtwPowerEnd(Fdo, Irp, STATUS_SUCCESS);
 
     IoSkipCurrentIrpStackLocation(Irp);
     status = IoCallDriver(Fdo->LowerDeviceObject, Irp);
@@ -979,7 +3023,7 @@ __FdoSetDevicePower(
     NTSTATUS            status;
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
-    DeviceState = StackLocation->Parameters.Power.State.DeviceState;
+    DeviceState = __FdoRequestedDevicePowerState(StackLocation);
     PowerAction = StackLocation->Parameters.Power.ShutdownType;
 
     Trace("====> (%s:%s)\n",
@@ -988,6 +3032,23 @@ __FdoSetDevicePower(
 
     ASSERT3U(PowerAction, <, PowerActionShutdown);
 
+    // Selective suspend leaves the backend enabled. If the system is now
+    // going to sleep then the device has to be fully powered down, even
+    // though it is already in D3.
+    if (DeviceState == PowerDeviceD3 &&
+        __FdoGetDevicePowerState(Fdo) == PowerDeviceD3 &&
+        Fdo->Idle &&
+        PowerAction != PowerActionNone) {
+        EtwPowerStart(Fdo, Irp, PowerDeviceD3, DeviceState);
+        FdoD0ToD3(Fdo);
+        EtwPowerEnd(Fdo, Irp, STATUS_SUCCESS);
+
+        IoSkipCurrentIrpStackLocation(Irp);
+        status = IoCallDriver(Fdo->LowerDeviceObject, Irp);
+
+        goto done;
+    }
+
     if (DeviceState == __FdoGetDevicePowerState(Fdo)) {
         IoSkipCurrentIrpStackLocation(Irp);
         status = IoCallDriver(Fdo->LowerDeviceObject, Irp);
@@ -1014,31 +3075,24 @@ FdoDevicePower(
 )
 {
     PXENHID_FDO         Fdo = (PXENHID_FDO)Context;
-    PKEVENT             Event;
-
-    Event = ThreadGetEvent(Self);
 
     for (;;) {
         PIRP                Irp;
         PIO_STACK_LOCATION  StackLocation;
         UCHAR               MinorFunction;
 
-        if (Fdo->DevicePowerIrp == NULL) {
-            (VOID)KeWaitForSingleObject(Event,
-                Executive,
-                KernelMode,
-                FALSE,
-                NULL);
-            KeClearEvent(Event);
-        }
+        if (Fdo->DevicePowerIrp == NULL)
+            (VOID)ThreadWait(Self, NULL);
 
         if (ThreadIsAlerted(Self))
             break;
 
         Irp = Fdo->DevicePowerIrp;
 
-        if (Irp == NULL)
+        if (Irp == NULL) {
+            ThreadSpuriousWake(Self);
             continue;
+        }
 
         Fdo->DevicePowerIrp = NULL;
         KeMemoryBarrier();
@@ -1142,6 +3196,7 @@ FdoDispatchInternal(
 
     switch (IoControlCode) {
     case IOCTL_HID_GET_DEVICE_ATTRIBUTES:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_DEVICE_ATTRIBUTES);
         status = XENHID_HID(GetDeviceAttributes,
                             &Fdo->HidInterface,
                             Buffer,
@@ -1152,6 +3207,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_GET_DEVICE_DESCRIPTOR:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_DEVICE_DESCRIPTOR);
         status = XENHID_HID(GetDeviceDescriptor,
                             &Fdo->HidInterface,
                             Buffer,
@@ -1162,6 +3218,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_GET_REPORT_DESCRIPTOR:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_REPORT_DESCRIPTOR);
         status = XENHID_HID(GetReportDescriptor,
                             &Fdo->HidInterface,
                             Buffer,
@@ -1172,6 +3229,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_GET_STRING:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_STRING);
         status = XENHID_HID(GetString,
                             &Fdo->HidInterface,
                             Type3Input,
@@ -1183,6 +3241,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_GET_INDEXED_STRING:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_INDEXED_STRING);
         status = XENHID_HID(GetIndexedString,
                             &Fdo->HidInterface,
                             Type3Input,
@@ -1195,6 +3254,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_GET_FEATURE:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_FEATURE);
         status = XENHID_HID(GetFeature,
                             &Fdo->HidInterface,
                             Packet->reportId,
@@ -1206,6 +3266,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_SET_FEATURE:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_SET_FEATURE);
         status = XENHID_HID(SetFeature,
                             &Fdo->HidInterface,
                             Packet->reportId,
@@ -1214,6 +3275,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_GET_INPUT_REPORT:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_GET_INPUT_REPORT);
         status = XENHID_HID(GetInputReport,
                             &Fdo->HidInterface,
                             Packet->reportId,
@@ -1225,6 +3287,7 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_SET_OUTPUT_REPORT:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_SET_OUTPUT_REPORT);
         status = XENHID_HID(SetOutputReport,
                             &Fdo->HidInterface,
                             Packet->reportId,
@@ -1233,13 +3296,24 @@ FdoDispatchInternal(
         break;
 
     case IOCTL_HID_READ_REPORT:
+        // Fail fast rather than queue IRPs that no report can complete
+        if (__FdoGetDevicePowerState(Fdo) != PowerDeviceD0) {
+            status = STATUS_DEVICE_NOT_READY;
+            break;
+        }
+
+        status = IoCsqInsertIrpEx(&Fdo->Queue, Irp, NULL, NULL);
+        if (!NT_SUCCESS(status))
+            break;
+
         status = STATUS_PENDING;
-        IoCsqInsertIrp(&Fdo->Queue, Irp, NULL);
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_READ_REPORT);
         XENHID_HID(ReadReport,
                    &Fdo->HidInterface);
         break;
 
     case IOCTL_HID_WRITE_REPORT:
+        __FdoIncrementStatistic(Fdo, XENHID_STATISTIC_WRITE_REPORT);
         status = XENHID_HID(WriteReport,
                             &Fdo->HidInterface,
                             Packet->reportId,
@@ -1247,6 +3321,10 @@ FdoDispatchInternal(
                             Packet->reportBufferLen);
         break;
 
+    case IOCTL_HID_SEND_IDLE_NOTIFICATION_REQUEST:
+        status = FdoSubmitIdleNotification(Fdo, Irp);
+        break;
+
     // Other HID IOCTLs are failed as not supported
     default:
         status = STATUS_NOT_SUPPORTED;
@@ -1357,6 +3435,155 @@ fail1:
     return status;
 }
 
+NTSTATUS
+FdoQueryStatistics(
+    OUT PVOID                   Buffer,
+    IN  ULONG                   Length,
+    OUT PULONG                  Returned
+    )
+{
+    PXENHID_STATISTICS          Statistics = Buffer;
+    PXENHID_STATISTICS_DEVICE   Device;
+    PLIST_ENTRY                 ListEntry;
+    ULONG                       Count;
+    ULONG                       Size;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    *Returned = 0;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENHID_STATISTICS))
+        goto done;
+
+    KeAcquireSpinLock(&FdoListLock, &Irql);
+
+    Count = 0;
+    for (ListEntry = FdoList.Flink;
+         ListEntry != &FdoList;
+         ListEntry = ListEntry->Flink)
+        Count++;
+
+    Size = sizeof (XENHID_STATISTICS) +
+           (Count * sizeof (XENHID_STATISTICS_DEVICE));
+
+    RtlZeroMemory(Statistics, sizeof (XENHID_STATISTICS));
+    Statistics->Version = XENHID_STATISTICS_VERSION;
+    Statistics->Size = Size;
+    Statistics->StatisticCount = XENHID_STATISTIC_COUNT;
+    Statistics->DeviceSize = sizeof (XENHID_STATISTICS_DEVICE);
+    Statistics->DeviceCount = Count;
+
+    if (Length < Size) {
+        KeReleaseSpinLock(&FdoListLock, Irql);
+
+        *Returned = sizeof (XENHID_STATISTICS);
+        status = STATUS_BUFFER_OVERFLOW;
+        goto done;
+    }
+
+    Device = (PXENHID_STATISTICS_DEVICE)(Statistics + 1);
+
+    for (ListEntry = FdoList.Flink;
+         ListEntry != &FdoList;
+         ListEntry = ListEntry->Flink) {
+        PXENHID_FDO Fdo = CONTAINING_RECORD(ListEntry,
+                                            XENHID_FDO,
+                                            ListEntry);
+
+        Device->Index = Fdo->Index;
+        Device->DevicePowerState = (ULONG)Fdo->DevicePowerState;
+        __FdoQueryStatistics(Fdo, Device->Value);
+
+        Device++;
+    }
+
+    KeReleaseSpinLock(&FdoListLock, Irql);
+
+    *Returned = Size;
+    status = STATUS_SUCCESS;
+
+done:
+    return status;
+}
+
+static NTSTATUS
+__FdoQueryAddress(
+    IN  PXENHID_FDO         Fdo,
+    OUT PULONG              Address
+    )
+{
+    PHID_DEVICE_EXTENSION   Hid = Fdo->DeviceObject->DeviceExtension;
+    ULONG                   Length;
+
+    return IoGetDeviceProperty(Hid->PhysicalDeviceObject,
+                               DevicePropertyAddress,
+                               sizeof (ULONG),
+                               Address,
+                               &Length);
+}
+
+// Where the bus driver gives the PDO an address, that is the device's
+// number on its bus and so makes a stable index. Otherwise, or if it is
+// already taken, the lowest free index is used.
+static NTSTATUS
+FdoAllocateIndex(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    ULONG           Address;
+    LONG            Index;
+    KIRQL           Irql;
+    NTSTATUS        status;
+
+    status = __FdoQueryAddress(Fdo, &Address);
+    if (!NT_SUCCESS(status) || Address > FDO_MAXIMUM_INDEX)
+        Address = FDO_MAXIMUM_INDEX + 1;
+
+    KeAcquireSpinLock(&FdoListLock, &Irql);
+
+    if (Address <= FDO_MAXIMUM_INDEX &&
+        (FdoIndexMap & (1ull << Address)) == 0)
+        Index = (LONG)Address;
+    else
+        Index = __ffu(FdoIndexMap);
+
+    if (Index >= 0)
+        FdoIndexMap |= 1ull << Index;
+
+    KeReleaseSpinLock(&FdoListLock, Irql);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Index < 0)
+        goto fail1;
+
+    Fdo->Index = (ULONG)Index;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+FdoFreeIndex(
+    IN  PXENHID_FDO Fdo
+    )
+{
+    KIRQL           Irql;
+
+    KeAcquireSpinLock(&FdoListLock, &Irql);
+
+    ASSERT(FdoIndexMap & (1ull << Fdo->Index));
+    FdoIndexMap &= ~(1ull << Fdo->Index);
+
+    KeReleaseSpinLock(&FdoListLock, Irql);
+
+    Fdo->Index = 0;
+}
+
 NTSTATUS
 FdoCreate(
     IN  PXENHID_FDO     Fdo,
@@ -1364,6 +3591,9 @@ FdoCreate(
     IN  PDEVICE_OBJECT  LowerDeviceObject
     )
 {
+    STRING              String;
+    ULONG               Address;
+    KIRQL               Irql;
     NTSTATUS            status;
 
     Trace("=====>\n");
@@ -1371,23 +3601,64 @@ FdoCreate(
     Fdo->DeviceObject = DeviceObject;
     Fdo->LowerDeviceObject = LowerDeviceObject;
     Fdo->DevicePowerState = PowerDeviceD3;
+    __FdoSetDefaultConfiguration(Fdo);
 
-    status = ThreadCreate(FdoDevicePower, Fdo, &Fdo->DevicePowerThread);
+    status = FdoAllocateIndex(Fdo);
     if (!NT_SUCCESS(status))
         goto fail1;
 
+    String.Buffer = Fdo->Path;
+    String.MaximumLength = sizeof(Fdo->Path);
+    String.Length = 0;
+
+    status = StringPrintf(&String,
+                          "data/xenhid/%u",
+                          Fdo->Index);
+    ASSERT(NT_SUCCESS(status));
+
+    // Without an address there is no way to find the frontend area, in
+    // which case no feature keys are published
+    if (NT_SUCCESS(__FdoQueryAddress(Fdo, &Address))) {
+        String.Buffer = Fdo->FrontendPath;
+        String.MaximumLength = sizeof(Fdo->FrontendPath);
+        String.Length = 0;
+
+        status = StringPrintf(&String,
+                              FDO_FRONTEND_PREFIX "/%u",
+                              Address);
+        ASSERT(NT_SUCCESS(status));
+    }
+
+    Fdo->ProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Fdo->Statistics = __FdoAllocateAligned(sizeof (FDO_PROCESSOR_STATISTICS) *
+                                           Fdo->ProcessorCount,
+                                           SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    status = STATUS_NO_MEMORY;
+    if (Fdo->Statistics == NULL)
+        goto fail2;
+
+    status = ThreadCreate(FdoDevicePower, Fdo, &Fdo->DevicePowerThread);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     InitializeListHead(&Fdo->List);
     KeInitializeSpinLock(&Fdo->Lock);
-
-    status = IoCsqInitialize(&Fdo->Queue,
-                             FdoCsqInsertIrp,
-                             FdoCsqRemoveIrp,
-                             FdoCsqPeekNextIrp,
-                             FdoCsqAcquireLock,
-                             FdoCsqReleaseLock,
-                             FdoCsqCompleteCanceledIrp);
+    InitializeListHead(&Fdo->Staged);
+    KeInitializeSpinLock(&Fdo->StagedLock);
+    KeInitializeThreadedDpc(&Fdo->CompletionDpc, FdoCompletionDpc, Fdo);
+    ThreadWorkItemInitialize(&Fdo->IdleItem, FdoIdleCallback, Fdo);
+    ExInitializeRundownProtection(&Fdo->IdleRundown);
+
+    status = IoCsqInitializeEx(&Fdo->Queue,
+                               FdoCsqInsertIrp,
+                               FdoCsqRemoveIrp,
+                               FdoCsqPeekNextIrp,
+                               FdoCsqAcquireLock,
+                               FdoCsqReleaseLock,
+                               FdoCsqCompleteCanceledIrp);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail4;
 
     status = FdoQueryInterface(Fdo,
                                &GUID_XENBUS_SUSPEND_INTERFACE,
@@ -1395,7 +3666,7 @@ FdoCreate(
                                (PINTERFACE)&Fdo->SuspendInterface,
                                sizeof(XENBUS_SUSPEND_INTERFACE));
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail5;
 
     status = FdoQueryInterface(Fdo,
                                &GUID_XENBUS_STORE_INTERFACE,
@@ -1403,49 +3674,93 @@ FdoCreate(
                                (PINTERFACE)&Fdo->StoreInterface,
                                sizeof(XENBUS_STORE_INTERFACE));
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail6;
+
+    Fdo->HidInterfaceVersion = XENHID_HID_INTERFACE_VERSION_MAX;
 
     status = FdoQueryInterface(Fdo,
                                &GUID_XENHID_HID_INTERFACE,
                                XENHID_HID_INTERFACE_VERSION_MAX,
                                (PINTERFACE)&Fdo->HidInterface,
                                sizeof(XENHID_HID_INTERFACE));
+    if (!NT_SUCCESS(status)) {
+        // Older providers only implement version 1
+        Fdo->HidInterfaceVersion = XENHID_HID_INTERFACE_VERSION_MIN;
+
+        status = FdoQueryInterface(Fdo,
+                                   &GUID_XENHID_HID_INTERFACE,
+                                   XENHID_HID_INTERFACE_VERSION_MIN,
+                                   (PINTERFACE)&Fdo->HidInterface,
+                                   sizeof(XENHID_HID_INTERFACE));
+    }
     if (!NT_SUCCESS(status))
-        goto fail5;
+        goto fail7;
+
+    Info("HID interface version %u\n", Fdo->HidInterfaceVersion);
+
+    KeAcquireSpinLock(&FdoListLock, &Irql);
+    InsertTailList(&FdoList, &Fdo->ListEntry);
+    KeReleaseSpinLock(&FdoListLock, Irql);
+
+    ControlReference();
 
     Trace("<=====\n");
     return STATUS_SUCCESS;
 
-fail5:
-    Error("fail5\n");
+fail7:
+    Error("fail7\n");
+
+    Fdo->HidInterfaceVersion = 0;
 
     RtlZeroMemory(&Fdo->StoreInterface,
                   sizeof(XENBUS_STORE_INTERFACE));
 
-fail4:
-    Error("fail4\n");
+fail6:
+    Error("fail6\n");
 
     RtlZeroMemory(&Fdo->SuspendInterface,
                   sizeof(XENBUS_SUSPEND_INTERFACE));
 
-fail3:
-    Error("fail3\n");
+fail5:
+    Error("fail5\n");
 
     RtlZeroMemory(&Fdo->Queue, sizeof(IO_CSQ));
 
-fail2:
-    Error("fail2 %08x\n", status);
+fail4:
+    Error("fail4 %08x\n", status);
 
     ThreadAlert(Fdo->DevicePowerThread);
     ThreadJoin(Fdo->DevicePowerThread);
     Fdo->DevicePowerThread = NULL;
 
+    RtlZeroMemory(&Fdo->IdleItem, sizeof(XENHID_WORK_ITEM));
+    RtlZeroMemory(&Fdo->IdleRundown, sizeof(EX_RUNDOWN_REF));
+    RtlZeroMemory(&Fdo->CompletionDpc, sizeof(KDPC));
+    RtlZeroMemory(&Fdo->StagedLock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Fdo->Staged, sizeof(LIST_ENTRY));
     RtlZeroMemory(&Fdo->List, sizeof(LIST_ENTRY));
     RtlZeroMemory(&Fdo->Lock, sizeof(KSPIN_LOCK));
 
+fail3:
+    Error("fail3\n");
+
+    __FdoFree(Fdo->Statistics);
+    Fdo->Statistics = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    Fdo->ProcessorCount = 0;
+
+    RtlZeroMemory(Fdo->FrontendPath, sizeof(Fdo->FrontendPath));
+    RtlZeroMemory(Fdo->Path, sizeof(Fdo->Path));
+    FdoFreeIndex(Fdo);
+
 fail1:
     Error("fail1 %08x\n", status);
 
+    RtlZeroMemory(&Fdo->Configuration, sizeof(FDO_CONFIGURATION));
+    Fdo->DevicePowerState = 0;
     Fdo->DeviceObject = NULL;
     Fdo->LowerDeviceObject = NULL;
 
@@ -1458,24 +3773,63 @@ FdoDestroy(
     IN  PXENHID_FDO Fdo
     )
 {
+    KIRQL       Irql;
+
     Trace("=====>\n");
 
+    ControlDereference();
+
+    KeAcquireSpinLock(&FdoListLock, &Irql);
+    RemoveEntryList(&Fdo->ListEntry);
+    KeReleaseSpinLock(&FdoListLock, Irql);
+
+    RtlZeroMemory(&Fdo->ListEntry, sizeof (LIST_ENTRY));
+
     RtlZeroMemory(&Fdo->HidInterface,
                   sizeof(XENHID_HID_INTERFACE));
+    Fdo->HidInterfaceVersion = 0;
     RtlZeroMemory(&Fdo->SuspendInterface,
                   sizeof(XENBUS_SUSPEND_INTERFACE));
     RtlZeroMemory(&Fdo->StoreInterface,
                   sizeof(XENBUS_STORE_INTERFACE));
 
+    // Once this returns the idle work item is neither queued nor
+    // running, and cannot be queued again. A callback may still have
+    // requested a power state change, so this has to come before the
+    // device power thread is stopped.
+    ExWaitForRundownProtectionRelease(&Fdo->IdleRundown);
+    RtlZeroMemory(&Fdo->IdleItem, sizeof(XENHID_WORK_ITEM));
+    RtlZeroMemory(&Fdo->IdleRundown, sizeof(EX_RUNDOWN_REF));
+
     ThreadAlert(Fdo->DevicePowerThread);
     ThreadJoin(Fdo->DevicePowerThread);
     Fdo->DevicePowerThread = NULL;
     Fdo->DevicePowerIrp = NULL;
     Fdo->DevicePowerState = 0;
 
+    Fdo->IdleCallback = NULL;
+    Fdo->IdleContext = NULL;
+
     RtlZeroMemory(&Fdo->Queue, sizeof(IO_CSQ));
+    RtlZeroMemory(&Fdo->CompletionDpc, sizeof(KDPC));
+    RtlZeroMemory(&Fdo->StagedLock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Fdo->Staged, sizeof(LIST_ENTRY));
     RtlZeroMemory(&Fdo->List, sizeof(LIST_ENTRY));
     RtlZeroMemory(&Fdo->Lock, sizeof(KSPIN_LOCK));
+    Fdo->QueueDepth = 0;
+    Fdo->WatchdogActivity = 0;
+    Fdo->QueueDepthMaximum = 0;
+    Fdo->ReportSequence = 0;
+    Fdo->CallbackTimeMaximum = 0;
+
+    __FdoFree(Fdo->Statistics);
+    Fdo->Statistics = NULL;
+    Fdo->ProcessorCount = 0;
+
+    RtlZeroMemory(&Fdo->Configuration, sizeof(FDO_CONFIGURATION));
+    RtlZeroMemory(Fdo->FrontendPath, sizeof(Fdo->FrontendPath));
+    RtlZeroMemory(Fdo->Path, sizeof(Fdo->Path));
+    FdoFreeIndex(Fdo);
 
     Fdo->DeviceObject = NULL;
     Fdo->LowerDeviceObject = NULL;
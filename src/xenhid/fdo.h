@@ -40,6 +40,11 @@ FdoGetSize(
     VOID
     );
 
+extern NTSTATUS
+FdoInitialize(
+    VOID
+    );
+
 extern NTSTATUS
 FdoDispatch(
     IN  PXENHID_FDO Fdo,
@@ -58,4 +63,11 @@ FdoDestroy(
     IN  PXENHID_FDO Fdo
     );
 
+extern NTSTATUS
+FdoQueryStatistics(
+    OUT PVOID   Buffer,
+    IN  ULONG   Length,
+    OUT PULONG  Returned
+    );
+
 #endif  // _XENHID_FDO_H
@@ -0,0 +1,413 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <xenhid_ioctl.h>
+
+#include "pool.h"
+#include "util.h"
+#include "dbg_print.h"
+#include "assert.h"
+
+#define POOL_TAG            'LOOP'
+#define POOL_MAGIC          0x4c4f4f50  // 'POOL'
+#define POOL_POISON         0xfe
+
+#define POOL_CACHE_NONE     (~0ul)
+#define POOL_MAXIMUM_TAGS   16
+
+// For an aligned allocation Cache holds this flag together with the
+// offset of the header from the start of the underlying allocation
+#define POOL_CACHE_ALIGNED  0x80000000ul
+
+// Each allocation is preceded by a header recording where it came from
+// so that PoolFree() can return it to the right place and account for
+// it. The header size preserves the natural pool alignment.
+typedef struct _XENHID_POOL_HEADER {
+    ULONG   Magic;
+    ULONG   Tag;
+    ULONG   Length;
+    ULONG   Cache;
+} XENHID_POOL_HEADER, *PXENHID_POOL_HEADER;
+
+C_ASSERT((sizeof (XENHID_POOL_HEADER) % MEMORY_ALLOCATION_ALIGNMENT) == 0);
+
+// Cache sizes include the header
+static const ULONG  PoolCacheSize[] = {
+    64,
+    128,
+    256,
+    512
+};
+
+#define POOL_CACHE_COUNT    ARRAYSIZE(PoolCacheSize)
+
+typedef struct _XENHID_POOL_TAG {
+    LONG        Tag;
+    LONGLONG    Live;
+    LONGLONG    Peak;
+    LONGLONG    Allocations;
+} XENHID_POOL_TAG, *PXENHID_POOL_TAG;
+
+typedef struct _XENHID_POOL {
+    BOOLEAN             Initialized;
+    LOOKASIDE_LIST_EX   Cache[POOL_CACHE_COUNT];
+    XENHID_POOL_TAG     Tag[POOL_MAXIMUM_TAGS];
+} XENHID_POOL, *PXENHID_POOL;
+
+static XENHID_POOL  Pool;
+
+// Find, or claim, the accounting slot for Tag. If the table is full
+// the allocation simply goes unaccounted.
+static PXENHID_POOL_TAG
+__PoolLookupTag(
+    IN  ULONG   Tag
+    )
+{
+    ULONG       Index;
+
+    for (Index = 0; Index < POOL_MAXIMUM_TAGS; Index++) {
+        PXENHID_POOL_TAG    Entry = &Pool.Tag[Index];
+
+        if (Entry->Tag == (LONG)Tag)
+            return Entry;
+
+        if (Entry->Tag == 0 &&
+            InterlockedCompareExchange(&Entry->Tag, (LONG)Tag, 0) == 0)
+            return Entry;
+
+        // Somebody else may have just claimed the slot for Tag
+        if (Entry->Tag == (LONG)Tag)
+            return Entry;
+    }
+
+    return NULL;
+}
+
+static VOID
+__PoolAccount(
+    IN  ULONG       Tag,
+    IN  LONGLONG    Delta
+    )
+{
+    PXENHID_POOL_TAG    Entry;
+    LONGLONG            Live;
+    LONGLONG            Peak;
+
+    Entry = __PoolLookupTag(Tag);
+    if (Entry == NULL)
+        return;
+
+    Live = InterlockedAdd64(&Entry->Live, Delta);
+    if (Delta < 0)
+        return;
+
+    (VOID) InterlockedIncrement64(&Entry->Allocations);
+
+    do {
+        Peak = Entry->Peak;
+        if (Live <= Peak)
+            break;
+    } while (InterlockedCompareExchange64(&Entry->Peak, Live, Peak) != Peak);
+}
+
+PVOID
+PoolAllocate(
+    IN  ULONG           Length,
+    IN  ULONG           Tag
+    )
+{
+    PXENHID_POOL_HEADER Header;
+    ULONG               Size;
+    ULONG               Cache;
+
+    ASSERT(Pool.Initialized);
+
+    if (Length == 0 ||
+        Length > MAXULONG - sizeof (XENHID_POOL_HEADER))
+        return NULL;
+
+    Size = sizeof (XENHID_POOL_HEADER) + Length;
+
+    for (Cache = 0; Cache < POOL_CACHE_COUNT; Cache++)
+        if (Size <= PoolCacheSize[Cache])
+            break;
+
+    if (Cache < POOL_CACHE_COUNT) {
+        Header = ExAllocateFromLookasideListEx(&Pool.Cache[Cache]);
+        if (Header == NULL)
+            return NULL;
+
+        // Only the part that will be used needs to be zeroed
+        RtlZeroMemory(Header, Size);
+    } else {
+        Cache = POOL_CACHE_NONE;
+
+        // __AllocatePoolWithTag() zeroes the allocation itself
+        Header = __AllocatePoolWithTag(NonPagedPool, Size, Tag);
+        if (Header == NULL)
+            return NULL;
+    }
+
+    Header->Magic = POOL_MAGIC;
+    Header->Tag = Tag;
+    Header->Length = Length;
+    Header->Cache = Cache;
+
+    __PoolAccount(Tag, Length);
+
+    return Header + 1;
+}
+
+PVOID
+PoolAllocateAligned(
+    IN  ULONG           Length,
+    IN  ULONG           Alignment,
+    IN  ULONG           Tag
+    )
+{
+    PUCHAR              Base;
+    PXENHID_POOL_HEADER Header;
+    ULONG_PTR           Buffer;
+    ULONG               Size;
+
+    ASSERT(Pool.Initialized);
+    ASSERT(Alignment != 0 && (Alignment & (Alignment - 1)) == 0);
+    ASSERT3U(Alignment, <=, PAGE_SIZE);
+
+    if (Alignment <= MEMORY_ALLOCATION_ALIGNMENT)
+        return PoolAllocate(Length, Tag);
+
+    // The header, and hence the buffer, starts naturally aligned so
+    // rounding the buffer up moves it at most this far
+    if (Length == 0 ||
+        Length > MAXULONG - sizeof (XENHID_POOL_HEADER) -
+                 (Alignment - MEMORY_ALLOCATION_ALIGNMENT))
+        return NULL;
+
+    Size = sizeof (XENHID_POOL_HEADER) + Length +
+           (Alignment - MEMORY_ALLOCATION_ALIGNMENT);
+
+    // __AllocatePoolWithTag() zeroes the allocation itself
+    Base = __AllocatePoolWithTag(NonPagedPool, Size, Tag);
+    if (Base == NULL)
+        return NULL;
+
+    Buffer = ((ULONG_PTR)Base + sizeof (XENHID_POOL_HEADER) + Alignment - 1) &
+             ~((ULONG_PTR)Alignment - 1);
+
+    Header = (PXENHID_POOL_HEADER)Buffer - 1;
+    Header->Magic = POOL_MAGIC;
+    Header->Tag = Tag;
+    Header->Length = Length;
+    Header->Cache = POOL_CACHE_ALIGNED | (ULONG)((PUCHAR)Header - Base);
+
+    __PoolAccount(Tag, Length);
+
+    return (PVOID)Buffer;
+}
+
+VOID
+PoolFree(
+    IN  PVOID           Buffer,
+    IN  ULONG           Tag
+    )
+{
+    PXENHID_POOL_HEADER Header = (PXENHID_POOL_HEADER)Buffer - 1;
+    ULONG               Cache;
+
+    ASSERT(Pool.Initialized);
+    ASSERT3U(Header->Magic, ==, POOL_MAGIC);
+    ASSERT3U(Header->Tag, ==, Tag);
+
+    __PoolAccount(Tag, -(LONGLONG)Header->Length);
+
+    Cache = Header->Cache;
+
+#if DBG
+    // Catch use-after-free, and stale headers being passed back in
+    RtlFillMemory(Header,
+                  sizeof (XENHID_POOL_HEADER) + Header->Length,
+                  POOL_POISON);
+#endif
+
+    if (Cache == POOL_CACHE_NONE) {
+        __FreePoolWithTag(Header, Tag);
+    } else if (Cache & POOL_CACHE_ALIGNED) {
+        __FreePoolWithTag((PUCHAR)Header - (Cache & ~POOL_CACHE_ALIGNED), Tag);
+    } else {
+        ASSERT3U(Cache, <, POOL_CACHE_COUNT);
+        ExFreeToLookasideListEx(&Pool.Cache[Cache], Header);
+    }
+}
+
+NTSTATUS
+PoolQueryStatistics(
+    OUT PVOID                   Buffer,
+    IN  ULONG                   Length,
+    OUT PULONG                  Returned
+    )
+{
+    PXENHID_POOL_STATISTICS     Statistics = Buffer;
+    PXENHID_POOL_STATISTICS_TAG Entry;
+    ULONG                       Index;
+    ULONG                       Count;
+    ULONG                       Size;
+    NTSTATUS                    status;
+
+    *Returned = 0;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (Length < sizeof (XENHID_POOL_STATISTICS))
+        goto done;
+
+    // Slots are claimed in order and never released, so the table can
+    // only grow between the two passes; anything claimed in between is
+    // simply not reported
+    Count = 0;
+    for (Index = 0; Index < POOL_MAXIMUM_TAGS; Index++)
+        if (Pool.Tag[Index].Tag != 0)
+            Count++;
+
+    Size = sizeof (XENHID_POOL_STATISTICS) +
+           (Count * sizeof (XENHID_POOL_STATISTICS_TAG));
+
+    RtlZeroMemory(Statistics, sizeof (XENHID_POOL_STATISTICS));
+    Statistics->Version = XENHID_POOL_STATISTICS_VERSION;
+    Statistics->Size = Size;
+    Statistics->TagSize = sizeof (XENHID_POOL_STATISTICS_TAG);
+    Statistics->TagCount = Count;
+
+    if (Length < Size) {
+        *Returned = sizeof (XENHID_POOL_STATISTICS);
+        status = STATUS_BUFFER_OVERFLOW;
+        goto done;
+    }
+
+    Entry = (PXENHID_POOL_STATISTICS_TAG)(Statistics + 1);
+
+    for (Index = 0; Index < Count; Index++) {
+        PXENHID_POOL_TAG    Tag = &Pool.Tag[Index];
+
+        RtlZeroMemory(Entry, sizeof (XENHID_POOL_STATISTICS_TAG));
+        Entry->Tag = (ULONG)Tag->Tag;
+        Entry->Live = (ULONG64)Tag->Live;
+        Entry->Peak = (ULONG64)Tag->Peak;
+        Entry->Allocations = (ULONG64)Tag->Allocations;
+
+        Entry++;
+    }
+
+    *Returned = Size;
+    status = STATUS_SUCCESS;
+
+done:
+    return status;
+}
+
+NTSTATUS
+PoolInitialize(
+    VOID
+    )
+{
+    ULONG       Cache;
+    NTSTATUS    status;
+
+    ASSERT(!Pool.Initialized);
+
+    for (Cache = 0; Cache < POOL_CACHE_COUNT; Cache++) {
+        status = ExInitializeLookasideListEx(&Pool.Cache[Cache],
+                                             NULL,
+                                             NULL,
+                                             NonPagedPool,
+                                             0,
+                                             PoolCacheSize[Cache],
+                                             POOL_TAG,
+                                             0);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+    }
+
+    Pool.Initialized = TRUE;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    while (Cache != 0)
+        ExDeleteLookasideListEx(&Pool.Cache[--Cache]);
+
+    RtlZeroMemory(&Pool, sizeof (XENHID_POOL));
+
+    return status;
+}
+
+VOID
+PoolTeardown(
+    VOID
+    )
+{
+    ULONG       Index;
+    ULONG       Cache;
+
+    ASSERT(Pool.Initialized);
+
+    for (Index = 0; Index < POOL_MAXIMUM_TAGS; Index++) {
+        PXENHID_POOL_TAG    Entry = &Pool.Tag[Index];
+        ULONG               Tag = (ULONG)Entry->Tag;
+
+        if (Tag == 0)
+            continue;
+
+        Info("%c%c%c%c: allocations %lld peak %lld\n",
+             (CHAR)(Tag & 0xff),
+             (CHAR)((Tag >> 8) & 0xff),
+             (CHAR)((Tag >> 16) & 0xff),
+             (CHAR)((Tag >> 24) & 0xff),
+             Entry->Allocations,
+             Entry->Peak);
+
+        if (Entry->Live != 0)
+            Warning("%c%c%c%c: %lld bytes leaked\n",
+                    (CHAR)(Tag & 0xff),
+                    (CHAR)((Tag >> 8) & 0xff),
+                    (CHAR)((Tag >> 16) & 0xff),
+                    (CHAR)((Tag >> 24) & 0xff),
+                    Entry->Live);
+    }
+
+    for (Cache = 0; Cache < POOL_CACHE_COUNT; Cache++)
+        ExDeleteLookasideListEx(&Pool.Cache[Cache]);
+
+    RtlZeroMemory(&Pool, sizeof (XENHID_POOL));
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENHID_POOL_H
+#define _XENHID_POOL_H
+
+#include <ntddk.h>
+
+extern NTSTATUS
+PoolInitialize(
+    VOID
+    );
+
+extern VOID
+PoolTeardown(
+    VOID
+    );
+
+// Allocations are always zeroed. Small allocations are satisfied from
+// fixed-size lookaside caches; everything is accounted against Tag.
+extern PVOID
+PoolAllocate(
+    IN  ULONG   Length,
+    IN  ULONG   Tag
+    );
+
+// As PoolAllocate() but the returned buffer is aligned to Alignment,
+// which must be a power of two no greater than PAGE_SIZE. The buffer is
+// released with PoolFree() as usual.
+extern PVOID
+PoolAllocateAligned(
+    IN  ULONG   Length,
+    IN  ULONG   Alignment,
+    IN  ULONG   Tag
+    );
+
+extern VOID
+PoolFree(
+    IN  PVOID   Buffer,
+    IN  ULONG   Tag
+    );
+
+// Fill in the output of IOCTL_XENHID_QUERY_POOL
+extern NTSTATUS
+PoolQueryStatistics(
+    OUT PVOID   Buffer,
+    IN  ULONG   Length,
+    OUT PULONG  Returned
+    );
+
+#endif  // _XENHID_POOL_H
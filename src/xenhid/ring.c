@@ -0,0 +1,298 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <procgrp.h>
+
+#include "ring.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define RING_POOL_TAG   'GNIR'
+
+// Each processor records into its own ring of fixed size binary
+// entries. There are no locks and no formatting: a slot is claimed
+// with a single interlocked increment so a writer that is pre-empted
+// or migrated can never corrupt another writer's entry.
+//
+// The rings are intended to be read out of a crash dump. Everything
+// hangs off the RingDescriptor global, which starts with RING_MAGIC
+// and RING_VERSION; each ring's Index is the total number of entries
+// ever claimed so the newest entry is at (Index - 1) % RING_ENTRY_COUNT
+// and, with Timestamp, the rings can be merged into a single timeline.
+//
+// A slot is claimed before it is filled in, so each entry also carries
+// Sequence: the low 32 bits of its claim number plus one. It is zeroed
+// before the other fields are written and set last, with release
+// semantics, so an entry is only complete if Sequence matches the slot.
+// scripts/ringdecode.py decodes the rings on any host.
+//
+// Recording runs at DISPATCH_LEVEL (or above), so a recorder only ever
+// touches its own processor's ring and never shares a cache line with
+// another processor. RingTeardown() relies on that: once the rings are
+// unpublished, a DPC that has run on every processor means no recorder
+// can still be using them.
+
+#define RING_MAGIC          'GNIR'
+#define RING_VERSION        3
+#define RING_ENTRY_COUNT    256 // Must be a power of 2
+
+typedef struct _RING_ENTRY {
+    ULONG64     Timestamp;
+    ULONG64     Fdo;
+    ULONG64     Argument[2];
+    ULONG       Event;
+    ULONG       Processor;
+    LONG        Sequence;
+    ULONG       Reserved;
+} RING_ENTRY, *PRING_ENTRY;
+
+C_ASSERT(sizeof (RING_ENTRY) == 48);
+
+typedef struct _RING {
+    LONG        Index;
+    ULONG       Processor;
+    RING_ENTRY  Entry[RING_ENTRY_COUNT];
+} RING, *PRING;
+
+// Ring is at the same offset (0x18) on x86 and x64, so a debugger can
+// find the rings, and their size, from the fields before it whatever
+// the architecture of the dump
+typedef struct _RING_DESCRIPTOR {
+    ULONG       Magic;
+    ULONG       Version;
+    ULONG       EntrySize;
+    ULONG       EntryCount;
+    ULONG       RingCount;
+    ULONG       RingSize;
+    PRING       Ring;
+} RING_DESCRIPTOR, *PRING_DESCRIPTOR;
+
+C_ASSERT(FIELD_OFFSET(RING_DESCRIPTOR, Ring) == 0x18);
+
+RING_DESCRIPTOR RingDescriptor;
+
+static FORCEINLINE PVOID
+__RingAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, RING_POOL_TAG);
+}
+
+static FORCEINLINE VOID
+__RingFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, RING_POOL_TAG);
+}
+
+VOID
+RingRecord(
+    IN  RING_EVENT  Event,
+    IN  PVOID       Fdo OPTIONAL,
+    IN  ULONG_PTR   Argument0,
+    IN  ULONG_PTR   Argument1
+    )
+{
+    PRING_DESCRIPTOR    Descriptor = &RingDescriptor;
+    KIRQL               Irql;
+    ULONG               Processor;
+    PRING               Ring;
+    PRING_ENTRY         Entry;
+    LONG                Index;
+
+    Irql = KeGetCurrentIrql();
+    if (Irql < DISPATCH_LEVEL)
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    Ring = ReadPointerAcquire(&Descriptor->Ring);
+    if (Ring == NULL)
+        goto done;
+
+    Processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (Processor >= Descriptor->RingCount)
+        goto done;
+
+    Ring = &Ring[Processor];
+
+    Index = InterlockedIncrement(&Ring->Index) - 1;
+    Entry = &Ring->Entry[Index & (RING_ENTRY_COUNT - 1)];
+
+    // The exchange orders the invalidation before the stores below
+    (VOID) InterlockedExchange(&Entry->Sequence, 0);
+
+    Entry->Timestamp = ReadTimeStampCounter();
+    Entry->Fdo = (ULONG64)(ULONG_PTR)Fdo;
+    Entry->Argument[0] = (ULONG64)Argument0;
+    Entry->Argument[1] = (ULONG64)Argument1;
+    Entry->Processor = Processor;
+    Entry->Event = Event;
+
+    WriteRelease(&Entry->Sequence, (LONG)((ULONG)Index + 1));
+
+done:
+    if (Irql < DISPATCH_LEVEL)
+        KeLowerIrql(Irql);
+}
+
+NTSTATUS
+RingInitialize(
+    VOID
+    )
+{
+    PRING_DESCRIPTOR    Descriptor = &RingDescriptor;
+    ULONG               Count;
+    ULONG               Index;
+    PRING               Ring;
+    NTSTATUS            status;
+
+    ASSERT(IsZeroMemory(Descriptor, sizeof (RING_DESCRIPTOR)));
+
+    Count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    Ring = __RingAllocate(sizeof (RING) * Count);
+
+    status = STATUS_NO_MEMORY;
+    if (Ring == NULL)
+        goto fail1;
+
+    for (Index = 0; Index < Count; Index++)
+        Ring[Index].Processor = Index;
+
+    Descriptor->Magic = RING_MAGIC;
+    Descriptor->Version = RING_VERSION;
+    Descriptor->EntrySize = sizeof (RING_ENTRY);
+    Descriptor->EntryCount = RING_ENTRY_COUNT;
+    Descriptor->RingCount = Count;
+    Descriptor->RingSize = sizeof (RING);
+
+    WritePointerRelease(&Descriptor->Ring, Ring);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static KDEFERRED_ROUTINE RingFlushDpc;
+
+static VOID
+RingFlushDpc(
+    IN  PKDPC   Dpc,
+    IN  PVOID   Context,
+    IN  PVOID   Argument1,
+    IN  PVOID   Argument2
+    )
+{
+    PKEVENT     Event = Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    (VOID) KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+}
+
+// Run a DPC on each active processor in turn. It cannot run until the
+// processor drops below DISPATCH_LEVEL, i.e. until any recorder there
+// has finished.
+static VOID
+RingFlush(
+    IN  ULONG           Count
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        PROCESSOR_NUMBER    Number;
+        KDPC                Dpc;
+        KEVENT              Event;
+        NTSTATUS            status;
+
+        status = KeGetProcessorNumberFromIndex(Index, &Number);
+        if (!NT_SUCCESS(status))
+            continue;
+
+        // A processor that is not active cannot be recording, and a DPC
+        // targeted at it would never run
+        if ((KeQueryGroupAffinity(Number.Group) &
+             ((KAFFINITY)1 << Number.Number)) == 0)
+            continue;
+
+        KeInitializeEvent(&Event, NotificationEvent, FALSE);
+        KeInitializeDpc(&Dpc, RingFlushDpc, &Event);
+
+        (VOID) KeSetTargetProcessorDpcEx(&Dpc, &Number);
+        (VOID) KeInsertQueueDpc(&Dpc, NULL, NULL);
+
+        (VOID) KeWaitForSingleObject(&Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+    }
+
+    // Make sure the last DPC routine has returned before its stack
+    // goes away
+    KeFlushQueuedDpcs();
+}
+
+VOID
+RingTeardown(
+    VOID
+    )
+{
+    PRING_DESCRIPTOR    Descriptor = &RingDescriptor;
+    PRING               Ring;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Ring = Descriptor->Ring;
+    if (Ring == NULL)
+        return;
+
+    // Once this returns no recorder can be using the rings, and no
+    // new one can find them
+    WritePointerRelease(&Descriptor->Ring, NULL);
+    KeMemoryBarrier();
+
+    RingFlush(Descriptor->RingCount);
+
+    __RingFree(Ring);
+
+    RtlZeroMemory(Descriptor, sizeof (RING_DESCRIPTOR));
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENHID_RING_H
+#define _XENHID_RING_H
+
+#include <ntddk.h>
+
+typedef enum _RING_EVENT {
+    RING_EVENT_INVALID = 0,
+    RING_EVENT_REPORT_ARRIVAL,
+    RING_EVENT_REPORT_REFUSED,
+    RING_EVENT_IRP_QUEUE,
+    RING_EVENT_IRP_COMPLETE,
+    RING_EVENT_IRP_CANCEL,
+    RING_EVENT_POWER_START,
+    RING_EVENT_POWER_END,
+    RING_EVENT_THREAD_WAKE,
+    RING_EVENT_THREAD_ALERT,
+    RING_EVENT_THREAD_EXIT,
+    RING_EVENT_COUNT
+} RING_EVENT, *PRING_EVENT;
+
+extern NTSTATUS
+RingInitialize(
+    VOID
+    );
+
+extern VOID
+RingTeardown(
+    VOID
+    );
+
+extern VOID
+RingRecord(
+    IN  RING_EVENT  Event,
+    IN  PVOID       Fdo OPTIONAL,
+    IN  ULONG_PTR   Argument0,
+    IN  ULONG_PTR   Argument1
+    );
+
+#endif  // _XENHID_RING_H
@@ -38,54 +38,179 @@
 #include "dbg_print.h"
 #include "assert.h"
 
+// A STRING with a NULL Buffer is only measured: the output is counted
+// but not written, and is limited only by what a STRING can describe
+static FORCEINLINE LONG
+__StringMaximumLength(
+    IN  PSTRING String
+    )
+{
+    return (String->Buffer == NULL) ? MAXUSHORT : String->MaximumLength;
+}
+
 static FORCEINLINE NTSTATUS
 __StringPut(
     IN  PSTRING String,
     IN  CHAR    Character
     )
 {
-    if (String->Length >= String->MaximumLength - 1)
+    if (String->Length >= __StringMaximumLength(String) - 1)
         return STATUS_BUFFER_OVERFLOW;
 
-    String->Buffer[String->Length++] = Character;
+    if (String->Buffer != NULL)
+        String->Buffer[String->Length] = Character;
+
+    String->Length++;
     return STATUS_SUCCESS;
 }
 
+// Space left before the reserved NUL terminator
+static FORCEINLINE ULONG
+__StringAvailable(
+    IN  PSTRING String
+    )
+{
+    LONG        Available;
+
+    Available = __StringMaximumLength(String) - 1 - (LONG)String->Length;
+
+    return (Available > 0) ? (ULONG)Available : 0;
+}
+
+// The bulk variants below write as much as will fit before failing, so
+// that a truncated string is the same as if each character had been
+// written with __StringPut()
+static NTSTATUS
+__StringPutBuffer(
+    IN  PSTRING     String,
+    IN  const CHAR  *Buffer,
+    IN  ULONG       Length
+    )
+{
+    ULONG           Available = __StringAvailable(String);
+    ULONG           Count = min(Length, Available);
+
+    if (String->Buffer != NULL)
+        RtlCopyMemory(&String->Buffer[String->Length], Buffer, Count);
+
+    String->Length += (USHORT)Count;
+
+    return (Count < Length) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+static NTSTATUS
+__StringPutWideBuffer(
+    IN  PSTRING     String,
+    IN  const WCHAR *Buffer,
+    IN  ULONG       Length
+    )
+{
+    ULONG           Available = __StringAvailable(String);
+    ULONG           Count = min(Length, Available);
+    ULONG           Index;
+
+    if (String->Buffer != NULL)
+        for (Index = 0; Index < Count; Index++)
+            String->Buffer[String->Length + Index] = (CHAR)Buffer[Index];
+
+    String->Length += (USHORT)Count;
+
+    return (Count < Length) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+static NTSTATUS
+__StringPad(
+    IN  PSTRING     String,
+    IN  CHAR        Character,
+    IN  ULONG       Pad,
+    IN  ULONG       Length
+    )
+{
+    ULONG           Available;
+    ULONG           Count;
+
+    if (Pad <= Length)
+        return STATUS_SUCCESS;
+
+    Pad -= Length;
+
+    Available = __StringAvailable(String);
+    Count = min(Pad, Available);
+
+    if (String->Buffer != NULL)
+        RtlFillMemory(&String->Buffer[String->Length], Count, Character);
+
+    String->Length += (USHORT)Count;
+
+    return (Count < Pad) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+static const CHAR StringDecimalPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Format Value backwards into the space ending at End, returning the
+// first character written
 static PCHAR
 FormatNumber(
-    IN  PCHAR       Buffer,
+    IN  PCHAR       End,
     IN  ULONGLONG   Value,
     IN  UCHAR       Base,
     IN  BOOLEAN     UpperCase
     )
 {
-    ULONGLONG       Next = Value / Base;
+    PCHAR           Buffer = End;
+
+    if (Base == 10) {
+        while (Value >= 100) {
+            ULONG   Pair = (ULONG)(Value % 100) * 2;
 
-    if (Next != 0)
-        Buffer = FormatNumber(Buffer, Next, Base, UpperCase);
+            Value /= 100;
 
-    Value %= Base;
+            Buffer -= 2;
+            Buffer[0] = StringDecimalPairs[Pair];
+            Buffer[1] = StringDecimalPairs[Pair + 1];
+        }
 
-    if (Value < 10)
-        *Buffer++ = '0' + (CHAR)Value;
-    else
-        *Buffer++ = ((UpperCase) ? 'A' : 'a') + (CHAR)(Value - 10);
+        if (Value >= 10) {
+            ULONG   Pair = (ULONG)Value * 2;
 
-    *Buffer = '\0';
+            Buffer -= 2;
+            Buffer[0] = StringDecimalPairs[Pair];
+            Buffer[1] = StringDecimalPairs[Pair + 1];
+        } else {
+            *--Buffer = '0' + (CHAR)Value;
+        }
+    } else {
+        const CHAR  *Digits = (UpperCase) ?
+                              "0123456789ABCDEF" :
+                              "0123456789abcdef";
+        UCHAR       Shift = (Base == 16) ? 4 : 3;
+
+        ASSERT(Base == 8 || Base == 16);
+
+        do {
+            *--Buffer = Digits[Value & (Base - 1)];
+            Value >>= Shift;
+        } while (Value != 0);
+    }
 
     return Buffer;
 }
 
-#define FORMAT_NUMBER(_Arguments, _Type, _Character, _Buffer)                               \
+#define FORMAT_NUMBER(_Arguments, _Type, _Character, _Buffer, _Start)                       \
         do {                                                                                \
             U ## _Type  _Value = va_arg((_Arguments), U ## _Type);                          \
+            BOOLEAN     _Negative = FALSE;                                                  \
             BOOLEAN     _UpperCase = FALSE;                                                 \
             UCHAR       _Base = 0;                                                          \
-            ULONG       _Index = 0;                                                         \
                                                                                             \
             if ((_Character) == 'd' && (_Type)_Value < 0) {                                 \
-                _Value = -((_Type)_Value);                                                  \
-                (_Buffer)[_Index++] = '-';                                                  \
+                _Value = (U ## _Type)0 - _Value;  /* No overflow for the minimum */         \
+                _Negative = TRUE;                                                           \
             }                                                                               \
                                                                                             \
             switch (_Character) {                                                           \
@@ -108,312 +233,302 @@ FormatNumber(
                 break;                                                                      \
             }                                                                               \
                                                                                             \
-            (VOID) FormatNumber(&(_Buffer)[_Index], (ULONGLONG)_Value, _Base, _UpperCase);  \
+            (_Start) = FormatNumber(&(_Buffer)[sizeof (_Buffer)],                           \
+                                    (ULONGLONG)_Value,                                      \
+                                    _Base,                                                  \
+                                    _UpperCase);                                            \
+            if (_Negative)                                                                  \
+                *--(_Start) = '-';                                                          \
         } while (FALSE)
 
-static NTSTATUS
-StringWriteBuffer(
-    IN  PSTRING         String,
-    IN  const CHAR      *Format,
-    IN  va_list         Arguments
+// Parse the next literal run or conversion specification from Format,
+// returning a pointer to the character following it
+static FORCEINLINE const CHAR *
+__StringParse(
+    IN  const CHAR                  *Format,
+    OUT PXENHID_STRING_FORMAT_OP    Op
     )
 {
-    CHAR                Character;
-    NTSTATUS            status;
+    CHAR                            Character;
 
-    status = STATUS_SUCCESS;
+    Op->Literal = NULL;
+    Op->Length = 0;
+    Op->Conversion = '\0';
+    Op->Pad = 0;
+    Op->Long = 0;
+    Op->Wide = FALSE;
+    Op->ZeroPrefix = FALSE;
+    Op->OppositeJustification = FALSE;
 
-    while ((Character = *Format++) != '\0') {
-        UCHAR   Pad = 0;
-        UCHAR   Long = 0;
-        BOOLEAN Wide = FALSE;
-        BOOLEAN ZeroPrefix = FALSE;
-        BOOLEAN OppositeJustification = FALSE;
+    Character = *Format++;
+    ASSERT(Character != '\0');
 
-        if (Character != '%') {
-            status = __StringPut(String, Character);
-            if (!NT_SUCCESS(status))
-                goto done;
+    if (Character != '%') {
+        Op->Literal = Format - 1;
 
-            continue;
-        }
+        while (*Format != '\0' && *Format != '%')
+            Format++;
 
+        Op->Length = (ULONG)(Format - Op->Literal);
+        return Format;
+    }
+
+    Character = *Format++;
+    ASSERT(Character != '\0');
+
+    if (Character == '-') {
+        Op->OppositeJustification = TRUE;
         Character = *Format++;
         ASSERT(Character != '\0');
+    }
+
+    if (isdigit((unsigned char)Character)) {
+        Op->ZeroPrefix = (Character == '0') ? TRUE : FALSE;
 
-        if (Character == '-') {
-            OppositeJustification = TRUE;
+        while (isdigit((unsigned char)Character)) {
+            Op->Pad = (Op->Pad * 10) + (Character - '0');
             Character = *Format++;
             ASSERT(Character != '\0');
         }
+    }
 
-        if (isdigit((unsigned char)Character)) {
-            ZeroPrefix = (Character == '0') ? TRUE : FALSE;
+    while (Character == 'l') {
+        Op->Long++;
+        Character = *Format++;
+        ASSERT(Character == 'd' ||
+               Character == 'u' ||
+               Character == 'o' ||
+               Character == 'x' ||
+               Character == 'X' ||
+               Character == 'l');
+    }
+    ASSERT3U(Op->Long, <=, 2);
 
-            while (isdigit((unsigned char)Character)) {
-                Pad = (Pad * 10) + (Character - '0');
-                Character = *Format++;
-                ASSERT(Character != '\0');
-            }
-        }
+    while (Character == 'w') {
+        Op->Wide = TRUE;
+        Character = *Format++;
+        ASSERT(Character == 'c' ||
+               Character == 's' ||
+               Character == 'Z');
+    }
 
-        while (Character == 'l') {
-            Long++;
-            Character = *Format++;
-            ASSERT(Character == 'd' ||
-                   Character == 'u' ||
-                   Character == 'o' ||
-                   Character == 'x' ||
-                   Character == 'X' ||
-                   Character == 'l');
-        }
-        ASSERT3U(Long, <=, 2);
+    switch (Character) {
+    case 'p':
+        Op->ZeroPrefix = TRUE;
+        Op->Pad = sizeof (ULONG_PTR) * 2;
+        Op->Long = sizeof (ULONG_PTR) / sizeof (ULONG);
+        /* FALLTHRU */
+
+    case 'c':
+    case 'd':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+    case 's':
+    case 'Z':
+        Op->Conversion = Character;
+        break;
+
+    default:
+        // Anything else (e.g. '%%') is emitted literally
+        Op->Literal = Format - 1;
+        Op->Length = 1;
+        break;
+    }
 
-        while (Character == 'w') {
-            Wide = TRUE;
-            Character = *Format++;
-            ASSERT(Character == 'c' ||
-                   Character == 's' ||
-                   Character == 'Z');
-        }
+    return Format;
+}
 
-        switch (Character) {
-        case 'c': {
-            if (Wide) {
-                WCHAR   Value;
-                Value = va_arg(Arguments, WCHAR);
+static FORCEINLINE NTSTATUS
+__StringWriteOp(
+    IN  PSTRING                         String,
+    IN  const XENHID_STRING_FORMAT_OP   *Op,
+    IN  va_list                         *Arguments
+    )
+{
+    CHAR                                Character = Op->Conversion;
+    ULONG                               Pad = Op->Pad;
+    BOOLEAN                             OppositeJustification = Op->OppositeJustification;
+    NTSTATUS                            status;
 
-                status = __StringPut(String, (CHAR)Value);
-                if (!NT_SUCCESS(status))
-                    goto done;
-            } else {
-                CHAR    Value;
+    switch (Character) {
+    case '\0':
+        status = __StringPutBuffer(String, Op->Literal, Op->Length);
+        break;
 
-                Value = va_arg(Arguments, CHAR);
+    case 'c': {
+        if (Op->Wide) {
+            WCHAR   Value;
+            Value = (WCHAR)va_arg(*Arguments, int);
 
-                status = __StringPut(String, Value);
-                if (!NT_SUCCESS(status))
-                    goto done;
-            }
-            break;
+            status = __StringPut(String, (CHAR)Value);
+        } else {
+            CHAR    Value;
+
+            Value = (CHAR)va_arg(*Arguments, int);
+
+            status = __StringPut(String, Value);
+        }
+        break;
+    }
+    case 'p':
+    case 'd':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+        CHAR    Buffer[22]; // Enough for 8 bytes in octal
+        PCHAR   Start;
+        ULONG   Length;
+
+        if (Op->Long == 2)
+            FORMAT_NUMBER(*Arguments, LONGLONG, Character, Buffer, Start);
+        else
+            FORMAT_NUMBER(*Arguments, LONG, Character, Buffer, Start);
+
+        Length = (ULONG)(&Buffer[sizeof (Buffer)] - Start);
+
+        if (!OppositeJustification) {
+            status = __StringPad(String,
+                                 (Op->ZeroPrefix) ? '0' : ' ',
+                                 Pad,
+                                 Length);
+            if (!NT_SUCCESS(status))
+                break;
         }
-        case 'p':
-            ZeroPrefix = TRUE;
-            Pad = sizeof (ULONG_PTR) * 2;
-            Long = sizeof (ULONG_PTR) / sizeof (ULONG);
-            /* FALLTHRU */
-
-        case 'd':
-        case 'u':
-        case 'o':
-        case 'x':
-        case 'X': {
-            CHAR    Buffer[23]; // Enough for 8 bytes in octal plus the NUL terminator
-            ULONG   Length;
-            ULONG   Index;
-
-            if (Long == 2)
-                FORMAT_NUMBER(Arguments, LONGLONG, Character, Buffer);
-            else
-                FORMAT_NUMBER(Arguments, LONG, Character, Buffer);
 
-            Length = (ULONG)strlen(Buffer);
-            if (!OppositeJustification) {
-                while (Pad > Length) {
-                    status = __StringPut(String, (ZeroPrefix) ? '0' : ' ');
-                    if (!NT_SUCCESS(status))
-                        goto done;
-
-                    --Pad;
-                }
-            }
+        status = __StringPutBuffer(String, Start, Length);
+        if (!NT_SUCCESS(status))
+            break;
 
-            for (Index = 0; Index < Length; Index++) {
-                status = __StringPut(String, Buffer[Index]);
-                if (!NT_SUCCESS(status))
-                    goto done;
-            }
+        if (OppositeJustification)
+            status = __StringPad(String, ' ', Pad, Length);
 
-            if (OppositeJustification) {
-                while (Pad > Length) {
-                    status = __StringPut(String, ' ');
-                    if (!NT_SUCCESS(status))
-                        goto done;
+        break;
+    }
+    case 's':
+    case 'Z': {
+        const CHAR  *Buffer = NULL;
+        const WCHAR *WideBuffer = NULL;
+        ULONG       Length;
 
-                    --Pad;
-                }
-            }
+        if (Character == 's' && Op->Wide) {
+            WideBuffer = va_arg(*Arguments, PWCHAR);
 
-            break;
-        }
-        case 's': {
-            if (Wide) {
-                PWCHAR  Value = va_arg(Arguments, PWCHAR);
-                ULONG   Length;
-                ULONG   Index;
-
-                if (Value == NULL)
-                    Value = L"(null)";
-
-                Length = (ULONG)wcslen(Value);
-
-                if (OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
-
-                for (Index = 0; Index < Length; Index++) {
-                    status = __StringPut(String, (CHAR)Value[Index]);
-                    if (!NT_SUCCESS(status))
-                        goto done;
-                }
-
-                if (!OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
+            if (WideBuffer == NULL)
+                WideBuffer = L"(null)";
+
+            Length = (ULONG)wcslen(WideBuffer);
+        } else if (Character == 's') {
+            Buffer = va_arg(*Arguments, PCHAR);
+
+            if (Buffer == NULL)
+                Buffer = "(null)";
+
+            Length = (ULONG)strlen(Buffer);
+        } else if (Op->Wide) {
+            PUNICODE_STRING Value = va_arg(*Arguments, PUNICODE_STRING);
+
+            if (Value == NULL) {
+                WideBuffer = L"(null)";
+                Length = sizeof ("(null)") - 1;
             } else {
-                PCHAR   Value = va_arg(Arguments, PCHAR);
-                ULONG   Length;
-                ULONG   Index;
-
-                if (Value == NULL)
-                    Value = "(null)";
-
-                Length = (ULONG)strlen(Value);
-
-                if (OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
-
-                for (Index = 0; Index < Length; Index++) {
-                    status = __StringPut(String, Value[Index]);
-                    if (!NT_SUCCESS(status))
-                        goto done;
-                }
-
-                if (!OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
+                WideBuffer = Value->Buffer;
+                Length = Value->Length / sizeof (WCHAR);
             }
+        } else {
+            PANSI_STRING    Value = va_arg(*Arguments, PANSI_STRING);
 
-            break;
-        }
-        case 'Z': {
-            if (Wide) {
-                PUNICODE_STRING Value = va_arg(Arguments, PUNICODE_STRING);
-                PWCHAR          Buffer;
-                ULONG           Length;
-                ULONG           Index;
-
-                if (Value == NULL) {
-                    Buffer = L"(null)";
-                    Length = sizeof ("(null)") - 1;
-                } else {
-                    Buffer = Value->Buffer;
-                    Length = Value->Length / sizeof (WCHAR);
-                }
-
-                if (OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
-
-                for (Index = 0; Index < Length; Index++) {
-                    status = __StringPut(String, (CHAR)Buffer[Index]);
-                    if (!NT_SUCCESS(status))
-                        goto done;
-                }
-
-                if (!OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
+            if (Value == NULL) {
+                Buffer = "(null)";
+                Length = sizeof ("(null)") - 1;
             } else {
-                PANSI_STRING Value = va_arg(Arguments, PANSI_STRING);
-                PCHAR        Buffer;
-                ULONG        Length;
-                ULONG        Index;
-
-                if (Value == NULL) {
-                    Buffer = "(null)";
-                    Length = sizeof ("(null)") - 1;
-                } else {
-                    Buffer = Value->Buffer;
-                    Length = Value->Length / sizeof (CHAR);
-                }
-
-                if (OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
-
-                for (Index = 0; Index < Length; Index++) {
-                    status = __StringPut(String, Buffer[Index]);
-                    if (!NT_SUCCESS(status))
-                        goto done;
-                }
-
-                if (!OppositeJustification) {
-                    while (Pad > Length) {
-                        status = __StringPut(String, ' ');
-                        if (!NT_SUCCESS(status))
-                            goto done;
-
-                        --Pad;
-                    }
-                }
+                Buffer = Value->Buffer;
+                Length = Value->Length / sizeof (CHAR);
             }
-
-            break;
         }
-        default:
-            status = __StringPut(String, Character);
+
+        if (OppositeJustification) {
+            status = __StringPad(String, ' ', Pad, Length);
             if (!NT_SUCCESS(status))
-                goto done;
+                break;
+        }
 
+        status = (Op->Wide) ?
+                 __StringPutWideBuffer(String, WideBuffer, Length) :
+                 __StringPutBuffer(String, Buffer, Length);
+        if (!NT_SUCCESS(status))
             break;
-        }
+
+        if (!OppositeJustification)
+            status = __StringPad(String, ' ', Pad, Length);
+
+        break;
+    }
+    default:
+        ASSERT(FALSE);
+        status = STATUS_INVALID_PARAMETER;
+        break;
+    }
+
+    return status;
+}
+
+static NTSTATUS
+StringWriteBuffer(
+    IN  PSTRING         String,
+    IN  const CHAR      *Format,
+    IN  va_list         Arguments
+    )
+{
+    va_list             Copy;
+    NTSTATUS            status;
+
+    status = STATUS_SUCCESS;
+
+    va_copy(Copy, Arguments);
+
+    while (*Format != '\0') {
+        XENHID_STRING_FORMAT_OP Op;
+
+        Format = __StringParse(Format, &Op);
+
+        status = __StringWriteOp(String, &Op, &Copy);
+        if (!NT_SUCCESS(status))
+            goto done;
+    }
+
+done:
+    va_end(Copy);
+
+    return status;
+}
+
+static NTSTATUS
+StringWriteCompiled(
+    IN  PSTRING                     String,
+    IN  const XENHID_STRING_FORMAT  *Compiled,
+    IN  va_list                     Arguments
+    )
+{
+    va_list                         Copy;
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    status = STATUS_SUCCESS;
+
+    va_copy(Copy, Arguments);
+
+    for (Index = 0; Index < Compiled->Count; Index++) {
+        status = __StringWriteOp(String, &Compiled->Op[Index], &Copy);
+        if (!NT_SUCCESS(status))
+            goto done;
     }
 
 done:
+    va_end(Copy);
+
     return status;
 }
 
@@ -466,3 +581,81 @@ StringPrintf(
 
     return status;
 }
+
+NTSTATUS
+StringFormatCompile(
+    OUT PXENHID_STRING_FORMAT   Compiled,
+    IN  const CHAR              *Format
+    )
+{
+    NTSTATUS                    status;
+
+    Compiled->Count = 0;
+
+    while (*Format != '\0') {
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Compiled->Count == STRING_FORMAT_MAXIMUM_OPS)
+            goto fail1;
+
+        Format = __StringParse(Format, &Compiled->Op[Compiled->Count++]);
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    Compiled->Count = 0;
+
+    return status;
+}
+
+NTSTATUS
+StringFormatVPrintf(
+    IN  PSTRING                     String,
+    IN  const XENHID_STRING_FORMAT  *Compiled,
+    IN  va_list                     Arguments
+    )
+{
+    NTSTATUS                        status;
+
+    status = StringWriteCompiled(String,
+                                 Compiled,
+                                 Arguments);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = __StringPut(String, '\0');
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    // Length should not include the NUL terminator
+    --String->Length;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+NTSTATUS
+StringFormatPrintf(
+    IN  PSTRING                     String,
+    IN  const XENHID_STRING_FORMAT  *Compiled,
+    ...
+    )
+{
+    va_list                         Arguments;
+    NTSTATUS                        status;
+
+    va_start(Arguments, Compiled);
+    status = StringFormatVPrintf(String, Compiled, Arguments);
+    va_end(Arguments);
+
+    return status;
+}
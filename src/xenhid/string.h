@@ -35,6 +35,9 @@
 
 #include <ntddk.h>
 
+// If String->Buffer is NULL then nothing is written and, on success,
+// String->Length is set to the length the output would have (not
+// including the NUL terminator).
 extern NTSTATUS
 StringVPrintf(
     IN  PSTRING     String,
@@ -49,4 +52,45 @@ StringPrintf(
     ...
     );
 
+// A format string parsed once by StringFormatCompile() so that it can
+// be used repeatedly without being re-parsed. Literal runs refer back
+// into the original format string, which must therefore outlive it.
+typedef struct _XENHID_STRING_FORMAT_OP {
+    const CHAR  *Literal;
+    ULONG       Length;
+    CHAR        Conversion; // '\0' for a literal run
+    UCHAR       Pad;
+    UCHAR       Long;
+    BOOLEAN     Wide;
+    BOOLEAN     ZeroPrefix;
+    BOOLEAN     OppositeJustification;
+} XENHID_STRING_FORMAT_OP, *PXENHID_STRING_FORMAT_OP;
+
+#define STRING_FORMAT_MAXIMUM_OPS   16
+
+typedef struct _XENHID_STRING_FORMAT {
+    ULONG                   Count;
+    XENHID_STRING_FORMAT_OP Op[STRING_FORMAT_MAXIMUM_OPS];
+} XENHID_STRING_FORMAT, *PXENHID_STRING_FORMAT;
+
+extern NTSTATUS
+StringFormatCompile(
+    OUT PXENHID_STRING_FORMAT   Compiled,
+    IN  const CHAR              *Format
+    );
+
+extern NTSTATUS
+StringFormatVPrintf(
+    IN  PSTRING                     String,
+    IN  const XENHID_STRING_FORMAT  *Compiled,
+    IN  va_list                     Arguments
+    );
+
+extern NTSTATUS
+StringFormatPrintf(
+    IN  PSTRING                     String,
+    IN  const XENHID_STRING_FORMAT  *Compiled,
+    ...
+    );
+
 #endif  // _XENHID_STRING_H
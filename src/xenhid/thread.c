@@ -31,8 +31,11 @@
  */
 
 #include <ntddk.h>
+#include <procgrp.h>
 
 #include "thread.h"
+#include "ring.h"
+#include "pool.h"
 #include "util.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -43,9 +46,22 @@ struct _XENHID_THREAD {
     XENHID_THREAD_FUNCTION  Function;
     PVOID                   Context;
     KEVENT                  Event;
+    LONG                    Pending;
     BOOLEAN                 Alerted;
+    KTIMER                  Timer;
+    KSPIN_LOCK              TimerLock;
+    PXENHID_THREAD_TIMER    TimerHeap[THREAD_TIMER_MAXIMUM];
+    ULONG                   TimerCount;
     LONG                    References;
     PKTHREAD                Thread;
+    LONGLONG                Frequency;
+    LONGLONG                WakeTime;
+    LONGLONG                RunTime;
+    LONGLONG                Wakes;
+    LONGLONG                SpuriousWakes;
+    LONGLONG                BusyTime;
+    LONGLONG                BusyTimeMaximum;
+    LONGLONG                WakeToRunTime;
 };
 
 static FORCEINLINE PVOID
@@ -53,7 +69,7 @@ __ThreadAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocatePoolWithTag(NonPagedPool, Length, THREAD_POOL);
+    return PoolAllocate(Length, THREAD_POOL);
 }
 
 static FORCEINLINE VOID
@@ -61,17 +77,46 @@ __ThreadFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, THREAD_POOL);
+    PoolFree(Buffer, THREAD_POOL);
 }
 
+// Wake-ups are coalesced: only the producer that moves Pending from 0
+// to 1 signals the event. ThreadWait() clears the event before Pending,
+// and the thread then looks for work, so anything published before a
+// wake that found Pending already set is still seen.
 static FORCEINLINE VOID
-__ThreadWake(
+__ThreadSignal(
     IN  PXENHID_THREAD  Thread
     )
 {
+    // Only the first wake after the thread last ran is timed. This is
+    // in the waker's path (which may be the backend's report callback),
+    // so interrupt time is used: reading it is only a memory read,
+    // whereas the performance counter may be emulated. It only moves
+    // once per clock tick, but where a wake falls within a tick is
+    // random, so the total over many wakes is still a fair measure.
+    (VOID) InterlockedCompareExchange64(&Thread->WakeTime,
+                                        (LONGLONG)KeQueryInterruptTime(),
+                                        0);
+
     KeSetEvent(&Thread->Event, IO_NO_INCREMENT, FALSE);
 }
 
+static FORCEINLINE VOID
+__ThreadWake(
+    IN  PXENHID_THREAD  Thread
+    )
+{
+    LONG                Pending;
+
+    Pending = InterlockedExchange(&Thread->Pending, 1);
+
+    RingRecord(RING_EVENT_THREAD_WAKE, NULL, (ULONG_PTR)Thread, Pending);
+
+    if (Pending == 0)
+        __ThreadSignal(Thread);
+}
+
 VOID
 ThreadWake(
     IN  PXENHID_THREAD  Thread
@@ -85,8 +130,19 @@ __ThreadAlert(
     IN  PXENHID_THREAD  Thread
     )
 {
+    KIRQL               Irql;
+
+    RingRecord(RING_EVENT_THREAD_ALERT, NULL, (ULONG_PTR)Thread, 0);
+
+    // Take the timer lock so that no timer can be set, or run, once
+    // the alert is visible
+    KeAcquireSpinLock(&Thread->TimerLock, &Irql);
     Thread->Alerted = TRUE;
-    __ThreadWake(Thread);
+    KeReleaseSpinLock(&Thread->TimerLock, Irql);
+
+    // An alert always signals, whatever the state of Pending
+    (VOID) InterlockedExchange(&Thread->Pending, 1);
+    __ThreadSignal(Thread);
 }
 
 VOID
@@ -109,6 +165,8 @@ ThreadFunction(
 
     status = Self->Function(Self, Self->Context);
 
+    RingRecord(RING_EVENT_THREAD_EXIT, NULL, (ULONG_PTR)Self, (ULONG_PTR)status);
+
     if (InterlockedDecrement(&Self->References) == 0)
         __ThreadFree(Self);
 
@@ -139,10 +197,15 @@ ThreadCreate(
 
     (*Thread)->Function = Function;
     (*Thread)->Context = Context;
+    (*Thread)->Pending = 0;
     (*Thread)->Alerted = FALSE;
     (*Thread)->References = 2; // One for us, one for the thread function
 
+    (VOID) KeQueryPerformanceCounter((PLARGE_INTEGER)&(*Thread)->Frequency);
+
     KeInitializeEvent(&(*Thread)->Event, NotificationEvent, FALSE);
+    KeInitializeTimerEx(&(*Thread)->Timer, SynchronizationTimer);
+    KeInitializeSpinLock(&(*Thread)->TimerLock);
 
     status = PsCreateSystemThread(&Handle,
                                   STANDARD_RIGHTS_ALL | SPECIFIC_RIGHTS_ALL,
@@ -205,6 +268,388 @@ ThreadIsAlerted(
     return Thread->Alerted;
 }
 
+// Timers. Pending timers are kept in a binary min-heap ordered by
+// deadline (in interrupt time) and a single coalescable KTIMER is armed
+// for the earliest of them. Expired timers are run by the thread itself,
+// from within ThreadWait(), so their functions are called at
+// PASSIVE_LEVEL and never concurrently with the thread's own work.
+
+#define THREAD_TIMER_INVALID    MAXULONG
+
+static FORCEINLINE VOID
+__ThreadTimerSwap(
+    IN  PXENHID_THREAD  Thread,
+    IN  ULONG           Index1,
+    IN  ULONG           Index2
+    )
+{
+    PXENHID_THREAD_TIMER    Timer;
+
+    Timer = Thread->TimerHeap[Index1];
+    Thread->TimerHeap[Index1] = Thread->TimerHeap[Index2];
+    Thread->TimerHeap[Index2] = Timer;
+
+    Thread->TimerHeap[Index1]->Index = Index1;
+    Thread->TimerHeap[Index2]->Index = Index2;
+}
+
+static VOID
+__ThreadTimerSiftUp(
+    IN  PXENHID_THREAD  Thread,
+    IN  ULONG           Index
+    )
+{
+    while (Index != 0) {
+        ULONG   Parent = (Index - 1) / 2;
+
+        if (Thread->TimerHeap[Parent]->Deadline <=
+            Thread->TimerHeap[Index]->Deadline)
+            break;
+
+        __ThreadTimerSwap(Thread, Parent, Index);
+        Index = Parent;
+    }
+}
+
+static VOID
+__ThreadTimerSiftDown(
+    IN  PXENHID_THREAD  Thread,
+    IN  ULONG           Index
+    )
+{
+    for (;;) {
+        ULONG   Left = (Index * 2) + 1;
+        ULONG   Right = Left + 1;
+        ULONG   Smallest = Index;
+
+        if (Left < Thread->TimerCount &&
+            Thread->TimerHeap[Left]->Deadline <
+            Thread->TimerHeap[Smallest]->Deadline)
+            Smallest = Left;
+
+        if (Right < Thread->TimerCount &&
+            Thread->TimerHeap[Right]->Deadline <
+            Thread->TimerHeap[Smallest]->Deadline)
+            Smallest = Right;
+
+        if (Smallest == Index)
+            break;
+
+        __ThreadTimerSwap(Thread, Index, Smallest);
+        Index = Smallest;
+    }
+}
+
+static VOID
+__ThreadTimerInsert(
+    IN  PXENHID_THREAD          Thread,
+    IN  PXENHID_THREAD_TIMER    Timer
+    )
+{
+    ULONG                       Index;
+
+    ASSERT3U(Thread->TimerCount, <, THREAD_TIMER_MAXIMUM);
+
+    Index = Thread->TimerCount++;
+
+    Thread->TimerHeap[Index] = Timer;
+    Timer->Index = Index;
+
+    __ThreadTimerSiftUp(Thread, Index);
+}
+
+static VOID
+__ThreadTimerRemove(
+    IN  PXENHID_THREAD          Thread,
+    IN  PXENHID_THREAD_TIMER    Timer
+    )
+{
+    ULONG                       Index = Timer->Index;
+    ULONG                       Last;
+
+    ASSERT3U(Index, <, Thread->TimerCount);
+    ASSERT3P(Thread->TimerHeap[Index], ==, Timer);
+
+    Last = --Thread->TimerCount;
+    if (Index != Last) {
+        __ThreadTimerSwap(Thread, Index, Last);
+
+        __ThreadTimerSiftDown(Thread, Index);
+        __ThreadTimerSiftUp(Thread, Index);
+    }
+
+    Thread->TimerHeap[Last] = NULL;
+    Timer->Index = THREAD_TIMER_INVALID;
+}
+
+static VOID
+__ThreadTimerArm(
+    IN  PXENHID_THREAD      Thread
+    )
+{
+    PXENHID_THREAD_TIMER    Timer;
+    ULONGLONG               Now;
+    LARGE_INTEGER           DueTime;
+
+    if (Thread->TimerCount == 0) {
+        (VOID) KeCancelTimer(&Thread->Timer);
+        return;
+    }
+
+    Timer = Thread->TimerHeap[0];
+    Now = KeQueryInterruptTime();
+
+    DueTime.QuadPart = (Timer->Deadline > Now) ?
+                       TIME_RELATIVE((LONGLONG)(Timer->Deadline - Now)) :
+                       TIME_RELATIVE(1);
+
+    (VOID) KeSetCoalescableTimer(&Thread->Timer,
+                                 DueTime,
+                                 0,
+                                 Timer->Tolerance,
+                                 NULL);
+}
+
+static VOID
+__ThreadRunTimers(
+    IN  PXENHID_THREAD  Self
+    )
+{
+    for (;;) {
+        PXENHID_THREAD_TIMER    Timer;
+        XENHID_TIMER_FUNCTION   Function;
+        PVOID                   Context;
+        ULONGLONG               Now;
+        KIRQL                   Irql;
+
+        KeAcquireSpinLock(&Self->TimerLock, &Irql);
+
+        Now = KeQueryInterruptTime();
+
+        if (Self->Alerted ||
+            Self->TimerCount == 0 ||
+            Self->TimerHeap[0]->Deadline > Now) {
+            __ThreadTimerArm(Self);
+            KeReleaseSpinLock(&Self->TimerLock, Irql);
+            break;
+        }
+
+        Timer = Self->TimerHeap[0];
+        __ThreadTimerRemove(Self, Timer);
+
+        if (Timer->Period != 0) {
+            // Don't try to catch up on periods that were missed
+            Timer->Deadline += Timer->Period;
+            if (Timer->Deadline <= Now)
+                Timer->Deadline = Now + Timer->Period;
+
+            __ThreadTimerInsert(Self, Timer);
+        }
+
+        Function = Timer->Function;
+        Context = Timer->Context;
+
+        KeReleaseSpinLock(&Self->TimerLock, Irql);
+
+        Function(Context);
+    }
+}
+
+VOID
+ThreadTimerInitialize(
+    IN  PXENHID_THREAD_TIMER    Timer,
+    IN  XENHID_TIMER_FUNCTION   Function,
+    IN  PVOID                   Context
+    )
+{
+    RtlZeroMemory(Timer, sizeof (XENHID_THREAD_TIMER));
+
+    Timer->Function = Function;
+    Timer->Context = Context;
+    Timer->Index = THREAD_TIMER_INVALID;
+}
+
+NTSTATUS
+ThreadTimerSet(
+    IN  PXENHID_THREAD          Thread,
+    IN  PXENHID_THREAD_TIMER    Timer,
+    IN  ULONG                   DueTime,
+    IN  ULONG                   Period,
+    IN  ULONG                   Tolerance
+    )
+{
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    KeAcquireSpinLock(&Thread->TimerLock, &Irql);
+
+    status = STATUS_CANCELLED;
+    if (Thread->Alerted)
+        goto done;
+
+    if (Timer->Index != THREAD_TIMER_INVALID)
+        __ThreadTimerRemove(Thread, Timer);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Thread->TimerCount == THREAD_TIMER_MAXIMUM)
+        goto done;
+
+    Timer->Deadline = KeQueryInterruptTime() + TIME_MS((ULONGLONG)DueTime);
+    Timer->Period = TIME_MS((ULONGLONG)Period);
+    Timer->Tolerance = Tolerance;
+
+    __ThreadTimerInsert(Thread, Timer);
+    status = STATUS_SUCCESS;
+
+done:
+    __ThreadTimerArm(Thread);
+
+    KeReleaseSpinLock(&Thread->TimerLock, Irql);
+
+    return status;
+}
+
+BOOLEAN
+ThreadTimerCancel(
+    IN  PXENHID_THREAD          Thread,
+    IN  PXENHID_THREAD_TIMER    Timer
+    )
+{
+    KIRQL                       Irql;
+    BOOLEAN                     Cancelled;
+
+    KeAcquireSpinLock(&Thread->TimerLock, &Irql);
+
+    Cancelled = FALSE;
+    if (Timer->Index != THREAD_TIMER_INVALID) {
+        __ThreadTimerRemove(Thread, Timer);
+        __ThreadTimerArm(Thread);
+        Cancelled = TRUE;
+    }
+
+    KeReleaseSpinLock(&Thread->TimerLock, Irql);
+
+    return Cancelled;
+}
+
+// The counters below are only ever written by the thread itself so the
+// accounting needs no interlocked operations beyond the wake timestamp.
+NTSTATUS
+ThreadWait(
+    IN  PXENHID_THREAD  Self,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    )
+{
+    PVOID               Object[2];
+    ULONGLONG           End;
+    LONGLONG            Now;
+    LONGLONG            WakeTime;
+    NTSTATUS            status;
+
+    if (Self->RunTime != 0) {
+        LONGLONG    Busy;
+
+        Busy = KeQueryPerformanceCounter(NULL).QuadPart - Self->RunTime;
+
+        Self->BusyTime += Busy;
+        if (Busy > Self->BusyTimeMaximum)
+            Self->BusyTimeMaximum = Busy;
+    }
+
+    Object[0] = &Self->Event;
+    Object[1] = &Self->Timer;
+
+    // Expired timers are run without returning to the caller, so a
+    // relative timeout has to be tracked as an absolute deadline
+    End = 0;
+    if (Timeout != NULL && Timeout->QuadPart < 0)
+        End = KeQueryInterruptTime() + (ULONGLONG)(-Timeout->QuadPart);
+
+    for (;;) {
+        PLARGE_INTEGER  Wait = Timeout;
+        LARGE_INTEGER   Remaining;
+
+        if (End != 0) {
+            ULONGLONG   Time = KeQueryInterruptTime();
+
+            Remaining.QuadPart = (Time < End) ?
+                                 TIME_RELATIVE((LONGLONG)(End - Time)) :
+                                 0;
+            Wait = &Remaining;
+        }
+
+        status = KeWaitForMultipleObjects(ARRAYSIZE(Object),
+                                          Object,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          Wait,
+                                          NULL);
+        if (status != STATUS_WAIT_1)
+            break;
+
+        __ThreadRunTimers(Self);
+    }
+
+    KeClearEvent(&Self->Event);
+    (VOID) InterlockedExchange(&Self->Pending, 0);
+
+    Now = KeQueryPerformanceCounter(NULL).QuadPart;
+    Self->RunTime = Now;
+
+    if (status == STATUS_SUCCESS)
+        Self->Wakes++;
+
+    // The event may also be set directly (e.g. by a XenStore watch), in
+    // which case there is no timestamp to measure from
+    WakeTime = InterlockedExchange64(&Self->WakeTime, 0);
+    if (WakeTime != 0)
+        Self->WakeToRunTime += (LONGLONG)KeQueryInterruptTime() - WakeTime;
+
+    return status;
+}
+
+VOID
+ThreadSpuriousWake(
+    IN  PXENHID_THREAD  Self
+    )
+{
+    Self->SpuriousWakes++;
+}
+
+static FORCEINLINE ULONGLONG
+__ThreadTicksToMicroseconds(
+    IN  PXENHID_THREAD  Thread,
+    IN  LONGLONG        Ticks
+    )
+{
+    ULONGLONG           Frequency = (ULONGLONG)Thread->Frequency;
+
+    if (Frequency == 0)
+        return 0;
+
+    // Split the conversion so that it cannot overflow for any
+    // plausible counter frequency
+    return (((ULONGLONG)Ticks / Frequency) * 1000000) +
+           ((((ULONGLONG)Ticks % Frequency) * 1000000) / Frequency);
+}
+
+VOID
+ThreadQueryStatistics(
+    IN  PXENHID_THREAD              Thread,
+    OUT PXENHID_THREAD_STATISTICS   Statistics
+    )
+{
+    Statistics->Wakes = (ULONGLONG)Thread->Wakes;
+    Statistics->SpuriousWakes = (ULONGLONG)Thread->SpuriousWakes;
+    Statistics->BusyTime = __ThreadTicksToMicroseconds(Thread,
+                                                       Thread->BusyTime);
+    Statistics->BusyTimeMaximum = __ThreadTicksToMicroseconds(Thread,
+                                                              Thread->BusyTimeMaximum);
+    Statistics->WakeToRunTime = (ULONGLONG)Thread->WakeToRunTime / TIME_US(1);
+}
+
 VOID
 ThreadJoin(
     IN  PXENHID_THREAD  Thread
@@ -221,8 +666,329 @@ ThreadJoin(
                                  FALSE,
                                  NULL);
 
+    // Drop the reference taken in ThreadCreate()
+    ObDereferenceObject(Thread->Thread);
+    Thread->Thread = NULL;
+
+    Info("%p: wakes %llu spurious %llu busy %llu us (max %llu us) wake-to-run %llu us\n",
+         Thread,
+         (ULONGLONG)Thread->Wakes,
+         (ULONGLONG)Thread->SpuriousWakes,
+         __ThreadTicksToMicroseconds(Thread, Thread->BusyTime),
+         __ThreadTicksToMicroseconds(Thread, Thread->BusyTimeMaximum),
+         (ULONGLONG)Thread->WakeToRunTime / TIME_US(1));
+
+    // The thread is gone so any timers still pending can never run
+    (VOID) KeCancelTimer(&Thread->Timer);
+
+    while (Thread->TimerCount != 0)
+        __ThreadTimerRemove(Thread, Thread->TimerHeap[0]);
+
     References = InterlockedDecrement(&Thread->References);
     ASSERT3U(References, ==, 0);
 
     __ThreadFree(Thread);
 }
+
+// Worker pool. Each worker is an ordinary XENHID_THREAD with its own
+// queue; work is queued to the worker selected by the current processor
+// so that related items tend to stay together, and an idle worker will
+// steal from the tail of its siblings' queues before going back to
+// sleep. If the selected worker is busy then an idle sibling is woken
+// to do so. Workers may optionally be restricted to a processor group
+// and mask, and run at a chosen priority.
+
+typedef struct _THREAD_POOL_WORKER {
+    PXENHID_THREAD_POOL Pool;
+    ULONG               Index;
+    KSPIN_LOCK          Lock;
+    LIST_ENTRY          List;
+    LONG                Busy;
+    PXENHID_THREAD      Thread;
+} THREAD_POOL_WORKER, *PTHREAD_POOL_WORKER;
+
+struct _XENHID_THREAD_POOL {
+    ULONG               Count;
+    GROUP_AFFINITY      Affinity;
+    KPRIORITY           Priority;
+    EX_RUNDOWN_REF      Rundown;
+    THREAD_POOL_WORKER  Worker[THREAD_POOL_MAXIMUM_WORKERS];
+};
+
+VOID
+ThreadWorkItemInitialize(
+    IN  PXENHID_WORK_ITEM       Item,
+    IN  XENHID_WORK_FUNCTION    Function,
+    IN  PVOID                   Context
+    )
+{
+    RtlZeroMemory(Item, sizeof (XENHID_WORK_ITEM));
+
+    Item->Function = Function;
+    Item->Context = Context;
+}
+
+static PXENHID_WORK_ITEM
+__ThreadPoolDequeue(
+    IN  PTHREAD_POOL_WORKER Worker,
+    IN  BOOLEAN             Steal
+    )
+{
+    PLIST_ENTRY             ListEntry;
+    KIRQL                   Irql;
+
+    KeAcquireSpinLock(&Worker->Lock, &Irql);
+
+    ListEntry = NULL;
+    if (!IsListEmpty(&Worker->List))
+        ListEntry = (Steal) ?
+                    RemoveTailList(&Worker->List) :
+                    RemoveHeadList(&Worker->List);
+
+    KeReleaseSpinLock(&Worker->Lock, Irql);
+
+    if (ListEntry == NULL)
+        return NULL;
+
+    return CONTAINING_RECORD(ListEntry, XENHID_WORK_ITEM, ListEntry);
+}
+
+static PXENHID_WORK_ITEM
+__ThreadPoolSteal(
+    IN  PTHREAD_POOL_WORKER Worker
+    )
+{
+    PXENHID_THREAD_POOL     Pool = Worker->Pool;
+    ULONG                   Offset;
+
+    for (Offset = 1; Offset < Pool->Count; Offset++) {
+        PTHREAD_POOL_WORKER Victim;
+        PXENHID_WORK_ITEM   Item;
+
+        Victim = &Pool->Worker[(Worker->Index + Offset) % Pool->Count];
+
+        Item = __ThreadPoolDequeue(Victim, TRUE);
+        if (Item != NULL)
+            return Item;
+    }
+
+    return NULL;
+}
+
+static FORCEINLINE VOID
+__ThreadPoolRun(
+    IN  PXENHID_WORK_ITEM   Item
+    )
+{
+    // Clear Queued first so that the function may re-queue the item
+    (VOID) InterlockedExchange(&Item->Queued, 0);
+
+    Item->Function(Item->Context);
+}
+
+static NTSTATUS
+ThreadPoolWorker(
+    IN  PXENHID_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PTHREAD_POOL_WORKER Worker = Context;
+    PXENHID_THREAD_POOL Pool = Worker->Pool;
+
+    if (Pool->Affinity.Mask != 0) {
+        GROUP_AFFINITY  Previous;
+
+        KeSetSystemGroupAffinityThread(&Pool->Affinity, &Previous);
+    }
+
+    (VOID) KeSetPriorityThread(KeGetCurrentThread(), Pool->Priority);
+
+    for (;;) {
+        PXENHID_WORK_ITEM   Item;
+        BOOLEAN             Alerted;
+
+        (VOID) ThreadWait(Self, NULL);
+
+        // Sample the alert before draining so that nothing queued
+        // before ThreadPoolDestroy() is left behind
+        Alerted = ThreadIsAlerted(Self);
+
+        (VOID) InterlockedExchange(&Worker->Busy, 1);
+
+        Item = __ThreadPoolDequeue(Worker, FALSE);
+        if (Item == NULL)
+            Item = __ThreadPoolSteal(Worker);
+
+        if (Item == NULL && !Alerted)
+            ThreadSpuriousWake(Self);
+
+        while (Item != NULL) {
+            __ThreadPoolRun(Item);
+
+            Item = __ThreadPoolDequeue(Worker, FALSE);
+            if (Item == NULL)
+                Item = __ThreadPoolSteal(Worker);
+        }
+
+        // Anything queued to this worker from now on will wake it
+        (VOID) InterlockedExchange(&Worker->Busy, 0);
+
+        if (Alerted)
+            break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+ThreadPoolQueue(
+    IN  PXENHID_THREAD_POOL Pool,
+    IN  PXENHID_WORK_ITEM   Item
+    )
+{
+    PTHREAD_POOL_WORKER     Worker;
+    ULONG                   Index;
+    ULONG                   Offset;
+    BOOLEAN                 Queued;
+    KIRQL                   Irql;
+
+    // Nothing is accepted once ThreadPoolDestroy() has started, since
+    // the workers may already have drained their queues for the last
+    // time
+    if (!ExAcquireRundownProtection(&Pool->Rundown))
+        return FALSE;
+
+    Queued = FALSE;
+    if (InterlockedCompareExchange(&Item->Queued, 1, 0) != 0)
+        goto done;
+
+    Index = KeGetCurrentProcessorNumberEx(NULL) % Pool->Count;
+    Worker = &Pool->Worker[Index];
+
+    KeAcquireSpinLock(&Worker->Lock, &Irql);
+    InsertTailList(&Worker->List, &Item->ListEntry);
+    KeReleaseSpinLock(&Worker->Lock, Irql);
+
+    ThreadWake(Worker->Thread);
+    Queued = TRUE;
+
+    if (ReadNoFence(&Worker->Busy) == 0)
+        goto done;
+
+    for (Offset = 1; Offset < Pool->Count; Offset++) {
+        PTHREAD_POOL_WORKER Sibling;
+
+        Sibling = &Pool->Worker[(Index + Offset) % Pool->Count];
+        if (ReadNoFence(&Sibling->Busy) == 0) {
+            ThreadWake(Sibling->Thread);
+            break;
+        }
+    }
+
+done:
+    ExReleaseRundownProtection(&Pool->Rundown);
+
+    return Queued;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+ThreadPoolCreate(
+    IN  ULONG               Count,
+    IN  PGROUP_AFFINITY     Affinity OPTIONAL,
+    IN  KPRIORITY           Priority,
+    OUT PXENHID_THREAD_POOL *Pool
+    )
+{
+    ULONG                   Index;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0 || Count > THREAD_POOL_MAXIMUM_WORKERS)
+        goto fail1;
+
+    if (Priority < LOW_PRIORITY + 1 || Priority > HIGH_PRIORITY)
+        goto fail1;
+
+    *Pool = __ThreadAllocate(sizeof (XENHID_THREAD_POOL));
+
+    status = STATUS_NO_MEMORY;
+    if (*Pool == NULL)
+        goto fail2;
+
+    (*Pool)->Count = Count;
+    (*Pool)->Priority = Priority;
+    ExInitializeRundownProtection(&(*Pool)->Rundown);
+    if (Affinity != NULL)
+        (*Pool)->Affinity = *Affinity;
+
+    for (Index = 0; Index < Count; Index++) {
+        PTHREAD_POOL_WORKER Worker = &(*Pool)->Worker[Index];
+
+        Worker->Pool = *Pool;
+        Worker->Index = Index;
+        KeInitializeSpinLock(&Worker->Lock);
+        InitializeListHead(&Worker->List);
+
+        status = ThreadCreate(ThreadPoolWorker, Worker, &Worker->Thread);
+        if (!NT_SUCCESS(status))
+            goto fail3;
+    }
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    while (Index != 0) {
+        PTHREAD_POOL_WORKER Worker = &(*Pool)->Worker[--Index];
+
+        ThreadAlert(Worker->Thread);
+        ThreadJoin(Worker->Thread);
+    }
+
+    __ThreadFree(*Pool);
+
+fail2:
+    Error("fail2\n");
+
+    *Pool = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+VOID
+ThreadPoolDestroy(
+    IN  PXENHID_THREAD_POOL Pool
+    )
+{
+    ULONG                   Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    // Refuse new work, and wait for any ThreadPoolQueue() that has
+    // already been admitted to finish
+    ExWaitForRundownProtectionRelease(&Pool->Rundown);
+
+    // Each worker drains what it can see before it exits, so stop
+    // them all before joining any of them
+    for (Index = 0; Index < Pool->Count; Index++)
+        ThreadAlert(Pool->Worker[Index].Thread);
+
+    for (Index = 0; Index < Pool->Count; Index++) {
+        PTHREAD_POOL_WORKER Worker = &Pool->Worker[Index];
+
+        ThreadJoin(Worker->Thread);
+        Worker->Thread = NULL;
+
+        ASSERT(IsListEmpty(&Worker->List));
+    }
+
+    __ThreadFree(Pool);
+}
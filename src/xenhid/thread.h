@@ -39,6 +39,22 @@ typedef struct _XENHID_THREAD XENHID_THREAD, *PXENHID_THREAD;
 
 typedef NTSTATUS (*XENHID_THREAD_FUNCTION)(PXENHID_THREAD, PVOID);
 
+typedef VOID (*XENHID_TIMER_FUNCTION)(PVOID);
+
+// A timer is owned by the caller and must remain valid until it has
+// been cancelled, or the thread it was set on has been joined. Its
+// function runs on that thread, from within ThreadWait().
+typedef struct _XENHID_THREAD_TIMER {
+    XENHID_TIMER_FUNCTION   Function;
+    PVOID                   Context;
+    ULONGLONG               Deadline;
+    ULONGLONG               Period;
+    ULONG                   Tolerance;
+    ULONG                   Index;
+} XENHID_THREAD_TIMER, *PXENHID_THREAD_TIMER;
+
+#define THREAD_TIMER_MAXIMUM    32
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 extern NTSTATUS
 ThreadCreate(
@@ -57,6 +73,33 @@ ThreadIsAlerted(
     IN  PXENHID_THREAD  Self
     );
 
+extern NTSTATUS
+ThreadWait(
+    IN  PXENHID_THREAD  Self,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    );
+
+extern VOID
+ThreadSpuriousWake(
+    IN  PXENHID_THREAD  Self
+    );
+
+// Times are in microseconds. WakeToRunTime is measured with interrupt
+// time, so is only meaningful as a total over many wakes.
+typedef struct _XENHID_THREAD_STATISTICS {
+    ULONGLONG   Wakes;
+    ULONGLONG   SpuriousWakes;
+    ULONGLONG   BusyTime;
+    ULONGLONG   BusyTimeMaximum;
+    ULONGLONG   WakeToRunTime;
+} XENHID_THREAD_STATISTICS, *PXENHID_THREAD_STATISTICS;
+
+extern VOID
+ThreadQueryStatistics(
+    IN  PXENHID_THREAD              Thread,
+    OUT PXENHID_THREAD_STATISTICS   Statistics
+    );
+
 extern VOID
 ThreadWake(
     IN  PXENHID_THREAD  Thread
@@ -67,9 +110,79 @@ ThreadAlert(
     IN  PXENHID_THREAD  Thread
     );
 
+extern VOID
+ThreadTimerInitialize(
+    IN  PXENHID_THREAD_TIMER    Timer,
+    IN  XENHID_TIMER_FUNCTION   Function,
+    IN  PVOID                   Context
+    );
+
+// DueTime, Period and Tolerance are in milliseconds. A Period of zero
+// gives a one-shot timer. Setting a timer that is already pending
+// moves it.
+extern NTSTATUS
+ThreadTimerSet(
+    IN  PXENHID_THREAD          Thread,
+    IN  PXENHID_THREAD_TIMER    Timer,
+    IN  ULONG                   DueTime,
+    IN  ULONG                   Period,
+    IN  ULONG                   Tolerance
+    );
+
+extern BOOLEAN
+ThreadTimerCancel(
+    IN  PXENHID_THREAD          Thread,
+    IN  PXENHID_THREAD_TIMER    Timer
+    );
+
 extern VOID
 ThreadJoin(
     IN  PXENHID_THREAD  Thread
     );
 
+typedef struct _XENHID_THREAD_POOL XENHID_THREAD_POOL, *PXENHID_THREAD_POOL;
+
+typedef VOID (*XENHID_WORK_FUNCTION)(PVOID);
+
+// A work item is owned by the caller and must remain valid until its
+// function has started to run. It may be re-queued from that function.
+typedef struct _XENHID_WORK_ITEM {
+    LIST_ENTRY              ListEntry;
+    XENHID_WORK_FUNCTION    Function;
+    PVOID                   Context;
+    LONG                    Queued;
+} XENHID_WORK_ITEM, *PXENHID_WORK_ITEM;
+
+#define THREAD_POOL_MAXIMUM_WORKERS 16
+
+extern VOID
+ThreadWorkItemInitialize(
+    IN  PXENHID_WORK_ITEM       Item,
+    IN  XENHID_WORK_FUNCTION    Function,
+    IN  PVOID                   Context
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern NTSTATUS
+ThreadPoolCreate(
+    IN  ULONG               Count,
+    IN  PGROUP_AFFINITY     Affinity OPTIONAL,
+    IN  KPRIORITY           Priority,
+    OUT PXENHID_THREAD_POOL *Pool
+    );
+
+// Returns FALSE if the item was already queued, or if the pool is being
+// destroyed
+extern BOOLEAN
+ThreadPoolQueue(
+    IN  PXENHID_THREAD_POOL Pool,
+    IN  PXENHID_WORK_ITEM   Item
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+extern VOID
+ThreadPoolDestroy(
+    IN  PXENHID_THREAD_POOL Pool
+    );
+
 #endif  // _XENHID_THREAD_H
@@ -41,40 +41,69 @@
 #define	P2ROUNDUP(_x, _a)   \
         (-(-(_x) & -(_a)))
 
+#define TIME_US(_us)        ((_us) * 10)
+#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
+#define TIME_S(_s)          (TIME_MS((_s) * 1000))
+#define TIME_RELATIVE(_t)   (-(_t))
+
 static FORCEINLINE LONG
 __ffs(
     IN  unsigned long long  mask
     )
 {
-    unsigned char           *array = (unsigned char *)&mask;
-    unsigned int            byte;
-    unsigned int            bit;
-    unsigned char           val;
+    unsigned long           bit;
 
-    val = 0;
+#if defined(_WIN64)
+    if (!_BitScanForward64(&bit, mask))
+        return -1;
 
-    byte = 0;
-    while (byte < 8) {
-        val = array[byte];
+    return (LONG)bit;
+#else
+    if (_BitScanForward(&bit, (unsigned long)mask))
+        return (LONG)bit;
 
-        if (val != 0)
-            break;
+    if (_BitScanForward(&bit, (unsigned long)(mask >> 32)))
+        return (LONG)bit + 32;
 
-        byte++;
-    }
-    if (byte == 8)
+    return -1;
+#endif
+}
+
+static FORCEINLINE LONG
+__fls(
+    IN  unsigned long long  mask
+    )
+{
+    unsigned long           bit;
+
+#if defined(_WIN64)
+    if (!_BitScanReverse64(&bit, mask))
         return -1;
 
-    bit = 0;
-    while (bit < 8) {
-        if (val & 0x01)
-            break;
+    return (LONG)bit;
+#else
+    if (_BitScanReverse(&bit, (unsigned long)(mask >> 32)))
+        return (LONG)bit + 32;
 
-        val >>= 1;
-        bit++;
-    }
+    if (_BitScanReverse(&bit, (unsigned long)mask))
+        return (LONG)bit;
 
-    return (byte * 8) + bit;
+    return -1;
+#endif
+}
+
+// The POPCNT instruction cannot be assumed to be present so count the
+// bits in parallel instead
+static FORCEINLINE ULONG
+__popcount(
+    IN  unsigned long long  mask
+    )
+{
+    mask = mask - ((mask >> 1) & 0x5555555555555555ull);
+    mask = (mask & 0x3333333333333333ull) + ((mask >> 2) & 0x3333333333333333ull);
+    mask = (mask + (mask >> 4)) & 0x0f0f0f0f0f0f0f0full;
+
+    return (ULONG)((mask * 0x0101010101010101ull) >> 56);
 }
 
 #define __ffu(_mask)  \
@@ -106,21 +135,15 @@ __CpuId(
         *EDX = (ULONG)Value[3];
 }
 
+// The following all return the new value
+
 static FORCEINLINE LONG
 __InterlockedAdd(
     IN  LONG    *Value,
     IN  LONG    Delta
     )
 {
-    LONG        New;
-    LONG        Old;
-
-    do {
-        Old = *Value;
-        New = Old + Delta;
-    } while (InterlockedCompareExchange(Value, New, Old) != Old);
-
-    return New;
+    return InterlockedExchangeAdd(Value, Delta) + Delta;
 }
 
 static FORCEINLINE LONG
@@ -129,15 +152,25 @@ __InterlockedSubtract(
     IN  LONG    Delta
     )
 {
-    LONG        New;
-    LONG        Old;
+    return InterlockedExchangeAdd(Value, -Delta) - Delta;
+}
 
-    do {
-        Old = *Value;
-        New = Old - Delta;
-    } while (InterlockedCompareExchange(Value, New, Old) != Old);
+static FORCEINLINE LONG
+__InterlockedOr(
+    IN  LONG    *Value,
+    IN  LONG    Mask
+    )
+{
+    return InterlockedOr(Value, Mask) | Mask;
+}
 
-    return New;
+static FORCEINLINE LONG
+__InterlockedAnd(
+    IN  LONG    *Value,
+    IN  LONG    Mask
+    )
+{
+    return InterlockedAnd(Value, Mask) & Mask;
 }
 
 __checkReturn
@@ -265,6 +298,32 @@ __FreePages(
 
 #define __FreePage(_Mdl)    __FreePages(_Mdl)
 
+// The tokenizers below build a 256-bit map of the delimiter set once per
+// call, rather than searching the set for every input character. Bit 0
+// (NUL) is never set by the delimiter set itself; it is added once the
+// leading delimiters have been skipped so that the end of the token and
+// the end of the string are found with a single test.
+
+#define DELIMITER_MAP_SIZE  (256 / (sizeof (ULONG) * 8))
+
+static FORCEINLINE VOID
+__DelimiterMapSet(
+    IN  PULONG  Map,
+    IN  UCHAR   Character
+    )
+{
+    Map[Character >> 5] |= 1ul << (Character & 31);
+}
+
+static FORCEINLINE BOOLEAN
+__DelimiterMapTest(
+    IN  const ULONG *Map,
+    IN  UCHAR       Character
+    )
+{
+    return (Map[Character >> 5] & (1ul << (Character & 31))) ? TRUE : FALSE;
+}
+
 static FORCEINLINE PCHAR
 __strtok_r(
     IN      PCHAR   Buffer,
@@ -272,6 +331,7 @@ __strtok_r(
     IN OUT  PCHAR   *Context
     )
 {
+    ULONG           Map[DELIMITER_MAP_SIZE] = {0};
     PCHAR           Token;
     PCHAR           End;
 
@@ -283,16 +343,20 @@ __strtok_r(
     if (Token == NULL)
         return NULL;
 
+    while (*Delimiter != '\0')
+        __DelimiterMapSet(Map, (UCHAR)*Delimiter++);
+
     while (*Token != '\0' &&
-           strchr(Delimiter, *Token) != NULL)
+           __DelimiterMapTest(Map, (UCHAR)*Token))
         Token++;
 
     if (*Token == '\0')
         return NULL;
 
+    __DelimiterMapSet(Map, '\0');
+
     End = Token + 1;
-    while (*End != '\0' &&
-           strchr(Delimiter, *End) == NULL)
+    while (!__DelimiterMapTest(Map, (UCHAR)*End))
         End++;
 
     if (*End != '\0')
@@ -303,6 +367,22 @@ __strtok_r(
     return Token;
 }
 
+// Wide characters outside the map are only looked up in the delimiter
+// set if it actually contains any
+static FORCEINLINE BOOLEAN
+__wcsdelim(
+    IN  const ULONG *Map,
+    IN  BOOLEAN     Wide,
+    IN  PWCHAR      Delimiter,
+    IN  WCHAR       Character
+    )
+{
+    if (Character < 256)
+        return __DelimiterMapTest(Map, (UCHAR)Character);
+
+    return (Wide && wcschr(Delimiter, Character) != NULL) ? TRUE : FALSE;
+}
+
 static FORCEINLINE PWCHAR
 __wcstok_r(
     IN      PWCHAR  Buffer,
@@ -310,6 +390,9 @@ __wcstok_r(
     IN OUT  PWCHAR  *Context
     )
 {
+    ULONG           Map[DELIMITER_MAP_SIZE] = {0};
+    BOOLEAN         Wide;
+    PWCHAR          Character;
     PWCHAR          Token;
     PWCHAR          End;
 
@@ -321,16 +404,25 @@ __wcstok_r(
     if (Token == NULL)
         return NULL;
 
+    Wide = FALSE;
+    for (Character = Delimiter; *Character != L'\0'; Character++) {
+        if (*Character < 256)
+            __DelimiterMapSet(Map, (UCHAR)*Character);
+        else
+            Wide = TRUE;
+    }
+
     while (*Token != L'\0' &&
-           wcschr(Delimiter, *Token) != NULL)
+           __wcsdelim(Map, Wide, Delimiter, *Token))
         Token++;
 
     if (*Token == L'\0')
         return NULL;
 
+    __DelimiterMapSet(Map, '\0');
+
     End = Token + 1;
-    while (*End != L'\0' &&
-           wcschr(Delimiter, *End) == NULL)
+    while (!__wcsdelim(Map, Wide, Delimiter, *End))
         End++;
 
     if (*End != L'\0')
@@ -341,6 +433,88 @@ __wcstok_r(
     return Token;
 }
 
+// Count the strings in a double NUL terminated list. An empty list
+// (a single pair of NULs) counts as one empty string.
+static FORCEINLINE ULONG
+__MultiSzCount(
+    IN  const CHAR  *Buffer
+    )
+{
+    ULONG           Index;
+    ULONG           Count;
+
+    Index = 0;
+    Count = 0;
+    for (;;) {
+        if (Buffer[Index] == '\0') {
+            Count++;
+            Index++;
+
+            // Check for double NUL
+            if (Buffer[Index] == '\0')
+                break;
+        }
+        else {
+            Index++;
+        }
+    }
+
+    return Count;
+}
+
+// Point each of the Count entries of Ansi at the corresponding string
+// in Buffer. Nothing is copied so Buffer must outlive the views.
+static FORCEINLINE VOID
+__MultiSzToViews(
+    IN  PCHAR           Buffer,
+    OUT PANSI_STRING    Ansi,
+    IN  ULONG           Count
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Length;
+
+        Length = (ULONG)strlen(Buffer);
+        Ansi[Index].MaximumLength = (USHORT)(Length + 1);
+        Ansi[Index].Buffer = Buffer;
+        Ansi[Index].Length = (USHORT)Length;
+
+        Buffer += Length + 1;
+    }
+}
+
+// TRUE if Ansi is a canonical decimal number (no sign, no leading
+// zeros) no greater than Maximum, which must be less than 1000
+static FORCEINLINE BOOLEAN
+__IsDecimalIndex(
+    IN  PANSI_STRING    Ansi,
+    IN  ULONG           Maximum
+    )
+{
+    ULONG               Value;
+    USHORT              Index;
+
+    if (Ansi->Length == 0 || Ansi->Length > 3)
+        return FALSE;
+
+    if (Ansi->Length > 1 && Ansi->Buffer[0] == '0')
+        return FALSE;
+
+    Value = 0;
+    for (Index = 0; Index < Ansi->Length; Index++) {
+        CHAR    Character = Ansi->Buffer[Index];
+
+        if (Character < '0' || Character > '9')
+            return FALSE;
+
+        Value = (Value * 10) + (Character - '0');
+    }
+
+    return (Value <= Maximum) ? TRUE : FALSE;
+}
+
 static FORCEINLINE CHAR
 __toupper(
     IN  CHAR    Character
@@ -363,4 +537,93 @@ __tolower(
     return 'a' + Character - 'A';
 }
 
+// A window over the SEQUENCE_WINDOW_SIZE sequence numbers below Next.
+// Bit N of Missing is set if Next - 1 - N was skipped and has not
+// turned up since, so a report offered late can be told apart from one
+// offered again: only the former fills a gap. Anything older than the
+// window is treated as a repeat.
+
+#define SEQUENCE_WINDOW_SIZE    (sizeof (ULONG64) * 8)
+
+typedef struct _SEQUENCE_WINDOW {
+    ULONG   Next;
+    ULONG64 Missing;
+} SEQUENCE_WINDOW, *PSEQUENCE_WINDOW;
+
+typedef enum _SEQUENCE_OFFER {
+    SEQUENCE_OFFER_NEXT,
+    SEQUENCE_OFFER_LATE,
+    SEQUENCE_OFFER_REPEAT
+} SEQUENCE_OFFER, *PSEQUENCE_OFFER;
+
+static FORCEINLINE VOID
+__SequenceWindowInitialize(
+    OUT PSEQUENCE_WINDOW    Window,
+    IN  ULONG               Sequence
+    )
+{
+    Window->Next = Sequence;
+    Window->Missing = 0;
+}
+
+// Classify Sequence. If it is ahead of Next then everything in between
+// is marked missing, and its count returned in Skipped, so that Next
+// is then the sequence offered.
+static FORCEINLINE SEQUENCE_OFFER
+__SequenceWindowOffer(
+    IN OUT  PSEQUENCE_WINDOW    Window,
+    IN      ULONG               Sequence,
+    OUT     PULONG              Skipped
+    )
+{
+    LONG                        Delta;
+    ULONG                       Offset;
+
+    *Skipped = 0;
+
+    Delta = (LONG)(Sequence - Window->Next);
+    if (Delta > 0) {
+        if ((ULONG)Delta >= SEQUENCE_WINDOW_SIZE)
+            Window->Missing = ~0ull;
+        else
+            Window->Missing = (Window->Missing << Delta) |
+                              ((1ull << Delta) - 1);
+
+        Window->Next = Sequence;
+        *Skipped = (ULONG)Delta;
+    }
+
+    if (Delta >= 0)
+        return SEQUENCE_OFFER_NEXT;
+
+    Offset = (ULONG)-(Delta + 1);
+    if (Offset < SEQUENCE_WINDOW_SIZE &&
+        (Window->Missing & (1ull << Offset)) != 0)
+        return SEQUENCE_OFFER_LATE;
+
+    return SEQUENCE_OFFER_REPEAT;
+}
+
+// Record that Sequence, as classified by __SequenceWindowOffer(), has
+// been delivered
+static FORCEINLINE VOID
+__SequenceWindowAccept(
+    IN OUT  PSEQUENCE_WINDOW    Window,
+    IN      ULONG               Sequence
+    )
+{
+    ULONG                       Offset;
+
+    if (Sequence == Window->Next) {
+        Window->Missing <<= 1;
+        Window->Next++;
+        return;
+    }
+
+    Offset = Window->Next - 1 - Sequence;
+    ASSERT3U(Offset, <, SEQUENCE_WINDOW_SIZE);
+
+    Window->Missing &= ~(1ull << Offset);
+}
+
 #endif  // _XENHID_UTIL_H
@@ -0,0 +1,400 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The bit scans, population count and interlocked arithmetic in util.h,
+// checked against the obvious loops. The Makefile also builds this as
+// bits32, without _WIN64, so that the paths built from pairs of 32-bit
+// scans are covered too.
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "test.h"
+
+#if defined(_WIN64)
+#define TEST_NAME   "bits"
+#else
+#define TEST_NAME   "bits32"
+#endif
+
+static ULONGLONG    TestRandomState = 0x9E3779B97F4A7C15ull;
+
+static ULONGLONG
+TestRandom(
+    VOID
+    )
+{
+    ULONGLONG   Value = TestRandomState;
+
+    Value ^= Value << 13;
+    Value ^= Value >> 7;
+    Value ^= Value << 17;
+
+    TestRandomState = Value;
+    return Value;
+}
+
+// Sparse, dense and in between
+static ULONGLONG
+TestRandomMask(
+    VOID
+    )
+{
+    switch (TestRandom() % 4) {
+    case 0:
+        return TestRandom() & TestRandom() & TestRandom();
+
+    case 1:
+        return TestRandom() | TestRandom() | TestRandom();
+
+    case 2:
+        return TestRandom() >> (TestRandom() % 64);
+
+    default:
+        return TestRandom() << (TestRandom() % 64);
+    }
+}
+
+static LONG
+ReferenceFfs(
+    IN  ULONGLONG   Mask
+    )
+{
+    LONG            Bit;
+
+    for (Bit = 0; Bit < 64; Bit++)
+        if (Mask & (1ull << Bit))
+            return Bit;
+
+    return -1;
+}
+
+static LONG
+ReferenceFls(
+    IN  ULONGLONG   Mask
+    )
+{
+    LONG            Bit;
+
+    for (Bit = 63; Bit >= 0; Bit--)
+        if (Mask & (1ull << Bit))
+            return Bit;
+
+    return -1;
+}
+
+static ULONG
+ReferencePopcount(
+    IN  ULONGLONG   Mask
+    )
+{
+    ULONG           Count;
+
+    for (Count = 0; Mask != 0; Mask >>= 1)
+        Count += (ULONG)(Mask & 1);
+
+    return Count;
+}
+
+static VOID
+TestCheckMask(
+    IN  ULONGLONG   Mask
+    )
+{
+    CHECK3S(__ffs(Mask), ==, ReferenceFfs(Mask));
+    CHECK3S(__fls(Mask), ==, ReferenceFls(Mask));
+    CHECK3U(__popcount(Mask), ==, ReferencePopcount(Mask));
+    CHECK3S(__ffu(Mask), ==, ReferenceFfs(~Mask));
+
+    if (TestFailures != 0) {
+        fprintf(stderr, "mask %016llx\n", Mask);
+        exit(TestExit(TEST_NAME));
+    }
+}
+
+#define TEST_ITERATIONS 1000000
+
+static VOID
+TestScans(
+    VOID
+    )
+{
+    ULONG   Low;
+    ULONG   High;
+    ULONG   Iteration;
+
+    TestCheckMask(0);
+    TestCheckMask(~0ull);
+
+    // Every single bit and every pair, which covers both halves and the
+    // boundary between them
+    for (Low = 0; Low < 64; Low++) {
+        for (High = Low; High < 64; High++) {
+            TestCheckMask((1ull << Low) | (1ull << High));
+            TestCheckMask(~((1ull << Low) | (1ull << High)));
+        }
+    }
+
+    for (Iteration = 0; Iteration < TEST_ITERATIONS; Iteration++)
+        TestCheckMask(TestRandomMask());
+}
+
+// __ffu() as __FdoAllocateIndex() uses it: always the lowest free index
+// in a 64 entry map, and -1 once the map is full
+static VOID
+TestAllocate(
+    VOID
+    )
+{
+    ULONG64 Map = 0;
+    LONG    Index;
+    ULONG   Iteration;
+
+    for (Index = 0; Index < 64; Index++) {
+        CHECK3S(__ffu(Map), ==, Index);
+        Map |= 1ull << Index;
+    }
+
+    CHECK3S(__ffu(Map), ==, -1);
+
+    for (Iteration = 0; Iteration < 10000; Iteration++) {
+        LONG    Free = (LONG)(TestRandom() % 64);
+
+        Map &= ~(1ull << Free);
+        if (TestRandom() % 2)
+            Map &= ~(1ull << (TestRandom() % 64));
+
+        Index = __ffu(Map);
+        CHECK3S(Index, ==, ReferenceFfs(~Map));
+        CHECK3S(Index, <=, Free);
+
+        Map |= 1ull << Index;
+    }
+
+    // A narrower map is promoted before it is complemented, so a full
+    // one yields the first index beyond it rather than -1
+    CHECK3S(__ffu((ULONG)0xFFFFFFFF), ==, -1);
+    CHECK3S(__ffu((ULONG)0x7FFFFFFF), ==, 31);
+    CHECK3S(__ffu((UCHAR)0xFF), ==, 8);
+}
+
+static VOID
+TestInterlockedValues(
+    VOID
+    )
+{
+    LONG    Value;
+
+    Value = 5;
+    CHECK3S(__InterlockedAdd(&Value, 3), ==, 8);
+    CHECK3S(Value, ==, 8);
+    CHECK3S(__InterlockedAdd(&Value, -10), ==, -2);
+    CHECK3S(__InterlockedSubtract(&Value, 3), ==, -5);
+    CHECK3S(__InterlockedSubtract(&Value, -7), ==, 2);
+    CHECK3S(Value, ==, 2);
+
+    Value = 0x0F;
+    CHECK3S(__InterlockedOr(&Value, 0x30), ==, 0x3F);
+    CHECK3S(__InterlockedAnd(&Value, 0x3C), ==, 0x3C);
+    CHECK3S(__InterlockedAnd(&Value, 0), ==, 0);
+    CHECK3S(__InterlockedOr(&Value, (LONG)0x80000000), ==, (LONG)0x80000000);
+    CHECK3S(Value, ==, (LONG)0x80000000);
+}
+
+#define TEST_THREADS            4
+#define TEST_THREAD_ITERATIONS  100000
+
+typedef struct _TEST_SHARED {
+    LONG    Count;
+    LONG    Bits;
+} TEST_SHARED, *PTEST_SHARED;
+
+static TEST_SHARED  TestShared;
+
+typedef struct _TEST_THREAD {
+    pthread_t   Thread;
+    ULONG       Number;
+    BOOLEAN     Lost;
+} TEST_THREAD, *PTEST_THREAD;
+
+static void *
+TestInterlockedThread(
+    void            *Argument
+    )
+{
+    PTEST_THREAD    Thread = Argument;
+    LONG            Bit = 1 << Thread->Number;
+    ULONG           Iteration;
+
+    for (Iteration = 0; Iteration < TEST_THREAD_ITERATIONS; Iteration++) {
+        LONG    Value;
+
+        (VOID) __InterlockedAdd(&TestShared.Count, 3);
+        (VOID) __InterlockedSubtract(&TestShared.Count, 1);
+
+        // Each thread owns one bit, so its own view of it is exact
+        Value = __InterlockedOr(&TestShared.Bits, Bit);
+        if ((Value & Bit) == 0)
+            Thread->Lost = TRUE;
+
+        Value = __InterlockedAnd(&TestShared.Bits, ~Bit);
+        if ((Value & Bit) != 0)
+            Thread->Lost = TRUE;
+    }
+
+    return NULL;
+}
+
+static VOID
+TestInterlockedThreads(
+    VOID
+    )
+{
+    TEST_THREAD Thread[TEST_THREADS];
+    ULONG       Index;
+
+    RtlZeroMemory(&TestShared, sizeof (TestShared));
+    RtlZeroMemory(Thread, sizeof (Thread));
+
+    for (Index = 0; Index < TEST_THREADS; Index++) {
+        Thread[Index].Number = Index;
+        CHECK(pthread_create(&Thread[Index].Thread, NULL,
+                             TestInterlockedThread, &Thread[Index]) == 0);
+    }
+
+    for (Index = 0; Index < TEST_THREADS; Index++) {
+        CHECK(pthread_join(Thread[Index].Thread, NULL) == 0);
+        CHECK(!Thread[Index].Lost);
+    }
+
+    CHECK3S(TestShared.Count, ==, TEST_THREADS * TEST_THREAD_ITERATIONS * 2);
+    CHECK3S(TestShared.Bits, ==, 0);
+}
+
+// __InterlockedAdd() as it was: a compare-exchange retry loop
+static LONG
+CompareExchangeAdd(
+    IN  LONG    *Value,
+    IN  LONG    Delta
+    )
+{
+    LONG        Old;
+    LONG        New;
+
+    do {
+        Old = *Value;
+        New = Old + Delta;
+    } while (InterlockedCompareExchange(Value, New, Old) != Old);
+
+    return New;
+}
+
+#define BENCH_MASKS         4096
+#define BENCH_ITERATIONS    2000
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static ULONGLONG    Masks[BENCH_MASKS];
+    ULONGLONG           Start;
+    ULONGLONG           Sum;
+    ULONG               Iteration;
+    ULONG               Index;
+    LONG                Value;
+
+    for (Index = 0; Index < BENCH_MASKS; Index++)
+        Masks[Index] = TestRandomMask();
+
+    printf(TEST_NAME ": %u masks x %u iterations\n", BENCH_MASKS,
+           BENCH_ITERATIONS);
+
+#define BENCH(_Name, _Function)                                             \
+    do {                                                                    \
+        Sum = 0;                                                            \
+        Start = TestNow();                                                  \
+        for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {    \
+            for (Index = 0; Index < BENCH_MASKS; Index++)                   \
+                Sum += (ULONGLONG)_Function(Masks[Index]);                  \
+            __asm__ __volatile__("" : "+r" (Sum));                          \
+        }                                                                   \
+        TestReport(_Name, TestNow() - Start,                                \
+                   (ULONGLONG)BENCH_ITERATIONS * BENCH_MASKS);              \
+    } while (FALSE)
+
+    BENCH("__ffs", __ffs);
+    BENCH("reference ffs loop", ReferenceFfs);
+    BENCH("__fls", __fls);
+    BENCH("reference fls loop", ReferenceFls);
+    BENCH("__popcount", __popcount);
+    BENCH("reference popcount loop", ReferencePopcount);
+    BENCH("__builtin_popcountll", __builtin_popcountll);
+
+#undef  BENCH
+
+    Value = 0;
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS * BENCH_MASKS; Iteration++)
+        (VOID) __InterlockedAdd(&Value, 1);
+    TestReport("__InterlockedAdd", TestNow() - Start,
+               (ULONGLONG)BENCH_ITERATIONS * BENCH_MASKS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS * BENCH_MASKS; Iteration++)
+        (VOID) CompareExchangeAdd(&Value, 1);
+    TestReport("compare-exchange add", TestNow() - Start,
+               (ULONGLONG)BENCH_ITERATIONS * BENCH_MASKS);
+
+    CHECK3S(Value, ==, 2 * BENCH_ITERATIONS * BENCH_MASKS);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestScans();
+    TestAllocate();
+    TestInterlockedValues();
+    TestInterlockedThreads();
+
+    if (Bench)
+        Benchmark();
+
+    return TestExit(TEST_NAME);
+}
@@ -0,0 +1,244 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The logging macros in dbg_print.h against the ones they replaced, as
+// a free build sees them (the Makefile builds this with DBG=0): a call
+// site below the compile-time floor or outside the runtime mask must not
+// evaluate its arguments or print, and `make bench` times the disabled
+// call sites on the power and distribution paths both ways.
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include "dbg_print.h"
+#include "test.h"
+
+#if DBG
+#error "dbgprint tests the free build"
+#endif
+
+// The previous macros, free build. Trace compiled to an empty function
+// whose arguments were still evaluated, and the others tested a level
+// inside the function, after the call and its arguments.
+
+static ULONG    PreviousDbgPrintLevel = DPFLTR_INFO_LEVEL;
+
+static __inline VOID
+__PreviousTrace(
+    IN  const CHAR  *Prefix,
+    IN  const CHAR  *Format,
+    ...
+    )
+{
+    UNREFERENCED_PARAMETER(Prefix);
+    UNREFERENCED_PARAMETER(Format);
+}
+
+#define PreviousTrace(...)  \
+        __PreviousTrace(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+
+static __inline VOID
+__PreviousInfo(
+    IN  const CHAR  *Prefix,
+    IN  const CHAR  *Format,
+    ...
+    )
+{
+    va_list         Arguments;
+
+    if (PreviousDbgPrintLevel < DPFLTR_INFO_LEVEL)
+        return;
+
+    va_start(Arguments, Format);
+    vDbgPrintExWithPrefix(Prefix,
+                          DPFLTR_IHVDRIVER_ID,
+                          DPFLTR_INFO_LEVEL,
+                          Format,
+                          Arguments);
+    va_end(Arguments);
+}
+
+#define PreviousInfo(...)  \
+        __PreviousInfo(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+
+// Stands in for PowerDeviceStateName(), which lives in another
+// translation unit, so the compiler cannot see that it has no side
+// effects. Here it really has one: it counts its calls.
+static ULONG    TestEvaluations;
+
+static __attribute__((noinline)) const CHAR *
+TestStateName(
+    IN  ULONG   State
+    )
+{
+    static const CHAR   *Name[] = {
+        "PowerDeviceUnspecified",
+        "PowerDeviceD0",
+        "PowerDeviceD1",
+        "PowerDeviceD2",
+        "PowerDeviceD3",
+    };
+
+    TestEvaluations++;
+
+    return Name[State % ARRAYSIZE(Name)];
+}
+
+static VOID
+TestReset(
+    VOID
+    )
+{
+    TestEvaluations = 0;
+    TestPrints = 0;
+}
+
+static VOID
+TestFiltering(
+    VOID
+    )
+{
+    ULONG   Mask = DbgPrintMask;
+
+    TestPrintsQuiet = TRUE;
+
+    // Trace is below the free build's floor whatever the mask says
+    DbgPrintMask = DBG_PRINT_LEVEL_MASK(DPFLTR_INFO_LEVEL);
+
+    TestReset();
+    Trace("%s -> %s\n", TestStateName(4), TestStateName(1));
+    CHECK3U(TestEvaluations, ==, 0);
+    CHECK3U(TestPrints, ==, 0);
+
+    TestReset();
+    PreviousTrace("%s -> %s\n", TestStateName(4), TestStateName(1));
+    CHECK3U(TestEvaluations, ==, 2);
+    CHECK3U(TestPrints, ==, 0);
+
+    // Info is compiled in, so it prints while the mask allows it...
+    TestReset();
+    Info("%s\n", TestStateName(1));
+    CHECK3U(TestEvaluations, ==, 1);
+    CHECK3U(TestPrints, ==, 1);
+
+    // ...and otherwise costs nothing
+    DbgPrintMask = DBG_PRINT_LEVEL_MASK(DPFLTR_WARNING_LEVEL);
+    PreviousDbgPrintLevel = DPFLTR_WARNING_LEVEL;
+
+    TestReset();
+    Info("%s\n", TestStateName(1));
+    CHECK3U(TestEvaluations, ==, 0);
+    CHECK3U(TestPrints, ==, 0);
+
+    TestReset();
+    PreviousInfo("%s\n", TestStateName(1));
+    CHECK3U(TestEvaluations, ==, 1);
+    CHECK3U(TestPrints, ==, 0);
+
+    // Warnings and errors are rate limited but otherwise as before
+    TestReset();
+    Warning("%s\n", TestStateName(3));
+    Error("%s\n", TestStateName(3));
+    CHECK3U(TestEvaluations, ==, 2);
+    CHECK3U(TestPrints, ==, 2);
+
+    DbgPrintMask = Mask;
+    PreviousDbgPrintLevel = DPFLTR_INFO_LEVEL;
+    TestPrintsQuiet = FALSE;
+}
+
+#define BENCH_ITERATIONS    10000000
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    ULONG       Mask = DbgPrintMask;
+    ULONGLONG   Start;
+    ULONG       Iteration;
+
+    printf("dbgprint: %u iterations, free build\n", BENCH_ITERATIONS);
+
+    // As the device power handlers trace each SET_POWER IRP
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++)
+        Trace("%s -> %s\n",
+              TestStateName(Iteration),
+              TestStateName(Iteration + 1));
+    TestReport("Trace (below floor)", TestNow() - Start, BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++)
+        PreviousTrace("%s -> %s\n",
+                      TestStateName(Iteration),
+                      TestStateName(Iteration + 1));
+    TestReport("previous Trace", TestNow() - Start, BENCH_ITERATIONS);
+
+    // As each device power transition is logged, with the log level
+    // knob set to warnings
+    DbgPrintMask = DBG_PRINT_LEVEL_MASK(DPFLTR_WARNING_LEVEL);
+    PreviousDbgPrintLevel = DPFLTR_WARNING_LEVEL;
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++)
+        Info("%s -> %s\n",
+             TestStateName(Iteration),
+             TestStateName(Iteration + 1));
+    TestReport("Info (masked)", TestNow() - Start, BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++)
+        PreviousInfo("%s -> %s\n",
+                     TestStateName(Iteration),
+                     TestStateName(Iteration + 1));
+    TestReport("previous Info (masked)", TestNow() - Start, BENCH_ITERATIONS);
+
+    DbgPrintMask = Mask;
+    PreviousDbgPrintLevel = DPFLTR_INFO_LEVEL;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestFiltering();
+
+    if (Bench)
+        Benchmark();
+
+    return TestExit("dbgprint");
+}
@@ -0,0 +1,302 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Formats compiled by StringFormatCompile() against the same formats
+// parsed by StringPrintf() on every call: the output must be identical,
+// truncation included, and `make bench` times the two on the driver's
+// own formats
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include "string.h"
+#include "dbg_print.h"
+#include "test.h"
+
+#define RECORD_FORMAT   "%s %s %u.%u.%u.%u %s"
+
+static ULONG    TestRandomState = 0x2545F491;
+
+static ULONG
+TestRandom(
+    VOID
+    )
+{
+    ULONG   Value = TestRandomState;
+
+    Value ^= Value << 13;
+    Value ^= Value >> 17;
+    Value ^= Value << 5;
+
+    TestRandomState = Value;
+    return Value;
+}
+
+static VOID
+TestCompile(
+    VOID
+    )
+{
+    XENHID_STRING_FORMAT    Compiled;
+    CHAR                    Format[2 * (STRING_FORMAT_MAXIMUM_OPS + 1) + 1];
+    ULONG                   Index;
+    ULONG                   Mask;
+
+    CHECK3U(StringFormatCompile(&Compiled, RECORD_FORMAT), ==, STATUS_SUCCESS);
+
+    // Seven conversions and the six literal runs between them
+    CHECK3U(Compiled.Count, ==, 13);
+    for (Index = 0; Index < Compiled.Count; Index++) {
+        PXENHID_STRING_FORMAT_OP    Op = &Compiled.Op[Index];
+
+        if (Index % 2 != 0) {
+            CHECK3U(Op->Conversion, ==, '\0');
+            CHECK3U(Op->Length, ==, 1);
+        } else {
+            CHECK(Op->Conversion == 's' || Op->Conversion == 'u');
+        }
+    }
+
+    CHECK3U(StringFormatCompile(&Compiled, ""), ==, STATUS_SUCCESS);
+    CHECK3U(Compiled.Count, ==, 0);
+
+    // Exactly the maximum fits...
+    for (Index = 0; Index < STRING_FORMAT_MAXIMUM_OPS; Index++)
+        memcpy(&Format[Index * 2], "%u", 2);
+    Format[Index * 2] = '\0';
+
+    CHECK3U(StringFormatCompile(&Compiled, Format), ==, STATUS_SUCCESS);
+    CHECK3U(Compiled.Count, ==, STRING_FORMAT_MAXIMUM_OPS);
+
+    // ...and one more does not, leaving nothing usable behind
+    Mask = DbgPrintMask;
+    DbgPrintMask = 0;
+
+    memcpy(&Format[Index * 2], "%u", 3);
+
+    CHECK3U(StringFormatCompile(&Compiled, Format), ==, STATUS_BUFFER_OVERFLOW);
+    CHECK3U(Compiled.Count, ==, 0);
+
+    DbgPrintMask = Mask;
+}
+
+static const CHAR   *TestWords[] = {
+    "", "a", "XENHID", "Xen_Project", "(DEBUG)", "data/xenhid/255"
+};
+
+typedef struct _TEST_RECORD {
+    const CHAR  *Vendor;
+    const CHAR  *Product;
+    ULONG       Version[4];
+    const CHAR  *Attributes;
+} TEST_RECORD, *PTEST_RECORD;
+
+static VOID
+TestRandomRecord(
+    OUT PTEST_RECORD    Record
+    )
+{
+    ULONG               Index;
+
+    Record->Vendor = TestWords[TestRandom() % ARRAYSIZE(TestWords)];
+    Record->Product = TestWords[TestRandom() % ARRAYSIZE(TestWords)];
+    for (Index = 0; Index < ARRAYSIZE(Record->Version); Index++)
+        Record->Version[Index] = TestRandom() >> (TestRandom() % 32);
+    Record->Attributes = TestWords[TestRandom() % ARRAYSIZE(TestWords)];
+}
+
+#define TEST_ITERATIONS 100000
+
+static VOID
+TestEquivalence(
+    VOID
+    )
+{
+    XENHID_STRING_FORMAT    Record;
+    XENHID_STRING_FORMAT    Index;
+    ULONG                   Iteration;
+    ULONG                   Mask;
+
+    CHECK3U(StringFormatCompile(&Record, RECORD_FORMAT), ==, STATUS_SUCCESS);
+    CHECK3U(StringFormatCompile(&Index, "%u"), ==, STATUS_SUCCESS);
+
+    // Truncation is expected to fail, so don't print it
+    Mask = DbgPrintMask;
+    DbgPrintMask = 0;
+
+    for (Iteration = 0; Iteration < TEST_ITERATIONS; Iteration++) {
+        TEST_RECORD Values;
+        CHAR        Parsed[96];
+        CHAR        Compiled[96];
+        STRING      ParsedString;
+        STRING      CompiledString;
+        USHORT      Maximum;
+        NTSTATUS    ParsedStatus;
+        NTSTATUS    CompiledStatus;
+
+        TestRandomRecord(&Values);
+
+        // Anything from too small for anything to more than enough
+        Maximum = (USHORT)(TestRandom() % sizeof (Parsed));
+
+        RtlFillMemory(Parsed, sizeof (Parsed), 'x');
+        ParsedString.Buffer = Parsed;
+        ParsedString.MaximumLength = Maximum;
+        ParsedString.Length = 0;
+
+        RtlFillMemory(Compiled, sizeof (Compiled), 'x');
+        CompiledString.Buffer = Compiled;
+        CompiledString.MaximumLength = Maximum;
+        CompiledString.Length = 0;
+
+        if (Iteration % 2 == 0) {
+            ParsedStatus = StringPrintf(&ParsedString,
+                                        RECORD_FORMAT,
+                                        Values.Vendor,
+                                        Values.Product,
+                                        Values.Version[0],
+                                        Values.Version[1],
+                                        Values.Version[2],
+                                        Values.Version[3],
+                                        Values.Attributes);
+            CompiledStatus = StringFormatPrintf(&CompiledString,
+                                                &Record,
+                                                Values.Vendor,
+                                                Values.Product,
+                                                Values.Version[0],
+                                                Values.Version[1],
+                                                Values.Version[2],
+                                                Values.Version[3],
+                                                Values.Attributes);
+        } else {
+            ParsedStatus = StringPrintf(&ParsedString,
+                                        "%u",
+                                        Values.Version[0]);
+            CompiledStatus = StringFormatPrintf(&CompiledString,
+                                                &Index,
+                                                Values.Version[0]);
+        }
+
+        CHECK3U(CompiledStatus, ==, ParsedStatus);
+        CHECK3U(CompiledString.Length, ==, ParsedString.Length);
+        CHECK(memcmp(Compiled, Parsed, sizeof (Parsed)) == 0);
+
+        if (TestFailures != 0)
+            break;
+    }
+
+    DbgPrintMask = Mask;
+}
+
+#define BENCH_ITERATIONS    1000000
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    XENHID_STRING_FORMAT    Record;
+    XENHID_STRING_FORMAT    Index;
+    CHAR                    Buffer[96];
+    STRING                  String;
+    ULONGLONG               Start;
+    ULONG                   Iteration;
+
+    printf("format: %u iterations\n", BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        (VOID) StringFormatCompile(&Record, RECORD_FORMAT);
+        __asm__ __volatile__("" : : "r" (&Record) : "memory");
+    }
+    TestReport("compile record", TestNow() - Start, BENCH_ITERATIONS);
+
+    (VOID) StringFormatCompile(&Index, "%u");
+
+#define BENCH_STRING()                              \
+    do {                                            \
+        String.Buffer = Buffer;                     \
+        String.MaximumLength = sizeof (Buffer);     \
+        String.Length = 0;                          \
+    } while (FALSE)
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        BENCH_STRING();
+        (VOID) StringPrintf(&String, "%u", Iteration & 0xFF);
+    }
+    TestReport("parsed \"%u\"", TestNow() - Start, BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        BENCH_STRING();
+        (VOID) StringFormatPrintf(&String, &Index, Iteration & 0xFF);
+    }
+    TestReport("compiled \"%u\"", TestNow() - Start, BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        BENCH_STRING();
+        (VOID) StringPrintf(&String, RECORD_FORMAT,
+                            "Xen_Project", "XENHID", 9, 1, 0, Iteration,
+                            "(DEBUG)");
+    }
+    TestReport("parsed record", TestNow() - Start, BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        BENCH_STRING();
+        (VOID) StringFormatPrintf(&String, &Record,
+                                  "Xen_Project", "XENHID", 9, 1, 0, Iteration,
+                                  "(DEBUG)");
+    }
+    TestReport("compiled record", TestNow() - Start, BENCH_ITERATIONS);
+
+#undef  BENCH_STRING
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestCompile();
+    TestEquivalence();
+
+    if (Bench)
+        Benchmark();
+
+    return TestExit("format");
+}
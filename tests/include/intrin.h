@@ -0,0 +1,101 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// MSVC intrinsics used by util.h, in terms of the GCC builtins. On
+// Windows an unsigned long is 32 bits, so the 32-bit scans ignore the top
+// half of it here too. The index is cleared when nothing is found, which
+// MSVC leaves undefined, only to keep GCC's uninitialized warnings quiet.
+
+#ifndef _TESTS_INTRIN_H
+#define _TESTS_INTRIN_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#undef __cpuid
+#endif
+
+static inline unsigned char
+_BitScanForward(unsigned long *Index, unsigned long Mask)
+{
+    *Index = 0;
+    if ((unsigned int)Mask == 0)
+        return 0;
+
+    *Index = (unsigned long)__builtin_ctz((unsigned int)Mask);
+    return 1;
+}
+
+static inline unsigned char
+_BitScanReverse(unsigned long *Index, unsigned long Mask)
+{
+    *Index = 0;
+    if ((unsigned int)Mask == 0)
+        return 0;
+
+    *Index = (unsigned long)(31 - __builtin_clz((unsigned int)Mask));
+    return 1;
+}
+
+static inline unsigned char
+_BitScanForward64(unsigned long *Index, unsigned long long Mask)
+{
+    *Index = 0;
+    if (Mask == 0)
+        return 0;
+
+    *Index = (unsigned long)__builtin_ctzll(Mask);
+    return 1;
+}
+
+static inline unsigned char
+_BitScanReverse64(unsigned long *Index, unsigned long long Mask)
+{
+    *Index = 0;
+    if (Mask == 0)
+        return 0;
+
+    *Index = (unsigned long)(63 - __builtin_clzll(Mask));
+    return 1;
+}
+
+static inline void
+__cpuid(int Value[4], int Leaf)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __cpuid_count(Leaf, 0, Value[0], Value[1], Value[2], Value[3]);
+#else
+    Value[0] = Value[1] = Value[2] = Value[3] = 0;
+    (void)Leaf;
+#endif
+}
+
+#endif  // _TESTS_INTRIN_H
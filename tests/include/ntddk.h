@@ -0,0 +1,597 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Just enough of the kernel headers to build the parts of the driver that
+// do not touch hardware as an ordinary Linux program. Wide characters are
+// 16 bits, as on Windows, so everything must be built with -fshort-wchar.
+
+#ifndef _TESTS_NTDDK_H
+#define _TESTS_NTDDK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#ifndef TEST_NO_WIN64
+#define _WIN64  1
+#endif
+#endif
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define FORCEINLINE                     inline __attribute__((always_inline))
+#define DECLSPEC_NOINLINE               __attribute__((noinline))
+#define DECLSPEC_CACHEALIGN             __attribute__((aligned(SYSTEM_CACHE_ALIGNMENT_SIZE)))
+#define __checkReturn
+#define __analysis_assume(_EXP)         ((void)0)
+#define __drv_requiresIRQL(_Irql)
+#define __annotation(...)               __test_annotation()
+#define C_ASSERT(_EXP)                  _Static_assert(_EXP, #_EXP)
+#define UNREFERENCED_PARAMETER(_P)      ((void)(_P))
+
+// MSVC treats __FUNCTION__ as a string literal, which can be pasted
+// into a format; GCC does not
+#define __FUNCTION__    ""
+
+static inline void __test_annotation(void) {}
+
+#define VOID                void
+typedef void                *PVOID;
+typedef char                CHAR, *PCHAR;
+typedef unsigned char       UCHAR, *PUCHAR;
+typedef short               SHORT, *PSHORT;
+typedef unsigned short      USHORT, *PUSHORT;
+typedef int                 LONG, *PLONG;
+typedef unsigned int        ULONG, *PULONG;
+typedef long long           LONGLONG, *PLONGLONG, LONG64, *PLONG64;
+typedef unsigned long long  ULONGLONG, *PULONGLONG, ULONG64, *PULONG64;
+typedef uintptr_t           ULONG_PTR, *PULONG_PTR;
+typedef intptr_t            LONG_PTR;
+typedef size_t              SIZE_T;
+typedef UCHAR               BOOLEAN, *PBOOLEAN;
+typedef wchar_t             WCHAR, *PWCHAR, *PWSTR;
+typedef LONG                NTSTATUS;
+typedef PVOID               HANDLE, *PHANDLE;
+typedef UCHAR               KIRQL, *PKIRQL;
+typedef LONG                KPRIORITY, *PKPRIORITY;
+typedef ULONG_PTR           KAFFINITY;
+typedef USHORT              CSHORT;
+
+_Static_assert(sizeof (WCHAR) == 2, "build with -fshort-wchar");
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG   LowPart;
+        LONG    HighPart;
+    };
+    LONGLONG    QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS;
+
+#define TRUE    1
+#define FALSE   0
+
+#define MAXUCHAR    0xff
+#define MAXUSHORT   0xffff
+#define MAXULONG    0xffffffffu
+#define MAXLONG     0x7fffffff
+
+#define ARRAYSIZE(_A)   (sizeof (_A) / sizeof ((_A)[0]))
+
+#define FIELD_OFFSET(_Type, _Field) offsetof(_Type, _Field)
+
+#define CONTAINING_RECORD(_Address, _Type, _Field) \
+        ((_Type *)((PCHAR)(_Address) - FIELD_OFFSET(_Type, _Field)))
+
+#define __min(_A, _B)   (((_A) < (_B)) ? (_A) : (_B))
+#define __max(_A, _B)   (((_A) > (_B)) ? (_A) : (_B))
+
+#ifndef min
+#define min(_A, _B)     __min((_A), (_B))
+#endif
+
+#ifndef max
+#define max(_A, _B)     __max((_A), (_B))
+#endif
+
+#define PAGE_SIZE                       4096
+#define PAGE_ALIGN(_Va)                 ((PVOID)((ULONG_PTR)(_Va) & ~((ULONG_PTR)PAGE_SIZE - 1)))
+#define SYSTEM_CACHE_ALIGNMENT_SIZE     64
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_WAIT_0                   ((NTSTATUS)0x00000000)
+#define STATUS_WAIT_1                   ((NTSTATUS)0x00000001)
+#define STATUS_ALERTED                  ((NTSTATUS)0x00000101)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS)0xC0000002)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000D)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009A)
+#define STATUS_CANCELLED                ((NTSTATUS)0xC0000120)
+
+#define NT_SUCCESS(_Status) ((NTSTATUS)(_Status) >= 0)
+
+typedef struct _STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PCHAR   Buffer;
+} STRING, *PSTRING, ANSI_STRING, *PANSI_STRING;
+
+typedef struct _UNICODE_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWCHAR  Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+#define RtlCopyMemory(_D, _S, _L)   memcpy((_D), (_S), (_L))
+#define RtlMoveMemory(_D, _S, _L)   memmove((_D), (_S), (_L))
+#define RtlFillMemory(_D, _L, _F)   memset((_D), (_F), (_L))
+#define RtlZeroMemory(_D, _L)       memset((_D), 0, (_L))
+#define RtlEqualMemory(_A, _B, _L)  (memcmp((_A), (_B), (_L)) == 0)
+
+// glibc's wide string functions assume a 32-bit wchar_t
+static inline size_t
+__test_wcslen(const WCHAR *String)
+{
+    size_t  Length = 0;
+
+    while (String[Length] != 0)
+        Length++;
+
+    return Length;
+}
+
+static inline WCHAR *
+__test_wcschr(const WCHAR *String, WCHAR Character)
+{
+    for (;;) {
+        if (*String == Character)
+            return (WCHAR *)String;
+        if (*String == 0)
+            return NULL;
+        String++;
+    }
+}
+
+#define wcslen  __test_wcslen
+#define wcschr  __test_wcschr
+
+// glibc has its own __strtok_r
+#define __strtok_r  __test_strtok_r
+
+// Interlocked operations
+
+#define InterlockedIncrement(_P)                    __atomic_add_fetch((_P), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(_P)                    __atomic_sub_fetch((_P), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(_P, _V)                 __atomic_exchange_n((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(_P, _V)               __atomic_exchange_n((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(_P, _V)              __atomic_fetch_add((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(_P, _V)            __atomic_fetch_add((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(_P, _V)                    __atomic_add_fetch((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(_P)                  __atomic_add_fetch((_P), 1, __ATOMIC_SEQ_CST)
+#define InterlockedOr(_P, _V)                       __atomic_fetch_or((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(_P, _V)                      __atomic_fetch_and((_P), (_V), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(_P, _V, _C)      __sync_val_compare_and_swap((_P), (_C), (_V))
+#define InterlockedCompareExchange64(_P, _V, _C)    __sync_val_compare_and_swap((_P), (_C), (_V))
+#define InterlockedCompareExchangePointer(_P, _V, _C) \
+        __sync_val_compare_and_swap((_P), (_C), (_V))
+#define InterlockedExchangePointer(_P, _V)          __atomic_exchange_n((_P), (_V), __ATOMIC_SEQ_CST)
+
+#define ReadNoFence(_P)         __atomic_load_n((_P), __ATOMIC_RELAXED)
+#define ReadNoFence64(_P)       __atomic_load_n((_P), __ATOMIC_RELAXED)
+#define WriteNoFence(_P, _V)    __atomic_store_n((_P), (_V), __ATOMIC_RELAXED)
+#define WriteNoFence64(_P, _V)  __atomic_store_n((_P), (_V), __ATOMIC_RELAXED)
+#define ReadULong64NoFence(_P)  __atomic_load_n((_P), __ATOMIC_RELAXED)
+
+#define WriteRelease(_P, _V)            __atomic_store_n((_P), (_V), __ATOMIC_RELEASE)
+#define ReadPointerAcquire(_P)          __atomic_load_n((_P), __ATOMIC_ACQUIRE)
+#define WritePointerRelease(_P, _V)     __atomic_store_n((_P), (_V), __ATOMIC_RELEASE)
+#define KeMemoryBarrier()               __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// Lists
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static inline VOID
+InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+static inline BOOLEAN
+IsListEmpty(const LIST_ENTRY *ListHead)
+{
+    return (ListHead->Flink == ListHead) ? TRUE : FALSE;
+}
+
+static inline BOOLEAN
+RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = Entry->Flink;
+    PLIST_ENTRY Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+
+    return (Flink == Blink) ? TRUE : FALSE;
+}
+
+static inline PLIST_ENTRY
+RemoveHeadList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Flink;
+
+    (VOID) RemoveEntryList(Entry);
+    return Entry;
+}
+
+static inline PLIST_ENTRY
+RemoveTailList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Blink;
+
+    (VOID) RemoveEntryList(Entry);
+    return Entry;
+}
+
+static inline VOID
+InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+static inline VOID
+InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = ListHead->Flink;
+
+    Entry->Flink = Flink;
+    Entry->Blink = ListHead;
+    Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+// Debug output and bug checks, see kernel.c
+
+#define DPFLTR_ERROR_LEVEL      0
+#define DPFLTR_WARNING_LEVEL    1
+#define DPFLTR_TRACE_LEVEL      2
+#define DPFLTR_INFO_LEVEL       3
+#define DPFLTR_IHVDRIVER_ID     77
+
+extern ULONG
+vDbgPrintExWithPrefix(
+    const CHAR  *Prefix,
+    ULONG       ComponentId,
+    ULONG       Level,
+    const CHAR  *Format,
+    va_list     Arguments
+    );
+
+extern VOID
+KeBugCheckEx(
+    ULONG       Code,
+    ULONG_PTR   Parameter1,
+    ULONG_PTR   Parameter2,
+    ULONG_PTR   Parameter3,
+    ULONG_PTR   Parameter4
+    ) __attribute__((noreturn));
+
+extern VOID
+DbgRaiseAssertionFailure(
+    VOID
+    ) __attribute__((noreturn));
+
+// Time. Interrupt time is virtual: it only moves when a test moves it
+// (see TestAdvanceInterruptTime() in kernel.h).
+
+extern ULONGLONG
+KeQueryInterruptTime(
+    VOID
+    );
+
+extern LARGE_INTEGER
+KeQueryPerformanceCounter(
+    PLARGE_INTEGER  Frequency
+    );
+
+// Also virtual: each read returns one more than the last
+extern ULONG64
+ReadTimeStampCounter(
+    VOID
+    );
+
+// Memory. Only declared so that util.h compiles; nothing in the tests
+// maps pages.
+
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+typedef enum _MEMORY_CACHING_TYPE {
+    MmNonCached,
+    MmCached
+} MEMORY_CACHING_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode
+} MODE, KPROCESSOR_MODE;
+
+typedef struct _MDL {
+    struct _MDL *Next;
+    CSHORT      Size;
+    CSHORT      MdlFlags;
+    PVOID       Process;
+    PVOID       MappedSystemVa;
+    PVOID       StartVa;
+    ULONG       ByteCount;
+    ULONG       ByteOffset;
+} MDL, *PMDL;
+
+#define MDL_MAPPED_TO_SYSTEM_VA         0x0001
+#define MDL_SOURCE_IS_NONPAGED_POOL     0x0004
+#define MDL_PARTIAL                     0x0010
+#define MDL_PARTIAL_HAS_BEEN_MAPPED     0x0020
+#define MDL_IO_SPACE                    0x0800
+#define MDL_PARENT_MAPPED_SYSTEM_VA     0x0100
+#define MM_ALLOCATE_FULLY_REQUIRED      0x00000004
+
+extern PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+extern PVOID ExAllocatePoolUninitialized(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+extern VOID ExFreePoolWithTag(PVOID Buffer, ULONG Tag);
+extern VOID ExFreePool(PVOID Buffer);
+extern PMDL MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS LowAddress, PHYSICAL_ADDRESS HighAddress,
+                                    PHYSICAL_ADDRESS SkipBytes, SIZE_T TotalBytes,
+                                    MEMORY_CACHING_TYPE CacheType, ULONG Flags);
+extern PVOID MmMapLockedPagesSpecifyCache(PMDL Mdl, KPROCESSOR_MODE AccessMode,
+                                          MEMORY_CACHING_TYPE CacheType, PVOID RequestedAddress,
+                                          ULONG BugCheckOnFailure, ULONG Priority);
+extern VOID MmUnmapLockedPages(PVOID BaseAddress, PMDL Mdl);
+extern VOID MmFreePagesFromMdl(PMDL Mdl);
+
+// Dispatcher objects. These are all protected by a single lock, as they
+// once were in the kernel itself, and waiters are woken by broadcasting
+// whenever any of them changes state.
+
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+
+#define LOW_PRIORITY    0
+#define HIGH_PRIORITY   31
+
+#define IO_NO_INCREMENT 0
+
+typedef struct _DISPATCHER_HEADER {
+    LONG    Type;
+    LONG    SignalState;
+} DISPATCHER_HEADER;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _TIMER_TYPE {
+    NotificationTimer,
+    SynchronizationTimer
+} TIMER_TYPE;
+
+typedef enum _WAIT_TYPE {
+    WaitAll,
+    WaitAny
+} WAIT_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive
+} KWAIT_REASON;
+
+// Sets counts the KeSetEvent() calls, so that tests can see how many
+// signals were sent
+typedef struct _KEVENT {
+    DISPATCHER_HEADER   Header;
+    LONG                Sets;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KTIMER {
+    DISPATCHER_HEADER   Header;
+    LIST_ENTRY          ListEntry;
+    ULONGLONG           DueTime;
+    LONG                Period;
+    BOOLEAN             Inserted;
+} KTIMER, *PKTIMER;
+
+typedef struct _KDPC    KDPC, *PKDPC;
+typedef struct _KTHREAD *PKTHREAD, *PETHREAD;
+typedef PVOID           PKWAIT_BLOCK;
+
+extern VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+extern LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait);
+extern VOID KeClearEvent(PKEVENT Event);
+extern LONG KeResetEvent(PKEVENT Event);
+extern LONG KeReadStateEvent(PKEVENT Event);
+
+extern VOID KeInitializeTimerEx(PKTIMER Timer, TIMER_TYPE Type);
+extern BOOLEAN KeSetCoalescableTimer(PKTIMER Timer, LARGE_INTEGER DueTime,
+                                     ULONG Period, ULONG TolerableDelay,
+                                     PKDPC Dpc);
+extern BOOLEAN KeCancelTimer(PKTIMER Timer);
+
+#define KeInitializeTimer(_Timer)   KeInitializeTimerEx((_Timer), NotificationTimer)
+
+extern NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[],
+                                         WAIT_TYPE WaitType,
+                                         KWAIT_REASON WaitReason,
+                                         KPROCESSOR_MODE WaitMode,
+                                         BOOLEAN Alertable,
+                                         PLARGE_INTEGER Timeout,
+                                         PKWAIT_BLOCK WaitBlockArray);
+extern NTSTATUS KeWaitForSingleObject(PVOID Object,
+                                      KWAIT_REASON WaitReason,
+                                      KPROCESSOR_MODE WaitMode,
+                                      BOOLEAN Alertable,
+                                      PLARGE_INTEGER Timeout);
+
+// Spin locks really spin, but also raise the (per-thread) IRQL so that
+// PASSIVE_LEVEL assertions mean something
+
+typedef volatile LONG   KSPIN_LOCK, *PKSPIN_LOCK;
+
+extern VOID KeInitializeSpinLock(PKSPIN_LOCK Lock);
+extern VOID __test_KeAcquireSpinLock(PKSPIN_LOCK Lock, PKIRQL Irql);
+extern VOID KeReleaseSpinLock(PKSPIN_LOCK Lock, KIRQL Irql);
+extern KIRQL KeGetCurrentIrql(VOID);
+extern VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql);
+extern VOID KeLowerIrql(KIRQL NewIrql);
+
+#define KeAcquireSpinLock(_Lock, _Irql) __test_KeAcquireSpinLock((_Lock), (_Irql))
+
+// Threads
+
+typedef struct _GROUP_AFFINITY {
+    KAFFINITY   Mask;
+    USHORT      Group;
+    USHORT      Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT  Group;
+    UCHAR   Number;
+    UCHAR   Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef VOID KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+
+typedef PVOID   POBJECT_TYPE;
+typedef ULONG   ACCESS_MASK;
+
+#define SYNCHRONIZE             0x00100000
+#define STANDARD_RIGHTS_ALL     0x001F0000
+#define SPECIFIC_RIGHTS_ALL     0x0000FFFF
+
+extern POBJECT_TYPE *PsThreadType;
+
+extern NTSTATUS PsCreateSystemThread(PHANDLE Handle, ULONG DesiredAccess,
+                                     PVOID ObjectAttributes,
+                                     HANDLE ProcessHandle, PVOID ClientId,
+                                     PKSTART_ROUTINE StartRoutine,
+                                     PVOID StartContext);
+extern VOID PsTerminateSystemThread(NTSTATUS Status) __attribute__((noreturn));
+extern NTSTATUS __test_ObReferenceObjectByHandle(HANDLE Handle,
+                                                 ACCESS_MASK DesiredAccess,
+                                                 POBJECT_TYPE ObjectType,
+                                                 KPROCESSOR_MODE AccessMode,
+                                                 PVOID *Object,
+                                                 PVOID HandleInformation);
+extern VOID ObDereferenceObject(PVOID Object);
+extern NTSTATUS ZwClose(HANDLE Handle);
+
+#define ObReferenceObjectByHandle(_Handle, _Access, _Type, _Mode, _Object, _Information) \
+        __test_ObReferenceObjectByHandle((_Handle), (_Access), (_Type), (_Mode),         \
+                                         (PVOID *)(_Object), (_Information))
+
+extern PKTHREAD KeGetCurrentThread(VOID);
+extern KPRIORITY KeSetPriorityThread(PKTHREAD Thread, KPRIORITY Priority);
+extern VOID KeSetSystemGroupAffinityThread(PGROUP_AFFINITY Affinity,
+                                           PGROUP_AFFINITY PreviousAffinity);
+extern ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+
+// Processors. There is a single group, and every processor in it is
+// active (see TestSetProcessorCount() in test.h).
+
+#define ALL_PROCESSOR_GROUPS    0xffff
+
+extern ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber);
+extern NTSTATUS KeGetProcessorNumberFromIndex(ULONG ProcIndex,
+                                              PPROCESSOR_NUMBER ProcNumber);
+extern KAFFINITY KeQueryGroupAffinity(USHORT GroupNumber);
+
+// DPCs run as soon as they are queued, on the queuing thread but at
+// DISPATCH_LEVEL and as the target processor
+
+typedef VOID KDEFERRED_ROUTINE(PKDPC Dpc, PVOID DeferredContext,
+                               PVOID SystemArgument1, PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+struct _KDPC {
+    PKDEFERRED_ROUTINE  DeferredRoutine;
+    PVOID               DeferredContext;
+    PROCESSOR_NUMBER    Number;
+};
+
+extern VOID KeInitializeDpc(PKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine,
+                            PVOID DeferredContext);
+extern NTSTATUS KeSetTargetProcessorDpcEx(PKDPC Dpc,
+                                          PPROCESSOR_NUMBER ProcNumber);
+extern BOOLEAN KeInsertQueueDpc(PKDPC Dpc, PVOID SystemArgument1,
+                                PVOID SystemArgument2);
+extern VOID KeFlushQueuedDpcs(VOID);
+
+// Run-down protection
+
+typedef struct _EX_RUNDOWN_REF {
+    ULONG_PTR   Count;
+} EX_RUNDOWN_REF, *PEX_RUNDOWN_REF;
+
+extern VOID ExInitializeRundownProtection(PEX_RUNDOWN_REF Rundown);
+extern BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF Rundown);
+extern VOID ExReleaseRundownProtection(PEX_RUNDOWN_REF Rundown);
+extern VOID ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF Rundown);
+
+#endif  // _TESTS_NTDDK_H
@@ -0,0 +1,1162 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// User mode stand-ins for the kernel services used by the code under test
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "ring.h"
+#include "dbg_print.h"
+#include "test.h"
+
+// Only errors (including assertion failures) are printed, unless
+// XENHID_TEST_DEBUG is set in the environment to a different level mask
+ULONG       DbgPrintMask = DBG_PRINT_LEVEL(DPFLTR_ERROR_LEVEL);
+
+ULONG       TestFailures;
+ULONG       TestPrints;
+BOOLEAN     TestPrintsQuiet;
+
+static ULONGLONG    TestInterruptTime = 10000000ull;
+
+BOOLEAN
+TestParseArguments(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    const CHAR  *Debug;
+
+    Debug = getenv("XENHID_TEST_DEBUG");
+    if (Debug != NULL)
+        DbgPrintMask = (ULONG)strtoul(Debug, NULL, 0);
+
+    return (argc > 1 && strcmp(argv[1], "--bench") == 0) ? TRUE : FALSE;
+}
+
+int
+TestExit(
+    IN  const CHAR  *Name
+    )
+{
+    if (TestFailures != 0) {
+        fprintf(stderr, "%s: %u check(s) failed\n", Name, TestFailures);
+        return 1;
+    }
+
+    printf("%s: ok\n", Name);
+    return 0;
+}
+
+ULONGLONG
+TestNow(
+    VOID
+    )
+{
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+
+    return ((ULONGLONG)Now.tv_sec * 1000000000ull) + (ULONGLONG)Now.tv_nsec;
+}
+
+VOID
+TestReport(
+    IN  const CHAR  *Name,
+    IN  ULONGLONG   Elapsed,
+    IN  ULONGLONG   Count
+    )
+{
+    printf("  %-40s %10.1f ns\n", Name, (double)Elapsed / (double)Count);
+}
+
+ULONGLONG
+KeQueryInterruptTime(
+    VOID
+    )
+{
+    return __atomic_load_n(&TestInterruptTime, __ATOMIC_SEQ_CST);
+}
+
+// 100ns ticks, like the real counter on most hypervisors
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    PLARGE_INTEGER  Frequency
+    )
+{
+    LARGE_INTEGER   Counter;
+
+    if (Frequency != NULL)
+        Frequency->QuadPart = 10000000ll;
+
+    Counter.QuadPart = (LONGLONG)(TestNow() / 100);
+    return Counter;
+}
+
+static ULONG64  TestTimeStampCounter;
+
+ULONG64
+ReadTimeStampCounter(
+    VOID
+    )
+{
+    return __atomic_add_fetch(&TestTimeStampCounter, 1, __ATOMIC_SEQ_CST);
+}
+
+ULONG
+vDbgPrintExWithPrefix(
+    const CHAR  *Prefix,
+    ULONG       ComponentId,
+    ULONG       Level,
+    const CHAR  *Format,
+    va_list     Arguments
+    )
+{
+    UNREFERENCED_PARAMETER(ComponentId);
+    UNREFERENCED_PARAMETER(Level);
+
+    (VOID) __atomic_add_fetch(&TestPrints, 1, __ATOMIC_SEQ_CST);
+    if (TestPrintsQuiet)
+        return 0;
+
+    fputs(Prefix, stderr);
+    vfprintf(stderr, Format, Arguments);
+
+    return 0;
+}
+
+VOID
+DbgRaiseAssertionFailure(
+    VOID
+    )
+{
+    abort();
+}
+
+VOID
+KeBugCheckEx(
+    ULONG       Code,
+    ULONG_PTR   Parameter1,
+    ULONG_PTR   Parameter2,
+    ULONG_PTR   Parameter3,
+    ULONG_PTR   Parameter4
+    )
+{
+    fprintf(stderr, "BUGCHECK %08x (%lx %lx %lx %lx)\n",
+            Code,
+            (unsigned long)Parameter1,
+            (unsigned long)Parameter2,
+            (unsigned long)Parameter3,
+            (unsigned long)Parameter4);
+    abort();
+}
+
+PVOID
+ExAllocatePoolWithTag(
+    POOL_TYPE   PoolType,
+    SIZE_T      NumberOfBytes,
+    ULONG       Tag
+    )
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    return malloc(NumberOfBytes);
+}
+
+VOID
+ExFreePoolWithTag(
+    PVOID   Buffer,
+    ULONG   Tag
+    )
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    free(Buffer);
+}
+
+// The pool is not under test here: allocations come straight from the C
+// library (zeroed, as PoolAllocate() guarantees)
+
+PVOID
+PoolAllocate(
+    IN  ULONG   Length,
+    IN  ULONG   Tag
+    )
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    return calloc(1, Length);
+}
+
+PVOID
+PoolAllocateAligned(
+    IN  ULONG   Length,
+    IN  ULONG   Alignment,
+    IN  ULONG   Tag
+    )
+{
+    PVOID       Buffer;
+
+    UNREFERENCED_PARAMETER(Tag);
+
+    Buffer = aligned_alloc(Alignment, ((Length + Alignment - 1) / Alignment) * Alignment);
+    if (Buffer != NULL)
+        memset(Buffer, 0, Length);
+
+    return Buffer;
+}
+
+VOID
+PoolFree(
+    IN  PVOID   Buffer,
+    IN  ULONG   Tag
+    )
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    free(Buffer);
+}
+
+// Weak, so that a test can link the real one from ring.c instead
+__attribute__((weak)) VOID
+RingRecord(
+    IN  RING_EVENT  Event,
+    IN  PVOID       Fdo OPTIONAL,
+    IN  ULONG_PTR   Argument0,
+    IN  ULONG_PTR   Argument1
+    )
+{
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(Fdo);
+    UNREFERENCED_PARAMETER(Argument0);
+    UNREFERENCED_PARAMETER(Argument1);
+}
+
+// Dispatcher
+
+typedef enum _TEST_OBJECT_TYPE {
+    TestNotificationEvent,
+    TestSynchronizationEvent,
+    TestNotificationTimer,
+    TestSynchronizationTimer,
+    TestThread
+} TEST_OBJECT_TYPE;
+
+struct _KTHREAD {
+    DISPATCHER_HEADER   Header;
+    LONG                References;
+    pthread_t           Id;
+    PKSTART_ROUTINE     StartRoutine;
+    PVOID               StartContext;
+    KPRIORITY           Priority;
+    GROUP_AFFINITY      Affinity;
+};
+
+static pthread_mutex_t  DispatcherLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   DispatcherCondition = PTHREAD_COND_INITIALIZER;
+static LIST_ENTRY       DispatcherTimerList = { &DispatcherTimerList, &DispatcherTimerList };
+
+// The number of threads that have blocked since anything last changed,
+// and so are known to be idle
+static ULONG            DispatcherWaiters;
+static ULONG            DispatcherGeneration;
+
+static BOOLEAN          DispatcherChaos;
+
+static __thread KIRQL       CurrentIrql;
+static __thread PKTHREAD    CurrentThread;
+static __thread ULONG       CurrentProcessor;
+
+static struct _KTHREAD  InitialThread;
+
+static POBJECT_TYPE     ThreadType;
+POBJECT_TYPE            *PsThreadType = &ThreadType;
+
+// Called with DispatcherLock held whenever an object may have become
+// signalled
+static VOID
+__DispatcherBroadcast(
+    VOID
+    )
+{
+    DispatcherGeneration++;
+    DispatcherWaiters = 0;
+    pthread_cond_broadcast(&DispatcherCondition);
+}
+
+static VOID
+__DispatcherExpireTimers(
+    VOID
+    )
+{
+    ULONGLONG   Now = KeQueryInterruptTime();
+    PLIST_ENTRY ListEntry;
+    BOOLEAN     Expired;
+
+    Expired = FALSE;
+
+    ListEntry = DispatcherTimerList.Flink;
+    while (ListEntry != &DispatcherTimerList) {
+        PKTIMER Timer = CONTAINING_RECORD(ListEntry, KTIMER, ListEntry);
+
+        ListEntry = ListEntry->Flink;
+
+        if (Timer->DueTime > Now)
+            continue;
+
+        Timer->Header.SignalState = 1;
+        Expired = TRUE;
+
+        if (Timer->Period != 0) {
+            // A single expiry however far time has moved
+            while (Timer->DueTime <= Now)
+                Timer->DueTime += (ULONGLONG)Timer->Period * 10000;
+        } else {
+            (VOID) RemoveEntryList(&Timer->ListEntry);
+            Timer->Inserted = FALSE;
+        }
+    }
+
+    if (Expired)
+        __DispatcherBroadcast();
+}
+
+VOID
+TestAdvanceInterruptTime(
+    IN  ULONGLONG   Delta
+    )
+{
+    pthread_mutex_lock(&DispatcherLock);
+
+    (VOID) __atomic_add_fetch(&TestInterruptTime, Delta, __ATOMIC_SEQ_CST);
+    __DispatcherExpireTimers();
+
+    pthread_mutex_unlock(&DispatcherLock);
+}
+
+BOOLEAN
+TestWaitForIdle(
+    IN  ULONG   Count
+    )
+{
+    ULONG       Retry;
+
+    for (Retry = 0; Retry < TEST_WAIT_RETRIES; Retry++) {
+        ULONG   Waiters;
+
+        pthread_mutex_lock(&DispatcherLock);
+        Waiters = DispatcherWaiters;
+        pthread_mutex_unlock(&DispatcherLock);
+
+        if (Waiters >= Count)
+            return TRUE;
+
+        usleep(TEST_WAIT_INTERVAL);
+    }
+
+    return FALSE;
+}
+
+BOOLEAN
+TestWaitForValue(
+    IN  volatile LONG   *Value,
+    IN  LONG            Expected
+    )
+{
+    ULONG               Retry;
+
+    for (Retry = 0; Retry < TEST_WAIT_RETRIES; Retry++) {
+        if (__atomic_load_n(Value, __ATOMIC_SEQ_CST) == Expected)
+            return TRUE;
+
+        usleep(TEST_WAIT_INTERVAL);
+    }
+
+    return FALSE;
+}
+
+VOID
+TestSetCurrentProcessor(
+    IN  ULONG   Processor
+    )
+{
+    CurrentProcessor = Processor;
+}
+
+VOID
+TestSetChaos(
+    IN  BOOLEAN Enable
+    )
+{
+    __atomic_store_n(&DispatcherChaos, Enable, __ATOMIC_SEQ_CST);
+}
+
+// Yield about half the time, so that both orders of a race are tried
+static FORCEINLINE VOID
+__DispatcherChaos(
+    VOID
+    )
+{
+    static __thread ULONG   Seed = 1;
+
+    if (!__atomic_load_n(&DispatcherChaos, __ATOMIC_RELAXED))
+        return;
+
+    Seed = (Seed * 1103515245) + 12345;
+    if (Seed & 0x10000)
+        sched_yield();
+}
+
+VOID
+TestChaos(
+    VOID
+    )
+{
+    __DispatcherChaos();
+}
+
+VOID
+TestQueryThread(
+    IN  PKTHREAD        Thread,
+    OUT PKPRIORITY      Priority,
+    OUT PGROUP_AFFINITY Affinity
+    )
+{
+    pthread_mutex_lock(&DispatcherLock);
+
+    *Priority = Thread->Priority;
+    *Affinity = Thread->Affinity;
+
+    pthread_mutex_unlock(&DispatcherLock);
+}
+
+VOID
+KeInitializeEvent(
+    PKEVENT     Event,
+    EVENT_TYPE  Type,
+    BOOLEAN     State
+    )
+{
+    Event->Header.Type = (Type == NotificationEvent) ?
+                         TestNotificationEvent :
+                         TestSynchronizationEvent;
+    Event->Header.SignalState = State;
+    Event->Sets = 0;
+}
+
+LONG
+KeSetEvent(
+    PKEVENT Event,
+    LONG    Increment,
+    BOOLEAN Wait
+    )
+{
+    LONG    Previous;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    __DispatcherChaos();
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    Event->Sets++;
+
+    Previous = Event->Header.SignalState;
+    Event->Header.SignalState = 1;
+    __DispatcherBroadcast();
+
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return Previous;
+}
+
+LONG
+KeResetEvent(
+    PKEVENT Event
+    )
+{
+    LONG    Previous;
+
+    __DispatcherChaos();
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    Previous = Event->Header.SignalState;
+    Event->Header.SignalState = 0;
+
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return Previous;
+}
+
+VOID
+KeClearEvent(
+    PKEVENT Event
+    )
+{
+    (VOID) KeResetEvent(Event);
+}
+
+LONG
+KeReadStateEvent(
+    PKEVENT Event
+    )
+{
+    LONG    State;
+
+    pthread_mutex_lock(&DispatcherLock);
+    State = Event->Header.SignalState;
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return State;
+}
+
+VOID
+KeInitializeTimerEx(
+    PKTIMER     Timer,
+    TIMER_TYPE  Type
+    )
+{
+    RtlZeroMemory(Timer, sizeof (KTIMER));
+
+    Timer->Header.Type = (Type == NotificationTimer) ?
+                         TestNotificationTimer :
+                         TestSynchronizationTimer;
+}
+
+// Relative due times are measured against the virtual interrupt clock;
+// so, for simplicity, are absolute ones
+BOOLEAN
+KeSetCoalescableTimer(
+    PKTIMER         Timer,
+    LARGE_INTEGER   DueTime,
+    ULONG           Period,
+    ULONG           TolerableDelay,
+    PKDPC           Dpc
+    )
+{
+    BOOLEAN         Inserted;
+
+    UNREFERENCED_PARAMETER(TolerableDelay);
+
+    if (Dpc != NULL)
+        abort();
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    Inserted = Timer->Inserted;
+    if (Inserted)
+        (VOID) RemoveEntryList(&Timer->ListEntry);
+
+    Timer->DueTime = (DueTime.QuadPart < 0) ?
+                     KeQueryInterruptTime() + (ULONGLONG)(-DueTime.QuadPart) :
+                     (ULONGLONG)DueTime.QuadPart;
+    Timer->Period = (LONG)Period;
+    Timer->Header.SignalState = 0;
+
+    InsertTailList(&DispatcherTimerList, &Timer->ListEntry);
+    Timer->Inserted = TRUE;
+
+    __DispatcherExpireTimers();
+
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return Inserted;
+}
+
+BOOLEAN
+KeCancelTimer(
+    PKTIMER Timer
+    )
+{
+    BOOLEAN Inserted;
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    Inserted = Timer->Inserted;
+    if (Inserted) {
+        (VOID) RemoveEntryList(&Timer->ListEntry);
+        Timer->Inserted = FALSE;
+    }
+
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return Inserted;
+}
+
+static BOOLEAN
+__DispatcherSatisfy(
+    IN  DISPATCHER_HEADER   *Header
+    )
+{
+    if (Header->SignalState <= 0)
+        return FALSE;
+
+    if (Header->Type == TestSynchronizationEvent ||
+        Header->Type == TestSynchronizationTimer)
+        Header->SignalState = 0;
+
+    return TRUE;
+}
+
+NTSTATUS
+KeWaitForMultipleObjects(
+    ULONG           Count,
+    PVOID           Object[],
+    WAIT_TYPE       WaitType,
+    KWAIT_REASON    WaitReason,
+    KPROCESSOR_MODE WaitMode,
+    BOOLEAN         Alertable,
+    PLARGE_INTEGER  Timeout,
+    PKWAIT_BLOCK    WaitBlockArray
+    )
+{
+    ULONGLONG       End;
+    NTSTATUS        status;
+
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+    UNREFERENCED_PARAMETER(WaitBlockArray);
+
+    if (WaitType != WaitAny || CurrentIrql != PASSIVE_LEVEL)
+        abort();
+
+    End = 0;
+    if (Timeout != NULL)
+        End = (Timeout->QuadPart < 0) ?
+              KeQueryInterruptTime() + (ULONGLONG)(-Timeout->QuadPart) :
+              (ULONGLONG)Timeout->QuadPart;
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    for (;;) {
+        ULONG   Index;
+        ULONG   Generation;
+
+        for (Index = 0; Index < Count; Index++) {
+            if (__DispatcherSatisfy(Object[Index])) {
+                status = STATUS_WAIT_0 + Index;
+                goto done;
+            }
+        }
+
+        status = STATUS_TIMEOUT;
+        if (Timeout != NULL && KeQueryInterruptTime() >= End)
+            goto done;
+
+        // A broadcast resets the count, so only decrement it again if
+        // the wake was spurious
+        Generation = DispatcherGeneration;
+        DispatcherWaiters++;
+
+        pthread_cond_wait(&DispatcherCondition, &DispatcherLock);
+
+        if (DispatcherGeneration == Generation)
+            DispatcherWaiters--;
+    }
+
+done:
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return status;
+}
+
+NTSTATUS
+KeWaitForSingleObject(
+    PVOID           Object,
+    KWAIT_REASON    WaitReason,
+    KPROCESSOR_MODE WaitMode,
+    BOOLEAN         Alertable,
+    PLARGE_INTEGER  Timeout
+    )
+{
+    return KeWaitForMultipleObjects(1,
+                                    &Object,
+                                    WaitAny,
+                                    WaitReason,
+                                    WaitMode,
+                                    Alertable,
+                                    Timeout,
+                                    NULL);
+}
+
+VOID
+KeInitializeSpinLock(
+    PKSPIN_LOCK Lock
+    )
+{
+    *Lock = 0;
+}
+
+VOID
+__test_KeAcquireSpinLock(
+    PKSPIN_LOCK Lock,
+    PKIRQL      Irql
+    )
+{
+    __DispatcherChaos();
+
+    *Irql = CurrentIrql;
+    CurrentIrql = DISPATCH_LEVEL;
+
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0)
+        sched_yield();
+}
+
+VOID
+KeReleaseSpinLock(
+    PKSPIN_LOCK Lock,
+    KIRQL       Irql
+    )
+{
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+
+    CurrentIrql = Irql;
+}
+
+KIRQL
+KeGetCurrentIrql(
+    VOID
+    )
+{
+    return CurrentIrql;
+}
+
+VOID
+KeRaiseIrql(
+    KIRQL   NewIrql,
+    PKIRQL  OldIrql
+    )
+{
+    if (NewIrql < CurrentIrql)
+        abort();
+
+    *OldIrql = CurrentIrql;
+    CurrentIrql = NewIrql;
+}
+
+VOID
+KeLowerIrql(
+    KIRQL   NewIrql
+    )
+{
+    if (NewIrql > CurrentIrql)
+        abort();
+
+    CurrentIrql = NewIrql;
+}
+
+// Thread objects are referenced by the thread itself, by the handle
+// returned from PsCreateSystemThread() and by ObReferenceObjectByHandle()
+
+static VOID
+__ThreadDereference(
+    IN  PKTHREAD    Thread
+    )
+{
+    BOOLEAN         Free;
+
+    pthread_mutex_lock(&DispatcherLock);
+    Free = (--Thread->References == 0) ? TRUE : FALSE;
+    pthread_mutex_unlock(&DispatcherLock);
+
+    if (Free)
+        free(Thread);
+}
+
+static VOID
+__ThreadExit(
+    VOID
+    )
+{
+    PKTHREAD    Thread = CurrentThread;
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    Thread->Header.SignalState = 1;
+    __DispatcherBroadcast();
+
+    pthread_mutex_unlock(&DispatcherLock);
+
+    __ThreadDereference(Thread);
+}
+
+static void *
+__ThreadStart(
+    void        *Argument
+    )
+{
+    PKTHREAD    Thread = Argument;
+
+    CurrentThread = Thread;
+
+    Thread->StartRoutine(Thread->StartContext);
+
+    __ThreadExit();
+    return NULL;
+}
+
+NTSTATUS
+PsCreateSystemThread(
+    PHANDLE         Handle,
+    ULONG           DesiredAccess,
+    PVOID           ObjectAttributes,
+    HANDLE          ProcessHandle,
+    PVOID           ClientId,
+    PKSTART_ROUTINE StartRoutine,
+    PVOID           StartContext
+    )
+{
+    PKTHREAD        Thread;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectAttributes);
+    UNREFERENCED_PARAMETER(ProcessHandle);
+    UNREFERENCED_PARAMETER(ClientId);
+
+    Thread = calloc(1, sizeof (struct _KTHREAD));
+    if (Thread == NULL)
+        return STATUS_NO_MEMORY;
+
+    Thread->Header.Type = TestThread;
+    Thread->References = 2;
+    Thread->StartRoutine = StartRoutine;
+    Thread->StartContext = StartContext;
+    Thread->Priority = 8;
+
+    if (pthread_create(&Thread->Id, NULL, __ThreadStart, Thread) != 0) {
+        free(Thread);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    (VOID) pthread_detach(Thread->Id);
+
+    *Handle = Thread;
+    return STATUS_SUCCESS;
+}
+
+VOID
+PsTerminateSystemThread(
+    NTSTATUS    Status
+    )
+{
+    UNREFERENCED_PARAMETER(Status);
+
+    __ThreadExit();
+    pthread_exit(NULL);
+}
+
+NTSTATUS
+__test_ObReferenceObjectByHandle(
+    HANDLE          Handle,
+    ACCESS_MASK     DesiredAccess,
+    POBJECT_TYPE    ObjectType,
+    KPROCESSOR_MODE AccessMode,
+    PVOID           *Object,
+    PVOID           HandleInformation
+    )
+{
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectType);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(HandleInformation);
+
+    pthread_mutex_lock(&DispatcherLock);
+    ((PKTHREAD)Handle)->References++;
+    pthread_mutex_unlock(&DispatcherLock);
+
+    *Object = Handle;
+    return STATUS_SUCCESS;
+}
+
+// Threads are the only objects there are handles to
+VOID
+ObDereferenceObject(
+    PVOID   Object
+    )
+{
+    __ThreadDereference(Object);
+}
+
+NTSTATUS
+ZwClose(
+    HANDLE  Handle
+    )
+{
+    __ThreadDereference(Handle);
+
+    return STATUS_SUCCESS;
+}
+
+PKTHREAD
+KeGetCurrentThread(
+    VOID
+    )
+{
+    return (CurrentThread != NULL) ? CurrentThread : &InitialThread;
+}
+
+KPRIORITY
+KeSetPriorityThread(
+    PKTHREAD    Thread,
+    KPRIORITY   Priority
+    )
+{
+    KPRIORITY   Previous;
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    Previous = Thread->Priority;
+    Thread->Priority = Priority;
+
+    pthread_mutex_unlock(&DispatcherLock);
+
+    return Previous;
+}
+
+VOID
+KeSetSystemGroupAffinityThread(
+    PGROUP_AFFINITY Affinity,
+    PGROUP_AFFINITY PreviousAffinity
+    )
+{
+    PKTHREAD        Thread = KeGetCurrentThread();
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    if (PreviousAffinity != NULL)
+        *PreviousAffinity = Thread->Affinity;
+
+    Thread->Affinity = *Affinity;
+
+    pthread_mutex_unlock(&DispatcherLock);
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(
+    PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    if (ProcNumber != NULL) {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)CurrentProcessor;
+        ProcNumber->Reserved = 0;
+    }
+
+    return CurrentProcessor;
+}
+
+// Processors and DPCs
+
+static ULONG    ProcessorCount = 1;
+static ULONG    DpcCount[64];
+
+VOID
+TestSetProcessorCount(
+    IN  ULONG   Count
+    )
+{
+    if (Count == 0 || Count > ARRAYSIZE(DpcCount))
+        abort();
+
+    ProcessorCount = Count;
+}
+
+ULONG
+TestQueryDpcCount(
+    IN  ULONG   Processor
+    )
+{
+    return __atomic_load_n(&DpcCount[Processor], __ATOMIC_SEQ_CST);
+}
+
+ULONG
+KeQueryMaximumProcessorCountEx(
+    USHORT  GroupNumber
+    )
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return ProcessorCount;
+}
+
+NTSTATUS
+KeGetProcessorNumberFromIndex(
+    ULONG               ProcIndex,
+    PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    if (ProcIndex >= ProcessorCount)
+        return STATUS_INVALID_PARAMETER;
+
+    ProcNumber->Group = 0;
+    ProcNumber->Number = (UCHAR)ProcIndex;
+    ProcNumber->Reserved = 0;
+
+    return STATUS_SUCCESS;
+}
+
+KAFFINITY
+KeQueryGroupAffinity(
+    USHORT  GroupNumber
+    )
+{
+    if (GroupNumber != 0)
+        return 0;
+
+    return (ProcessorCount == 64) ?
+           ~(KAFFINITY)0 :
+           ((KAFFINITY)1 << ProcessorCount) - 1;
+}
+
+VOID
+KeInitializeDpc(
+    PKDPC               Dpc,
+    PKDEFERRED_ROUTINE  DeferredRoutine,
+    PVOID               DeferredContext
+    )
+{
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+    (VOID) KeGetCurrentProcessorNumberEx(&Dpc->Number);
+}
+
+NTSTATUS
+KeSetTargetProcessorDpcEx(
+    PKDPC               Dpc,
+    PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    Dpc->Number = *ProcNumber;
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+    PKDPC   Dpc,
+    PVOID   SystemArgument1,
+    PVOID   SystemArgument2
+    )
+{
+    ULONG   Processor = CurrentProcessor;
+    KIRQL   Irql = CurrentIrql;
+
+    if (Dpc->Number.Group != 0 || Dpc->Number.Number >= ProcessorCount)
+        abort();
+
+    CurrentProcessor = Dpc->Number.Number;
+    CurrentIrql = DISPATCH_LEVEL;
+
+    Dpc->DeferredRoutine(Dpc, Dpc->DeferredContext,
+                         SystemArgument1, SystemArgument2);
+    (VOID) __atomic_add_fetch(&DpcCount[Dpc->Number.Number], 1,
+                              __ATOMIC_SEQ_CST);
+
+    CurrentProcessor = Processor;
+    CurrentIrql = Irql;
+
+    return TRUE;
+}
+
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    )
+{
+}
+
+// Run-down protection. As in the kernel the bottom bit of Count is set
+// once a wait has started and references are counted in twos above it.
+
+VOID
+ExInitializeRundownProtection(
+    PEX_RUNDOWN_REF Rundown
+    )
+{
+    Rundown->Count = 0;
+}
+
+BOOLEAN
+ExAcquireRundownProtection(
+    PEX_RUNDOWN_REF Rundown
+    )
+{
+    ULONG_PTR       Count = __atomic_load_n(&Rundown->Count, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        if (Count & 1)
+            return FALSE;
+
+        if (__atomic_compare_exchange_n(&Rundown->Count, &Count, Count + 2,
+                                        FALSE, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST))
+            return TRUE;
+    }
+}
+
+VOID
+ExReleaseRundownProtection(
+    PEX_RUNDOWN_REF Rundown
+    )
+{
+    if (__atomic_sub_fetch(&Rundown->Count, 2, __ATOMIC_SEQ_CST) != 1)
+        return;
+
+    pthread_mutex_lock(&DispatcherLock);
+    __DispatcherBroadcast();
+    pthread_mutex_unlock(&DispatcherLock);
+}
+
+VOID
+ExWaitForRundownProtectionRelease(
+    PEX_RUNDOWN_REF Rundown
+    )
+{
+    (VOID) __atomic_fetch_or(&Rundown->Count, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&DispatcherLock);
+
+    while (__atomic_load_n(&Rundown->Count, __ATOMIC_SEQ_CST) != 1)
+        pthread_cond_wait(&DispatcherCondition, &DispatcherLock);
+
+    pthread_mutex_unlock(&DispatcherLock);
+}
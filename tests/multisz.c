@@ -0,0 +1,331 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The multi-sz helpers behind __FdoClearDistribution(), and a comparison
+// of the view based parse against the copying parse it replaced, over a
+// synthetic 255 entry drivers directory
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include "pool.h"
+#include "util.h"
+#include "test.h"
+
+#define MULTISZ_TAG 'TSUM'
+
+static VOID
+TestCount(
+    VOID
+    )
+{
+    CHAR    Empty[] = "\0";
+    CHAR    One[] = "abc\0";
+    CHAR    Three[] = "a\0bc\0def\0";
+
+    CHECK3U(__MultiSzCount(Empty), ==, 1);
+    CHECK3U(__MultiSzCount(One), ==, 1);
+    CHECK3U(__MultiSzCount(Three), ==, 3);
+}
+
+static VOID
+TestViews(
+    VOID
+    )
+{
+    CHAR        Buffer[] = "a\0bc\0def\0";
+    ANSI_STRING Ansi[4];
+    ULONG       Count;
+
+    RtlZeroMemory(Ansi, sizeof (Ansi));
+
+    Count = __MultiSzCount(Buffer);
+    __MultiSzToViews(Buffer, Ansi, Count);
+
+    CHECK(Ansi[0].Buffer == &Buffer[0]);
+    CHECK3U(Ansi[0].Length, ==, 1);
+    CHECK3U(Ansi[0].MaximumLength, ==, 2);
+    CHECK(Ansi[1].Buffer == &Buffer[2]);
+    CHECK3U(Ansi[1].Length, ==, 2);
+    CHECK(Ansi[2].Buffer == &Buffer[5]);
+    CHECK3U(Ansi[2].Length, ==, 3);
+    CHECK(strcmp(Ansi[2].Buffer, "def") == 0);
+
+    // The array is one longer than Count and its terminator is untouched
+    CHECK(Ansi[3].Buffer == NULL);
+}
+
+static BOOLEAN
+__IsIndex(
+    IN  const CHAR  *Text,
+    IN  ULONG       Maximum
+    )
+{
+    ANSI_STRING     Ansi;
+
+    Ansi.Buffer = (PCHAR)Text;
+    Ansi.Length = (USHORT)strlen(Text);
+    Ansi.MaximumLength = Ansi.Length + 1;
+
+    return __IsDecimalIndex(&Ansi, Maximum);
+}
+
+static VOID
+TestDecimalIndex(
+    VOID
+    )
+{
+    ULONG   Value;
+    CHAR    Text[8];
+
+    // Everything StringPrintf("%u") produces for the range is accepted...
+    for (Value = 0; Value <= 255; Value++) {
+        (VOID) snprintf(Text, sizeof (Text), "%u", Value);
+        CHECK(__IsIndex(Text, 255));
+    }
+
+    // ...and nothing else
+    CHECK(!__IsIndex("256", 255));
+    CHECK(!__IsIndex("999", 255));
+    CHECK(!__IsIndex("1000", 999));
+    CHECK(!__IsIndex("", 255));
+    CHECK(!__IsIndex("00", 255));
+    CHECK(!__IsIndex("01", 255));
+    CHECK(!__IsIndex("-1", 255));
+    CHECK(!__IsIndex("+1", 255));
+    CHECK(!__IsIndex("1a", 255));
+    CHECK(!__IsIndex(" 1", 255));
+    CHECK(!__IsIndex("xenvbd", 255));
+    CHECK(__IsIndex("10", 10));
+    CHECK(!__IsIndex("11", 10));
+}
+
+// The directory as XenStore returns it: a mix of our own indices and
+// entries written by other drivers
+static ULONG
+TestBuildDirectory(
+    OUT PCHAR   Buffer,
+    IN  ULONG   Size
+    )
+{
+    ULONG       Offset;
+    ULONG       Index;
+
+    Offset = 0;
+    for (Index = 0; Index < 255; Index++) {
+        int Length;
+
+        if (Index % 8 == 7)
+            Length = snprintf(Buffer + Offset, Size - Offset,
+                              "xenvbd-%u", Index);
+        else
+            Length = snprintf(Buffer + Offset, Size - Offset,
+                              "%u", Index);
+
+        Offset += (ULONG)Length + 1;
+    }
+
+    Buffer[Offset++] = '\0';
+    return Offset;
+}
+
+// The parse as it was before entries became views: an allocation and a
+// copy for each of them
+static PANSI_STRING
+CopyingMultiSzToAnsi(
+    IN  PCHAR       Buffer
+    )
+{
+    PANSI_STRING    Ansi;
+    ULONG           Count;
+    ULONG           Index;
+
+    Count = __MultiSzCount(Buffer);
+
+    Ansi = PoolAllocate(sizeof (ANSI_STRING) * (Count + 1), MULTISZ_TAG);
+    if (Ansi == NULL)
+        return NULL;
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Length;
+
+        Length = (ULONG)strlen(Buffer);
+        Ansi[Index].MaximumLength = (USHORT)(Length + 1);
+        Ansi[Index].Buffer = PoolAllocate(Ansi[Index].MaximumLength,
+                                          MULTISZ_TAG);
+        RtlCopyMemory(Ansi[Index].Buffer, Buffer, Length);
+        Ansi[Index].Length = (USHORT)Length;
+
+        Buffer += Length + 1;
+    }
+
+    return Ansi;
+}
+
+static VOID
+CopyingFreeAnsi(
+    IN  PANSI_STRING    Ansi
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Ansi[Index].Buffer != NULL; Index++)
+        PoolFree(Ansi[Index].Buffer, MULTISZ_TAG);
+
+    PoolFree(Ansi, MULTISZ_TAG);
+}
+
+static PANSI_STRING
+ViewMultiSzToAnsi(
+    IN  PCHAR       Buffer
+    )
+{
+    PANSI_STRING    Ansi;
+    ULONG           Count;
+
+    Count = __MultiSzCount(Buffer);
+
+    Ansi = PoolAllocate(sizeof (ANSI_STRING) * (Count + 1), MULTISZ_TAG);
+    if (Ansi == NULL)
+        return NULL;
+
+    __MultiSzToViews(Buffer, Ansi, Count);
+
+    return Ansi;
+}
+
+static VOID
+TestDirectory(
+    VOID
+    )
+{
+    static CHAR     Directory[4096];
+    PANSI_STRING    Copy;
+    PANSI_STRING    View;
+    ULONG           Index;
+    ULONG           Matches;
+
+    (VOID) TestBuildDirectory(Directory, sizeof (Directory));
+
+    Copy = CopyingMultiSzToAnsi(Directory);
+    View = ViewMultiSzToAnsi(Directory);
+
+    Matches = 0;
+    for (Index = 0; Copy[Index].Buffer != NULL; Index++) {
+        CHECK(View[Index].Buffer != NULL);
+        CHECK3U(View[Index].Length, ==, Copy[Index].Length);
+        CHECK(memcmp(View[Index].Buffer,
+                     Copy[Index].Buffer,
+                     Copy[Index].Length) == 0);
+
+        if (__IsDecimalIndex(&View[Index], 255))
+            Matches++;
+    }
+
+    CHECK3U(Index, ==, 255);
+    CHECK(View[Index].Buffer == NULL);
+
+    // Every eighth entry belongs to someone else and is skipped without
+    // being read
+    CHECK3U(Matches, ==, 255 - (255 / 8));
+
+    CopyingFreeAnsi(Copy);
+    PoolFree(View, MULTISZ_TAG);
+}
+
+#define BENCH_ITERATIONS    100000
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static CHAR Directory[4096];
+    ULONGLONG   Start;
+    ULONG       Iteration;
+    ULONG       Matches;
+
+    (VOID) TestBuildDirectory(Directory, sizeof (Directory));
+
+    printf("multisz: 255 entry directory, %u iterations\n", BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        PANSI_STRING    Ansi = CopyingMultiSzToAnsi(Directory);
+
+        CopyingFreeAnsi(Ansi);
+    }
+    TestReport("copying parse", TestNow() - Start, BENCH_ITERATIONS);
+
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        PANSI_STRING    Ansi = ViewMultiSzToAnsi(Directory);
+
+        PoolFree(Ansi, MULTISZ_TAG);
+    }
+    TestReport("view parse", TestNow() - Start, BENCH_ITERATIONS);
+
+    Matches = 0;
+    Start = TestNow();
+    for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {
+        PANSI_STRING    Ansi = ViewMultiSzToAnsi(Directory);
+        ULONG           Index;
+
+        for (Index = 0; Ansi[Index].Buffer != NULL; Index++)
+            if (__IsDecimalIndex(&Ansi[Index], 255))
+                Matches++;
+
+        PoolFree(Ansi, MULTISZ_TAG);
+    }
+    TestReport("view parse + index filter", TestNow() - Start, BENCH_ITERATIONS);
+
+    CHECK3U(Matches, ==, (ULONGLONG)BENCH_ITERATIONS * (255 - (255 / 8)));
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestCount();
+    TestViews();
+    TestDecimalIndex();
+    TestDirectory();
+
+    if (Bench)
+        Benchmark();
+
+    return TestExit("multisz");
+}
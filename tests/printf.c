@@ -0,0 +1,557 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// StringPrintf() checked against the C library's snprintf(), one random
+// conversion at a time, and the two timed on the formats the driver
+// actually uses.
+//
+// Where the driver deliberately differs from C the reference format is
+// adjusted to match:
+//
+//   %s, %ws, %Z, %wZ   left justified by default, '-' right justifies
+//   %p                 always zero padded upper case hex, no 0x prefix
+//   %c, %wc            no padding
+//   %wc, %ws, %wZ      each WCHAR is truncated to a CHAR
+//
+// A zero padded negative %d puts the padding before the sign (where C
+// puts it after) so that combination is not generated.
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "string.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "test.h"
+
+static ULONGLONG    TestRandomState = 0x9E3779B97F4A7C15ull;
+
+static ULONGLONG
+TestRandom(
+    VOID
+    )
+{
+    ULONGLONG   Value = TestRandomState;
+
+    Value ^= Value << 13;
+    Value ^= Value >> 7;
+    Value ^= Value << 17;
+
+    TestRandomState = Value;
+    return Value;
+}
+
+static ULONG
+TestRandomBelow(
+    IN  ULONG   Limit
+    )
+{
+    return (ULONG)(TestRandom() % Limit);
+}
+
+// Mostly values at the edges of the type, where the bugs are
+static ULONGLONG
+TestRandomNumber(
+    VOID
+    )
+{
+    static const ULONGLONG  Edges[] = {
+        0, 1, 9, 10, 99, 100, 0x7F, 0x80, 0xFF,
+        0x7FFFFFFF, 0x80000000, 0xFFFFFFFF,
+        0x100000000ull, 0x7FFFFFFFFFFFFFFFull,
+        0x8000000000000000ull, 0xFFFFFFFFFFFFFFFFull
+    };
+
+    if (TestRandomBelow(4) == 0)
+        return Edges[TestRandomBelow(ARRAYSIZE(Edges))];
+
+    return TestRandom() >> TestRandomBelow(64);
+}
+
+typedef enum _TEST_KIND {
+    TEST_KIND_NUMBER,
+    TEST_KIND_LONG_NUMBER,
+    TEST_KIND_POINTER,
+    TEST_KIND_CHAR,
+    TEST_KIND_WIDE_CHAR,
+    TEST_KIND_STRING,
+    TEST_KIND_WIDE_STRING,
+    TEST_KIND_ANSI_STRING,
+    TEST_KIND_UNICODE_STRING,
+    TEST_KIND_COUNT
+} TEST_KIND;
+
+#define TEST_TEXT_LENGTH    24
+
+typedef struct _TEST_CASE {
+    TEST_KIND       Kind;
+    CHAR            Format[32];
+    CHAR            Reference[32];
+    ULONGLONG       Number;
+    CHAR            Text[TEST_TEXT_LENGTH + 1];
+    WCHAR           WideText[TEST_TEXT_LENGTH + 1];
+    BOOLEAN         Null;
+    ANSI_STRING     Ansi;
+    UNICODE_STRING  Unicode;
+} TEST_CASE, *PTEST_CASE;
+
+static VOID
+TestRandomText(
+    IN  PTEST_CASE  Case
+    )
+{
+    ULONG           Length = TestRandomBelow(TEST_TEXT_LENGTH + 1);
+    ULONG           Index;
+
+    for (Index = 0; Index < Length; Index++) {
+        // Above 0xFF only the low byte survives, so keep it printable
+        WCHAR   Value = (WCHAR)(' ' + TestRandomBelow(95));
+
+        if (TestRandomBelow(8) == 0)
+            Value |= (WCHAR)(TestRandomBelow(0xFF) + 1) << 8;
+
+        Case->WideText[Index] = Value;
+        Case->Text[Index] = (CHAR)Value;
+    }
+
+    Case->WideText[Length] = L'\0';
+    Case->Text[Length] = '\0';
+}
+
+static VOID
+TestGenerate(
+    OUT PTEST_CASE  Case
+    )
+{
+    BOOLEAN         Opposite = (TestRandomBelow(4) == 0);
+    BOOLEAN         Zero = (TestRandomBelow(3) == 0);
+    ULONG           Pad = (TestRandomBelow(2) == 0) ? TestRandomBelow(40) : 0;
+    CHAR            Flags[8];
+    CHAR            ReferenceFlags[8];
+    ULONG           Length;
+
+    RtlZeroMemory(Case, sizeof (TEST_CASE));
+
+    Case->Kind = (TEST_KIND)TestRandomBelow(TEST_KIND_COUNT);
+    Case->Number = TestRandomNumber();
+    Case->Null = (TestRandomBelow(16) == 0);
+    TestRandomText(Case);
+
+    // A leading zero in the width is what selects zero padding
+    if (Pad == 0)
+        Zero = FALSE;
+
+    switch (Case->Kind) {
+    case TEST_KIND_NUMBER:
+    case TEST_KIND_LONG_NUMBER: {
+        static const CHAR   Conversions[] = "duoxX";
+        CHAR                Conversion = Conversions[TestRandomBelow(5)];
+        BOOLEAN             Long = (Case->Kind == TEST_KIND_LONG_NUMBER);
+        BOOLEAN             Negative;
+
+        Negative = (Conversion == 'd') &&
+                   ((Long) ? (LONGLONG)Case->Number < 0 :
+                             (LONG)Case->Number < 0);
+        if (Negative)
+            Zero = FALSE;
+
+        (VOID) snprintf(Flags, sizeof (Flags), "%s%s",
+                        (Opposite) ? "-" : "",
+                        (Zero) ? "0" : "");
+
+        if (Pad != 0) {
+            (VOID) snprintf(Case->Format, sizeof (Case->Format),
+                            "%%%s%u%s%c", Flags, Pad,
+                            (Long) ? "ll" : (TestRandomBelow(2) ? "l" : ""),
+                            Conversion);
+            (VOID) snprintf(Case->Reference, sizeof (Case->Reference),
+                            "%%%s%u%s%c", Flags, Pad,
+                            (Long) ? "ll" : "", Conversion);
+        } else {
+            (VOID) snprintf(Case->Format, sizeof (Case->Format),
+                            "%%%s%s%c", (Opposite) ? "-" : "",
+                            (Long) ? "ll" : "", Conversion);
+            (VOID) snprintf(Case->Reference, sizeof (Case->Reference),
+                            "%%%s%s%c", (Opposite) ? "-" : "",
+                            (Long) ? "ll" : "", Conversion);
+        }
+        break;
+    }
+    case TEST_KIND_POINTER:
+        (VOID) snprintf(Case->Format, sizeof (Case->Format), "%%p");
+        (VOID) snprintf(Case->Reference, sizeof (Case->Reference),
+                        "%%0%ullX", (ULONG)(sizeof (ULONG_PTR) * 2));
+        break;
+
+    case TEST_KIND_CHAR:
+    case TEST_KIND_WIDE_CHAR:
+        // A NUL would end the reference output early
+        if (Case->Text[0] == '\0') {
+            Case->Text[0] = 'c';
+            Case->WideText[0] = L'c';
+        }
+
+        (VOID) snprintf(Case->Format, sizeof (Case->Format), "%%%sc",
+                        (Case->Kind == TEST_KIND_WIDE_CHAR) ? "w" : "");
+        (VOID) snprintf(Case->Reference, sizeof (Case->Reference), "%%c");
+        break;
+
+    case TEST_KIND_STRING:
+    case TEST_KIND_WIDE_STRING:
+    case TEST_KIND_ANSI_STRING:
+    case TEST_KIND_UNICODE_STRING: {
+        const CHAR  *Modifier;
+
+        switch (Case->Kind) {
+        case TEST_KIND_STRING:
+            Modifier = "s";
+            break;
+
+        case TEST_KIND_WIDE_STRING:
+            Modifier = "ws";
+            break;
+
+        case TEST_KIND_ANSI_STRING:
+            Modifier = "Z";
+            break;
+
+        default:
+            Modifier = "wZ";
+            break;
+        }
+
+        // Counted strings are views of a prefix, so the characters
+        // beyond Length must not be printed
+        Length = (ULONG)strlen(Case->Text);
+        Length = (Length == 0) ? 0 : TestRandomBelow(Length + 1);
+
+        Case->Ansi.Buffer = Case->Text;
+        Case->Ansi.Length = (USHORT)Length;
+        Case->Ansi.MaximumLength = (USHORT)sizeof (Case->Text);
+        Case->Unicode.Buffer = Case->WideText;
+        Case->Unicode.Length = (USHORT)(Length * sizeof (WCHAR));
+        Case->Unicode.MaximumLength = (USHORT)sizeof (Case->WideText);
+
+        if (Case->Kind == TEST_KIND_STRING ||
+            Case->Kind == TEST_KIND_WIDE_STRING)
+            Length = (ULONG)strlen(Case->Text);
+
+        if (Case->Null)
+            Length = sizeof ("(null)") - 1;
+
+        // The padding is always spaces and the justification is the
+        // opposite of C's
+        (VOID) snprintf(Flags, sizeof (Flags), "%s%s",
+                        (Opposite) ? "-" : "",
+                        (Zero) ? "0" : "");
+        (VOID) snprintf(ReferenceFlags, sizeof (ReferenceFlags), "%s",
+                        (Opposite) ? "" : "-");
+
+        if (Pad != 0) {
+            (VOID) snprintf(Case->Format, sizeof (Case->Format),
+                            "%%%s%u%s", Flags, Pad, Modifier);
+            (VOID) snprintf(Case->Reference, sizeof (Case->Reference),
+                            "%%%s%u.%us", ReferenceFlags, Pad, Length);
+        } else {
+            (VOID) snprintf(Case->Format, sizeof (Case->Format),
+                            "%%%s%s", (Opposite) ? "-" : "", Modifier);
+            (VOID) snprintf(Case->Reference, sizeof (Case->Reference),
+                            "%%.%us", Length);
+        }
+        break;
+    }
+    default:
+        ASSERT(FALSE);
+        break;
+    }
+}
+
+static NTSTATUS
+TestPrint(
+    IN  PSTRING     String,
+    IN  PTEST_CASE  Case
+    )
+{
+    switch (Case->Kind) {
+    case TEST_KIND_NUMBER:
+        return StringPrintf(String, Case->Format, (ULONG)Case->Number);
+
+    case TEST_KIND_LONG_NUMBER:
+        return StringPrintf(String, Case->Format, Case->Number);
+
+    case TEST_KIND_POINTER:
+        return StringPrintf(String, Case->Format, (PVOID)(ULONG_PTR)Case->Number);
+
+    case TEST_KIND_CHAR:
+        return StringPrintf(String, Case->Format, Case->Text[0]);
+
+    case TEST_KIND_WIDE_CHAR:
+        return StringPrintf(String, Case->Format, Case->WideText[0]);
+
+    case TEST_KIND_STRING:
+        return StringPrintf(String, Case->Format,
+                            (Case->Null) ? NULL : Case->Text);
+
+    case TEST_KIND_WIDE_STRING:
+        return StringPrintf(String, Case->Format,
+                            (Case->Null) ? NULL : Case->WideText);
+
+    case TEST_KIND_ANSI_STRING:
+        return StringPrintf(String, Case->Format,
+                            (Case->Null) ? NULL : &Case->Ansi);
+
+    case TEST_KIND_UNICODE_STRING:
+        return StringPrintf(String, Case->Format,
+                            (Case->Null) ? NULL : &Case->Unicode);
+
+    default:
+        ASSERT(FALSE);
+        return STATUS_INVALID_PARAMETER;
+    }
+}
+
+static ULONG
+TestReference(
+    OUT PCHAR       Buffer,
+    IN  ULONG       Size,
+    IN  PTEST_CASE  Case
+    )
+{
+    int             Length;
+
+    switch (Case->Kind) {
+    case TEST_KIND_NUMBER:
+        Length = snprintf(Buffer, Size, Case->Reference,
+                          (unsigned int)Case->Number);
+        break;
+
+    case TEST_KIND_LONG_NUMBER:
+    case TEST_KIND_POINTER:
+        Length = snprintf(Buffer, Size, Case->Reference,
+                          (unsigned long long)Case->Number);
+        break;
+
+    case TEST_KIND_CHAR:
+    case TEST_KIND_WIDE_CHAR:
+        Length = snprintf(Buffer, Size, Case->Reference, Case->Text[0]);
+        break;
+
+    default:
+        Length = snprintf(Buffer, Size, Case->Reference,
+                          (Case->Null) ? "(null)" : Case->Text);
+        break;
+    }
+
+    ASSERT(Length >= 0 && (ULONG)Length < Size);
+    return (ULONG)Length;
+}
+
+#define TEST_ITERATIONS 200000
+
+static VOID
+TestDifferential(
+    VOID
+    )
+{
+    ULONG       Iteration;
+    ULONG       Mask;
+
+    // Truncation is expected to fail, so don't print it
+    Mask = DbgPrintMask;
+    DbgPrintMask = 0;
+
+    for (Iteration = 0; Iteration < TEST_ITERATIONS; Iteration++) {
+        TEST_CASE   Case;
+        CHAR        Expected[128];
+        CHAR        Buffer[128];
+        ULONG       Length;
+        ULONG       Maximum;
+        STRING      String;
+        NTSTATUS    status;
+
+        TestGenerate(&Case);
+        Length = TestReference(Expected, sizeof (Expected), &Case);
+
+        // With room to spare
+        RtlFillMemory(Buffer, sizeof (Buffer), 'x');
+        String.Buffer = Buffer;
+        String.MaximumLength = sizeof (Buffer);
+        String.Length = 0;
+
+        status = TestPrint(&String, &Case);
+        CHECK3U(status, ==, STATUS_SUCCESS);
+        CHECK3U(String.Length, ==, Length);
+        CHECK(memcmp(Buffer, Expected, Length + 1) == 0);
+
+        if (TestFailures != 0) {
+            fprintf(stderr, "'%s' (reference '%s'): '%.*s' != '%s'\n",
+                    Case.Format, Case.Reference,
+                    (int)String.Length, Buffer, Expected);
+            break;
+        }
+
+        // Measured only
+        String.Buffer = NULL;
+        String.MaximumLength = 0;
+        String.Length = 0;
+
+        status = TestPrint(&String, &Case);
+        CHECK3U(status, ==, STATUS_SUCCESS);
+        CHECK3U(String.Length, ==, Length);
+
+        // Truncated, or only just not. One character is kept in reserve
+        // even when writing the NUL so success needs two spare
+        Maximum = TestRandomBelow(Length + 4);
+
+        RtlFillMemory(Buffer, sizeof (Buffer), 'x');
+        String.Buffer = Buffer;
+        String.MaximumLength = (USHORT)Maximum;
+        String.Length = 0;
+
+        status = TestPrint(&String, &Case);
+        if (Length + 2 <= Maximum) {
+            CHECK3U(status, ==, STATUS_SUCCESS);
+            CHECK3U(String.Length, ==, Length);
+            CHECK(memcmp(Buffer, Expected, Length + 1) == 0);
+        } else {
+            ULONG   Written = (Maximum == 0) ? 0 : min(Length, Maximum - 1);
+
+            CHECK3U(status, ==, STATUS_BUFFER_OVERFLOW);
+            CHECK3U(String.Length, ==, Written);
+            CHECK(memcmp(Buffer, Expected, Written) == 0);
+            CHECK(Buffer[Written] == 'x' || Written + 1 > Maximum);
+        }
+
+        if (TestFailures != 0) {
+            fprintf(stderr, "'%s' (reference '%s'), maximum %u\n",
+                    Case.Format, Case.Reference, Maximum);
+            break;
+        }
+    }
+
+    DbgPrintMask = Mask;
+}
+
+// Several conversions in one format, including '%%' and literal runs
+static VOID
+TestCombined(
+    VOID
+    )
+{
+    CHAR        Buffer[128];
+    STRING      String;
+    ANSI_STRING Ansi;
+    NTSTATUS    status;
+
+    Ansi.Buffer = "statistics";
+    Ansi.Length = 4;
+    Ansi.MaximumLength = sizeof ("statistics");
+
+    String.Buffer = Buffer;
+    String.MaximumLength = sizeof (Buffer);
+    String.Length = 0;
+
+    status = StringPrintf(&String,
+                          "%s %s %u.%u.%u.%u %s|%d%%|%Z|%-6s|%04x",
+                          "Xen_Project", "XENHID", 9, 1, 0, 42, "(DEBUG)",
+                          -7, &Ansi, "ab", 0xbeef);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    CHECK(strcmp(Buffer,
+                 "Xen_Project XENHID 9.1.0.42 (DEBUG)|-7%|stat|    ab|beef")
+          == 0);
+    CHECK3U(String.Length, ==, strlen(Buffer));
+}
+
+#define BENCH_ITERATIONS    1000000
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    CHAR        Buffer[128];
+    STRING      String;
+    ULONGLONG   Start;
+    ULONG       Iteration;
+
+    printf("printf: %u iterations\n", BENCH_ITERATIONS);
+
+#define BENCH(_Name, _Format, ...)                                          \
+    do {                                                                    \
+        Start = TestNow();                                                  \
+        for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {    \
+            String.Buffer = Buffer;                                         \
+            String.MaximumLength = sizeof (Buffer);                         \
+            String.Length = 0;                                              \
+                                                                            \
+            (VOID) StringPrintf(&String, _Format, __VA_ARGS__);             \
+            __asm__ __volatile__("" : : "r" (Buffer) : "memory");           \
+        }                                                                   \
+        TestReport("StringPrintf " _Name, TestNow() - Start,                \
+                   BENCH_ITERATIONS);                                       \
+                                                                            \
+        Start = TestNow();                                                  \
+        for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {    \
+            (VOID) snprintf(Buffer, sizeof (Buffer), _Format, __VA_ARGS__); \
+            __asm__ __volatile__("" : : "r" (Buffer) : "memory");           \
+        }                                                                   \
+        TestReport("snprintf " _Name, TestNow() - Start,                    \
+                   BENCH_ITERATIONS);                                       \
+    } while (FALSE)
+
+    BENCH("\"%u\"", "%u", Iteration & 0xFF);
+    BENCH("\"data/xenhid/%u\"", "data/xenhid/%u", Iteration & 0xFF);
+    BENCH("\"%s/statistics\"", "%s/statistics", "data/xenhid/0");
+    BENCH("record", "%s %s %u.%u.%u.%u %s",
+          "Xen_Project", "XENHID", 9, 1, 0, Iteration, "(DEBUG)");
+    BENCH("\"%08x\"", "%08x", Iteration);
+
+#undef  BENCH
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestDifferential();
+    TestCombined();
+
+    if (Bench)
+        Benchmark();
+
+    return TestExit("printf");
+}
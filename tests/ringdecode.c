@@ -0,0 +1,372 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The per-processor event rings in ring.c, recorded for real and then
+// decoded by scripts/ringdecode.py from a raw copy of the memory, as it
+// would be from a crash dump. Also checks that RingRecord() leaves the
+// IRQL as it found it and that RingTeardown() runs its flush DPC on
+// every processor.
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ring.h"
+#include "test.h"
+
+// RingDescriptor as a debugger sees it: the layout is part of the dump
+// format, so it is spelled out here rather than shared with ring.c
+typedef struct _TEST_RING_DESCRIPTOR {
+    ULONG   Magic;
+    ULONG   Version;
+    ULONG   EntrySize;
+    ULONG   EntryCount;
+    ULONG   RingCount;
+    ULONG   RingSize;
+    PUCHAR  Ring;
+} TEST_RING_DESCRIPTOR, *PTEST_RING_DESCRIPTOR;
+
+extern TEST_RING_DESCRIPTOR RingDescriptor;
+
+#define TEST_DESCRIPTOR_SIZE    0x18
+#define TEST_RING_HEADER_SIZE   8
+#define TEST_SEQUENCE_OFFSET    40
+
+// Must match RING_EVENT, and so the decoder's table
+static const CHAR   *TestEventName[] = {
+    "invalid",
+    "report-arrival",
+    "report-refused",
+    "irp-queue",
+    "irp-complete",
+    "irp-cancel",
+    "power-start",
+    "power-end",
+    "thread-wake",
+    "thread-alert",
+    "thread-exit",
+};
+
+C_ASSERT(ARRAYSIZE(TestEventName) == RING_EVENT_COUNT);
+
+#define TEST_PROCESSORS 3
+#define TEST_WRAP       300 // Events recorded by processor 1
+#define TEST_EVENTS     (TEST_WRAP + 8)
+
+typedef struct _TEST_ENTRY {
+    ULONG64     Timestamp;
+    ULONG       Processor;
+    RING_EVENT  Event;
+    ULONG_PTR   Fdo;
+    ULONG_PTR   Argument[2];
+    BOOLEAN     Visible;
+} TEST_ENTRY, *PTEST_ENTRY;
+
+static TEST_ENTRY   TestEntry[TEST_EVENTS];
+static ULONG        TestEntryCount;
+static ULONG64      TestTimestamp;
+
+static VOID
+TestRecord(
+    IN  ULONG       Processor,
+    IN  RING_EVENT  Event,
+    IN  ULONG_PTR   Fdo,
+    IN  ULONG_PTR   Argument0,
+    IN  ULONG_PTR   Argument1
+    )
+{
+    PTEST_ENTRY     Entry = &TestEntry[TestEntryCount++];
+
+    TestSetCurrentProcessor(Processor);
+    RingRecord(Event, (PVOID)Fdo, Argument0, Argument1);
+
+    // Each record reads the (virtual) time stamp counter once
+    Entry->Timestamp = ++TestTimestamp;
+    Entry->Processor = Processor;
+    Entry->Event = Event;
+    Entry->Fdo = Fdo;
+    Entry->Argument[0] = Argument0;
+    Entry->Argument[1] = Argument1;
+    Entry->Visible = TRUE;
+}
+
+static BOOLEAN
+TestWriteFile(
+    IN  const CHAR  *Path,
+    IN  const VOID  *Buffer,
+    IN  ULONG       Length
+    )
+{
+    FILE            *File;
+    BOOLEAN         Success;
+
+    File = fopen(Path, "wb");
+    if (File == NULL)
+        return FALSE;
+
+    Success = (fwrite(Buffer, 1, Length, File) == Length) ? TRUE : FALSE;
+
+    if (fclose(File) != 0)
+        Success = FALSE;
+
+    return Success;
+}
+
+// Run the decoder, returning its exit status and what it wrote to
+// whichever of stdout or stderr Redirect leaves
+static int
+TestDecode(
+    IN  const CHAR  *Arguments,
+    IN  const CHAR  *Redirect,
+    OUT PCHAR       Output,
+    IN  ULONG       Size
+    )
+{
+    const CHAR      *Python = getenv("PYTHON");
+    CHAR            Command[512];
+    FILE            *Pipe;
+    size_t          Length;
+    int             Status;
+
+    if (Python == NULL)
+        Python = "python3";
+
+    (VOID) snprintf(Command, sizeof (Command),
+                    "%s ../scripts/ringdecode.py %s %s",
+                    Python, Arguments, Redirect);
+
+    Pipe = popen(Command, "r");
+    if (Pipe == NULL)
+        return -1;
+
+    Length = fread(Output, 1, Size - 1, Pipe);
+    Output[Length] = '\0';
+
+    Status = pclose(Pipe);
+    return WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+}
+
+static VOID
+TestRings(
+    VOID
+    )
+{
+    static CHAR             Output[64 * 1024];
+    static CHAR             Expected[64 * 1024];
+    PTEST_RING_DESCRIPTOR   Descriptor = &RingDescriptor;
+    CHAR                    DescriptorPath[] = "/tmp/ringdescXXXXXX";
+    CHAR                    RingPath[] = "/tmp/ringdumpXXXXXX";
+    CHAR                    Arguments[128];
+    TEST_RING_DESCRIPTOR    Copy;
+    PUCHAR                  Dump;
+    ULONG                   Length;
+    ULONG                   Index;
+    ULONG64                 Start;
+    PCHAR                   Cursor;
+    int                     Fd;
+    KIRQL                   Irql;
+
+    TestSetProcessorCount(TEST_PROCESSORS);
+    CHECK3U(RingInitialize(), ==, STATUS_SUCCESS);
+
+    CHECK3U(Descriptor->Magic, ==, 'GNIR');
+    CHECK3U(Descriptor->EntrySize, ==, 48);
+    CHECK3U(Descriptor->EntryCount, ==, 256);
+    CHECK3U(Descriptor->RingCount, ==, TEST_PROCESSORS);
+    CHECK3U(Descriptor->RingSize, ==,
+            TEST_RING_HEADER_SIZE +
+            Descriptor->EntryCount * Descriptor->EntrySize);
+    CHECK(Descriptor->Ring != NULL);
+
+    // Processor 0 records a few events, interleaved with processor 1
+    // recording enough to wrap its ring. Processor 2 records nothing.
+    for (Index = 0; Index < TEST_WRAP; Index++) {
+        if (Index % 100 == 0)
+            TestRecord(0, RING_EVENT_REPORT_ARRIVAL, 0xFFFF8000DEAD0000ull,
+                       Index, 64);
+
+        TestRecord(1, (RING_EVENT)(1 + Index % (RING_EVENT_COUNT - 1)),
+                   (Index % 2) ? 0 : 0xFFFF8000BEEF0000ull,
+                   Index, ~(ULONG_PTR)Index);
+    }
+
+    // Recording at DISPATCH_LEVEL is fine, and either way the IRQL is
+    // left as it was found
+    CHECK3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    TestRecord(0, RING_EVENT_IRP_COMPLETE, 0xFFFF8000DEAD0000ull, 1, 2);
+    CHECK3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    KeLowerIrql(Irql);
+
+    CHECK3U(TestEntryCount, <=, TEST_EVENTS);
+
+    // The oldest of processor 1's entries have been overwritten
+    Length = 0;
+    for (Index = TestEntryCount; Index != 0; Index--) {
+        PTEST_ENTRY Entry = &TestEntry[Index - 1];
+
+        if (Entry->Processor != 1)
+            continue;
+
+        if (++Length > Descriptor->EntryCount)
+            Entry->Visible = FALSE;
+    }
+
+    // Copy everything out, as from a dump, and tear processor 0's
+    // second entry as if its writer had been interrupted
+    Length = Descriptor->RingCount * Descriptor->RingSize;
+
+    Dump = malloc(Length);
+    CHECK(Dump != NULL);
+    if (Dump == NULL)
+        return;
+
+    RtlCopyMemory(Dump, Descriptor->Ring, Length);
+    RtlZeroMemory(&Dump[TEST_RING_HEADER_SIZE +
+                        Descriptor->EntrySize +
+                        TEST_SEQUENCE_OFFSET],
+                  sizeof (LONG));
+
+    Length = 0;
+    for (Index = 0; Index < TestEntryCount; Index++) {
+        if (TestEntry[Index].Processor == 0 && ++Length == 2) {
+            TestEntry[Index].Visible = FALSE;
+            break;
+        }
+    }
+
+    Length = Descriptor->RingCount * Descriptor->RingSize;
+
+    Fd = mkstemp(DescriptorPath);
+    CHECK(Fd >= 0);
+    (VOID) close(Fd);
+
+    Fd = mkstemp(RingPath);
+    CHECK(Fd >= 0);
+    (VOID) close(Fd);
+
+    CHECK(TestWriteFile(DescriptorPath, Descriptor, TEST_DESCRIPTOR_SIZE));
+    CHECK(TestWriteFile(RingPath, Dump, Length));
+
+    // The timeline, oldest first
+    Start = 0;
+    Cursor = Expected;
+    for (;;) {
+        PTEST_ENTRY Next = NULL;
+
+        for (Index = 0; Index < TestEntryCount; Index++) {
+            PTEST_ENTRY Entry = &TestEntry[Index];
+
+            if (!Entry->Visible)
+                continue;
+
+            if (Next == NULL || Entry->Timestamp < Next->Timestamp)
+                Next = Entry;
+        }
+
+        if (Next == NULL)
+            break;
+
+        if (Start == 0)
+            Start = Next->Timestamp;
+
+        Cursor += snprintf(Cursor, sizeof (Expected) - (Cursor - Expected),
+                           "%16llu cpu%-3u %-16s fdo %016llx %016llx %016llx\n",
+                           Next->Timestamp - Start,
+                           Next->Processor,
+                           TestEventName[Next->Event],
+                           (ULONG64)Next->Fdo,
+                           (ULONG64)Next->Argument[0],
+                           (ULONG64)Next->Argument[1]);
+        Next->Visible = FALSE;
+    }
+
+    (VOID) snprintf(Arguments, sizeof (Arguments), "--descriptor %s %s",
+                    DescriptorPath, RingPath);
+
+    CHECK3S(TestDecode(Arguments, "2>/dev/null", Output, sizeof (Output)),
+            ==, 0);
+    CHECK(strcmp(Output, Expected) == 0);
+
+    // The torn entry is reported, and is the only one
+    CHECK3S(TestDecode(Arguments, "2>&1 >/dev/null", Output, sizeof (Output)),
+            ==, 0);
+    CHECK(strcmp(Output, "cpu 0: 1 incomplete entries skipped\n") == 0);
+
+    // A descriptor from another version of the driver is refused
+    RtlCopyMemory(&Copy, Descriptor, sizeof (Copy));
+    Copy.Version--;
+    CHECK(TestWriteFile(DescriptorPath, &Copy, TEST_DESCRIPTOR_SIZE));
+    CHECK3S(TestDecode(Arguments, "2>/dev/null", Output, sizeof (Output)),
+            !=, 0);
+
+    // As is a dump that does not match the number of rings
+    RtlCopyMemory(&Copy, Descriptor, sizeof (Copy));
+    Copy.RingCount++;
+    CHECK(TestWriteFile(DescriptorPath, &Copy, TEST_DESCRIPTOR_SIZE));
+    CHECK3S(TestDecode(Arguments, "2>/dev/null", Output, sizeof (Output)),
+            !=, 0);
+
+    (VOID) unlink(DescriptorPath);
+    (VOID) unlink(RingPath);
+    free(Dump);
+
+    // Teardown flushes every processor, and afterwards recording is
+    // quietly dropped
+    for (Index = 0; Index < TEST_PROCESSORS; Index++)
+        CHECK3U(TestQueryDpcCount(Index), ==, 0);
+
+    RingTeardown();
+
+    for (Index = 0; Index < TEST_PROCESSORS; Index++)
+        CHECK3U(TestQueryDpcCount(Index), ==, 1);
+
+    CHECK(Descriptor->Ring == NULL);
+    CHECK3U(Descriptor->Magic, ==, 0);
+
+    RingRecord(RING_EVENT_THREAD_EXIT, NULL, 0, 0);
+    CHECK3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) TestParseArguments(argc, argv);
+
+    TestRings();
+
+    return TestExit("ringdecode");
+}
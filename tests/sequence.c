@@ -0,0 +1,393 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The sequence window in util.h, driven as FdoHidCallback() drives it:
+// a report is passed on unless it is a repeat, and the window only
+// moves on once one is accepted. The counters are those the callback
+// keeps, so every report below the window's Next must end up either
+// delivered exactly once or counted as lost.
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "test.h"
+
+typedef struct _TEST_CALLBACK {
+    SEQUENCE_WINDOW Window;
+    BOOLEAN         Valid;
+    ULONG           Base;
+    BOOLEAN         Refuse;
+    ULONG           Delivered;
+    ULONG           Gaps;
+    LONGLONG        Lost;
+    ULONG           Duplicates;
+    ULONG           Reorders;
+    PUCHAR          Seen;
+    ULONG           SeenCount;
+} TEST_CALLBACK, *PTEST_CALLBACK;
+
+static BOOLEAN
+TestCallback(
+    IN  PTEST_CALLBACK  Callback,
+    IN  ULONG           Sequence
+    )
+{
+    SEQUENCE_OFFER      Offer;
+    ULONG               Skipped;
+    ULONG               Index;
+
+    if (!Callback->Valid) {
+        __SequenceWindowInitialize(&Callback->Window, Sequence);
+        Callback->Base = Sequence;
+        Callback->Valid = TRUE;
+    }
+
+    Offer = __SequenceWindowOffer(&Callback->Window, Sequence, &Skipped);
+    if (Skipped != 0) {
+        Callback->Gaps++;
+        Callback->Lost += Skipped;
+    }
+
+    if (Offer == SEQUENCE_OFFER_REPEAT) {
+        Callback->Duplicates++;
+        return TRUE;
+    }
+
+    if (Callback->Refuse)
+        return FALSE;
+
+    // HIDCLASS sees each report at most once
+    Index = Sequence - Callback->Base;
+    if (Index < Callback->SeenCount) {
+        CHECK3U(Callback->Seen[Index], ==, 0);
+        Callback->Seen[Index] = 1;
+    }
+
+    Callback->Delivered++;
+
+    __SequenceWindowAccept(&Callback->Window, Sequence);
+
+    if (Offer == SEQUENCE_OFFER_LATE) {
+        Callback->Reorders++;
+        Callback->Lost--;
+    }
+
+    return TRUE;
+}
+
+#define TEST_SEEN   (1u << 21)
+
+static UCHAR    TestSeen[TEST_SEEN];
+
+static VOID
+TestInitialize(
+    OUT PTEST_CALLBACK  Callback
+    )
+{
+    RtlZeroMemory(Callback, sizeof (TEST_CALLBACK));
+    RtlZeroMemory(TestSeen, sizeof (TestSeen));
+
+    Callback->Seen = TestSeen;
+    Callback->SeenCount = TEST_SEEN;
+}
+
+static VOID
+TestInOrder(
+    VOID
+    )
+{
+    TEST_CALLBACK   Callback;
+    ULONG           Sequence;
+
+    TestInitialize(&Callback);
+
+    for (Sequence = 1; Sequence <= 3; Sequence++)
+        CHECK(TestCallback(&Callback, Sequence));
+
+    CHECK3U(Callback.Delivered, ==, 3);
+    CHECK3U(Callback.Window.Next, ==, 4);
+    CHECK3U(Callback.Window.Missing, ==, 0);
+
+    // The last report offered again
+    CHECK(TestCallback(&Callback, 3));
+    CHECK3U(Callback.Duplicates, ==, 1);
+
+    // An older one offered again is a repeat too, not a late report,
+    // and the window stays where it is
+    CHECK(TestCallback(&Callback, 2));
+    CHECK(TestCallback(&Callback, 1));
+    CHECK3U(Callback.Duplicates, ==, 3);
+    CHECK3U(Callback.Reorders, ==, 0);
+    CHECK3S(Callback.Lost, ==, 0);
+    CHECK3U(Callback.Delivered, ==, 3);
+    CHECK3U(Callback.Window.Next, ==, 4);
+
+    CHECK(TestCallback(&Callback, 4));
+    CHECK3U(Callback.Delivered, ==, 4);
+}
+
+static VOID
+TestLate(
+    VOID
+    )
+{
+    TEST_CALLBACK   Callback;
+
+    TestInitialize(&Callback);
+
+    CHECK(TestCallback(&Callback, 1));
+    CHECK(TestCallback(&Callback, 5));
+    CHECK3U(Callback.Gaps, ==, 1);
+    CHECK3S(Callback.Lost, ==, 3);
+
+    // A late report fills its gap once; offering it again is a repeat
+    CHECK(TestCallback(&Callback, 3));
+    CHECK3U(Callback.Reorders, ==, 1);
+    CHECK3S(Callback.Lost, ==, 2);
+
+    CHECK(TestCallback(&Callback, 3));
+    CHECK(TestCallback(&Callback, 3));
+    CHECK3U(Callback.Duplicates, ==, 2);
+    CHECK3U(Callback.Reorders, ==, 1);
+    CHECK3S(Callback.Lost, ==, 2);
+    CHECK3U(Callback.Delivered, ==, 3);
+
+    // A late report that is refused stays missing until it is accepted
+    Callback.Refuse = TRUE;
+    CHECK(!TestCallback(&Callback, 2));
+    CHECK3S(Callback.Lost, ==, 2);
+
+    Callback.Refuse = FALSE;
+    CHECK(TestCallback(&Callback, 2));
+    CHECK3U(Callback.Reorders, ==, 2);
+    CHECK3S(Callback.Lost, ==, 1);
+
+    // Neither late reports nor repeats move the window
+    CHECK3U(Callback.Window.Next, ==, 6);
+
+    CHECK(TestCallback(&Callback, 4));
+    CHECK(TestCallback(&Callback, 4));
+    CHECK3S(Callback.Lost, ==, 0);
+    CHECK3U(Callback.Window.Missing, ==, 0);
+    CHECK3U(Callback.Delivered, ==, 5);
+    CHECK3U(Callback.Duplicates, ==, 3);
+
+    // A refused report after a gap: the gap is only counted once
+    Callback.Refuse = TRUE;
+    CHECK(!TestCallback(&Callback, 8));
+    CHECK3S(Callback.Lost, ==, 2);
+
+    Callback.Refuse = FALSE;
+    CHECK(TestCallback(&Callback, 8));
+    CHECK3U(Callback.Gaps, ==, 2);
+    CHECK3S(Callback.Lost, ==, 2);
+    CHECK3U(Callback.Window.Next, ==, 9);
+}
+
+static VOID
+TestWindow(
+    VOID
+    )
+{
+    TEST_CALLBACK   Callback;
+
+    TestInitialize(&Callback);
+
+    // Anything that falls out of the window stays lost, and a very
+    // long gap is no different
+    CHECK(TestCallback(&Callback, 0));
+    CHECK(TestCallback(&Callback, 100));
+    CHECK3S(Callback.Lost, ==, 99);
+    CHECK3U(Callback.Window.Missing, ==, ~1ull);
+
+    CHECK(TestCallback(&Callback, 100 - SEQUENCE_WINDOW_SIZE));
+    CHECK3U(Callback.Duplicates, ==, 1);
+
+    CHECK(TestCallback(&Callback, 101 - SEQUENCE_WINDOW_SIZE));
+    CHECK3U(Callback.Reorders, ==, 1);
+    CHECK3S(Callback.Lost, ==, 98);
+
+    CHECK(TestCallback(&Callback, 0x80000000));
+    CHECK3S(Callback.Lost, ==, 98 + 0x80000000 - 101);
+    CHECK3U(Callback.Window.Next, ==, 0x80000001);
+
+    // Across the wrap of the sequence number
+    TestInitialize(&Callback);
+
+    CHECK(TestCallback(&Callback, 0xFFFFFFFE));
+    CHECK(TestCallback(&Callback, 1));
+    CHECK3S(Callback.Lost, ==, 2);
+
+    CHECK(TestCallback(&Callback, 0));
+    CHECK(TestCallback(&Callback, 0xFFFFFFFF));
+    CHECK(TestCallback(&Callback, 0xFFFFFFFE));
+    CHECK(TestCallback(&Callback, 0));
+    CHECK3S(Callback.Lost, ==, 0);
+    CHECK3U(Callback.Reorders, ==, 2);
+    CHECK3U(Callback.Duplicates, ==, 2);
+    CHECK3U(Callback.Delivered, ==, 4);
+}
+
+static ULONG    TestRandomState = 0x2545F491;
+
+static ULONG
+TestRandom(
+    VOID
+    )
+{
+    ULONG   Value = TestRandomState;
+
+    Value ^= Value << 13;
+    Value ^= Value >> 17;
+    Value ^= Value << 5;
+
+    TestRandomState = Value;
+    return Value;
+}
+
+#define TEST_ITERATIONS 200000
+
+// A provider that skips, reorders and repeats reports at random, and a
+// HIDCLASS that sometimes refuses them, checked against a model of
+// which reports have been delivered
+static VOID
+TestRandomOffers(
+    IN  ULONG       Base
+    )
+{
+    TEST_CALLBACK   Callback;
+    ULONG           Stream;
+    ULONG           Pending;
+    BOOLEAN         Refused;
+    ULONG           Iteration;
+    ULONG           Delivered;
+    ULONG           Duplicates;
+    ULONG           Reorders;
+
+    TestInitialize(&Callback);
+
+    Stream = 0;
+    Refused = FALSE;
+    Pending = 0;
+
+    for (Iteration = 0; Iteration < TEST_ITERATIONS; Iteration++) {
+        ULONG           Choice = TestRandom() % 16;
+        ULONG           Offset;
+        SEQUENCE_OFFER  Expected;
+        BOOLEAN         Completed;
+
+        if (Refused) {
+            // A refused report is offered again
+            Offset = Pending;
+        } else if (Choice < 8 || Stream == 0) {
+            Offset = Stream++;
+        } else if (Choice < 10) {
+            Stream += 1 + TestRandom() % 8;
+            Offset = Stream++;
+        } else if (Choice < 11) {
+            Stream += 1 + TestRandom() % (2 * SEQUENCE_WINDOW_SIZE);
+            Offset = Stream++;
+        } else {
+            Offset = Stream - 1 - TestRandom() % min(Stream,
+                                                     2 * SEQUENCE_WINDOW_SIZE);
+        }
+
+        if (Offset + 1 >= TEST_SEEN)
+            break;
+
+        if (Callback.Valid &&
+            (LONG)(Base + Offset - Callback.Window.Next) < 0) {
+            ULONG   Distance = Callback.Window.Next - 1 - (Base + Offset);
+
+            Expected = (!TestSeen[Offset] && Distance < SEQUENCE_WINDOW_SIZE) ?
+                       SEQUENCE_OFFER_LATE :
+                       SEQUENCE_OFFER_REPEAT;
+        } else {
+            Expected = SEQUENCE_OFFER_NEXT;
+        }
+
+        Callback.Refuse = (TestRandom() % 8 == 0) ? TRUE : FALSE;
+
+        Delivered = Callback.Delivered;
+        Duplicates = Callback.Duplicates;
+        Reorders = Callback.Reorders;
+
+        Completed = TestCallback(&Callback, Base + Offset);
+
+        // A repeat is dropped; anything else is delivered unless it is
+        // refused
+        if (Expected == SEQUENCE_OFFER_REPEAT) {
+            CHECK(Completed);
+            CHECK3U(Callback.Delivered, ==, Delivered);
+            CHECK3U(Callback.Duplicates, ==, Duplicates + 1);
+        } else {
+            CHECK3U(Callback.Delivered, ==, Delivered + Completed);
+            CHECK3U(Callback.Duplicates, ==, Duplicates);
+            CHECK3U(TestSeen[Offset], ==, Completed);
+        }
+
+        CHECK3U(Callback.Reorders, ==,
+                Reorders + (Expected == SEQUENCE_OFFER_LATE && Completed));
+
+        Refused = !Completed;
+        Pending = Offset;
+
+        // Nothing is ever lost twice or found twice
+        CHECK3S(Callback.Lost, >=, 0);
+        CHECK3S((LONGLONG)Callback.Delivered + Callback.Lost, ==,
+                Callback.Window.Next - Base);
+
+        if (TestFailures != 0)
+            break;
+    }
+
+    CHECK3U(Callback.Reorders, !=, 0);
+    CHECK3U(Callback.Duplicates, !=, 0);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) TestParseArguments(argc, argv);
+
+    TestInOrder();
+    TestLate();
+    TestWindow();
+    TestRandomOffers(0);
+    TestRandomOffers(0xFFFFF000);
+
+    return TestExit("sequence");
+}
@@ -0,0 +1,419 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The IOCTL_XENHID_QUERY_STATISTICS snapshot, laid out as
+// FdoQueryStatistics() lays it out and decoded by
+// scripts/statsdecode.py. The counter names are taken from the
+// driver's own table in fdo.c, so the decoder cannot drift from what
+// the driver publishes in XenStore.
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <xenhid_ioctl.h>
+
+#include "test.h"
+
+#define TEST_DEVICES    3
+
+// DEVICE_POWER_STATE, as the decoder names it
+static const CHAR   *TestPowerStateName[] = {
+    "unspecified",
+    "D0",
+    "D1",
+    "D2",
+    "D3",
+};
+
+#define TEST_STATISTIC(_Statistic) \
+    [XENHID_STATISTIC_ ## _Statistic] = #_Statistic
+
+// The enumerators, to look up the names _FDO_STATISTIC_NAME() is
+// given
+static const CHAR   *TestStatisticSymbol[] = {
+    TEST_STATISTIC(REPORTS_RECEIVED),
+    TEST_STATISTIC(REPORTS_REFUSED),
+    TEST_STATISTIC(IRPS_COMPLETED),
+    TEST_STATISTIC(IRPS_CANCELLED),
+    TEST_STATISTIC(QUEUE_DEPTH_MAXIMUM),
+    TEST_STATISTIC(GET_DEVICE_ATTRIBUTES),
+    TEST_STATISTIC(GET_DEVICE_DESCRIPTOR),
+    TEST_STATISTIC(GET_REPORT_DESCRIPTOR),
+    TEST_STATISTIC(GET_STRING),
+    TEST_STATISTIC(GET_INDEXED_STRING),
+    TEST_STATISTIC(GET_FEATURE),
+    TEST_STATISTIC(SET_FEATURE),
+    TEST_STATISTIC(GET_INPUT_REPORT),
+    TEST_STATISTIC(SET_OUTPUT_REPORT),
+    TEST_STATISTIC(READ_REPORT),
+    TEST_STATISTIC(WRITE_REPORT),
+    TEST_STATISTIC(D3_TO_D0),
+    TEST_STATISTIC(D0_TO_D3),
+    TEST_STATISTIC(PROBES),
+    TEST_STATISTIC(SEQUENCE_GAPS),
+    TEST_STATISTIC(REPORTS_LOST),
+    TEST_STATISTIC(SEQUENCE_DUPLICATES),
+    TEST_STATISTIC(SEQUENCE_REORDERS),
+    TEST_STATISTIC(WATCHDOG_RECOVERIES),
+    TEST_STATISTIC(IRPS_DRAINED),
+    TEST_STATISTIC(IRPS_DEFERRED),
+    TEST_STATISTIC(CALLBACK_TIME),
+    TEST_STATISTIC(CALLBACK_TIME_MAXIMUM),
+    TEST_STATISTIC(IDLE_ENTRIES),
+    TEST_STATISTIC(IDLE_WAKES),
+    TEST_STATISTIC(IDLE_WAKE_TIME),
+    TEST_STATISTIC(QUIESCE_TIME),
+};
+
+#undef  TEST_STATISTIC
+
+C_ASSERT(ARRAYSIZE(TestStatisticSymbol) == XENHID_STATISTIC_COUNT);
+
+static CHAR TestStatisticName[XENHID_STATISTIC_COUNT][64];
+
+// Pick the names out of FdoStatisticName()
+static VOID
+TestReadStatisticNames(
+    VOID
+    )
+{
+    FILE        *File;
+    CHAR        Line[256];
+    ULONG       Count;
+    ULONG       Index;
+
+    File = fopen("../src/xenhid/fdo.c", "r");
+    CHECK(File != NULL);
+    if (File == NULL)
+        return;
+
+    Count = 0;
+    while (fgets(Line, sizeof (Line), File) != NULL) {
+        CHAR    Symbol[64];
+        CHAR    Name[64];
+
+        if (sscanf(Line, " _FDO_STATISTIC_NAME(%63[A-Z0-9_], \"%63[^\"]\")",
+                   Symbol, Name) != 2)
+            continue;
+
+        for (Index = 0; Index < XENHID_STATISTIC_COUNT; Index++)
+            if (strcmp(Symbol, TestStatisticSymbol[Index]) == 0)
+                break;
+
+        CHECK3U(Index, <, XENHID_STATISTIC_COUNT);
+        if (Index == XENHID_STATISTIC_COUNT)
+            continue;
+
+        CHECK3U(TestStatisticName[Index][0], ==, '\0');
+        strcpy(TestStatisticName[Index], Name);
+        Count++;
+    }
+
+    (VOID) fclose(File);
+
+    CHECK3U(Count, ==, XENHID_STATISTIC_COUNT);
+}
+
+static ULONG64
+TestRandom(
+    VOID
+    )
+{
+    static ULONG64  State = 0x9E3779B97F4A7C15ull;
+
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+
+    return State;
+}
+
+static BOOLEAN
+TestWriteFile(
+    IN  const CHAR  *Path,
+    IN  const VOID  *Buffer,
+    IN  ULONG       Length
+    )
+{
+    FILE            *File;
+    BOOLEAN         Success;
+
+    File = fopen(Path, "wb");
+    if (File == NULL)
+        return FALSE;
+
+    Success = (fwrite(Buffer, 1, Length, File) == Length) ? TRUE : FALSE;
+
+    if (fclose(File) != 0)
+        Success = FALSE;
+
+    return Success;
+}
+
+// Run the decoder, returning its exit status and what it wrote to
+// whichever of stdout or stderr Redirect leaves
+static int
+TestDecode(
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Redirect,
+    OUT PCHAR       Output,
+    IN  ULONG       Size
+    )
+{
+    const CHAR      *Python = getenv("PYTHON");
+    CHAR            Command[512];
+    FILE            *Pipe;
+    size_t          Length;
+    int             Status;
+
+    if (Python == NULL)
+        Python = "python3";
+
+    (VOID) snprintf(Command, sizeof (Command),
+                    "%s ../scripts/statsdecode.py %s %s",
+                    Python, Path, Redirect);
+
+    Pipe = popen(Command, "r");
+    if (Pipe == NULL)
+        return -1;
+
+    Length = fread(Output, 1, Size - 1, Pipe);
+    Output[Length] = '\0';
+
+    Status = pclose(Pipe);
+    return WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+}
+
+// A snapshot of TEST_DEVICES devices with StatisticCount counters in
+// records of DeviceSize bytes, as a driver with that many counters
+// would fill it in, and what the decoder should make of it
+static ULONG
+TestSnapshot(
+    OUT PUCHAR  Buffer,
+    IN  ULONG   StatisticCount,
+    IN  ULONG   DeviceSize,
+    OUT PCHAR   Expected,
+    IN  ULONG   ExpectedSize
+    )
+{
+    PXENHID_STATISTICS  Statistics = (PXENHID_STATISTICS)Buffer;
+    PCHAR               Cursor = Expected;
+    PCHAR               End = Expected + ExpectedSize;
+    ULONG               Size;
+    ULONG               Device;
+    ULONG               Index;
+
+    Size = sizeof (XENHID_STATISTICS) + (TEST_DEVICES * DeviceSize);
+
+    RtlZeroMemory(Buffer, Size);
+    Statistics->Version = XENHID_STATISTICS_VERSION;
+    Statistics->Size = Size;
+    Statistics->StatisticCount = StatisticCount;
+    Statistics->DeviceSize = DeviceSize;
+    Statistics->DeviceCount = TEST_DEVICES;
+
+    Cursor += snprintf(Cursor, End - Cursor,
+                       "version %u: %u device(s), %u statistic(s)\n",
+                       XENHID_STATISTICS_VERSION, TEST_DEVICES,
+                       StatisticCount);
+
+    for (Device = 0; Device < TEST_DEVICES; Device++) {
+        PXENHID_STATISTICS_DEVICE   Record;
+        ULONG                       PowerState;
+
+        Record = (PXENHID_STATISTICS_DEVICE)(Buffer +
+                                             sizeof (XENHID_STATISTICS) +
+                                             (Device * DeviceSize));
+
+        // Device indices need not be dense, and a new device may not
+        // have a power state yet
+        PowerState = (Device == 0) ? 0 : (Device % 4) + 1;
+
+        Record->Index = Device * 2;
+        Record->DevicePowerState = PowerState;
+
+        Cursor += snprintf(Cursor, End - Cursor, "device %u (%s)\n",
+                           Record->Index, TestPowerStateName[PowerState]);
+
+        for (Index = 0; Index < StatisticCount; Index++) {
+            ULONG64 Value;
+            CHAR    Name[64];
+
+            switch (Index % 3) {
+            case 0:
+                Value = 0;
+                break;
+
+            case 1:
+                Value = TestRandom() & 0xFFFF;
+                break;
+
+            default:
+                Value = TestRandom();
+                break;
+            }
+
+            // Written as the driver writes it, which need not be
+            // aligned for a device record of any size
+            RtlCopyMemory((PUCHAR)Record +
+                          FIELD_OFFSET(XENHID_STATISTICS_DEVICE, Value) +
+                          (Index * sizeof (ULONG64)),
+                          &Value, sizeof (ULONG64));
+
+            if (Index < XENHID_STATISTIC_COUNT)
+                strcpy(Name, TestStatisticName[Index]);
+            else
+                (VOID) snprintf(Name, sizeof (Name), "statistic-%u", Index);
+
+            Cursor += snprintf(Cursor, End - Cursor, "  %-32s %20llu\n",
+                               Name, Value);
+        }
+    }
+
+    CHECK(Cursor < End);
+
+    return Size;
+}
+
+static VOID
+TestStatistics(
+    VOID
+    )
+{
+    static UCHAR        Buffer[64 * 1024];
+    static CHAR         Output[64 * 1024];
+    static CHAR         Expected[64 * 1024];
+    PXENHID_STATISTICS  Statistics = (PXENHID_STATISTICS)Buffer;
+    CHAR                Path[] = "/tmp/statsXXXXXX";
+    ULONG               Size;
+    int                 Fd;
+
+    Fd = mkstemp(Path);
+    CHECK(Fd >= 0);
+    (VOID) close(Fd);
+
+    // What this driver returns
+    Size = TestSnapshot(Buffer, XENHID_STATISTIC_COUNT,
+                        sizeof (XENHID_STATISTICS_DEVICE),
+                        Expected, sizeof (Expected));
+    CHECK3U(Size, ==,
+            sizeof (XENHID_STATISTICS) +
+            (TEST_DEVICES * sizeof (XENHID_STATISTICS_DEVICE)));
+
+    CHECK(TestWriteFile(Path, Buffer, Size));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), ==, 0);
+    CHECK(strcmp(Output, Expected) == 0);
+
+    // A newer driver with more counters, in records with room to spare
+    Size = TestSnapshot(Buffer, XENHID_STATISTIC_COUNT + 3,
+                        sizeof (XENHID_STATISTICS_DEVICE) + 40,
+                        Expected, sizeof (Expected));
+
+    CHECK(TestWriteFile(Path, Buffer, Size));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), ==, 0);
+    CHECK(strcmp(Output, Expected) == 0);
+
+    // An older one with fewer
+    Size = TestSnapshot(Buffer, XENHID_STATISTIC_COUNT - 5,
+                        sizeof (XENHID_STATISTICS_DEVICE) - 40,
+                        Expected, sizeof (Expected));
+
+    CHECK(TestWriteFile(Path, Buffer, Size));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), ==, 0);
+    CHECK(strcmp(Output, Expected) == 0);
+
+    // No devices at all
+    Size = TestSnapshot(Buffer, XENHID_STATISTIC_COUNT,
+                        sizeof (XENHID_STATISTICS_DEVICE),
+                        Expected, sizeof (Expected));
+    Statistics->DeviceCount = 0;
+    Statistics->Size = sizeof (XENHID_STATISTICS);
+
+    CHECK(TestWriteFile(Path, Buffer, sizeof (XENHID_STATISTICS)));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), ==, 0);
+    CHECK(strncmp(Output, "version 1: 0 device(s)", 22) == 0);
+
+    // Only the header, as returned with STATUS_BUFFER_OVERFLOW: the
+    // size to ask for is reported
+    Size = TestSnapshot(Buffer, XENHID_STATISTIC_COUNT,
+                        sizeof (XENHID_STATISTICS_DEVICE),
+                        Expected, sizeof (Expected));
+
+    CHECK(TestWriteFile(Path, Buffer, sizeof (XENHID_STATISTICS)));
+    CHECK3S(TestDecode(Path, "2>&1 >/dev/null", Output, sizeof (Output)),
+            !=, 0);
+    (VOID) snprintf(Expected, sizeof (Expected),
+                    "header only: query again with %u bytes\n", Size);
+    CHECK(strcmp(Output, Expected) == 0);
+
+    // A snapshot cut short anywhere else is refused
+    CHECK(TestWriteFile(Path, Buffer, Size - 1));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), !=, 0);
+
+    CHECK(TestWriteFile(Path, Buffer, sizeof (XENHID_STATISTICS) - 1));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), !=, 0);
+
+    // As is a layout from another version
+    Statistics->Version = XENHID_STATISTICS_VERSION + 1;
+    CHECK(TestWriteFile(Path, Buffer, Size));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), !=, 0);
+    Statistics->Version = XENHID_STATISTICS_VERSION;
+
+    // Or records too small for their counters
+    Statistics->StatisticCount++;
+    CHECK(TestWriteFile(Path, Buffer, Size));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), !=, 0);
+    Statistics->StatisticCount--;
+
+    // Or a size that does not add up
+    Statistics->DeviceCount++;
+    CHECK(TestWriteFile(Path, Buffer, Size));
+    CHECK3S(TestDecode(Path, "2>/dev/null", Output, sizeof (Output)), !=, 0);
+    Statistics->DeviceCount--;
+
+    (VOID) unlink(Path);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) TestParseArguments(argc, argv);
+
+    TestReadStatisticNames();
+    TestStatistics();
+
+    return TestExit("statsdecode");
+}
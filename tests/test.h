@@ -0,0 +1,176 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TESTS_TEST_H
+#define _TESTS_TEST_H
+
+#include <ntddk.h>
+#include <stdio.h>
+
+// Failures are counted rather than fatal so that one run reports every
+// broken check. Each test program returns TestExit() from main().
+extern ULONG    TestFailures;
+
+// Calls to vDbgPrintExWithPrefix(), which only counts them while
+// TestPrintsQuiet is set
+extern ULONG    TestPrints;
+extern BOOLEAN  TestPrintsQuiet;
+
+#define CHECK(_EXP)                                                     \
+        do {                                                            \
+            if (!(_EXP)) {                                              \
+                fprintf(stderr, "%s:%d: CHECK(%s) failed\n",            \
+                        __FILE__, __LINE__, #_EXP);                     \
+                TestFailures++;                                         \
+            }                                                           \
+        } while (FALSE)
+
+#define CHECK3U(_X, _OP, _Y)                                            \
+        do {                                                            \
+            ULONGLONG   _Lval = (ULONGLONG)(_X);                        \
+            ULONGLONG   _Rval = (ULONGLONG)(_Y);                        \
+            if (!(_Lval _OP _Rval)) {                                   \
+                fprintf(stderr, "%s:%d: CHECK3U(%s %s %s) failed: "     \
+                        "%llu %s %llu\n",                               \
+                        __FILE__, __LINE__, #_X, #_OP, #_Y,             \
+                        _Lval, #_OP, _Rval);                            \
+                TestFailures++;                                         \
+            }                                                           \
+        } while (FALSE)
+
+#define CHECK3S(_X, _OP, _Y)                                            \
+        do {                                                            \
+            LONGLONG    _Lval = (LONGLONG)(_X);                         \
+            LONGLONG    _Rval = (LONGLONG)(_Y);                         \
+            if (!(_Lval _OP _Rval)) {                                   \
+                fprintf(stderr, "%s:%d: CHECK3S(%s %s %s) failed: "     \
+                        "%lld %s %lld\n",                               \
+                        __FILE__, __LINE__, #_X, #_OP, #_Y,             \
+                        _Lval, #_OP, _Rval);                            \
+                TestFailures++;                                         \
+            }                                                           \
+        } while (FALSE)
+
+// TRUE if the program was run with --bench, in which case it should time
+// its operations as well as check them
+extern BOOLEAN
+TestParseArguments(
+    IN  int     argc,
+    IN  char    **argv
+    );
+
+extern int
+TestExit(
+    IN  const CHAR  *Name
+    );
+
+// Wall clock time in nanoseconds, for benchmarks
+extern ULONGLONG
+TestNow(
+    VOID
+    );
+
+// Report the cost per call of Count iterations that took Elapsed ns
+extern VOID
+TestReport(
+    IN  const CHAR  *Name,
+    IN  ULONGLONG   Elapsed,
+    IN  ULONGLONG   Count
+    );
+
+// Interrupt time (in 100ns units) as returned by KeQueryInterruptTime()
+// only moves when a test moves it. Any kernel timers that fall due are
+// signalled as it does.
+extern VOID
+TestAdvanceInterruptTime(
+    IN  ULONGLONG   Delta
+    );
+
+// Polling waits give up after TEST_WAIT_RETRIES * TEST_WAIT_INTERVAL us
+#define TEST_WAIT_RETRIES   100000
+#define TEST_WAIT_INTERVAL  100
+
+// Wait until at least Count threads are blocked in a kernel wait with
+// nothing left to wake them, i.e. the system has gone idle
+extern BOOLEAN
+TestWaitForIdle(
+    IN  ULONG   Count
+    );
+
+extern BOOLEAN
+TestWaitForValue(
+    IN  volatile LONG   *Value,
+    IN  LONG            Expected
+    );
+
+// The processor that KeGetCurrentProcessorNumberEx() reports for the
+// calling thread
+extern VOID
+TestSetCurrentProcessor(
+    IN  ULONG   Processor
+    );
+
+// The number of processors KeQueryMaximumProcessorCountEx() reports, all
+// of them active (at most 64, default 1)
+extern VOID
+TestSetProcessorCount(
+    IN  ULONG   Count
+    );
+
+// The number of DPCs that have run as Processor
+extern ULONG
+TestQueryDpcCount(
+    IN  ULONG   Processor
+    );
+
+// While enabled, event and spin lock operations yield the processor
+// before taking effect, to shake out races on machines with few
+// processors
+extern VOID
+TestSetChaos(
+    IN  BOOLEAN Enable
+    );
+
+// A chance to yield, if enabled, for use by tests' own threads
+extern VOID
+TestChaos(
+    VOID
+    );
+
+extern VOID
+TestQueryThread(
+    IN  PKTHREAD        Thread,
+    OUT PKPRIORITY      Priority,
+    OUT PGROUP_AFFINITY Affinity
+    );
+
+#endif  // _TESTS_TEST_H
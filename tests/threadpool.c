@@ -0,0 +1,356 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// The worker pool in thread.c, run on pthreads
+
+#include <ntddk.h>
+#include <pthread.h>
+
+#include "thread.h"
+#include "dbg_print.h"
+#include "test.h"
+
+typedef struct _TEST_WORK {
+    XENHID_WORK_ITEM    Item;
+    PXENHID_THREAD_POOL Pool;
+    LONG                Runs;
+    LONG                Requeue;    // Further runs to queue from the function
+    BOOLEAN             Requeued;   // Result of the last of those
+    PKEVENT             Gate;       // Wait on this before returning
+    LONG                Running;
+    PKTHREAD            Thread;
+} TEST_WORK, *PTEST_WORK;
+
+static VOID
+TestWorkFunction(
+    IN  PVOID   Context
+    )
+{
+    PTEST_WORK  Work = Context;
+
+    Work->Thread = KeGetCurrentThread();
+    (VOID) InterlockedExchange(&Work->Running, 1);
+
+    if (Work->Gate != NULL)
+        (VOID) KeWaitForSingleObject(Work->Gate,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+
+    if (Work->Requeue != 0) {
+        Work->Requeue--;
+        Work->Requeued = ThreadPoolQueue(Work->Pool, &Work->Item);
+    }
+
+    (VOID) InterlockedIncrement(&Work->Runs);
+}
+
+static VOID
+TestWorkInitialize(
+    OUT PTEST_WORK          Work,
+    IN  PXENHID_THREAD_POOL Pool
+    )
+{
+    RtlZeroMemory(Work, sizeof (TEST_WORK));
+
+    Work->Pool = Pool;
+    ThreadWorkItemInitialize(&Work->Item, TestWorkFunction, Work);
+}
+
+static VOID
+TestParameters(
+    VOID
+    )
+{
+    PXENHID_THREAD_POOL Pool;
+    ULONG               Mask;
+
+    // The failures are expected, so don't print them
+    Mask = DbgPrintMask;
+    DbgPrintMask = 0;
+
+    CHECK3U(ThreadPoolCreate(0, NULL, 8, &Pool), ==, STATUS_INVALID_PARAMETER);
+    CHECK3U(ThreadPoolCreate(THREAD_POOL_MAXIMUM_WORKERS + 1, NULL, 8, &Pool),
+            ==, STATUS_INVALID_PARAMETER);
+    CHECK3U(ThreadPoolCreate(1, NULL, LOW_PRIORITY, &Pool),
+            ==, STATUS_INVALID_PARAMETER);
+    CHECK3U(ThreadPoolCreate(1, NULL, HIGH_PRIORITY + 1, &Pool),
+            ==, STATUS_INVALID_PARAMETER);
+
+    DbgPrintMask = Mask;
+}
+
+// Work runs at the pool's priority and affinity, and may re-queue itself
+static VOID
+TestRun(
+    VOID
+    )
+{
+    PXENHID_THREAD_POOL Pool;
+    GROUP_AFFINITY      Affinity;
+    GROUP_AFFINITY      Actual;
+    KPRIORITY           Priority;
+    TEST_WORK           Work;
+    NTSTATUS            status;
+
+    RtlZeroMemory(&Affinity, sizeof (Affinity));
+    Affinity.Group = 1;
+    Affinity.Mask = 0x6;
+
+    status = ThreadPoolCreate(2, &Affinity, 12, &Pool);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    TestWorkInitialize(&Work, Pool);
+    Work.Requeue = 3;
+
+    CHECK(ThreadPoolQueue(Pool, &Work.Item));
+    CHECK(TestWaitForValue(&Work.Runs, 4));
+    CHECK(Work.Requeued);
+
+    TestQueryThread(Work.Thread, &Priority, &Actual);
+    CHECK3U(Priority, ==, 12);
+    CHECK3U(Actual.Group, ==, 1);
+    CHECK3U(Actual.Mask, ==, 0x6);
+
+    ThreadPoolDestroy(Pool);
+    CHECK3U(Work.Runs, ==, 4);
+}
+
+// Work queued behind a busy worker is picked up by an idle sibling, and
+// an item cannot be queued twice
+static VOID
+TestBusy(
+    VOID
+    )
+{
+    PXENHID_THREAD_POOL Pool;
+    KEVENT              Gate;
+    TEST_WORK           Blocker[2];
+    TEST_WORK           Work;
+    NTSTATUS            status;
+
+    status = ThreadPoolCreate(2, NULL, 8, &Pool);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    CHECK(TestWaitForIdle(2));
+
+    KeInitializeEvent(&Gate, NotificationEvent, FALSE);
+
+    TestWorkInitialize(&Blocker[0], Pool);
+    Blocker[0].Gate = &Gate;
+
+    TestWorkInitialize(&Blocker[1], Pool);
+    Blocker[1].Gate = &Gate;
+
+    TestWorkInitialize(&Work, Pool);
+
+    // Everything is queued to worker 0, which only the first item wakes
+    TestSetCurrentProcessor(0);
+
+    CHECK(ThreadPoolQueue(Pool, &Blocker[0].Item));
+    CHECK(TestWaitForValue(&Blocker[0].Running, 1));
+
+    CHECK(ThreadPoolQueue(Pool, &Work.Item));
+    CHECK(TestWaitForValue(&Work.Runs, 1));
+    CHECK(Work.Thread != Blocker[0].Thread);
+
+    // Block the other worker too
+    CHECK(TestWaitForIdle(2));
+
+    CHECK(ThreadPoolQueue(Pool, &Blocker[1].Item));
+    CHECK(TestWaitForValue(&Blocker[1].Running, 1));
+    CHECK(Blocker[1].Thread != Blocker[0].Thread);
+
+    CHECK(ThreadPoolQueue(Pool, &Work.Item));
+    CHECK(!ThreadPoolQueue(Pool, &Work.Item));
+
+    KeSetEvent(&Gate, IO_NO_INCREMENT, FALSE);
+
+    CHECK(TestWaitForValue(&Work.Runs, 2));
+
+    ThreadPoolDestroy(Pool);
+
+    CHECK3U(Blocker[0].Runs, ==, 1);
+    CHECK3U(Blocker[1].Runs, ==, 1);
+    CHECK3U(Work.Runs, ==, 2);
+}
+
+// Items that are queued, but not yet run, when the pool is destroyed are
+// still run; items queued once destruction has started are refused
+typedef struct _TEST_DESTROY {
+    PXENHID_THREAD_POOL Pool;
+} TEST_DESTROY, *PTEST_DESTROY;
+
+static void *
+TestDestroyThread(
+    void                *Argument
+    )
+{
+    PTEST_DESTROY       Destroy = Argument;
+
+    ThreadPoolDestroy(Destroy->Pool);
+    return NULL;
+}
+
+static VOID
+TestDestroy(
+    VOID
+    )
+{
+    TEST_DESTROY        Destroy;
+    pthread_t           Thread;
+    KEVENT              Gate;
+    TEST_WORK           Blocker;
+    TEST_WORK           Work;
+    NTSTATUS            status;
+
+    status = ThreadPoolCreate(1, NULL, 8, &Destroy.Pool);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    KeInitializeEvent(&Gate, NotificationEvent, FALSE);
+
+    TestWorkInitialize(&Blocker, Destroy.Pool);
+    Blocker.Gate = &Gate;
+    Blocker.Requeue = 1;
+
+    TestWorkInitialize(&Work, Destroy.Pool);
+
+    CHECK(ThreadPoolQueue(Destroy.Pool, &Blocker.Item));
+    CHECK(TestWaitForValue(&Blocker.Running, 1));
+    CHECK(ThreadPoolQueue(Destroy.Pool, &Work.Item));
+
+    // Wait for the destroying thread to block joining the worker, which
+    // is itself blocked in the gate
+    CHECK(pthread_create(&Thread, NULL, TestDestroyThread, &Destroy) == 0);
+    CHECK(TestWaitForIdle(2));
+
+    KeSetEvent(&Gate, IO_NO_INCREMENT, FALSE);
+    CHECK(pthread_join(Thread, NULL) == 0);
+
+    CHECK3U(Blocker.Runs, ==, 1);
+    CHECK(!Blocker.Requeued);
+    CHECK3U(Work.Runs, ==, 1);
+}
+
+// Many producers, on many processors, queueing to a small pool: every
+// item runs exactly once
+#define STRESS_PRODUCERS    4
+#define STRESS_ITEMS        20000
+
+typedef struct _TEST_PRODUCER {
+    PXENHID_THREAD_POOL Pool;
+    ULONG               Index;
+    TEST_WORK           *Work;
+} TEST_PRODUCER, *PTEST_PRODUCER;
+
+static void *
+TestProducerThread(
+    void                *Argument
+    )
+{
+    PTEST_PRODUCER      Producer = Argument;
+    ULONG               Index;
+
+    for (Index = 0; Index < STRESS_ITEMS; Index++) {
+        TestSetCurrentProcessor(Producer->Index + Index);
+        CHECK(ThreadPoolQueue(Producer->Pool, &Producer->Work[Index].Item));
+    }
+
+    return NULL;
+}
+
+static VOID
+TestStress(
+    VOID
+    )
+{
+    PXENHID_THREAD_POOL Pool;
+    TEST_PRODUCER       Producer[STRESS_PRODUCERS];
+    pthread_t           Thread[STRESS_PRODUCERS];
+    ULONG               Index;
+    ULONG               Item;
+    NTSTATUS            status;
+
+    status = ThreadPoolCreate(3, NULL, 8, &Pool);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    for (Index = 0; Index < STRESS_PRODUCERS; Index++) {
+        Producer[Index].Pool = Pool;
+        Producer[Index].Index = Index;
+        Producer[Index].Work = calloc(STRESS_ITEMS, sizeof (TEST_WORK));
+
+        for (Item = 0; Item < STRESS_ITEMS; Item++)
+            TestWorkInitialize(&Producer[Index].Work[Item], Pool);
+
+        CHECK(pthread_create(&Thread[Index], NULL, TestProducerThread,
+                             &Producer[Index]) == 0);
+    }
+
+    for (Index = 0; Index < STRESS_PRODUCERS; Index++)
+        CHECK(pthread_join(Thread[Index], NULL) == 0);
+
+    // Destruction runs anything still queued
+    ThreadPoolDestroy(Pool);
+
+    for (Index = 0; Index < STRESS_PRODUCERS; Index++) {
+        for (Item = 0; Item < STRESS_ITEMS; Item++)
+            CHECK3U(Producer[Index].Work[Item].Runs, ==, 1);
+
+        free(Producer[Index].Work);
+    }
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) TestParseArguments(argc, argv);
+
+    TestParameters();
+    TestRun();
+    TestBusy();
+    TestDestroy();
+    TestStress();
+
+    return TestExit("threadpool");
+}
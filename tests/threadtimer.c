@@ -0,0 +1,431 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Thread timers, driven by the virtual interrupt clock: nothing fires
+// until a test moves time on, so every expiry can be checked exactly
+
+#include <ntddk.h>
+
+#include "thread.h"
+#include "util.h"
+#include "test.h"
+
+#define LOG_SIZE    64
+
+typedef struct _TEST_THREAD {
+    PXENHID_THREAD  Thread;
+    PLARGE_INTEGER  Timeout;
+    LONG            Fires;
+    ULONG           Log[LOG_SIZE];      // Timer identifiers, in order
+    ULONGLONG       When[LOG_SIZE];     // ...and the times they ran
+    LONG            Timeouts;
+    ULONGLONG       TimeoutWhen;
+    BOOLEAN         WrongIrql;
+} TEST_THREAD, *PTEST_THREAD;
+
+typedef struct _TEST_TIMER {
+    XENHID_THREAD_TIMER Timer;
+    PTEST_THREAD        Thread;
+    ULONG               Identifier;
+} TEST_TIMER, *PTEST_TIMER;
+
+static ULONGLONG    Base;
+
+// Milliseconds since the start of the current test
+#define NOW_MS  ((KeQueryInterruptTime() - Base) / TIME_MS(1))
+
+static VOID
+TestTimerFunction(
+    IN  PVOID       Context
+    )
+{
+    PTEST_TIMER     Timer = Context;
+    PTEST_THREAD    Thread = Timer->Thread;
+    LONG            Index;
+
+    Index = Thread->Fires;
+    if (Index < LOG_SIZE) {
+        Thread->Log[Index] = Timer->Identifier;
+        Thread->When[Index] = NOW_MS;
+    }
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+        Thread->WrongIrql = TRUE;
+
+    (VOID) InterlockedIncrement(&Thread->Fires);
+}
+
+static NTSTATUS
+TestThreadFunction(
+    IN  PXENHID_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PTEST_THREAD        Thread = Context;
+
+    for (;;) {
+        NTSTATUS    status;
+
+        status = ThreadWait(Self, Thread->Timeout);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        if (status == STATUS_TIMEOUT) {
+            Thread->TimeoutWhen = NOW_MS;
+            (VOID) InterlockedIncrement(&Thread->Timeouts);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static BOOLEAN
+TestThreadStart(
+    OUT PTEST_THREAD    Thread,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    )
+{
+    NTSTATUS            status;
+
+    RtlZeroMemory(Thread, sizeof (TEST_THREAD));
+    Thread->Timeout = Timeout;
+
+    Base = KeQueryInterruptTime();
+
+    status = ThreadCreate(TestThreadFunction, Thread, &Thread->Thread);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return FALSE;
+
+    CHECK(TestWaitForIdle(1));
+    return TRUE;
+}
+
+static VOID
+TestThreadStop(
+    IN  PTEST_THREAD    Thread
+    )
+{
+    ThreadAlert(Thread->Thread);
+    ThreadJoin(Thread->Thread);
+
+    CHECK(!Thread->WrongIrql);
+}
+
+static VOID
+TestTimerInitialize(
+    OUT PTEST_TIMER     Timer,
+    IN  PTEST_THREAD    Thread,
+    IN  ULONG           Identifier
+    )
+{
+    Timer->Thread = Thread;
+    Timer->Identifier = Identifier;
+
+    ThreadTimerInitialize(&Timer->Timer, TestTimerFunction, Timer);
+}
+
+// Move time on and let the thread run whatever fell due
+static VOID
+TestAdvance(
+    IN  ULONG   Milliseconds
+    )
+{
+    TestAdvanceInterruptTime(TIME_MS((ULONGLONG)Milliseconds));
+    CHECK(TestWaitForIdle(1));
+}
+
+static VOID
+TestOrder(
+    VOID
+    )
+{
+    TEST_THREAD Thread;
+    TEST_TIMER  Timer[3];
+
+    if (!TestThreadStart(&Thread, NULL))
+        return;
+
+    TestTimerInitialize(&Timer[0], &Thread, 0);
+    TestTimerInitialize(&Timer[1], &Thread, 1);
+    TestTimerInitialize(&Timer[2], &Thread, 2);
+
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[0].Timer, 30, 0, 0), ==, STATUS_SUCCESS);
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[1].Timer, 10, 0, 0), ==, STATUS_SUCCESS);
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[2].Timer, 20, 0, 0), ==, STATUS_SUCCESS);
+
+    TestAdvance(9);
+    CHECK3U(Thread.Fires, ==, 0);
+
+    TestAdvance(1);
+    CHECK3U(Thread.Fires, ==, 1);
+
+    TestAdvance(10);
+    CHECK3U(Thread.Fires, ==, 2);
+
+    TestAdvance(15);
+    CHECK3U(Thread.Fires, ==, 3);
+
+    TestAdvance(100);
+    CHECK3U(Thread.Fires, ==, 3);
+
+    CHECK3U(Thread.Log[0], ==, 1);
+    CHECK3U(Thread.When[0], ==, 10);
+    CHECK3U(Thread.Log[1], ==, 2);
+    CHECK3U(Thread.When[1], ==, 20);
+    CHECK3U(Thread.Log[2], ==, 0);
+    CHECK3U(Thread.When[2], ==, 35);
+
+    // One-shot timers are no longer pending once they have run
+    CHECK(!ThreadTimerCancel(Thread.Thread, &Timer[0].Timer));
+
+    TestThreadStop(&Thread);
+}
+
+static VOID
+TestPeriodic(
+    VOID
+    )
+{
+    TEST_THREAD Thread;
+    TEST_TIMER  Timer;
+
+    if (!TestThreadStart(&Thread, NULL))
+        return;
+
+    TestTimerInitialize(&Timer, &Thread, 0);
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer.Timer, 10, 10, 2), ==, STATUS_SUCCESS);
+
+    TestAdvance(10);
+    TestAdvance(10);
+    TestAdvance(10);
+    CHECK3U(Thread.Fires, ==, 3);
+    CHECK3U(Thread.When[2], ==, 30);
+
+    // Missed periods are not caught up: one run, then a full period from
+    // when it ran
+    TestAdvance(35);
+    CHECK3U(Thread.Fires, ==, 4);
+    CHECK3U(Thread.When[3], ==, 65);
+
+    TestAdvance(9);
+    CHECK3U(Thread.Fires, ==, 4);
+
+    TestAdvance(1);
+    CHECK3U(Thread.Fires, ==, 5);
+    CHECK3U(Thread.When[4], ==, 75);
+
+    CHECK(ThreadTimerCancel(Thread.Thread, &Timer.Timer));
+
+    TestAdvance(100);
+    CHECK3U(Thread.Fires, ==, 5);
+
+    TestThreadStop(&Thread);
+}
+
+static VOID
+TestCancel(
+    VOID
+    )
+{
+    TEST_THREAD Thread;
+    TEST_TIMER  Timer[2];
+
+    if (!TestThreadStart(&Thread, NULL))
+        return;
+
+    TestTimerInitialize(&Timer[0], &Thread, 0);
+    TestTimerInitialize(&Timer[1], &Thread, 1);
+
+    CHECK(!ThreadTimerCancel(Thread.Thread, &Timer[0].Timer));
+
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[0].Timer, 10, 0, 0), ==, STATUS_SUCCESS);
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[1].Timer, 20, 0, 0), ==, STATUS_SUCCESS);
+
+    // Cancelling the earliest timer re-arms for the next one
+    CHECK(ThreadTimerCancel(Thread.Thread, &Timer[0].Timer));
+    CHECK(!ThreadTimerCancel(Thread.Thread, &Timer[0].Timer));
+
+    TestAdvance(10);
+    CHECK3U(Thread.Fires, ==, 0);
+
+    // Setting a pending timer moves it
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[1].Timer, 40, 0, 0), ==, STATUS_SUCCESS);
+
+    TestAdvance(10);
+    CHECK3U(Thread.Fires, ==, 0);
+
+    TestAdvance(30);
+    CHECK3U(Thread.Fires, ==, 1);
+    CHECK3U(Thread.Log[0], ==, 1);
+    CHECK3U(Thread.When[0], ==, 50);
+
+    TestThreadStop(&Thread);
+}
+
+// Timers are kept in a heap: set many, in no particular order, cancel
+// some, and they still run in deadline order
+static VOID
+TestHeap(
+    VOID
+    )
+{
+    TEST_THREAD Thread;
+    TEST_TIMER  Timer[THREAD_TIMER_MAXIMUM + 1];
+    ULONG       Index;
+    ULONG       Expected;
+    LONG        Fires;
+
+    if (!TestThreadStart(&Thread, NULL))
+        return;
+
+    for (Index = 0; Index < THREAD_TIMER_MAXIMUM; Index++) {
+        ULONG   DueTime = ((Index * 7) % THREAD_TIMER_MAXIMUM) + 1;
+
+        TestTimerInitialize(&Timer[Index], &Thread, DueTime);
+        CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[Index].Timer, DueTime, 0, 0),
+                ==, STATUS_SUCCESS);
+    }
+
+    TestTimerInitialize(&Timer[Index], &Thread, 0);
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[Index].Timer, 1, 0, 0),
+            ==, STATUS_INSUFFICIENT_RESOURCES);
+
+    // Cancel every timer due at a multiple of 5 ms
+    Fires = 0;
+    for (Index = 0; Index < THREAD_TIMER_MAXIMUM; Index++) {
+        if (Timer[Index].Identifier % 5 == 0)
+            CHECK(ThreadTimerCancel(Thread.Thread, &Timer[Index].Timer));
+        else
+            Fires++;
+    }
+
+    for (Index = 0; Index < THREAD_TIMER_MAXIMUM; Index++)
+        TestAdvance(1);
+
+    CHECK3U(Thread.Fires, ==, Fires);
+
+    Expected = 1;
+    for (Index = 0; Index < (ULONG)Fires; Index++) {
+        if (Expected % 5 == 0)
+            Expected++;
+
+        CHECK3U(Thread.Log[Index], ==, Expected);
+        CHECK3U(Thread.When[Index], ==, Expected);
+        Expected++;
+    }
+
+    TestThreadStop(&Thread);
+}
+
+// A ThreadWait() timeout is not cut short by the timers run inside it
+static VOID
+TestTimeout(
+    VOID
+    )
+{
+    TEST_THREAD     Thread;
+    TEST_TIMER      Timer;
+    LARGE_INTEGER   Timeout;
+
+    Timeout.QuadPart = TIME_RELATIVE(TIME_MS(50));
+
+    if (!TestThreadStart(&Thread, &Timeout))
+        return;
+
+    TestTimerInitialize(&Timer, &Thread, 0);
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer.Timer, 10, 10, 0), ==, STATUS_SUCCESS);
+
+    TestAdvance(10);
+    TestAdvance(10);
+    TestAdvance(10);
+    TestAdvance(10);
+    CHECK3U(Thread.Fires, ==, 4);
+    CHECK3U(Thread.Timeouts, ==, 0);
+
+    TestAdvance(10);
+    CHECK3U(Thread.Fires, ==, 5);
+    CHECK3U(Thread.Timeouts, ==, 1);
+    CHECK3U(Thread.TimeoutWhen, ==, 50);
+
+    TestThreadStop(&Thread);
+}
+
+// Nothing can be set once the thread is alerted, and whatever is still
+// pending when it is joined is discarded
+static VOID
+TestAlert(
+    VOID
+    )
+{
+    TEST_THREAD Thread;
+    TEST_TIMER  Timer[2];
+
+    if (!TestThreadStart(&Thread, NULL))
+        return;
+
+    TestTimerInitialize(&Timer[0], &Thread, 0);
+    TestTimerInitialize(&Timer[1], &Thread, 1);
+
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[0].Timer, 10, 0, 0), ==, STATUS_SUCCESS);
+
+    ThreadAlert(Thread.Thread);
+
+    CHECK3U(ThreadTimerSet(Thread.Thread, &Timer[1].Timer, 10, 0, 0), ==, STATUS_CANCELLED);
+
+    ThreadJoin(Thread.Thread);
+
+    CHECK3U(Timer[0].Timer.Index, ==, MAXULONG);
+    CHECK3U(Timer[1].Timer.Index, ==, MAXULONG);
+
+    TestAdvanceInterruptTime(TIME_MS(100));
+    CHECK3U(Thread.Fires, ==, 0);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (VOID) TestParseArguments(argc, argv);
+
+    TestOrder();
+    TestPeriodic();
+    TestCancel();
+    TestHeap();
+    TestTimeout();
+    TestAlert();
+
+    return TestExit("threadtimer");
+}
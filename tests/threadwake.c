@@ -0,0 +1,297 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// Wake coalescing in thread.c: only an idle-to-pending transition (or an
+// alert) signals the thread's event, and no wake is ever lost
+
+#include <ntddk.h>
+#include <pthread.h>
+
+#include "thread.h"
+#include "util.h"
+#include "test.h"
+
+typedef struct _TEST_CONSUMER {
+    PKEVENT         Gate;       // Wait on this after each wake
+    LONG            Iterations;
+    volatile LONG   *Published;
+    LONG            Consumed;
+} TEST_CONSUMER, *PTEST_CONSUMER;
+
+static NTSTATUS
+TestConsumer(
+    IN  PXENHID_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PTEST_CONSUMER      Consumer = Context;
+
+    for (;;) {
+        (VOID) ThreadWait(Self, NULL);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        if (Consumer->Published != NULL)
+            (VOID) InterlockedExchange(&Consumer->Consumed,
+                                       *Consumer->Published);
+
+        (VOID) InterlockedIncrement(&Consumer->Iterations);
+
+        if (Consumer->Gate != NULL)
+            (VOID) KeWaitForSingleObject(Consumer->Gate,
+                                         Executive,
+                                         KernelMode,
+                                         FALSE,
+                                         NULL);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+TestCoalesce(
+    VOID
+    )
+{
+    TEST_CONSUMER   Consumer;
+    PXENHID_THREAD  Thread;
+    PKEVENT         Event;
+    KEVENT          Gate;
+    ULONG           Index;
+    NTSTATUS        status;
+
+    RtlZeroMemory(&Consumer, sizeof (Consumer));
+
+    KeInitializeEvent(&Gate, NotificationEvent, FALSE);
+    Consumer.Gate = &Gate;
+
+    status = ThreadCreate(TestConsumer, &Consumer, &Thread);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    Event = ThreadGetEvent(Thread);
+    CHECK(TestWaitForIdle(1));
+
+    // The first wake signals and the thread then blocks in the gate,
+    // with nothing pending
+    ThreadWake(Thread);
+    CHECK(TestWaitForValue(&Consumer.Iterations, 1));
+    CHECK3U(Event->Sets, ==, 1);
+
+    // Only the first of these signals; the rest find it pending
+    for (Index = 0; Index < 100; Index++)
+        ThreadWake(Thread);
+
+    CHECK3U(Event->Sets, ==, 2);
+
+    // ...and they are all seen by one more pass
+    KeSetEvent(&Gate, IO_NO_INCREMENT, FALSE);
+    CHECK(TestWaitForValue(&Consumer.Iterations, 2));
+    CHECK(TestWaitForIdle(1));
+    CHECK3U(Consumer.Iterations, ==, 2);
+    CHECK3U(Event->Sets, ==, 2);
+
+    // An alert signals even when a wake is already pending
+    KeClearEvent(&Gate);
+
+    ThreadWake(Thread);
+    CHECK(TestWaitForValue(&Consumer.Iterations, 3));
+
+    ThreadWake(Thread);
+    CHECK3U(Event->Sets, ==, 4);
+
+    ThreadAlert(Thread);
+    CHECK3U(Event->Sets, ==, 5);
+
+    KeSetEvent(&Gate, IO_NO_INCREMENT, FALSE);
+    ThreadJoin(Thread);
+
+    CHECK3U(Consumer.Iterations, ==, 3);
+}
+
+// Many producers publish work and wake the consumer. Once they have all
+// finished, the consumer must see everything without being woken again.
+#define STRESS_PRODUCERS    8
+#define STRESS_WAKES        20000
+
+typedef struct _TEST_PRODUCER {
+    PXENHID_THREAD  Thread;
+    volatile LONG   *Published;
+} TEST_PRODUCER, *PTEST_PRODUCER;
+
+static void *
+TestProducer(
+    void            *Argument
+    )
+{
+    PTEST_PRODUCER  Producer = Argument;
+    ULONG           Index;
+
+    for (Index = 0; Index < STRESS_WAKES; Index++) {
+        (VOID) InterlockedIncrement(Producer->Published);
+        ThreadWake(Producer->Thread);
+
+        TestChaos();
+    }
+
+    return NULL;
+}
+
+static VOID
+TestStress(
+    IN  BOOLEAN     Bench
+    )
+{
+    TEST_CONSUMER   Consumer;
+    TEST_PRODUCER   Producer;
+    pthread_t       Thread[STRESS_PRODUCERS];
+    volatile LONG   Published;
+    PKEVENT         Event;
+    ULONGLONG       Start;
+    ULONG           Index;
+    NTSTATUS        status;
+
+    RtlZeroMemory(&Consumer, sizeof (Consumer));
+    Published = 0;
+    Consumer.Published = &Published;
+
+    status = ThreadCreate(TestConsumer, &Consumer, &Producer.Thread);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    Producer.Published = &Published;
+    Event = ThreadGetEvent(Producer.Thread);
+
+    // Yielding inside the event operations lets the producers run in
+    // the consumer's windows even on a single processor
+    if (!Bench)
+        TestSetChaos(TRUE);
+
+    Start = TestNow();
+
+    for (Index = 0; Index < STRESS_PRODUCERS; Index++)
+        CHECK(pthread_create(&Thread[Index], NULL, TestProducer,
+                             &Producer) == 0);
+
+    for (Index = 0; Index < STRESS_PRODUCERS; Index++)
+        CHECK(pthread_join(Thread[Index], NULL) == 0);
+
+    TestSetChaos(FALSE);
+
+    CHECK(TestWaitForValue(&Consumer.Consumed,
+                           STRESS_PRODUCERS * STRESS_WAKES));
+
+    if (Bench) {
+        printf("threadwake: %u producers, %u wakes each\n",
+               STRESS_PRODUCERS, STRESS_WAKES);
+        TestReport("ThreadWake", TestNow() - Start,
+                   STRESS_PRODUCERS * STRESS_WAKES);
+        printf("  %-40s %10u\n", "events set", Event->Sets);
+        printf("  %-40s %10u\n", "consumer passes", Consumer.Iterations);
+    }
+
+    // Every signal led to at most one pass (and some passes may have
+    // been satisfied by an earlier signal)
+    CHECK3U(Event->Sets, <=, STRESS_PRODUCERS * STRESS_WAKES);
+    CHECK3U(Consumer.Iterations, <=, Event->Sets);
+
+    ThreadAlert(Producer.Thread);
+    ThreadJoin(Producer.Thread);
+}
+
+// Wake-to-run time is measured from the first wake to the thread
+// running, in every build
+static VOID
+TestWakeToRun(
+    VOID
+    )
+{
+    TEST_CONSUMER               Consumer;
+    XENHID_THREAD_STATISTICS    Statistics;
+    PXENHID_THREAD              Thread;
+    KEVENT                      Gate;
+    NTSTATUS                    status;
+
+    RtlZeroMemory(&Consumer, sizeof (Consumer));
+
+    KeInitializeEvent(&Gate, NotificationEvent, FALSE);
+    Consumer.Gate = &Gate;
+
+    status = ThreadCreate(TestConsumer, &Consumer, &Thread);
+    CHECK3U(status, ==, STATUS_SUCCESS);
+    if (!NT_SUCCESS(status))
+        return;
+
+    CHECK(TestWaitForIdle(1));
+
+    // The thread runs straight away, so no time passes
+    ThreadWake(Thread);
+    CHECK(TestWaitForValue(&Consumer.Iterations, 1));
+
+    ThreadQueryStatistics(Thread, &Statistics);
+    CHECK3U(Statistics.WakeToRunTime, ==, 0);
+
+    // While it is held in the gate it is woken, and then only gets to
+    // run 3ms later. The second wake finds one pending and is not timed.
+    ThreadWake(Thread);
+    TestAdvanceInterruptTime(TIME_MS(2));
+    ThreadWake(Thread);
+    TestAdvanceInterruptTime(TIME_MS(1));
+
+    KeSetEvent(&Gate, IO_NO_INCREMENT, FALSE);
+    CHECK(TestWaitForValue(&Consumer.Iterations, 2));
+
+    ThreadQueryStatistics(Thread, &Statistics);
+    CHECK3U(Statistics.WakeToRunTime, ==, 3000);
+    CHECK3U(Statistics.Wakes, ==, 2);
+
+    ThreadAlert(Thread);
+    ThreadJoin(Thread);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestCoalesce();
+    TestWakeToRun();
+    TestStress(Bench);
+
+    return TestExit("threadwake");
+}
@@ -0,0 +1,369 @@
+/* Copyright (c) Xen Project.
+ * Copyright (c) Cloud Software Group, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// __strtok_r() and __wcstok_r() with their delimiter maps, fuzzed
+// against the strchr()/wcschr() versions they replaced: every call must
+// return the same token, leave the same context and make the same
+// changes to the buffer. `make bench` times the two on the record that
+// __FdoMatchDistribution() splits, and on a longer input.
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "test.h"
+
+static PCHAR
+PreviousStrtok(
+    IN      PCHAR   Buffer,
+    IN      PCHAR   Delimiter,
+    IN OUT  PCHAR   *Context
+    )
+{
+    PCHAR           Token;
+    PCHAR           End;
+
+    if (Buffer != NULL)
+        *Context = Buffer;
+
+    Token = *Context;
+
+    if (Token == NULL)
+        return NULL;
+
+    while (*Token != '\0' &&
+           strchr(Delimiter, *Token) != NULL)
+        Token++;
+
+    if (*Token == '\0')
+        return NULL;
+
+    End = Token + 1;
+    while (*End != '\0' &&
+           strchr(Delimiter, *End) == NULL)
+        End++;
+
+    if (*End != '\0')
+        *End++ = '\0';
+
+    *Context = End;
+
+    return Token;
+}
+
+static PWCHAR
+PreviousWcstok(
+    IN      PWCHAR  Buffer,
+    IN      PWCHAR  Delimiter,
+    IN OUT  PWCHAR  *Context
+    )
+{
+    PWCHAR          Token;
+    PWCHAR          End;
+
+    if (Buffer != NULL)
+        *Context = Buffer;
+
+    Token = *Context;
+
+    if (Token == NULL)
+        return NULL;
+
+    while (*Token != L'\0' &&
+           wcschr(Delimiter, *Token) != NULL)
+        Token++;
+
+    if (*Token == L'\0')
+        return NULL;
+
+    End = Token + 1;
+    while (*End != L'\0' &&
+           wcschr(Delimiter, *End) == NULL)
+        End++;
+
+    if (*End != L'\0')
+        *End++ = L'\0';
+
+    *Context = End;
+
+    return Token;
+}
+
+static ULONG    TestRandomState = 0x2545F491;
+
+static ULONG
+TestRandom(
+    VOID
+    )
+{
+    ULONG   Value = TestRandomState;
+
+    Value ^= Value << 13;
+    Value ^= Value >> 17;
+    Value ^= Value << 5;
+
+    TestRandomState = Value;
+    return Value;
+}
+
+// A small alphabet so that delimiters are common. It includes characters
+// with the top bit set and, for the wide tokenizer, characters of 256 and
+// above whose low byte matches one of the others.
+static const WCHAR  TestAlphabet[] = {
+    L' ', L'/', L'.', L'a', L'b', L'0', 0x80, 0xFF,
+    0x120, 0x12F, 0x161, 0x2000, 0xFF20
+};
+
+static WCHAR
+TestRandomCharacter(
+    IN  BOOLEAN Wide
+    )
+{
+    ULONG       Count = ARRAYSIZE(TestAlphabet);
+
+    // The narrow alphabet stops before the wide only characters
+    if (!Wide)
+        Count -= 5;
+
+    return TestAlphabet[TestRandom() % Count];
+}
+
+static VOID
+TestRandomString(
+    OUT PWCHAR  Buffer,
+    IN  ULONG   Maximum,
+    IN  BOOLEAN Wide
+    )
+{
+    ULONG       Length = TestRandom() % Maximum;
+    ULONG       Index;
+
+    for (Index = 0; Index < Length; Index++)
+        Buffer[Index] = TestRandomCharacter(Wide);
+
+    Buffer[Length] = L'\0';
+}
+
+#define TEST_ITERATIONS     100000
+#define TEST_TEXT_LENGTH    48
+#define TEST_DELIMITERS     5
+
+static VOID
+TestNarrow(
+    VOID
+    )
+{
+    ULONG   Iteration;
+
+    for (Iteration = 0; Iteration < TEST_ITERATIONS; Iteration++) {
+        WCHAR   Text[TEST_TEXT_LENGTH];
+        CHAR    Buffer[TEST_TEXT_LENGTH];
+        CHAR    Previous[TEST_TEXT_LENGTH];
+        PCHAR   Context = NULL;
+        PCHAR   PreviousContext = NULL;
+        ULONG   Call;
+        ULONG   Index;
+
+        TestRandomString(Text, TEST_TEXT_LENGTH, FALSE);
+        for (Index = 0; Index < TEST_TEXT_LENGTH; Index++)
+            Buffer[Index] = Previous[Index] = (CHAR)Text[Index];
+
+        // Each call may use a different delimiter set
+        for (Call = 0; Call < TEST_TEXT_LENGTH; Call++) {
+            WCHAR   WideDelimiter[TEST_DELIMITERS];
+            CHAR    Delimiter[TEST_DELIMITERS];
+            PCHAR   Token;
+            PCHAR   PreviousToken;
+
+            TestRandomString(WideDelimiter, TEST_DELIMITERS, FALSE);
+            for (Index = 0; Index < TEST_DELIMITERS; Index++)
+                Delimiter[Index] = (CHAR)WideDelimiter[Index];
+
+            Token = __strtok_r((Call == 0) ? Buffer : NULL,
+                               Delimiter, &Context);
+            PreviousToken = PreviousStrtok((Call == 0) ? Previous : NULL,
+                                           Delimiter, &PreviousContext);
+
+            CHECK3S((Token == NULL) ? -1 : Token - Buffer, ==,
+                    (PreviousToken == NULL) ? -1 : PreviousToken - Previous);
+            CHECK3S(Context - Buffer, ==, PreviousContext - Previous);
+            CHECK(memcmp(Buffer, Previous, sizeof (Buffer)) == 0);
+
+            if (TestFailures != 0 || Token == NULL)
+                break;
+        }
+
+        if (TestFailures != 0)
+            break;
+    }
+}
+
+static VOID
+TestWide(
+    VOID
+    )
+{
+    ULONG   Iteration;
+
+    for (Iteration = 0; Iteration < TEST_ITERATIONS; Iteration++) {
+        WCHAR   Buffer[TEST_TEXT_LENGTH];
+        WCHAR   Previous[TEST_TEXT_LENGTH];
+        PWCHAR  Context = NULL;
+        PWCHAR  PreviousContext = NULL;
+        ULONG   Call;
+
+        TestRandomString(Buffer, TEST_TEXT_LENGTH, TRUE);
+        RtlCopyMemory(Previous, Buffer, sizeof (Buffer));
+
+        for (Call = 0; Call < TEST_TEXT_LENGTH; Call++) {
+            WCHAR   Delimiter[TEST_DELIMITERS];
+            PWCHAR  Token;
+            PWCHAR  PreviousToken;
+
+            TestRandomString(Delimiter, TEST_DELIMITERS, TRUE);
+
+            Token = __wcstok_r((Call == 0) ? Buffer : NULL,
+                               Delimiter, &Context);
+            PreviousToken = PreviousWcstok((Call == 0) ? Previous : NULL,
+                                           Delimiter, &PreviousContext);
+
+            CHECK3S((Token == NULL) ? -1 : Token - Buffer, ==,
+                    (PreviousToken == NULL) ? -1 : PreviousToken - Previous);
+            CHECK3S(Context - Buffer, ==, PreviousContext - Previous);
+            CHECK(memcmp(Buffer, Previous, sizeof (Buffer)) == 0);
+
+            if (TestFailures != 0 || Token == NULL)
+                break;
+        }
+
+        if (TestFailures != 0)
+            break;
+    }
+}
+
+// The record __FdoMatchDistribution() splits, as __FdoSetDistribution()
+// writes it
+static VOID
+TestRecord(
+    VOID
+    )
+{
+    CHAR    Buffer[] = "Xen_Project  XENHID 9.1.0.42 (DEBUG)";
+    PCHAR   Context;
+    PCHAR   Token;
+
+    Token = __strtok_r(Buffer, " ", &Context);
+    CHECK(Token != NULL && strcmp(Token, "Xen_Project") == 0);
+
+    Token = __strtok_r(NULL, " ", &Context);
+    CHECK(Token != NULL && strcmp(Token, "XENHID") == 0);
+
+    Token = __strtok_r(NULL, ".", &Context);
+    CHECK(Token != NULL && strcmp(Token, "9") == 0);
+
+    Token = __strtok_r(NULL, " ", &Context);
+    CHECK(Token != NULL && strcmp(Token, "1.0.42") == 0);
+
+    Token = __strtok_r(NULL, " ", &Context);
+    CHECK(Token != NULL && strcmp(Token, "(DEBUG)") == 0);
+
+    CHECK(__strtok_r(NULL, " ", &Context) == NULL);
+    CHECK(__strtok_r(NULL, " ", &Context) == NULL);
+}
+
+#define BENCH_ITERATIONS    1000000
+
+static VOID
+Benchmark(
+    VOID
+    )
+{
+    static const CHAR   Record[] = "Xen_Project XENHID 9.1.0.42 (DEBUG)";
+    static CHAR         Path[] = "device/vkbd/0/backend-id/feature-abs/"
+                                 "feature-raw-pointer/feature-multi-touch/"
+                                 "multi-touch-width/multi-touch-height";
+    CHAR                Buffer[sizeof (Path)];
+    ULONGLONG           Start;
+    ULONG               Iteration;
+    ULONG               Count;
+
+    printf("tokenizer: %u iterations\n", BENCH_ITERATIONS);
+
+#define BENCH(_Name, _Function, _Text, _Delimiter)                          \
+    do {                                                                    \
+        Count = 0;                                                          \
+        Start = TestNow();                                                  \
+        for (Iteration = 0; Iteration < BENCH_ITERATIONS; Iteration++) {    \
+            PCHAR   Context;                                                \
+            PCHAR   Token;                                                  \
+                                                                            \
+            memcpy(Buffer, (_Text), sizeof (_Text));                        \
+                                                                            \
+            Token = _Function(Buffer, (_Delimiter), &Context);              \
+            while (Token != NULL) {                                         \
+                Count++;                                                    \
+                Token = _Function(NULL, (_Delimiter), &Context);            \
+            }                                                               \
+        }                                                                   \
+        TestReport(_Name, TestNow() - Start, BENCH_ITERATIONS);             \
+    } while (FALSE)
+
+    BENCH("__strtok_r record", __strtok_r, Record, " .()");
+    CHECK3U(Count, ==, BENCH_ITERATIONS * 7);
+    BENCH("strchr tokenizer record", PreviousStrtok, Record, " .()");
+    CHECK3U(Count, ==, BENCH_ITERATIONS * 7);
+
+    BENCH("__strtok_r path", __strtok_r, Path, "/-");
+    CHECK3U(Count, ==, BENCH_ITERATIONS * 19);
+    BENCH("strchr tokenizer path", PreviousStrtok, Path, "/-");
+    CHECK3U(Count, ==, BENCH_ITERATIONS * 19);
+
+#undef  BENCH
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    BOOLEAN Bench = TestParseArguments(argc, argv);
+
+    TestNarrow();
+    TestWide();
+    TestRecord();
+
+    if (Bench)
+        Benchmark();
+
+    return TestExit("tokenizer");
+}